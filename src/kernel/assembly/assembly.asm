@@ -24,6 +24,13 @@ lock_add32:
 	lock add [edx], eax
 	ret
 
+global lock_xadd32
+lock_xadd32:
+	mov edx, [esp + 4]
+	mov eax, [esp + 8]
+	lock xadd [edx], eax
+	ret
+
 global lock_cmpxchg32
 lock_cmpxchg32:
 	mov edx, [esp + 4]
@@ -9,6 +9,11 @@
 #define sti() do{__asm__("sti\n");}while(0)
 #define nop() do{__asm__("nop\n");}while(0)
 #define pause() do{__asm__("pause\n");}while(0)
+// no interrupt is accepted between sti and the next instruction, so the wakeup is not lost
+#define stiAndHlt() do{__asm__ __volatile__("sti\nhlt\n");}while(0)
+// wake up from mwait when the cache line of ADDRESS is written
+#define monitor(ADDRESS) do{__asm__ __volatile__("monitor\n"::"a"(ADDRESS),"c"(0),"d"(0));}while(0)
+#define stiAndMWait() do{__asm__ __volatile__("sti\nmwait\n"::"a"(0),"c"(0));}while(0)
 
 uint32_t getEBP(void);
 
@@ -21,6 +26,7 @@ uint32_t getCR2(void);
 uint32_t getCR3(void);
 void setCR3(uint32_t value);
 uint32_t getCR4(void);
+void setCR4(uint32_t value);
 
 uint8_t in8(uint16_t port);
 uint16_t in16(uint16_t port);
@@ -31,6 +37,8 @@ void out32(uint16_t port, uint32_t value);
 uint8_t xchg8(volatile uint8_t *a, uint8_t b);
 uint32_t xchg32(volatile uint32_t *a, uint32_t b);
 void lock_add32(volatile uint32_t *a, uint32_t b);
+// *a += b and return the old value
+uint32_t lock_xadd32(volatile uint32_t *a, uint32_t b);
 //if(*dst != cmp)cmp = *dst
 //else *dst = src
 //return cmp
@@ -76,6 +84,10 @@ EFlags getEFlags(void);
 
 int cpuid_isSupported(void);
 int cpuid_hasAPIC(void);
+// FXSAVE and FXRSTOR
+int cpuid_hasFXSR(void);
+int cpuid_hasSSE(void);
+int cpuid_hasMonitor(void);
 int cpuid_getInitialAPICID(void);
 
 enum MSR{
@@ -85,4 +97,7 @@ enum MSR{
 void rdmsr(enum MSR ecx, uint32_t *edx, uint32_t *eax);
 void wrmsr(enum MSR ecx, uint32_t edx, uint32_t eax);
 
+// time stamp counter
+uint64_t rdtsc(void);
+
 #endif
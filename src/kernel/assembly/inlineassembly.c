@@ -32,6 +32,7 @@ void set##F(T value){\
 
 SET_REGISTER(uint32_t, CR0, cr0)
 SET_REGISTER(uint32_t, CR3, cr3)
+SET_REGISTER(uint32_t, CR4, cr4)
 
 #undef SET_REGISTER
 
@@ -79,6 +80,24 @@ int cpuid_hasAPIC(void){
 	return (edx >> 9) & 1;
 }
 
+int cpuid_hasFXSR(void){
+	uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+	cpuid(&eax, &ebx, &ecx, &edx);
+	return (edx >> 24) & 1;
+}
+
+int cpuid_hasSSE(void){
+	uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+	cpuid(&eax, &ebx, &ecx, &edx);
+	return (edx >> 25) & 1;
+}
+
+int cpuid_hasMonitor(void){
+	uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
+	cpuid(&eax, &ebx, &ecx, &edx);
+	return (ecx >> 3) & 1;
+}
+
 int cpuid_getInitialAPICID(){
 	uint32_t eax = 1, ebx = 0, ecx = 0, edx = 0;
 	cpuid(&eax, &ebx, &ecx, &edx);
@@ -100,3 +119,12 @@ void wrmsr(enum MSR ecx, uint32_t edx,uint32_t eax){
 	:"c"(ecx), "d"(edx), "a"(eax)
 	);
 }
+
+uint64_t rdtsc(void){
+	uint64_t tsc;
+	__asm__ __volatile__(
+	"rdtsc\n"
+	:"=A"(tsc)
+	);
+	return tsc;
+}
@@ -100,3 +100,29 @@ int sscanf(const char *str, const char *format, ...);
 	}\
 	*((E)->prev) = (E);\
 }while(0)
+
+// the stores before the barrier are not moved after it
+#define COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// for the lists read without locks; see synchronizeRCU
+// the writers hold a lock
+// the node is published after it is initialized
+#define RCU_ADD_TO_DQUEUE(E, P) do{\
+	(E)->prev = (P);\
+	(E)->next = *(P);\
+	if((E)->next != NULL){\
+		(E)->next->prev = &((E)->next);\
+	}\
+	COMPILER_BARRIER();\
+	*((E)->prev) = (E);\
+}while(0)
+
+// the readers on the removed node can go on to the next node
+// the node can be deleted after synchronizeRCU
+#define RCU_REMOVE_FROM_DQUEUE(E) do{\
+	*((E)->prev) = (E)->next;\
+	if((E)->next != NULL){\
+		(E)->next->prev = (E)->prev; \
+	}\
+	(E)->prev = NULL;\
+}while(0)
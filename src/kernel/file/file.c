@@ -130,6 +130,7 @@ typedef struct FileSystem{
 }FileSystem;
 
 static struct{
+	// read without the lock; see searchFileSystem
 	FileSystem *head;
 	Spinlock lock;
 }fsList = {NULL, INITIAL_SPINLOCK};
@@ -143,7 +144,7 @@ int addFileSystem(const FileNameFunctions *fileNameFunctions, const char *name,
 	fs->nameLength = nameLength;
 	fs->fileNameFunctions = *fileNameFunctions;
 	acquireLock(&fsList.lock);
-	ADD_TO_DQUEUE(fs, &fsList.head);
+	RCU_ADD_TO_DQUEUE(fs, &fsList.head);
 	releaseLock(&fsList.lock);
 	FileEnumeration fe;
 	initFileEnumeration(&fe, name, nameLength);
@@ -159,15 +160,16 @@ int addFileSystem(const FileNameFunctions *fileNameFunctions, const char *name,
 	return 0;
 }
 
+// the file systems are never removed, so fs is valid after rcuReadUnlock
 static FileSystem *searchFileSystem(const char *name, uintptr_t nameLength){
-	acquireLock(&fsList.lock);
+	int interruptEnabled = rcuReadLock();
 	FileSystem *fs;
 	for(fs = fsList.head; fs != NULL; fs = fs->next){
 		if(isStringEqual(fs->name, fs->nameLength, name, nameLength)){
 			break;
 		}
 	}
-	releaseLock(&fsList.lock);
+	rcuReadUnlock(interruptEnabled);
 	return fs;
 }
 
@@ -943,11 +945,21 @@ uintptr_t syncSeekReadFile(uintptr_t handle, void *buffer, uint64_t position, ui
 	return handle;
 }
 
-uintptr_t systemCall_seekWriteFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t bufferSize){
-	return systemCall6(SYSCALL_SEEK_READ_FILE, handle, (uintptr_t)buffer, bufferSize,
+uintptr_t systemCall_seekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t bufferSize){
+	return systemCall6(SYSCALL_SEEK_WRITE_FILE, handle, (uintptr_t)buffer, bufferSize,
 		LOW64(position), HIGH64(position));
 }
 
+uintptr_t syncSeekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t *bufferSize){
+	uintptr_t r;
+	r = systemCall_seekWriteFile(handle, buffer, position, *bufferSize);
+	if(r == IO_REQUEST_FAILURE)
+		return r;
+	if(r != systemCall_waitIOReturn(r, 1, bufferSize))
+		return IO_REQUEST_FAILURE;
+	return handle;
+}
+
 uintptr_t systemCall_getFileParameter(uintptr_t handle, enum FileParameter parameterCode){
 	return systemCall3(SYSCALL_GET_FILE_PARAMETER, handle, parameterCode);
 }
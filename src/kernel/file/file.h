@@ -53,6 +53,34 @@ enum FileParameter{
 	//FILE_PARAM_DESTINATION_PORT = 35
 	FILE_PARAM_TRANSMIT_ETHERTYPE = 36,
 	//FILE_PARAM_RECEIVE_ETHERTYPE = 37
+	// network interrupt moderation
+	FILE_PARAM_INTERRUPT_THROTTLING = 0x40,
+	FILE_PARAM_RECEIVE_DELAY = 0x41,
+	FILE_PARAM_RECEIVE_ABSOLUTE_DELAY = 0x42,
+	FILE_PARAM_TRANSMIT_DELAY = 0x43,
+	FILE_PARAM_TRANSMIT_ABSOLUTE_DELAY = 0x44,
+	FILE_PARAM_POLL_BUDGET = 0x45,
+	// enum ChecksumOffload in io/network/ethernet.h
+	FILE_PARAM_CHECKSUM_OFFLOAD = 0x46,
+	// DESTINATION_PREFIX_SIZE in io/network/ethernet.h
+	FILE_PARAM_DESTINATION_PREFIX = 0x47,
+	// number of receive queues of the device, and the queue read by the opened file
+	FILE_PARAM_RECEIVE_QUEUE_COUNT = 0x48,
+	FILE_PARAM_RECEIVE_QUEUE = 0x49,
+	// SEGMENTATION_PREFIX_SHIFT in io/network/ethernet.h
+	FILE_PARAM_SEGMENTATION_OFFLOAD = 0x4a,
+	// MAC addresses accepted by the device besides FILE_PARAM_SOURCE_ADDRESS and broadcast
+	// the device counts how many times an address is added
+	FILE_PARAM_ADD_RECEIVE_ADDRESS = 0x4b,
+	FILE_PARAM_REMOVE_RECEIVE_ADDRESS = 0x4c,
+	// frames dropped by the device
+	FILE_PARAM_RECEIVE_FILTERED_COUNT = 0x4d,
+	FILE_PARAM_RECEIVE_MISSED_COUNT = 0x4e,
+	// IPv4 multicast group of socket; see igmp.c
+	FILE_PARAM_JOIN_IP_GROUP = 0x4f,
+	FILE_PARAM_LEAVE_IP_GROUP = 0x50,
+	// 1 if the frames of the device are recorded; see io/network/capture.c
+	FILE_PARAM_PACKET_CAPTURE = 0x51
 };
 
 // if failed, return IO_REQUEST_FAILURE
@@ -72,7 +100,8 @@ uintptr_t syncWriteFile(uintptr_t handle, const void *buffer, uintptr_t *bufferS
 uintptr_t systemCall_seekReadFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t bufferSize);
 uintptr_t syncSeekReadFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t *bufferSize);
 
-uintptr_t systemCall_seekWriteFile(uintptr_t handle, void *buffer, uint64_t position, uintptr_t bufferSize);
+uintptr_t systemCall_seekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t bufferSize);
+uintptr_t syncSeekWriteFile(uintptr_t handle, const void *buffer, uint64_t position, uintptr_t *bufferSize);
 
 uintptr_t systemCall_getFileParameter(uintptr_t handle, enum FileParameter parameterCode);
 uintptr_t syncGetFileParameter(uintptr_t handle, enum FileParameter paramCode, uint64_t *value);
@@ -196,5 +225,7 @@ void fatService(void);
 
 // kernel file
 void kernelFileService(void);
+// statfs.c; the files are read-only text, such as stat:spinlock
+int initStatisticsFileSystem(void);
 
 #endif
@@ -136,6 +136,9 @@ void kernelFileService(void){
 		printk("cannot register kernel image as file system\n");
 		systemCall_terminate();
 	}
+	if(initStatisticsFileSystem() == 0){
+		printk("cannot register kernel statistics as file system\n");
+	}
 	while(1){
 		sleep(1000);
 	}
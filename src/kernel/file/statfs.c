@@ -0,0 +1,83 @@
+#include"file.h"
+#include"memory/memory.h"
+#include"multiprocessor/spinlock.h"
+#include"task/task.h"
+
+// the statistics are printed when the file is opened
+#define MAX_STATISTICS_FILE_SIZE (4096)
+
+typedef uintptr_t PrintStatistics(char *buffer, uintptr_t bufferSize);
+
+static const struct{
+	const char *name;
+	PrintStatistics *print;
+}statisticsFile[] = {
+	{"spinlock", printSpinlockStatistics},
+	{"task", printTaskStatistics}
+};
+
+typedef struct{
+	uintptr_t size;
+	char text[MAX_STATISTICS_FILE_SIZE];
+}OpenedStatisticsFile;
+
+static int seekReadStatistics(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uint64_t position, uintptr_t bufferSize){
+	OpenedStatisticsFile *f = getFileInstance(of);
+	uintptr_t copySize = 0;
+	if(position < f->size){
+		copySize = MIN(bufferSize, f->size - (uintptr_t)position);
+	}
+	memcpy(buffer, f->text + (uintptr_t)position, copySize);
+	completeRWFileIO(rwfr, copySize, copySize);
+	return 1;
+}
+
+static int getStatisticsParameter(FileIORequest2 *fior2, OpenedFile *of, uintptr_t parameterCode){
+	OpenedStatisticsFile *f = getFileInstance(of);
+	switch(parameterCode){
+	case FILE_PARAM_SIZE:
+		completeFileIO64(fior2, f->size);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void closeStatistics(CloseFileRequest *cfr, OpenedFile *of){
+	OpenedStatisticsFile *f = getFileInstance(of);
+	completeCloseFile(cfr);
+	DELETE(f);
+}
+
+static int openStatistics(OpenFileRequest *ofr, const char *fileName, uintptr_t length, OpenFileMode mode){
+	EXPECT(mode.enumeration == 0 && mode.writable == 0);
+	uintptr_t i;
+	for(i = 0; i < LENGTH_OF(statisticsFile); i++){
+		if((uintptr_t)strlen(statisticsFile[i].name) == length && strncmp(statisticsFile[i].name, fileName, length) == 0)
+			break;
+	}
+	EXPECT(i < LENGTH_OF(statisticsFile));
+	OpenedStatisticsFile *NEW(f);
+	EXPECT(f != NULL);
+	f->size = statisticsFile[i].print(f->text, MAX_STATISTICS_FILE_SIZE);
+
+	FileFunctions func = INITIAL_FILE_FUNCTIONS;
+	func.read = seekReadByOffset;
+	func.seekRead = seekReadStatistics;
+	func.getParameter = getStatisticsParameter;
+	func.close = closeStatistics;
+	completeOpenFile(ofr, f, &func);
+	return 1;
+	//DELETE(f);
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+int initStatisticsFileSystem(void){
+	FileNameFunctions ff = INITIAL_FILE_NAME_FUNCTIONS;
+	ff.open = openStatistics;
+	return addFileSystem(&ff, "stat", strlen("stat"));
+}
@@ -224,6 +224,25 @@ void apic_setPICMask(PIC *pic, enum IRQ irq, int setMask){
 	writeIOAPIC(iap->mappedRegister, IOREDTBL0_32(i), r);
 }
 
+// fixed delivery mode, physical destination mode
+int apic_setPICDestination(PIC *pic, enum IRQ irq, int processorIndex){
+	IOAPIC *apic = pic->apic->ioapic;
+	if(processorIndex < 0 || processorIndex >= getNumberOfLAPIC(apic)){
+		return 0;
+	}
+	int i = irq;
+	struct IOAPICProfile *iap = getIOAPICProfile(apic, &i);
+	uint32_t r = readIOAPIC(iap->mappedRegister, IOREDTBL0_32(i));
+	// mask the IRQ while the entry is inconsistent
+	writeIOAPIC(iap->mappedRegister, IOREDTBL0_32(i), r | 0x00010000);
+	uint32_t r2 = readIOAPIC(iap->mappedRegister, IOREDTBL32_64(i));
+	r2 = ((r2 & 0x00ffffff) | (getLAPICIDByIndex(apic, processorIndex) << 24));
+	writeIOAPIC(iap->mappedRegister, IOREDTBL32_64(i), r2);
+	r &= ~0x00000f00;
+	writeIOAPIC(iap->mappedRegister, IOREDTBL0_32(i), r);
+	return 1;
+}
+
 InterruptVector *apic_irqToVector(PIC *pic, enum IRQ irq){
 	IOAPIC *apic = pic->apic->ioapic;
 	int i = irq;
@@ -239,6 +258,16 @@ uint32_t getLAPICIDByIndex(IOAPIC *ioapic, int index){
 	return ioapic->local[index]->apicID;
 }
 
+int getLAPICIndexByID(IOAPIC *ioapic, uint32_t lapicID){
+	int i;
+	for(i = 0; i < ioapic->localCount; i++){
+		if(ioapic->local[i]->apicID == lapicID)
+			return i;
+	}
+	panic("cannot find local APIC by ID");
+	return -1;
+}
+
 static IOAPIC *parseMADT(const MADT *madt, InterruptTable *t){
 	printk("MADT total size = %d\n",madt->header.length);
 	size_t offset;
@@ -67,6 +67,18 @@ static void initMultiprocessor(
 	addAndWaitAtBarrier(&barrier2, getNumberOfLAPIC(ioapic));
 }
 
+// fixed delivery mode, edge triggered, physical destination mode
+static int apic_getMSIMessage(PIC *pic, int processorIndex, InterruptVector *vector,
+	uint64_t *address, uint32_t *data){
+	IOAPIC *ioapic = pic->apic->ioapic;
+	if(processorIndex < 0 || processorIndex >= getNumberOfLAPIC(ioapic)){
+		return 0;
+	}
+	*address = (0xfee00000 | (getLAPICIDByIndex(ioapic, processorIndex) << 12));
+	*data = toChar(vector);
+	return 1;
+}
+
 PIC *castAPIC(APIC *apic){
 	return &apic->this;
 }
@@ -74,7 +86,6 @@ PIC *castAPIC(APIC *apic){
 PIC *createPIC(InterruptTable *t){
 	if(isAPICSupported() == 0){
 		PIC8259 *pic8259 = initPIC8259(t);
-		initProcessorLocal(1);
 		return castPIC8259(pic8259);
 	}
 	static IOAPIC *ioapic = NULL;
@@ -85,16 +96,18 @@ PIC *createPIC(InterruptTable *t){
 	apic->this.setPICMask = apic_setPICMask;
 	apic->this.irqToVector = apic_irqToVector;
 	apic->this.interruptAllOther = apic_interruptAllOther;
+	apic->this.getMSIMessage = apic_getMSIMessage;
+	apic->this.setPICDestination = apic_setPICDestination;
 	apic->lapic = lapic;
 	// apic->ioapic
 	if(isBSP(lapic)){
 		disablePIC8259();
 		ioapic = initAPIC(t);
 		printk("number of processors = %d\n", getNumberOfLAPIC(ioapic));
-		initProcessorLocal(MAX_LAPIC_ID);
 	}
 	apic->ioapic = ioapic;
 	apic->this.numberOfProcessors = getNumberOfLAPIC(ioapic);
+	apic->this.processorIndex = getLAPICIndexByID(ioapic, getLAPICID(lapic));
 	return castAPIC(apic);
 }
 
@@ -10,11 +10,20 @@ typedef struct InterruptController{
 		PIC8259 *pic8259;
 	};
 	int numberOfProcessors;
+	// the index of this processor, as in getMSIMessage; see processorLocalIndex
+	int processorIndex;
 	InterruptVector *(*irqToVector)(struct InterruptController *pic, enum IRQ irq);
 	// on = 0; off = 1
 	void (*setPICMask)(struct InterruptController *pic, enum IRQ irq, int setMask);
 	void (*endOfInterrupt)(InterruptParam *p);
 	void (*interruptAllOther)(struct InterruptController *pic, InterruptVector *vector);
+	// message signaled interrupt to the processorIndex-th processor
+	// return 0 if not supported
+	int (*getMSIMessage)(struct InterruptController *pic, int processorIndex, InterruptVector *vector,
+		uint64_t *address, uint32_t *data);
+	// deliver the IRQ to the processorIndex-th processor
+	// return 0 if not supported
+	int (*setPICDestination)(struct InterruptController *pic, enum IRQ irq, int processorIndex);
 }PIC;
 
 typedef struct InterruptTable InterruptTable;
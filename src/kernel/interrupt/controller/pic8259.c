@@ -82,14 +82,36 @@ static void pic8259_interruptAllOther(
 ){
 }
 
+static int pic8259_getMSIMessage(
+	__attribute__((__unused__)) struct InterruptController *pic,
+	__attribute__((__unused__)) int processorIndex,
+	__attribute__((__unused__)) InterruptVector *vector,
+	__attribute__((__unused__)) uint64_t *address,
+	__attribute__((__unused__)) uint32_t *data
+){
+	return 0;
+}
+
+// all IRQs go to the only processor
+static int pic8259_setPICDestination(
+	__attribute__((__unused__)) struct InterruptController *pic,
+	__attribute__((__unused__)) enum IRQ irq,
+	int processorIndex
+){
+	return processorIndex == 0;
+}
+
 PIC8259 *initPIC8259(InterruptTable *t){
 	PIC8259 *NEW(pic);
 	pic->this.pic8259 = pic;
 	pic->this.numberOfProcessors = 1;
+	pic->this.processorIndex = 0;
 	pic->this.endOfInterrupt = pic8259_endOfInterrupt;
 	pic->this.irqToVector = pic8259_irqToVector;
 	pic->this.setPICMask = pic8259_setPICMask;
 	pic->this.interruptAllOther = pic8259_interruptAllOther;
+	pic->this.getMSIMessage = pic8259_getMSIMessage;
+	pic->this.setPICDestination = pic8259_setPICDestination;
 
 	pic->interruptTable = t;
 	pic->vectorBase = registerIRQs(t, 0, 16);
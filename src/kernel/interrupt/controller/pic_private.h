@@ -17,9 +17,11 @@ int isAPICSupported(void);
 IOAPIC *initAPIC(InterruptTable *t);
 int getNumberOfLAPIC(IOAPIC *apic);
 uint32_t getLAPICIDByIndex(IOAPIC *apic, int index);
+int getLAPICIndexByID(IOAPIC *apic, uint32_t lapicID);
 
 
 void apic_setPICMask(PIC *pic, enum IRQ irq, int setMask);
+int apic_setPICDestination(PIC *pic, enum IRQ irq, int processorIndex);
 InterruptVector *apic_irqToVector(PIC *pic, enum IRQ irq);
 
 // local APIC
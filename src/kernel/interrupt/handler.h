@@ -73,6 +73,8 @@ enum ReservedInterruptVector{
 #define SYSTEM_CALL_VECTOR_STRING "126"
 
 InterruptVector *registerGeneralInterrupt(InterruptTable *t, InterruptHandler handler, uintptr_t arg);
+// the vector is reused if it is the last registered one; release in reverse order of registration
+void releaseGeneralInterrupt(InterruptTable *t, InterruptVector *v);
 InterruptVector *registerInterrupt(
 	InterruptTable *t,
 	enum ReservedInterruptVector,
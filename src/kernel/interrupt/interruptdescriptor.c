@@ -37,7 +37,9 @@ struct InterruptVector{
 	int irq;
 	InterruptTable *table;
 	// if irq != INVALID_IRQ
+	// read without the lock; see chainedInterruptHandler
 	InterruptHandlerChain *handlerChain;
+	// for addHandler and removeHandler
 	Spinlock lock;
 };
 
@@ -87,7 +89,7 @@ static void chainedInterruptHandler(InterruptParam *p){
 	assert(p->argument = 0xffffffff);
 	InterruptVector *v = p->vector;
 	struct InterruptHandlerChain *c;
-	acquireLock(&v->lock);
+	// interrupts are disabled, so this is a read-side critical section; see synchronizeRCU
 	int noHandler = (v->handlerChain == NULL);
 	int handledCount = 0;
 	for(c = v->handlerChain; c != NULL; c=c->next){
@@ -97,7 +99,6 @@ static void chainedInterruptHandler(InterruptParam *p){
 		}
 		assert(getEFlags().bit.interrupt == 0);
 	}
-	releaseLock(&v->lock);
 	if(noHandler){
 		defaultInterruptHandler(p);
 	}
@@ -105,6 +106,8 @@ static void chainedInterruptHandler(InterruptParam *p){
 		printk("unhandled interrupt: %d (irq %d)\n", toChar(v), getIRQ(v));
 	}
 	processorLocalPIC()->endOfInterrupt(p);
+	// the handlers may have woken an I/O task
+	scheduleIfPreempted();
 	// not call sti() to avoid stack underflow
 }
 
@@ -130,6 +133,16 @@ InterruptVector *registerGeneralInterrupt(InterruptTable *t, InterruptHandler ha
 	return t->vector + t->usedCount - 1;
 }
 
+void releaseGeneralInterrupt(InterruptTable *t, InterruptVector *v){
+	const int i = v - t->vector;
+	assert(i >= BEGIN_GENERAL_VECTOR && i < t->usedCount && v->irq == INVALID_IRQ);
+	t->asmIntEntry[i].handler = defaultInterruptHandler;
+	t->asmIntEntry[i].arg = 0;
+	if(i == t->usedCount - 1){
+		t->usedCount--;
+	}
+}
+
 InterruptVector *registerInterrupt(
 	InterruptTable *t,
 	enum ReservedInterruptVector i,
@@ -164,7 +177,7 @@ int addHandler(InterruptVector *vector, ChainedInterruptHandler handler, uintptr
 		return 0;
 	}
 	acquireLock(&vector->lock);
-	ADD_TO_DQUEUE(c, &vector->handlerChain);
+	RCU_ADD_TO_DQUEUE(c, &vector->handlerChain);
 	releaseLock(&vector->lock);
 	return 1;
 }
@@ -176,7 +189,7 @@ int removeHandler(InterruptVector *vector, ChainedInterruptHandler handler, uint
 	// assume handler and arg are legal
 	for(c = vector->handlerChain; c != NULL; c = c->next){
 		if(c->handler == handler || c->arg == arg){
-			REMOVE_FROM_DQUEUE(c);
+			RCU_REMOVE_FROM_DQUEUE(c);
 			break;
 		}
 	}
@@ -184,6 +197,8 @@ int removeHandler(InterruptVector *vector, ChainedInterruptHandler handler, uint
 	if(c == NULL){
 		return 0;
 	}
+	// wait for the interrupt handlers on other processors
+	synchronizeRCU();
 	DELETE(c);
 	return 1;
 }
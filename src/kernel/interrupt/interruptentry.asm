@@ -3,6 +3,8 @@
 
 align 4096
 NUMBER_OF_HANDLERS EQU 128
+; GDT_PROCESSOR_LOCAL_INDEX * 8; see segment.h
+PROCESSOR_LOCAL_SELECTOR EQU 6 * 8
 
 global numberOfIntEntries
 numberOfIntEntries:
@@ -59,6 +61,7 @@ generalEntry:
 	mov ds, bx
 	mov es, bx
 	mov fs, bx
+	mov bx, PROCESSOR_LOCAL_SELECTOR
 	mov gs, bx
 
 	db 0xba ; opcode: mov edx,
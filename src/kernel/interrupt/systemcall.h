@@ -21,6 +21,8 @@ enum SystemCall{
 	SYSCALL_CREATE_USER_THREAD = 14,
 	SYSCALL_TERMINATE = 15,
 	SYSCALL_SET_ALARM = 16,
+	SYSCALL_ADD_ROUTE = 17,
+	SYSCALL_SET_AFFINITY = 18,
 	// file
 	SYSCALL_OPEN_FILE = 20,
 	SYSCALL_CLOSE_FILE = 24,
@@ -645,9 +645,11 @@ typedef struct AHCIManager{
 	Spinlock lock;
 	AHCIInterruptArgument *ahciList;
 	int ahciCount;
+	// the interrupts and completeDiskRequestTask are on the same processor
+	int processorIndex;
 }AHCIManager;
 // must be in kernel space
-static AHCIManager ahciManager = {INITIAL_SPINLOCK, NULL, 0};
+static AHCIManager ahciManager = {INITIAL_SPINLOCK, NULL, 0, 0};
 
 struct DiskRequestList{
 	Spinlock lock;
@@ -880,6 +882,7 @@ static AHCIInterruptArgument *initAHCI(AHCIManager *am, const PCIConfigRegisters
 
 	InterruptVector *v = pic->irqToVector(pic, regs->interruptLine);
 	addHandler(v, AHCIHandler, (uintptr_t)arg);
+	pic->setPICDestination(pic, regs->interruptLine, am->processorIndex);
 	pic->setPICMask(pic, regs->interruptLine, 0);
 	return arg;
 }
@@ -996,6 +999,8 @@ void ahciDriver(void){
 	if(task2 == NULL){
 		systemCall_terminate();
 	}
+	ahciManager.processorIndex = processorLocalIndex();
+	setTaskAffinity(task2, PROCESSOR_BIT(ahciManager.processorIndex));
 	resume(task2);
 	while(1){
 		PCIConfigRegisters pciConfig;
@@ -3,6 +3,7 @@
 #include"memory/memory.h"
 #include"multiprocessor/spinlock.h"
 #include"task/exclusivelock.h"
+#include"assembly/assembly.h"
 
 struct FIFO{
 	uintptr_t begin, dataLength, bufferLength;
@@ -132,3 +133,386 @@ void deleteFIFO(FIFO *fifo){
 	DELETE(fifo->buffer);
 	DELETE(fifo);
 }
+
+// the head and the tail are written by different processors
+#define CACHE_LINE_SIZE (64)
+
+static int isPowerOf2(uintptr_t v){
+	return v != 0 && (v & (v - 1)) == 0;
+}
+
+// SPSCFIFO
+// x86 does not reorder stores with stores and loads with loads,
+// so the elements are visible before head and tail are updated
+
+struct SPSCFIFO{
+	// written by the reader
+	volatile uint32_t head;
+	uint8_t headPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+	// written by the writer
+	volatile uint32_t tail;
+	uint8_t tailPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+
+	uint32_t mask;
+	uintptr_t elementSize;
+	uint8_t *buffer;
+	Semaphore *semaphore;
+};
+
+SPSCFIFO *createSPSCFIFO(uintptr_t maxLength, uintptr_t elementSize){
+	EXPECT(isPowerOf2(maxLength));
+	SPSCFIFO *NEW(fifo);
+	EXPECT(fifo != NULL);
+	NEW_ARRAY(fifo->buffer, maxLength * elementSize);
+	EXPECT(fifo->buffer != NULL);
+	fifo->semaphore = createSemaphore(0);
+	EXPECT(fifo->semaphore != NULL);
+	fifo->head = 0;
+	fifo->tail = 0;
+	fifo->mask = maxLength - 1;
+	fifo->elementSize = elementSize;
+	return fifo;
+	//deleteSemaphore(fifo->semaphore);
+	ON_ERROR;
+	DELETE(fifo->buffer);
+	ON_ERROR;
+	DELETE(fifo);
+	ON_ERROR;
+	ON_ERROR;
+	return NULL;
+}
+
+void deleteSPSCFIFO(SPSCFIFO *fifo){
+	deleteSemaphore(fifo->semaphore);
+	DELETE(fifo->buffer);
+	DELETE(fifo);
+}
+
+uintptr_t writeSPSCFIFO(SPSCFIFO *fifo, const void *data, uintptr_t count){
+	const uint32_t tail = fifo->tail;
+	const uint32_t freeLength = fifo->mask + 1 - (tail - fifo->head);
+	const uintptr_t n = MIN(count, freeLength);
+	uintptr_t i;
+	for(i = 0; i < n; i++){
+		memcpy(fifo->buffer + ((tail + i) & fifo->mask) * fifo->elementSize,
+			((const uint8_t*)data) + i * fifo->elementSize, fifo->elementSize);
+	}
+	COMPILER_BARRIER();
+	fifo->tail = tail + n;
+	if(n != 0){
+		releaseSemaphore(fifo->semaphore);
+	}
+	return n;
+}
+
+uintptr_t readSPSCFIFONonBlock(SPSCFIFO *fifo, void *data, uintptr_t maxCount){
+	const uint32_t head = fifo->head;
+	const uintptr_t n = MIN(maxCount, (uint32_t)(fifo->tail - head));
+	uintptr_t i;
+	for(i = 0; i < n; i++){
+		memcpy(((uint8_t*)data) + i * fifo->elementSize,
+			fifo->buffer + ((head + i) & fifo->mask) * fifo->elementSize, fifo->elementSize);
+	}
+	COMPILER_BARRIER();
+	fifo->head = head + n;
+	return n;
+}
+
+uintptr_t readSPSCFIFO(SPSCFIFO *fifo, void *data, uintptr_t maxCount){
+	while(1){
+		uintptr_t n = readSPSCFIFONonBlock(fifo, data, maxCount);
+		if(n != 0 || maxCount == 0)
+			return n;
+		// the semaphore may be released by the elements already read
+		acquireAllSemaphore(fifo->semaphore);
+	}
+}
+
+// MPMCFIFO
+// every cell has a sequence number; see Dmitry Vyukov's bounded MPMC queue
+// if sequence == position, the cell is writable at position
+// if sequence == position + 1, the cell is readable at position
+
+struct MPMCFIFO{
+	volatile uint32_t writePosition;
+	uint8_t writePadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+	volatile uint32_t readPosition;
+	uint8_t readPadding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+
+	uint32_t mask;
+	uintptr_t elementSize;
+	// sizeof(uint32_t) + elementSize, aligned to 4 bytes
+	uintptr_t cellSize;
+	uint8_t *cell;
+	Semaphore *semaphore;
+};
+
+static volatile uint32_t *getCellSequence(MPMCFIFO *fifo, uint32_t position){
+	return (volatile uint32_t*)(fifo->cell + (position & fifo->mask) * fifo->cellSize);
+}
+
+static uint8_t *getCellData(MPMCFIFO *fifo, uint32_t position){
+	return fifo->cell + (position & fifo->mask) * fifo->cellSize + sizeof(uint32_t);
+}
+
+MPMCFIFO *createMPMCFIFO(uintptr_t maxLength, uintptr_t elementSize){
+	EXPECT(isPowerOf2(maxLength));
+	MPMCFIFO *NEW(fifo);
+	EXPECT(fifo != NULL);
+	fifo->cellSize = sizeof(uint32_t) + CEIL(elementSize, sizeof(uint32_t));
+	NEW_ARRAY(fifo->cell, maxLength * fifo->cellSize);
+	EXPECT(fifo->cell != NULL);
+	fifo->semaphore = createSemaphore(0);
+	EXPECT(fifo->semaphore != NULL);
+	fifo->writePosition = 0;
+	fifo->readPosition = 0;
+	fifo->mask = maxLength - 1;
+	fifo->elementSize = elementSize;
+	uint32_t i;
+	for(i = 0; i < maxLength; i++){
+		*getCellSequence(fifo, i) = i;
+	}
+	return fifo;
+	//deleteSemaphore(fifo->semaphore);
+	ON_ERROR;
+	DELETE(fifo->cell);
+	ON_ERROR;
+	DELETE(fifo);
+	ON_ERROR;
+	ON_ERROR;
+	return NULL;
+}
+
+void deleteMPMCFIFO(MPMCFIFO *fifo){
+	deleteSemaphore(fifo->semaphore);
+	DELETE(fifo->cell);
+	DELETE(fifo);
+}
+
+// return 0 if full
+static int writeMPMCElement(MPMCFIFO *fifo, const void *data){
+	uint32_t position = fifo->writePosition;
+	while(1){
+		const int diff = (int)(*getCellSequence(fifo, position) - position);
+		if(diff < 0){
+			return 0;
+		}
+		if(diff == 0){
+			const uint32_t oldPosition = lock_cmpxchg32(&fifo->writePosition, position, position + 1);
+			if(oldPosition == position)
+				break;
+			position = oldPosition;
+		}
+		else{
+			position = fifo->writePosition;
+		}
+	}
+	memcpy(getCellData(fifo, position), data, fifo->elementSize);
+	COMPILER_BARRIER();
+	*getCellSequence(fifo, position) = position + 1;
+	return 1;
+}
+
+// return 0 if empty, or the next element is being written
+static int readMPMCElement(MPMCFIFO *fifo, void *data){
+	uint32_t position = fifo->readPosition;
+	while(1){
+		const int diff = (int)(*getCellSequence(fifo, position) - (position + 1));
+		if(diff < 0){
+			return 0;
+		}
+		if(diff == 0){
+			const uint32_t oldPosition = lock_cmpxchg32(&fifo->readPosition, position, position + 1);
+			if(oldPosition == position)
+				break;
+			position = oldPosition;
+		}
+		else{
+			position = fifo->readPosition;
+		}
+	}
+	memcpy(data, getCellData(fifo, position), fifo->elementSize);
+	COMPILER_BARRIER();
+	*getCellSequence(fifo, position) = position + fifo->mask + 1;
+	return 1;
+}
+
+uintptr_t writeMPMCFIFO(MPMCFIFO *fifo, const void *data, uintptr_t count){
+	uintptr_t n;
+	for(n = 0; n < count; n++){
+		if(writeMPMCElement(fifo, ((const uint8_t*)data) + n * fifo->elementSize) == 0)
+			break;
+	}
+	if(n != 0){
+		releaseSemaphore(fifo->semaphore);
+	}
+	return n;
+}
+
+uintptr_t readMPMCFIFONonBlock(MPMCFIFO *fifo, void *data, uintptr_t maxCount){
+	uintptr_t n;
+	for(n = 0; n < maxCount; n++){
+		if(readMPMCElement(fifo, ((uint8_t*)data) + n * fifo->elementSize) == 0)
+			break;
+	}
+	return n;
+}
+
+uintptr_t readMPMCFIFO(MPMCFIFO *fifo, void *data, uintptr_t maxCount){
+	while(1){
+		uintptr_t n = readMPMCFIFONonBlock(fifo, data, maxCount);
+		if(n != 0 || maxCount == 0)
+			return n;
+		acquireAllSemaphore(fifo->semaphore);
+	}
+}
+
+#ifndef NDEBUG
+#include"task/task.h"
+#include"multiprocessor/processorlocal.h"
+
+#define TEST_FIFO_ELEMENT_COUNT (100000)
+#define TEST_FIFO_BATCH_SIZE (8)
+#define TEST_FIFO_TASK_COUNT (2)
+
+typedef struct{
+	SPSCFIFO *spsc;
+	MPMCFIFO *mpmc;
+	// number of finished tasks
+	Semaphore *finished;
+	volatile uint32_t readCount;
+	volatile uint32_t sum;
+}TestFIFO;
+
+static void yieldTestFIFO(void){
+	cli();
+	schedule();
+	sti();
+}
+
+static void testSPSCFIFOWriter(void *arg){
+	TestFIFO *t = *(TestFIFO**)arg;
+	uint32_t v = 0;
+	while(v < TEST_FIFO_ELEMENT_COUNT){
+		uint32_t batch[TEST_FIFO_BATCH_SIZE];
+		uintptr_t i;
+		for(i = 0; i < TEST_FIFO_BATCH_SIZE; i++){
+			batch[i] = v + i;
+		}
+		uintptr_t n = writeSPSCFIFO(t->spsc, batch, MIN(TEST_FIFO_BATCH_SIZE, TEST_FIFO_ELEMENT_COUNT - v));
+		if(n == 0){
+			yieldTestFIFO();
+		}
+		v += n;
+	}
+	releaseSemaphore(t->finished);
+	systemCall_terminate();
+}
+
+static void testSPSCFIFOReader(void *arg){
+	TestFIFO *t = *(TestFIFO**)arg;
+	uint32_t expected = 0;
+	while(expected < TEST_FIFO_ELEMENT_COUNT){
+		uint32_t batch[TEST_FIFO_BATCH_SIZE];
+		uintptr_t n = readSPSCFIFO(t->spsc, batch, TEST_FIFO_BATCH_SIZE);
+		uintptr_t i;
+		for(i = 0; i < n; i++){
+			assert(batch[i] == expected);
+			expected++;
+		}
+	}
+	releaseSemaphore(t->finished);
+	systemCall_terminate();
+}
+
+// every writer writes (writer index << 24) | i for i in 1 ~ TEST_FIFO_ELEMENT_COUNT
+static void testMPMCFIFOWriter(void *arg){
+	TestFIFO *t = *(TestFIFO**)arg;
+	static volatile uint32_t writerIndex = 0;
+	const uint32_t tag = (lock_xadd32(&writerIndex, 1) % TEST_FIFO_TASK_COUNT) << 24;
+	uint32_t i = 1;
+	while(i <= TEST_FIFO_ELEMENT_COUNT){
+		uint32_t v = tag | i;
+		if(writeMPMCFIFO(t->mpmc, &v, 1) == 0){
+			yieldTestFIFO();
+			continue;
+		}
+		i++;
+	}
+	releaseSemaphore(t->finished);
+	systemCall_terminate();
+}
+
+// the elements of each writer are read in order
+static void testMPMCFIFOReader(void *arg){
+	TestFIFO *t = *(TestFIFO**)arg;
+	uint32_t last[TEST_FIFO_TASK_COUNT] = {0};
+	while(t->readCount < TEST_FIFO_ELEMENT_COUNT * TEST_FIFO_TASK_COUNT){
+		uint32_t batch[TEST_FIFO_BATCH_SIZE];
+		uintptr_t n = readMPMCFIFONonBlock(t->mpmc, batch, TEST_FIFO_BATCH_SIZE);
+		if(n == 0){
+			yieldTestFIFO();
+			continue;
+		}
+		uintptr_t i;
+		for(i = 0; i < n; i++){
+			const uint32_t w = (batch[i] >> 24), v = (batch[i] & 0xffffff);
+			assert(w < TEST_FIFO_TASK_COUNT && v > last[w]);
+			last[w] = v;
+			lock_add32(&t->sum, v);
+		}
+		lock_add32(&t->readCount, n);
+	}
+	releaseSemaphore(t->finished);
+	systemCall_terminate();
+}
+
+static uint64_t runTestFIFOTasks(TestFIFO *t, void (*writer)(void*), void (*reader)(void*), uintptr_t taskCount){
+	const uint64_t t0 = rdtsc();
+	uintptr_t i;
+	for(i = 0; i < taskCount * 2; i++){
+		Task *task = createSharedMemoryTask((i % 2 == 0? writer: reader), &t, sizeof(t), processorLocalTask());
+		assert(task != NULL);
+		resume(task);
+	}
+	for(i = 0; i < taskCount * 2; i++){
+		acquireSemaphore(t->finished);
+	}
+	return rdtsc() - t0;
+}
+
+void testFIFO(void);
+void testFIFO(void){
+	static TestFIFO t;
+	t.spsc = createSPSCFIFO(64, sizeof(uint32_t));
+	t.mpmc = createMPMCFIFO(64, sizeof(uint32_t));
+	t.finished = createSemaphore(0);
+	assert(t.spsc != NULL && t.mpmc != NULL && t.finished != NULL);
+	// full and empty
+	uint32_t v[65] = {0};
+	assert(writeSPSCFIFO(t.spsc, v, 65) == 64 && writeSPSCFIFO(t.spsc, v, 1) == 0);
+	assert(readSPSCFIFONonBlock(t.spsc, v, 65) == 64 && readSPSCFIFONonBlock(t.spsc, v, 1) == 0);
+	assert(writeMPMCFIFO(t.mpmc, v, 65) == 64 && writeMPMCFIFO(t.mpmc, v, 1) == 0);
+	assert(readMPMCFIFONonBlock(t.mpmc, v, 65) == 64 && readMPMCFIFONonBlock(t.mpmc, v, 1) == 0);
+	tryAcquireAllSemaphore(t.spsc->semaphore);
+	tryAcquireAllSemaphore(t.mpmc->semaphore);
+
+	uint64_t spscCycles = runTestFIFOTasks(&t, testSPSCFIFOWriter, testSPSCFIFOReader, 1);
+	t.readCount = 0;
+	t.sum = 0;
+	uint64_t mpmcCycles = runTestFIFOTasks(&t, testMPMCFIFOWriter, testMPMCFIFOReader, TEST_FIFO_TASK_COUNT);
+	assert(t.readCount == TEST_FIFO_ELEMENT_COUNT * TEST_FIFO_TASK_COUNT);
+	// the sum of 1 ~ TEST_FIFO_ELEMENT_COUNT overflows
+	assert(t.sum == (uint32_t)(((uint64_t)TEST_FIFO_ELEMENT_COUNT * (TEST_FIFO_ELEMENT_COUNT + 1) / 2) * TEST_FIFO_TASK_COUNT));
+	printk("SPSC FIFO: %u cycles per element\n", (unsigned)(spscCycles / TEST_FIFO_ELEMENT_COUNT));
+	printk("MPMC FIFO: %u cycles per element\n",
+		(unsigned)(mpmcCycles / (TEST_FIFO_ELEMENT_COUNT * TEST_FIFO_TASK_COUNT)));
+
+	deleteSemaphore(t.finished);
+	deleteSPSCFIFO(t.spsc);
+	deleteMPMCFIFO(t.mpmc);
+	printk("test FIFO ok\n");
+	systemCall_terminate();
+}
+
+#endif
@@ -15,3 +15,25 @@ uintptr_t getDataLength(FIFO *fifo);
 FIFO *createFIFO(uintptr_t maxLength, uintptr_t elementSize);
 void deleteFIFO(FIFO *fifo);
 
+// lock-free FIFOs; return NULL if maxLength is not a power of 2
+// every write of at least one element releases the semaphore once,
+// so readers block only if the FIFO is empty
+// return the number of elements written or read; they are consecutive in data
+
+// one writer and one reader
+typedef struct SPSCFIFO SPSCFIFO;
+SPSCFIFO *createSPSCFIFO(uintptr_t maxLength, uintptr_t elementSize);
+void deleteSPSCFIFO(SPSCFIFO *fifo);
+uintptr_t writeSPSCFIFO(SPSCFIFO *fifo, const void *data, uintptr_t count);
+// wait until the FIFO is not empty
+uintptr_t readSPSCFIFO(SPSCFIFO *fifo, void *data, uintptr_t maxCount);
+uintptr_t readSPSCFIFONonBlock(SPSCFIFO *fifo, void *data, uintptr_t maxCount);
+
+// any number of writers and readers, including interrupt handlers
+typedef struct MPMCFIFO MPMCFIFO;
+MPMCFIFO *createMPMCFIFO(uintptr_t maxLength, uintptr_t elementSize);
+void deleteMPMCFIFO(MPMCFIFO *fifo);
+uintptr_t writeMPMCFIFO(MPMCFIFO *fifo, const void *data, uintptr_t count);
+uintptr_t readMPMCFIFO(MPMCFIFO *fifo, void *data, uintptr_t maxCount);
+uintptr_t readMPMCFIFONonBlock(MPMCFIFO *fifo, void *data, uintptr_t maxCount);
+
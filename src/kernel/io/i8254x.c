@@ -1,4 +1,5 @@
 #include"network/ethernet.h"
+#include"network/network.h"
 #include"task/task.h"
 #include"multiprocessor/processorlocal.h"
 #include"interrupt/controller/pic.h"
@@ -6,7 +7,6 @@
 #include"file/file.h"
 #include"resource/resource.h"
 
-#define BROADCAST_MAC_ADDRESS ((((uint64_t)0xffff) << 32) | 0xffffffff)
 
 typedef struct{
 	// big endian
@@ -47,13 +47,24 @@ typedef union{
 		uint8_t endOfPacket: 1;
 		uint8_t ignoreChecksum: 1;
 		uint8_t vlanPacket: 1;
-		uint8_t reserved: 1;
+		// extended descriptors only; legacy descriptors set tcpChecksum for UDP
+		uint8_t udpChecksum: 1;
 		uint8_t tcpChecksum: 1;
 		uint8_t ipChecksum: 1;
 		uint8_t passedInExactFilter: 1;
 	};
 }ReceiveStatus;
 
+enum ReceiveError{
+	CRC_ERROR = (1 << 0),
+	SYMBOL_ERROR = (1 << 1),
+	SEQUENCE_ERROR = (1 << 2),
+	CARRIER_EXTENSION_ERROR = (1 << 4),
+	TCP_UDP_CHECKSUM_ERROR = (1 << 5),
+	IP_CHECKSUM_ERROR = (1 << 6),
+	RX_DATA_ERROR = (1 << 7)
+};
+
 typedef struct{
 	uint64_t address;
 	uint16_t length;
@@ -66,6 +77,27 @@ typedef struct{
 static_assert(sizeof(ReceiveDescriptor) == 16);
 static_assert(sizeof(ReceiveStatus) == 1);
 
+// the device writes back status and errors in the same bit order as ReceiveDescriptor
+typedef union{
+	struct{
+		uint64_t address;
+		uint64_t reserved;
+	}read;
+	struct{
+		uint32_t multipleReceiveQueue;
+		uint32_t rssHash;
+		ReceiveStatus status;
+		uint8_t extendedStatus;
+		uint8_t reserved;
+		uint8_t errors;
+		uint16_t length;
+		uint16_t vlan;
+	}writeBack;
+}ExtendedReceiveDescriptor;
+
+static_assert(sizeof(ExtendedReceiveDescriptor) == 16);
+
+// also for ExtendedReceiveDescriptor, whose read format is the buffer address followed by zeros
 static void initReceiveDescriptor(volatile ReceiveDescriptor *r, volatile void *buffer){
 	const uintptr_t offset = ((uintptr_t)buffer) % PAGE_SIZE;
 	PhysicalAddress physicalAddress = checkAndTranslatePage(kernelLinear, (void*)((uintptr_t)buffer) - offset);
@@ -130,7 +162,8 @@ static int initTransmitDescriptor(
 	cmd.endOfPacket = (isEndOfFrame? 1: 0);
 	cmd.insertFCS = (autoAppendCRC? 1: 0);
 	cmd.insertChecksum = 0;
-	cmd.reportStatus = 1;
+	// only the last descriptor of a frame is checked. see reclaimI8254xTransmit
+	cmd.reportStatus = (isEndOfFrame? 1: 0);
 	cmd.reportPacketSent = 0;
 	cmd.extension = 0;
 	cmd.vlanEnable = 0;
@@ -176,16 +209,104 @@ typedef struct{
 
 static_assert(sizeof(DataTransmitDescriptor) == 16);
 
+// ContextTransmitDescriptor.type and DataTransmitDescriptor.type
+enum{
+	CONTEXT_DESCRIPTOR_TYPE = 0,
+	DATA_DESCRIPTOR_TYPE = 1
+};
+
+// ContextTransmitDescriptor.tuCommand
+enum{
+	CONTEXT_TCP = (1 << 0), // 0 = UDP
+	CONTEXT_IPV4 = (1 << 1), // 0 = IPv6
+	CONTEXT_SEGMENTATION = (1 << 2),
+	CONTEXT_EXTENSION = (1 << 5)
+};
+
+// DataTransmitDescriptor.command, see TransmitCommand
+enum{
+	DATA_END_OF_PACKET = (1 << 0),
+	DATA_INSERT_FCS = (1 << 1),
+	DATA_SEGMENTATION = (1 << 2),
+	DATA_REPORT_STATUS = (1 << 3),
+	DATA_EXTENSION = (1 << 5),
+	DATA_DELAY_INTERRUPT = (1 << 7)
+};
+
+// DataTransmitDescriptor.packetOption
+enum{
+	INSERT_IP_CHECKSUM = (1 << 0),
+	INSERT_TCP_UDP_CHECKSUM = (1 << 1)
+};
+
+// offsets are from the beginning of Ethernet frame
+// if maxSegmentSize != 0, the frame is cut into segments after the TCP header at tcpHeaderEnd
+static void initContextTransmitDescriptor(
+	volatile ContextTransmitDescriptor *cd,
+	uintptr_t ipBegin, uintptr_t ipHeaderEnd, int isTCP, uintptr_t tuChecksumOffset,
+	uintptr_t tcpHeaderEnd, uintptr_t frameSize, uintptr_t maxSegmentSize
+){
+	memset_volatile(cd, 0, sizeof(*cd));
+	cd->ipChecksumStart = ipBegin;
+	cd->ipChecksumOffset = ipBegin + MEMBER_OFFSET(IPV4Header, headerChecksum);
+	cd->ipChecksumEnd = ipHeaderEnd - 1;
+	cd->tuChecksumStart = ipHeaderEnd;
+	cd->tuChecksumOffset = ipHeaderEnd + tuChecksumOffset;
+	cd->tuChecksumEnd = 0; // end of frame
+	cd->payloadLength = 0;
+	cd->type = CONTEXT_DESCRIPTOR_TYPE;
+	cd->tuCommand = (CONTEXT_EXTENSION | CONTEXT_IPV4 | (isTCP? CONTEXT_TCP: 0));
+	cd->status = 0;
+	cd->reserved = 0;
+	cd->headerLength = 0;
+	cd->maxSegmentSize = 0;
+	if(maxSegmentSize != 0){
+		cd->tuCommand |= CONTEXT_SEGMENTATION;
+		cd->payloadLength = frameSize - tcpHeaderEnd;
+		cd->headerLength = tcpHeaderEnd;
+		cd->maxSegmentSize = maxSegmentSize;
+	}
+}
+
+static int initDataTransmitDescriptor(
+	volatile DataTransmitDescriptor *dd,
+	volatile void *buffer, uintptr_t length, int isEndOfFrame, int isSegmentation, uint8_t packetOption
+){
+	if(length + CRC_SIZE > MAX_FRAME_SIZE){
+		return 0;
+	}
+	uintptr_t offset = ((uintptr_t)buffer) % PAGE_SIZE;
+	PhysicalAddress pa = checkAndTranslatePage(kernelLinear, (void*)(((uintptr_t)buffer) - offset));
+	if(pa.value == INVALID_PAGE_ADDRESS){
+		return 0;
+	}
+	dd->address = pa.value + offset;
+	dd->dataLength = length;
+	dd->type = DATA_DESCRIPTOR_TYPE;
+	// only the last descriptor of a frame is checked. see reclaimI8254xTransmit
+	dd->command = (DATA_EXTENSION | DATA_INSERT_FCS | DATA_DELAY_INTERRUPT |
+		(isEndOfFrame? DATA_END_OF_PACKET | DATA_REPORT_STATUS: 0) | (isSegmentation? DATA_SEGMENTATION: 0));
+	dd->status = 0;
+	dd->reserved = 0;
+	dd->packetOption = packetOption;
+	dd->special = 0;
+	return 1;
+}
+
 #define S (sizeof(uint32_t))
 enum I8254xRegisterIndex{
 	DEVICE_CONTROL = 0x00000 / S,
 	DEVICE_STATUS = 0x0008 / S,
+	EXTENDED_DEVICE_CONTROL = 0x0018 / S,
 
 	INTERRUPT_CAUSE_READ = 0x00c0 / S,
-	// INTERRUPT_THROTTLING = 0x00c4 / S,
+	INTERRUPT_THROTTLING = 0x00c4 / S,
 	INTERRUPT_CAUSE_SET = 0x00c8 / S,
 	INTERRUPT_MASK_SET_READ = 0x00d0 / S,
 	INTERRUPT_MASK_CLEAR = 0x00d8 / S,
+	INTERRUPT_AUTO_CLEAR = 0x00dc / S,
+	INTERRUPT_ACK_AUTO_MASK = 0x00e0 / S,
+	INTERRUPT_VECTOR_ALLOCATION = 0x00e4 / S,
 
 	RECEIVE_CONTROL = 0x0100 / S,
 	RECEIVE_DESCRIPTORS_BASE_LOW = 0x2800 / S,
@@ -194,6 +315,7 @@ enum I8254xRegisterIndex{
 	RECEIVE_DESCRIPTORS_HEAD = 0x2810 / S,
 	RECEIVE_DESCRIPTORS_TAIL = 0x2818 / S,
 	RECEIVE_DELAY_TIMER = 0x2820 / S,
+	RECEIVE_ABSOLUTE_DELAY_TIMER = 0x282c / S,
 	RECEIVE_SMALL_PACKET_SIZE = 0x2c00 / S,
 
 	TRANSMIT_CONTROL = 0x400 / S,
@@ -204,13 +326,52 @@ enum I8254xRegisterIndex{
 	TRANSMIT_DESCRIPTORS_HEAD = 0x3810 / S,
 	TRANSMIT_DESCRIPTORS_TAIL = 0x3818 / S,
 	TRANSMIT_DELAY_TIMER = 0x03820 / S,
+	TRANSMIT_ABSOLUTE_DELAY_TIMER = 0x0382c / S,
+
+	// statistics are cleared on read
+	MISSED_PACKETS_COUNT = 0x4010 / S,
+	GOOD_PACKETS_RECEIVED_COUNT = 0x4074 / S,
+	TOTAL_PACKETS_RECEIVED = 0x40d0 / S,
 
+	RECEIVE_CHECKSUM_CONTROL = 0x5000 / S,
+	RECEIVE_FILTER_CONTROL = 0x5008 / S,
 	MULTICAST_TABLE_ARRAY = 0x5200 / S,
 	RECEIVE_ADDRESS_0_LOW = 0x5400 / S,
-	RECEIVE_ADDRESS_0_HIGH = 0x5404 / S
+	RECEIVE_ADDRESS_0_HIGH = 0x5404 / S,
+	MULTIPLE_RECEIVE_QUEUES_COMMAND = 0x5818 / S,
+	REDIRECTION_TABLE = 0x5c00 / S,
+	RSS_RANDOM_KEY = 0x5c80 / S
 };
+// registers of receive queue i are at RECEIVE_DESCRIPTORS_XX + 0x100 * i
+#define RECEIVE_QUEUE_REGISTER(R, I) ((R) + (I) * (0x100 / sizeof(uint32_t)))
+#define RECEIVE_ADDRESS_LOW(I) (RECEIVE_ADDRESS_0_LOW + 2 * (I))
+#define RECEIVE_ADDRESS_HIGH(I) (RECEIVE_ADDRESS_0_HIGH + 2 * (I))
 #undef S
+#define RECEIVE_ADDRESS_REGISTER_COUNT (16)
+#define RECEIVE_ADDRESS_VALID (((uint32_t)1) << 31)
 #define MULTICAST_TABLE_ARRAY_LENGTH (128)
+#define REDIRECTION_TABLE_LENGTH (32)
+#define RSS_RANDOM_KEY_LENGTH (10)
+
+// RECEIVE_CHECKSUM_CONTROL; bit 0~7 is the start offset of packet checksum
+#define RECEIVE_IP_CHECKSUM_OFFLOAD (1 << 8)
+#define RECEIVE_TCP_UDP_CHECKSUM_OFFLOAD (1 << 9)
+// write RSS hash instead of IP identification and checksum to the descriptors
+#define RECEIVE_PACKET_CHECKSUM_DISABLE (1 << 13)
+// RECEIVE_FILTER_CONTROL
+#define RECEIVE_EXTENDED_STATUS (1 << 15)
+// MULTIPLE_RECEIVE_QUEUES_COMMAND; hash TCP/IPv4 and IPv4 headers
+#define RSS_TWO_QUEUES (1 << 0)
+#define RSS_FIELD_IPV4_TCP (1 << 16)
+#define RSS_FIELD_IPV4 (1 << 17)
+// EXTENDED_DEVICE_CONTROL
+#define PBA_CLEAR_ON_MSIX (((uint32_t)1) << 31)
+// INTERRUPT_VECTOR_ALLOCATION; 4 bits for each cause
+#define VECTOR_ALLOCATION_VALID (1 << 3)
+#define VECTOR_ALLOCATION_RECEIVE_QUEUE(Q) (0 + 4 * (Q))
+#define VECTOR_ALLOCATION_TRANSMIT_QUEUE_0 (8)
+#define VECTOR_ALLOCATION_OTHER (16)
+#define VECTOR_ALLOCATION_EVERY_WRITE_BACK (((uint32_t)1) << 31)
 #define I8254X_REGISTERS_SIZE (0x20000)
 
 // for INTERRUPT_XX registers
@@ -223,7 +384,12 @@ enum InterruptBit{
 	//reserve (1 << 5)
 	RECEIVER_OVERRUN_BIT = (1 << 6),
 	RECEIVER_TIMER_EXPIRE_BIT = (1 << 7),
-	RECEIVER_SMALL_PACKET_BIT = (1 << 16)
+	RECEIVER_SMALL_PACKET_BIT = (1 << 16),
+	// MSI-X causes; see VECTOR_ALLOCATION_XX
+	RECEIVE_QUEUE_0_BIT = (1 << 20),
+	RECEIVE_QUEUE_1_BIT = (1 << 21),
+	TRANSMIT_QUEUE_0_BIT = (1 << 22),
+	OTHER_CAUSE_BIT = (1 << 24)
 };
 
 #define RECEIVE_INTERRUPT_BITS \
@@ -302,11 +468,20 @@ typedef struct RWI8254xRequest{
 	uint8_t *buffer;
 	uintptr_t rwSize;
 	EtherType etherType;
+	// enum ChecksumOffload
+	int checksumOffload;
+	// write only
+	uint64_t destinationAddress;
+	uintptr_t prefixSize;
+	// 0 if the frame is not cut by hardware; see SEGMENTATION_PREFIX_SHIFT
+	uintptr_t maxSegmentSize;
 
 	struct RWI8254xRequest **prev, *next;
 }RWI8254xRequest;
 
-static RWI8254xRequest *createRWI8254xRequest(RWFileRequest *rwfr, uint8_t *buffer, uintptr_t rwSize, EtherType etherType){
+static RWI8254xRequest *createRWI8254xRequest(
+	RWFileRequest *rwfr, uint8_t *buffer, uintptr_t rwSize, EtherType etherType, int checksumOffload
+){
 	RWI8254xRequest *NEW(r);
 	if(r == NULL){
 		return NULL;
@@ -315,12 +490,29 @@ static RWI8254xRequest *createRWI8254xRequest(RWFileRequest *rwfr, uint8_t *buff
 	r->buffer = buffer;
 	r->rwSize = rwSize;
 	r->etherType = etherType;
+	r->checksumOffload = checksumOffload;
+	r->destinationAddress = BROADCAST_MAC_ADDRESS;
+	r->prefixSize = 0;
+	r->maxSegmentSize = 0;
 	r->prev = NULL;
 	r->next = NULL;
 	return r;
 }
 
+// RDTR, RADV, TIDV and TADV are in 1.024 usec; ITR is in 256 nsec
+// 10^9 / (8000 * 256) = 488, at most 8000 interrupts per second
+#define DEFAULT_INTERRUPT_THROTTLING (488)
+#define DEFAULT_RECEIVE_DELAY (32)
+#define DEFAULT_RECEIVE_ABSOLUTE_DELAY (128)
+#define DEFAULT_TRANSMIT_DELAY (1000)
+#define DEFAULT_TRANSMIT_ABSOLUTE_DELAY (2000)
+#define MAX_DELAY_REGISTER_VALUE (0xffff)
+#define DEFAULT_POLL_BUDGET (64)
+
 #define RECEIVE_DESCRIPTOR_BUFFER_SIZE (256)
+// the redirection table of 82574 selects queues by 1 bit
+#define MAX_RECEIVE_QUEUE_COUNT (2)
+#define I82574_DEVICE_ID (0x10d3)
 #define TRANSMIT_DESCRIPTOR_BUFFER_SIZE (512)
 
 typedef struct{
@@ -331,6 +523,7 @@ typedef struct{
 		volatile ContextTransmitDescriptor *context;
 		volatile DataTransmitDescriptor *data;
 		volatile ReceiveDescriptor *receive;
+		volatile ExtendedReceiveDescriptor *extendedReceive;
 	}; // aligned to 16-bit
 	uintptr_t bufferCount;
 	// ring buffer queue
@@ -340,49 +533,197 @@ typedef struct{
 	uintptr_t maxBufferSize;
 	volatile uint8_t *bufferArray;
 
-	// HEAD >= intHead >= taskHead > taskTail >= TAIL
-	uintptr_t intHead, taskHead, taskTail;
+	// HEAD >= taskHead > taskTail >= TAIL
+	uintptr_t taskHead, taskTail;
 	Semaphore *intSemaphore;
 }I8254xDescriptorQueue;
 
 typedef struct{
 	I8254xDescriptorQueue queue;
+	// indexed by the first descriptor of each frame in taskHead ~ taskTail
+	struct I8254xTransmitFrame{
+		RWI8254xRequest *request;
+		uintptr_t descriptorCount;
+	}*frame;
 
 	Spinlock lock;
-	RWI8254xRequest *pending;
-	Semaphore *reqSemaphore;
+	// first in, first out
+	RWI8254xRequest *pending, **pendingTail;
+	// released by writers and by transmit interrupts
+	Semaphore *taskSemaphore;
 }I8254xTransmit;
 
-static void addPendingRWI8254xRequest(I8254xTransmit *q, RWI8254xRequest *r){
-	acquireLock(&q->lock);
-	ADD_TO_DQUEUE(r, &q->pending);
-	releaseLock(&q->lock);
-	releaseSemaphore(q->reqSemaphore);
+static void addPendingRWI8254xRequest(I8254xTransmit *t, RWI8254xRequest *r){
+	acquireLock(&t->lock);
+	ADD_TO_DQUEUE(r, t->pendingTail);
+	t->pendingTail = &r->next;
+	releaseLock(&t->lock);
+	releaseSemaphore(t->taskSemaphore);
 }
 
-static RWI8254xRequest *removeRWI8254xRequest(I8254xTransmit *q){
-	acquireSemaphore(q->reqSemaphore);
-	acquireLock(&q->lock);
-	RWI8254xRequest *r = q->pending;
-	assert(r != NULL);
-	REMOVE_FROM_DQUEUE(r);
-	releaseLock(&q->lock);
+typedef struct{
+	uintptr_t ipHeaderSize;
+	uint8_t packetOption;
+	int isTCP;
+	uintptr_t tuChecksumOffset;
+	// valid if maxSegmentSize != 0
+	uintptr_t tcpHeaderSize;
+	uintptr_t maxSegmentSize;
+}TransmitChecksumContext;
+
+// the context of a segmentation request needs a TCP/IPv4 packet with both checksums inserted
+static int getTransmitSegmentationContext(const RWI8254xRequest *r, TransmitChecksumContext *c){
+	const uint8_t *tcpHeader = r->buffer + c->ipHeaderSize;
+	if(c->isTCP == 0 || (c->packetOption & INSERT_IP_CHECKSUM) == 0 ||
+		r->rwSize < c->ipHeaderSize + TCP_DATA_OFFSET_OFFSET + 1){
+		return 0;
+	}
+	c->tcpHeaderSize = GET_TCP_HEADER_SIZE(tcpHeader);
+	// every segment is a frame of at most MAX_PAYLOAD_SIZE
+	if(c->tcpHeaderSize < TCP_CHECKSUM_OFFSET + sizeof(uint16_t) ||
+		c->ipHeaderSize + c->tcpHeaderSize > r->rwSize ||
+		c->ipHeaderSize + c->tcpHeaderSize + r->maxSegmentSize > MAX_PAYLOAD_SIZE){
+		return 0;
+	}
+	c->maxSegmentSize = r->maxSegmentSize;
+	return 1;
+}
+
+// return whether the request needs a context descriptor
+// a segmentation request fails if its packet cannot be segmented
+static int getTransmitChecksumContext(const RWI8254xRequest *r, TransmitChecksumContext *c){
+	if(r->checksumOffload == 0 || r->etherType != ETHERTYPE_IPV4 || r->rwSize < sizeof(IPV4Header)){
+		return 0;
+	}
+	const IPV4Header *h = (const IPV4Header*)r->buffer;
+	c->ipHeaderSize = getIPHeaderSize(h);
+	if(h->version != 4 || c->ipHeaderSize < sizeof(*h) || c->ipHeaderSize > r->rwSize){
+		return 0;
+	}
+	c->packetOption = 0;
+	c->isTCP = 0;
+	c->tuChecksumOffset = 0;
+	c->tcpHeaderSize = 0;
+	c->maxSegmentSize = 0;
+	if(r->checksumOffload & CHECKSUM_OFFLOAD_IPV4_HEADER){
+		c->packetOption |= INSERT_IP_CHECKSUM;
+	}
+	// the checksum of a fragment covers the whole datagram
+	if((r->checksumOffload & CHECKSUM_OFFLOAD_IPV4_DATA) && isIPFragment(h) == 0){
+		switch(h->protocol){
+		case IP_DATA_PROTOCOL_TCP:
+			c->isTCP = 1;
+			c->tuChecksumOffset = TCP_CHECKSUM_OFFSET;
+			c->packetOption |= INSERT_TCP_UDP_CHECKSUM;
+			break;
+		case IP_DATA_PROTOCOL_UDP:
+			c->tuChecksumOffset = UDP_CHECKSUM_OFFSET;
+			c->packetOption |= INSERT_TCP_UDP_CHECKSUM;
+			break;
+		default:
+			break;
+		}
+	}
+	if(r->maxSegmentSize != 0){
+		return getTransmitSegmentationContext(r, c);
+	}
+	return (c->packetOption != 0);
+}
+
+// the device adds the TCP length of each segment to the checksum
+// so the pseudo header sum of a segmentation request excludes the length
+static void excludeTCPLengthFromChecksum(volatile uint8_t *tcpHeader, uintptr_t tcpLength){
+	uint16_t checksum;
+	memcpy_volatile(&checksum, tcpHeader + TCP_CHECKSUM_OFFSET, sizeof(checksum));
+	checksum = ~updateChecksum16(~checksum, changeEndian16(tcpLength), 0);
+	memcpy_volatile(tcpHeader + TCP_CHECKSUM_OFFSET, &checksum, sizeof(checksum));
+}
+
+static uintptr_t getTransmitDescriptorCount(const I8254xDescriptorQueue *q, const RWI8254xRequest *r){
+	const uintptr_t firstPayloadSize = q->maxBufferSize - sizeof(EthernetHeader);
+	TransmitChecksumContext c;
+	const uintptr_t contextCount = (getTransmitChecksumContext(r, &c)? 1: 0);
+	if(r->rwSize <= firstPayloadSize){
+		return contextCount + 1;
+	}
+	return contextCount + 1 + DIV_CEIL(r->rwSize - firstPayloadSize, q->maxBufferSize);
+}
+
+// return NULL if there is no request or the first request needs more than freeDescCnt descriptors
+static RWI8254xRequest *removeRWI8254xRequest(I8254xTransmit *t, uintptr_t freeDescCnt){
+	acquireLock(&t->lock);
+	RWI8254xRequest *r = t->pending;
+	if(r != NULL && getTransmitDescriptorCount(&t->queue, r) <= freeDescCnt){
+		REMOVE_FROM_DQUEUE(r);
+		if(t->pending == NULL){
+			t->pendingTail = &t->pending;
+		}
+	}
+	else{
+		r = NULL;
+	}
+	releaseLock(&t->lock);
 	return r;
 }
 
 typedef struct{
 	I8254xDescriptorQueue queue;
+	struct I8254xDevice *device;
+	// see RECEIVE_QUEUE_REGISTER
+	uintptr_t index;
+	// ExtendedReceiveDescriptor or ReceiveDescriptor
+	int isExtended;
+	// enum InterruptBit masked while the receive task polls the ring
+	uint32_t interruptBits;
 	int bufferHeadHasHeader;
 	struct I8254xBufferStatus{
 		volatile uint8_t *payload;
 		uintptr_t payloadSize;
 		int isEndOfFrame;
+		// enum ChecksumOffload; valid if isEndOfFrame
+		int checksumVerified;
 	}*bufferStatus;
 	// protect bufferHead and reader
-	Semaphore *readerSemaphore;
+	Mutex *readerMutex;
 	struct I8254xReader *reader;
+	// max number of descriptors processed before yielding to other tasks
+	uintptr_t pollBudget;
+	// INTx only; woken by i8254xHandler and not finished polling
+	int isPolling;
+	// the beginning of the frame being received; see captureI8254xReceiveBuffer
+	struct I8254xCaptureFrame{
+		int isCapturing;
+		uint64_t timestamp;
+		uintptr_t snapshotSize, frameSize;
+		uint8_t snapshot[PACKET_CAPTURE_SNAPSHOT_LENGTH];
+	}capture;
 }I8254xReceive;
 
+static volatile ReceiveStatus *getReceiveStatus(const I8254xReceive *r, uintptr_t descriptorIndex){
+	const I8254xDescriptorQueue *q = &r->queue;
+	if(r->isExtended){
+		return &q->extendedReceive[descriptorIndex].writeBack.status;
+	}
+	return &q->receive[descriptorIndex].status;
+}
+
+static void readReceiveDescriptor(const I8254xReceive *r, uintptr_t descriptorIndex,
+	ReceiveStatus *status, uint8_t *errors, uintptr_t *length){
+	const I8254xDescriptorQueue *q = &r->queue;
+	if(r->isExtended){
+		const volatile ExtendedReceiveDescriptor *rd = &q->extendedReceive[descriptorIndex];
+		*status = rd->writeBack.status;
+		*errors = rd->writeBack.errors;
+		*length = rd->writeBack.length;
+	}
+	else{
+		const volatile ReceiveDescriptor *rd = &q->receive[descriptorIndex];
+		*status = rd->status;
+		*errors = rd->errors;
+		*length = rd->length;
+	}
+}
+
 typedef struct I8254xReader{
 	RWI8254xRequest *pending;
 	// I8254xReceive.bufferHead >= bufferIndex >= I8254xReceive.bufferTail
@@ -397,18 +738,34 @@ static void initI8254xReader(I8254xReader *r, I8254xReceive *q){
 	r->receive = q;
 	r->prev = NULL;
 	r->next = NULL;
-	acquireSemaphore(q->readerSemaphore);
+	acquireMutex(q->readerMutex);
 	r->bufferIndex = q->queue.bufferHead;
 	ADD_TO_DQUEUE(r, &q->reader);
-	releaseSemaphore(q->readerSemaphore);
+	releaseMutex(q->readerMutex);
 }
 
 static void destroyI8254xReader(I8254xReader *reader){
 	I8254xReceive *r = reader->receive;
 	assert(reader->pending == NULL);
-	acquireSemaphore(r->readerSemaphore);
+	acquireMutex(r->readerMutex);
 	REMOVE_FROM_DQUEUE(reader);
-	releaseSemaphore(r->readerSemaphore);
+	releaseMutex(r->readerMutex);
+}
+
+// return 0 if the reader has pending requests
+static int moveI8254xReader(I8254xReader *reader, I8254xReceive *q){
+	I8254xReceive *r = reader->receive;
+	acquireMutex(r->readerMutex);
+	const int hasPending = (reader->pending != NULL);
+	if(hasPending == 0){
+		REMOVE_FROM_DQUEUE(reader);
+	}
+	releaseMutex(r->readerMutex);
+	if(hasPending){
+		return 0;
+	}
+	initI8254xReader(reader, q);
+	return 1;
 }
 
 // return whether the buffer is valid
@@ -419,6 +776,7 @@ static int setBufferStatus(
 	bs->payloadSize = s;
 	bs->payload = buffer;
 	bs->isEndOfFrame = isEndOfFrame;
+	bs->checksumVerified = 0;
 	if(hasHeader){
 		volatile EthernetHeader *h = (volatile EthernetHeader*)buffer;
 		if(bs->payloadSize < sizeof(*h)){
@@ -450,15 +808,43 @@ static int setBufferStatus(
 	return 0;
 }
 
+// see FILE_PARAM_ADD_RECEIVE_ADDRESS
+#define MAX_FILTER_ADDRESS_COUNT (64)
+
+typedef struct{
+	uint64_t macAddress;
+	uintptr_t referenceCount;
+}I8254xFilterAddress;
+
+typedef struct{
+	Spinlock lock;
+	uintptr_t addressCount;
+	I8254xFilterAddress address[MAX_FILTER_ADDRESS_COUNT];
+	// accumulated statistics registers
+	uint64_t receivedCount, acceptedCount, missedCount;
+}I8254xAddressFilter;
+
 typedef struct I8254xDevice{
 	volatile uint32_t *regs;
 	uint64_t macAddress;
+	// frames to other addresses are dropped by hardware
+	I8254xAddressFilter filter;
 
 	int terminateFlag;
 	I8254xTransmit transmit;
 	Task *transmitTask;
-	I8254xReceive receive;
-	Task *receiveTask;
+	// RSS distributes the frames to receive queues; non-IP frames go to queue 0
+	uintptr_t receiveQueueCount;
+	I8254xReceive receive[MAX_RECEIVE_QUEUE_COUNT];
+	Task *receiveTask[MAX_RECEIVE_QUEUE_COUNT];
+	// 0 if all causes share INTx; see initI8254xMSIX
+	int useMSIX;
+	// INTx only; protect isPolling of the receive queues and pollingQueueCount
+	Spinlock pollLock;
+	uintptr_t pollingQueueCount;
+	// see FILE_PARAM_PACKET_CAPTURE; the only check in the data path if disabled
+	volatile int isCapturing;
+	PacketCapture *capture;
 
 	int serialNumber;
 
@@ -468,6 +854,11 @@ typedef struct I8254xDevice{
 typedef struct{
 	I8254xDevice *device;
 	EtherType transmitEtherType;
+	int checksumOffload;
+	uint64_t destinationAddress;
+	int destinationPrefix;
+	// see SEGMENTATION_PREFIX_SHIFT
+	int segmentationOffload;
 	I8254xReader reader;
 }OpenedI8254xDevice;
 
@@ -478,7 +869,11 @@ static OpenedI8254xDevice *createOpenedI8254xDevice(I8254xDevice *d){
 	}
 	od->device = d;
 	od->transmitEtherType = ETHERTYPE_IPV4;
-	initI8254xReader(&od->reader, &d->receive);
+	od->checksumOffload = 0;
+	od->destinationAddress = BROADCAST_MAC_ADDRESS;
+	od->destinationPrefix = 0;
+	od->segmentationOffload = 0;
+	initI8254xReader(&od->reader, &d->receive[0]);
 	return od;
 }
 
@@ -496,7 +891,6 @@ static int initDescriptorQueue(I8254xDescriptorQueue *q, uintptr_t descCnt, uint
 	q->bufferArray = allocatePages(kernelLinear, q->maxBufferSize * q->bufferCount, KERNEL_NON_CACHED_PAGE);
 	EXPECT(q->bufferArray != NULL);
 	// see regs[RECEIVE_DESCRIPTORS_HEAD] or regs[TRANSMIT_DESCRIPTORS_HEAD]
-	q->intHead = 0;
 	q->taskHead = 0;
 	q->taskTail = 0;
 	q->intSemaphore = createSemaphore(0);
@@ -531,52 +925,269 @@ static void destroyDescriptorQueue(I8254xDescriptorQueue *q){
 	checkAndReleasePages(kernelLinear, (void*)q->receive);
 }
 
-static int initI8254Receive(I8254xReceive *r, volatile uint32_t *regs){
+static int initI8254Receive(I8254xReceive *r, I8254xDevice *d, uintptr_t index, int isExtended){
 	const uintptr_t descCnt = PAGE_SIZE / sizeof(GenericDescriptor);
 	I8254xDescriptorQueue *q = &r->queue;
+	volatile uint32_t *const regs = d->regs;
 	// half of the buffers are for hardware, the other half for reader
 	int ok = initDescriptorQueue(q, descCnt, RECEIVE_DESCRIPTOR_BUFFER_SIZE, descCnt * 2);
 	EXPECT(ok);
+	r->device = d;
+	r->index = index;
+	r->isExtended = isExtended;
+	r->interruptBits = RECEIVE_INTERRUPT_BITS;
 	r->bufferHeadHasHeader = 1;
 	NEW_ARRAY(r->bufferStatus, q->bufferCount);
 	EXPECT(r->bufferStatus != NULL);
-	r->readerSemaphore = createSemaphore(1);
-	EXPECT(r->readerSemaphore != NULL);
+	r->readerMutex = createMutex();
+	EXPECT(r->readerMutex != NULL);
 	r->reader = NULL;
-	// set mac address
-	// regs[RECEIVE_ADDRESS_0_HIGH] =
-	// regs[RECEIVE_ADDRESS_0_LOW] =
-	// printk("%x %x\n", regs[RECEIVE_ADDRESS_0_HIGH], regs[RECEIVE_ADDRESS_0_LOW]);
-	// clear multicast table array
-	uintptr_t i;
-	for(i = 0; i < MULTICAST_TABLE_ARRAY_LENGTH; i++){
-		regs[MULTICAST_TABLE_ARRAY + i] = 0;
-	}
-	// disable receive delay timer
-	regs[RECEIVE_DELAY_TIMER] = 0;
-	// if packet size <= threshold, interrupt immediately
-	regs[RECEIVE_SMALL_PACKET_SIZE] = 0;
-	// iniI8254xTransmit also sets LINK_STATUS
-	// write 1 to disable interrupt
-	regs[INTERRUPT_MASK_CLEAR] = (LINK_STATUS_CHANGE_BIT | RECEIVE_INTERRUPT_BITS);
-	// write 1 to enable interrupt
-	regs[INTERRUPT_MASK_SET_READ] = (LINK_STATUS_CHANGE_BIT | RECEIVE_INTERRUPT_BITS);
+	r->pollBudget = DEFAULT_POLL_BUDGET;
+	r->capture.isCapturing = 0;
 	// descriptor array
 	const uintptr_t descArraySize = q->descriptorCount * sizeof(q->receive[0]);
 	uint64_t rdPhysical = getDescriptorQueueBase(q);
 	assert(descArraySize > 0 && descArraySize <= PAGE_SIZE && descArraySize % 128 == 0);
-	regs[RECEIVE_DESCRIPTORS_BASE_LOW] = LOW64(rdPhysical);
-	regs[RECEIVE_DESCRIPTORS_BASE_HIGH] = HIGH64(rdPhysical);
-	regs[RECEIVE_DESCRIPTORS_LENGTH] = descArraySize;
+	regs[RECEIVE_QUEUE_REGISTER(RECEIVE_DESCRIPTORS_BASE_LOW, index)] = LOW64(rdPhysical);
+	regs[RECEIVE_QUEUE_REGISTER(RECEIVE_DESCRIPTORS_BASE_HIGH, index)] = HIGH64(rdPhysical);
+	regs[RECEIVE_QUEUE_REGISTER(RECEIVE_DESCRIPTORS_LENGTH, index)] = descArraySize;
 	// descriptor buffer address
 	q->bufferTail = q->descriptorCount - 1;
 	q->taskTail = q->descriptorCount - 1;
+	uintptr_t i;
 	for(i = 0; i < q->taskTail; i++){
 		initReceiveDescriptor(&q->receive[i], getDescriptorQueueBuffer(q, i));
 	}
-	q->receive[q->bufferTail].status.value = 0;
-	regs[RECEIVE_DESCRIPTORS_HEAD] = 0;
-	regs[RECEIVE_DESCRIPTORS_TAIL] = q->taskTail;
+	getReceiveStatus(r, q->bufferTail)->value = 0;
+	regs[RECEIVE_QUEUE_REGISTER(RECEIVE_DESCRIPTORS_HEAD, index)] = 0;
+	regs[RECEIVE_QUEUE_REGISTER(RECEIVE_DESCRIPTORS_TAIL, index)] = q->taskTail;
+
+	return 1;
+	// deleteMutex(r->readerMutex);
+	ON_ERROR;
+	DELETE(r->bufferStatus);
+	ON_ERROR;
+	destroyDescriptorQueue(q);
+	ON_ERROR;
+	return 0;
+}
+
+static void destroyI8254xReceive(I8254xReceive *r){
+	assert(r->reader == NULL);
+	deleteMutex(r->readerMutex);
+	DELETE(r->bufferStatus);
+	destroyDescriptorQueue(&r->queue);
+}
+
+// 82574 supports RSS with extended descriptors
+static int initI8254xReceiveQueues(I8254xDevice *d, uint16_t deviceID){
+	d->receiveQueueCount = (deviceID == I82574_DEVICE_ID? MAX_RECEIVE_QUEUE_COUNT: 1);
+	const int isExtended = (d->receiveQueueCount > 1);
+	uintptr_t i;
+	for(i = 0; i < d->receiveQueueCount; i++){
+		if(initI8254Receive(&d->receive[i], d, i, isExtended) == 0)
+			break;
+	}
+	if(i == d->receiveQueueCount){
+		return 1;
+	}
+	while(i > 0){
+		i--;
+		destroyI8254xReceive(&d->receive[i]);
+	}
+	return 0;
+}
+
+static void destroyI8254xReceiveQueues(I8254xDevice *d){
+	uintptr_t i;
+	for(i = 0; i < d->receiveQueueCount; i++){
+		destroyI8254xReceive(&d->receive[i]);
+	}
+}
+
+// the key in the verification suite of Microsoft RSS
+static const uint8_t rssKey[RSS_RANDOM_KEY_LENGTH * sizeof(uint32_t)] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+	0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+	0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa
+};
+
+static void initI8254xRSS(volatile uint32_t *regs, uintptr_t queueCount){
+	uintptr_t i;
+	for(i = 0; i < RSS_RANDOM_KEY_LENGTH; i++){
+		uint32_t k;
+		memcpy(&k, rssKey + i * sizeof(k), sizeof(k));
+		regs[RSS_RANDOM_KEY + i] = k;
+	}
+	// 128 entries of 1 byte; bit 7 is the queue of the hash values whose lowest 7 bits are the index
+	for(i = 0; i < REDIRECTION_TABLE_LENGTH; i++){
+		uint32_t v = 0;
+		uintptr_t b;
+		for(b = 0; b < sizeof(v); b++){
+			v |= ((((i * sizeof(v) + b) % queueCount) << 7) << (b * 8));
+		}
+		regs[REDIRECTION_TABLE + i] = v;
+	}
+	regs[MULTIPLE_RECEIVE_QUEUES_COMMAND] = (RSS_TWO_QUEUES | RSS_FIELD_IPV4_TCP | RSS_FIELD_IPV4);
+}
+
+// call after the rings of all queues are initialized
+static void initI8254xAddressFilter(I8254xAddressFilter *f){
+	f->lock = initialSpinlock;
+	f->addressCount = 0;
+	f->receivedCount = 0;
+	f->acceptedCount = 0;
+	f->missedCount = 0;
+}
+
+// the individual/group bit of the first byte
+static int isMulticastMACAddress(uint64_t macAddress){
+	return (int)(macAddress & 1);
+}
+
+// RECEIVE_CONTROL.multicastOffset = 0 hashes bit 36~47 of the address
+static uintptr_t getMulticastTableIndex(uint64_t macAddress){
+	return (uintptr_t)((macAddress >> 36) & 0xfff);
+}
+
+static void writeReceiveAddress(volatile uint32_t *regs, uintptr_t index, uint64_t macAddress){
+	// invalidate the entry before changing the low half
+	regs[RECEIVE_ADDRESS_HIGH(index)] = 0;
+	regs[RECEIVE_ADDRESS_LOW(index)] = LOW64(macAddress);
+	regs[RECEIVE_ADDRESS_HIGH(index)] = (HIGH64(macAddress) & 0xffff) | RECEIVE_ADDRESS_VALID;
+}
+
+// receive address 0 is the address of the device
+// the added addresses take the other receive address registers, unicast addresses first,
+// and the remaining multicast addresses are hashed into the multicast table array
+static void writeI8254xAddressFilter(volatile uint32_t *regs, const I8254xAddressFilter *f){
+	uint32_t table[MULTICAST_TABLE_ARRAY_LENGTH];
+	memset(table, 0, sizeof(table));
+	uintptr_t next = 1;
+	int isMulticast;
+	for(isMulticast = 0; isMulticast <= 1; isMulticast++){
+		uintptr_t i;
+		for(i = 0; i < f->addressCount; i++){
+			const uint64_t a = f->address[i].macAddress;
+			if(isMulticastMACAddress(a) != isMulticast){
+				continue;
+			}
+			if(next < RECEIVE_ADDRESS_REGISTER_COUNT){
+				writeReceiveAddress(regs, next, a);
+				next++;
+				continue;
+			}
+			// see addI8254xFilterAddress
+			assert(isMulticast);
+			const uintptr_t h = getMulticastTableIndex(a);
+			table[h / 32] |= (((uint32_t)1) << (h % 32));
+		}
+	}
+	for(; next < RECEIVE_ADDRESS_REGISTER_COUNT; next++){
+		regs[RECEIVE_ADDRESS_HIGH(next)] = 0;
+	}
+	uintptr_t i;
+	for(i = 0; i < MULTICAST_TABLE_ARRAY_LENGTH; i++){
+		regs[MULTICAST_TABLE_ARRAY + i] = table[i];
+	}
+}
+
+static uintptr_t searchFilterAddress(const I8254xAddressFilter *f, uint64_t macAddress){
+	uintptr_t i;
+	for(i = 0; i < f->addressCount; i++){
+		if(f->address[i].macAddress == macAddress)
+			break;
+	}
+	return i;
+}
+
+static uintptr_t countUnicastFilterAddress(const I8254xAddressFilter *f){
+	uintptr_t i, n = 0;
+	for(i = 0; i < f->addressCount; i++){
+		n += (isMulticastMACAddress(f->address[i].macAddress)? 0: 1);
+	}
+	return n;
+}
+
+// unicast addresses cannot be hashed, so they are limited by the receive address registers
+static int addI8254xFilterAddress(I8254xDevice *d, uint64_t macAddress){
+	I8254xAddressFilter *f = &d->filter;
+	int ok = 1;
+	acquireLock(&f->lock);
+	const uintptr_t i = searchFilterAddress(f, macAddress);
+	if(i < f->addressCount){
+		f->address[i].referenceCount++;
+	}
+	else if(f->addressCount == MAX_FILTER_ADDRESS_COUNT || (isMulticastMACAddress(macAddress) == 0 &&
+		countUnicastFilterAddress(f) + 1 >= RECEIVE_ADDRESS_REGISTER_COUNT)){
+		ok = 0;
+	}
+	else{
+		f->address[i].macAddress = macAddress;
+		f->address[i].referenceCount = 1;
+		f->addressCount++;
+		writeI8254xAddressFilter(d->regs, f);
+	}
+	releaseLock(&f->lock);
+	return ok;
+}
+
+static int removeI8254xFilterAddress(I8254xDevice *d, uint64_t macAddress){
+	I8254xAddressFilter *f = &d->filter;
+	acquireLock(&f->lock);
+	const uintptr_t i = searchFilterAddress(f, macAddress);
+	const int ok = (i < f->addressCount);
+	if(ok){
+		f->address[i].referenceCount--;
+		if(f->address[i].referenceCount == 0){
+			f->addressCount--;
+			f->address[i] = f->address[f->addressCount];
+			writeI8254xAddressFilter(d->regs, f);
+		}
+	}
+	releaseLock(&f->lock);
+	return ok;
+}
+
+// frames dropped by the address filter or with errors, and frames dropped for lack of receive descriptors
+static void getI8254xDropCount(I8254xDevice *d, uint64_t *filteredCount, uint64_t *missedCount){
+	I8254xAddressFilter *f = &d->filter;
+	acquireLock(&f->lock);
+	f->receivedCount += d->regs[TOTAL_PACKETS_RECEIVED];
+	f->acceptedCount += d->regs[GOOD_PACKETS_RECEIVED_COUNT];
+	f->missedCount += d->regs[MISSED_PACKETS_COUNT];
+	// the counters are not read at the same time
+	*filteredCount = (f->receivedCount > f->acceptedCount? f->receivedCount - f->acceptedCount: 0);
+	*missedCount = f->missedCount;
+	releaseLock(&f->lock);
+}
+
+static void enableI8254xReceive(I8254xDevice *d){
+	volatile uint32_t *const regs = d->regs;
+	const I8254xReceive *r = &d->receive[0];
+	// receive address 0 is loaded from EEPROM
+	writeI8254xAddressFilter(regs, &d->filter);
+	// verify IPv4 and TCP/UDP checksums. see toChecksumVerified
+	regs[RECEIVE_CHECKSUM_CONTROL] = (RECEIVE_IP_CHECKSUM_OFFLOAD | RECEIVE_TCP_UDP_CHECKSUM_OFFLOAD | sizeof(EthernetHeader) |
+		(r->isExtended? RECEIVE_PACKET_CHECKSUM_DISABLE: 0));
+	if(r->isExtended){
+		regs[RECEIVE_FILTER_CONTROL] |= RECEIVE_EXTENDED_STATUS;
+	}
+	if(d->receiveQueueCount > 1){
+		initI8254xRSS(regs, d->receiveQueueCount);
+	}
+	// interrupt after the receiver is idle for RDTR, or at most RADV after the first frame
+	regs[RECEIVE_DELAY_TIMER] = DEFAULT_RECEIVE_DELAY;
+	regs[RECEIVE_ABSOLUTE_DELAY_TIMER] = DEFAULT_RECEIVE_ABSOLUTE_DELAY;
+	// limit the interrupt rate of all causes
+	regs[INTERRUPT_THROTTLING] = DEFAULT_INTERRUPT_THROTTLING;
+	// if packet size <= threshold, interrupt immediately
+	regs[RECEIVE_SMALL_PACKET_SIZE] = 0;
+	// iniI8254xTransmit also sets LINK_STATUS
+	// write 1 to disable interrupt
+	regs[INTERRUPT_MASK_CLEAR] = (LINK_STATUS_CHANGE_BIT | RECEIVE_INTERRUPT_BITS);
+	// write 1 to enable interrupt
+	regs[INTERRUPT_MASK_SET_READ] = (LINK_STATUS_CHANGE_BIT | RECEIVE_INTERRUPT_BITS);
 	ReceiveControlRegister rc = {value: 0};
 	rc.enabled = 1;
 	// do not filter destination address
@@ -585,12 +1196,12 @@ static int initI8254Receive(I8254xReceive *r, volatile uint32_t *regs){
 	// 0 = 1/2 of descriptor array; 1 = 1/4; 2 = 1/8
 	// 4096/16/8=32
 	rc.receiveDescThreshold = 2;
-	// bit 36~48 as lookup address
-	// IMPROVE: rc.multicastOffset = 0
+	// see getMulticastTableIndex
+	rc.multicastOffset = 0;
 	// accept broadcast
 	rc.broadacastAcceptMode = 1;
 	// 0 = 2048; 1 = 1024; 2 = 512; 3 = 256
-	switch(q->maxBufferSize){
+	switch(r->queue.maxBufferSize){
 	case 256:
 	case 256*16:
 		rc.receiveBufferSize = 3;
@@ -611,25 +1222,9 @@ static int initI8254Receive(I8254xReceive *r, volatile uint32_t *regs){
 		assert(0);
 	}
 	//0 = 1 byte; 1 = 16 bytes
-	rc.bufferSizeExtension = (q->maxBufferSize >= 4096? 1: 0);
+	rc.bufferSizeExtension = (r->queue.maxBufferSize >= 4096? 1: 0);
 	rc.stripEthernetCRC = 1;
 	regs[RECEIVE_CONTROL] = rc.value;
-
-	return 1;
-	// deleteSemaphore(r->readerSemaphore);
-	ON_ERROR;
-	DELETE(r->bufferStatus);
-	ON_ERROR;
-	destroyDescriptorQueue(q);
-	ON_ERROR;
-	return 0;
-}
-
-static void destroyI8254xReceive(I8254xReceive *r){
-	assert(r->reader == NULL);
-	deleteSemaphore(r->readerSemaphore);
-	DELETE(r->bufferStatus);
-	destroyDescriptorQueue(&r->queue);
 }
 
 static int initI8254xTransmit(I8254xTransmit *t, volatile uint32_t *regs){
@@ -637,10 +1232,18 @@ static int initI8254xTransmit(I8254xTransmit *t, volatile uint32_t *regs){
 	I8254xDescriptorQueue *q = &t->queue;
 	int ok = initDescriptorQueue(q, descCnt, TRANSMIT_DESCRIPTOR_BUFFER_SIZE, descCnt);
 	EXPECT(ok);
+	NEW_ARRAY(t->frame, q->descriptorCount);
+	EXPECT(t->frame != NULL);
+	uintptr_t i;
+	for(i = 0; i < q->descriptorCount; i++){
+		t->frame[i].request = NULL;
+		t->frame[i].descriptorCount = 0;
+	}
 	t->lock = initialSpinlock;
 	t->pending = NULL;
-	t->reqSemaphore = createSemaphore(0);
-	EXPECT(t->reqSemaphore != NULL);
+	t->pendingTail = &t->pending;
+	t->taskSemaphore = createSemaphore(0);
+	EXPECT(t->taskSemaphore != NULL);
 
 	// iniI8254xReceive also sets LINK_STATUS
 	regs[INTERRUPT_MASK_CLEAR] |=
@@ -653,14 +1256,14 @@ static int initI8254xTransmit(I8254xTransmit *t, volatile uint32_t *regs){
 	regs[TRANSMIT_DESCRIPTORS_BASE_LOW] = LOW64(tdAddress);
 	regs[TRANSMIT_DESCRIPTORS_BASE_HIGH] = HIGH64(tdAddress);
 	regs[TRANSMIT_DESCRIPTORS_LENGTH] = tdArraySize;
-	// TAIL status must be 0. see i8254xTransmitHandler
 	q->legacy[0].status.value = 0;
 	regs[TRANSMIT_DESCRIPTORS_HEAD] = 0;
 	regs[TRANSMIT_DESCRIPTORS_TAIL] = 0;
 
 	// 100Mbps = 12.5 byte/usec
 	// 1000 * 12.5 = 12500
-	regs[TRANSMIT_DELAY_TIMER] = 1000; // in 1.024 usec
+	regs[TRANSMIT_DELAY_TIMER] = DEFAULT_TRANSMIT_DELAY;
+	regs[TRANSMIT_ABSOLUTE_DELAY_TIMER] = DEFAULT_TRANSMIT_ABSOLUTE_DELAY;
 
 	InterPacketGapRegister ipg = {value: 0};
 	ipg.transmitTime = 10;
@@ -675,7 +1278,9 @@ static int initI8254xTransmit(I8254xTransmit *t, volatile uint32_t *regs){
 	tc.collisionDistance = 0x40;
 	regs[TRANSMIT_CONTROL] = tc.value;
 	return 1;
-	//deleteSemaphore(t->reqSemaphore);
+	//deleteSemaphore(t->taskSemaphore);
+	ON_ERROR;
+	DELETE(t->frame);
 	ON_ERROR;
 	destroyDescriptorQueue(q);
 	ON_ERROR;
@@ -683,20 +1288,36 @@ static int initI8254xTransmit(I8254xTransmit *t, volatile uint32_t *regs){
 }
 
 static void destroyI8254xTransmit(I8254xTransmit *tran){
-	assert(getSemaphoreValue(tran->reqSemaphore) == 0);
-	deleteSemaphore(tran->reqSemaphore);
+	assert(tran->pending == NULL);
+	deleteSemaphore(tran->taskSemaphore);
+	DELETE(tran->frame);
 	destroyDescriptorQueue(&tran->queue);
 }
 
+// if checksum offload is enabled, the read data begins with checksum status
+static uintptr_t getReadStatusSize(const RWI8254xRequest *rw){
+	return (rw->checksumOffload? CHECKSUM_OFFLOAD_STATUS_SIZE: 0);
+}
+
+static void completeI8254xReadRequest(RWI8254xRequest *rw, uintptr_t readSize, int checksumVerified){
+	if(rw->checksumOffload){
+		uint32_t status = checksumVerified;
+		memcpy(rw->buffer, &status, sizeof(status));
+	}
+	REMOVE_FROM_DQUEUE(rw);
+	completeRWFileIO(rw->rwfr, readSize, 0);
+	DELETE(rw);
+}
+
 // call this function when
 // increasing DescriptorQueue.bufferHead
 // having new RWFileRequest
 static void copyI8254xReadBuffer(I8254xReader *reader){
 	const I8254xReceive *r = reader->receive;
-	assert(getSemaphoreValue(r->readerSemaphore) == 0);
+	assert(isMutexOwner(r->readerMutex));
 	const I8254xDescriptorQueue *q = &r->queue;
 	RWI8254xRequest *rw = reader->pending;
-	uintptr_t rwOffset = 0;
+	uintptr_t rwOffset = (rw != NULL? getReadStatusSize(rw): 0);
 	int isRead = 0;
 	while(rw != NULL && reader->bufferIndex != q->bufferHead){
 		// both payloadSize and rwSize can be 0
@@ -713,34 +1334,30 @@ static void copyI8254xReadBuffer(I8254xReader *reader){
 		// 2. the driver has copied at least one buffer and has no more data from hardware
 		if(bs->isEndOfFrame){
 			// iterate next request
-			REMOVE_FROM_DQUEUE(rw);
-			completeRWFileIO(rw->rwfr, rwOffset, 0);
-			DELETE(rw);
+			completeI8254xReadRequest(rw, rwOffset, bs->checksumVerified);
 			rw = reader->pending;
-			rwOffset = 0;
+			rwOffset = (rw != NULL? getReadStatusSize(rw): 0);
 			isRead = 0;
 		}
 		reader->bufferIndex = (reader->bufferIndex + 1) % q->bufferCount;
 	}
 	if(isRead){
-		REMOVE_FROM_DQUEUE(rw);
-		completeRWFileIO(rw->rwfr, rwOffset, 0);
-		DELETE(rw);
+		completeI8254xReadRequest(rw, rwOffset, 0);
 	}
 }
 
 static void addReadI8254xRequest(I8254xReader *reader, RWI8254xRequest *req){
 	I8254xReceive *r = reader->receive;
-	acquireSemaphore(r->readerSemaphore);
+	acquireMutex(r->readerMutex);
 	ADD_TO_DQUEUE(req, &reader->pending);
 	copyI8254xReadBuffer(reader);
-	releaseSemaphore(r->readerSemaphore);
+	releaseMutex(r->readerMutex);
 }
 
 // call this function before increasing DescriptorQueue.bufferTail
 static void dropI8254xReadBuffer(I8254xReader *reader, uintptr_t addTail){
 	const I8254xReceive *r = reader->receive;
-	assert(getSemaphoreValue(r->readerSemaphore) == 0);
+	assert(isMutexOwner(r->readerMutex));
 	const I8254xDescriptorQueue *q = &r->queue;
 	uintptr_t newBufferTail = (q->bufferTail + addTail) % q->bufferCount;
 	uintptr_t readerDiff = (q->bufferCount + reader->bufferIndex - q->bufferTail) % q->bufferCount;
@@ -750,66 +1367,279 @@ static void dropI8254xReadBuffer(I8254xReader *reader, uintptr_t addTail){
 	}
 }
 
+// return number of done descriptors from taskHead, at most maxCount
+static uintptr_t countDoneReceiveDescriptor(const I8254xReceive *r, uintptr_t maxCount){
+	const I8254xDescriptorQueue *q = &r->queue;
+	uintptr_t c;
+	for(c = 0; c < maxCount; c++){
+		uintptr_t dHead = (q->taskHead + c) % q->descriptorCount;
+		if(dHead == q->taskTail || getReceiveStatus(r, dHead)->done == 0)
+			break;
+	}
+	return c;
+}
+
+// return enum ChecksumOffload
+static int toChecksumVerified(ReceiveStatus rs, uint8_t errors){
+	int v = 0;
+	if(rs.ignoreChecksum){
+		return v;
+	}
+	if(rs.ipChecksum && (errors & IP_CHECKSUM_ERROR) == 0){
+		v |= CHECKSUM_OFFLOAD_IPV4_HEADER;
+	}
+	if((rs.tcpChecksum || rs.udpChecksum) && (errors & TCP_UDP_CHECKSUM_ERROR) == 0){
+		v |= CHECKSUM_OFFLOAD_IPV4_DATA;
+	}
+	return v;
+}
+
+// called before bufferHeadHasHeader is updated
+// the timestamp is taken when the first buffer of the frame is processed
+static void captureI8254xReceiveBuffer(I8254xReceive *r, volatile const uint8_t *buffer, uintptr_t length,
+	int isEndOfFrame){
+	struct I8254xCaptureFrame *f = &r->capture;
+	if(r->bufferHeadHasHeader){
+		f->isCapturing = r->device->isCapturing;
+		f->timestamp = rdtsc();
+		f->snapshotSize = 0;
+		f->frameSize = 0;
+	}
+	// enabled in the middle of a frame
+	if(f->isCapturing == 0){
+		return;
+	}
+	const uintptr_t copySize = MIN(length, PACKET_CAPTURE_SNAPSHOT_LENGTH - f->snapshotSize);
+	memcpy_volatile(f->snapshot + f->snapshotSize, buffer, copySize);
+	f->snapshotSize += copySize;
+	f->frameSize += length;
+	if(isEndOfFrame){
+		capturePacket(r->device->capture, f->timestamp, f->snapshot, f->snapshotSize, f->frameSize);
+		f->isCapturing = 0;
+	}
+}
+
+static void processReceiveDescriptor(I8254xReceive *r, uintptr_t doneCnt){
+	I8254xDescriptorQueue *q = &r->queue;
+	volatile uint32_t *const tailRegister =
+		&r->device->regs[RECEIVE_QUEUE_REGISTER(RECEIVE_DESCRIPTORS_TAIL, r->index)];
+	uintptr_t a;
+	for(a = 0; a < doneCnt; a++){
+		uintptr_t bHead = (q->bufferHead + a) % q->bufferCount;
+		uintptr_t dHead = (q->taskHead + a) % q->descriptorCount;
+		ReceiveStatus rs;
+		uint8_t errors;
+		uintptr_t length;
+		readReceiveDescriptor(r, dHead, &rs, &errors, &length);
+		if(r->device->isCapturing || r->capture.isCapturing){
+			captureI8254xReceiveBuffer(r, getDescriptorQueueBuffer(q, bHead), length, (rs.endOfPacket != 0));
+		}
+		if(setBufferStatus(
+			&r->bufferStatus[bHead], getDescriptorQueueBuffer(q, bHead), length,
+			r->bufferHeadHasHeader, 0, (rs.endOfPacket != 0)) == 0
+		){
+			printk("warning: wrong Ethernet frame");
+		}
+		r->bufferHeadHasHeader = (rs.endOfPacket != 0);
+		if(rs.endOfPacket){
+			r->bufferStatus[bHead].checksumVerified = toChecksumVerified(rs, errors);
+		}
+		/* test
+		volatile EthernetHeader *h =
+			(volatile EthernetHeader*)getDescriptorQueueBuffer(q, bHead);
+		unsigned c;
+		for(c = 0; c < rd->length - sizeof(*h) && c < 10; c++){
+			printk("%c", (int)h->payload[c]);
+		}
+		printk("receive: %d (%d) bytes; status = %x\n",
+			(int)length, r->bufferStatus[bHead].payloadSize, (unsigned)rs.value);
+		*/
+	}
+
+	acquireMutex(r->readerMutex);
+	q->bufferHead = (q->bufferHead + doneCnt) % q->bufferCount;
+	I8254xReader *reader;
+	for(reader = r->reader; reader != NULL; reader = reader->next){
+		copyI8254xReadBuffer(reader);
+		dropI8254xReadBuffer(reader, doneCnt);
+	}
+	releaseMutex(r->readerMutex);
+	q->bufferTail = (q->bufferTail + doneCnt) % q->bufferCount;
+
+	assert(*tailRegister == q->taskTail);
+	assert(getReceiveStatus(r, q->taskTail)->value == 0);
+	//next buffer
+	uintptr_t i;
+	for(i = 0; i < doneCnt; i++){
+		uintptr_t dTail = (q->taskTail + i) % q->descriptorCount;
+		uintptr_t bTail = (q->bufferTail + i) % q->bufferCount;
+		initReceiveDescriptor(&q->receive[dTail], getDescriptorQueueBuffer(q, bTail));
+	}
+	q->taskHead = (q->taskHead + doneCnt) % q->descriptorCount;
+	q->taskTail = (q->taskTail + doneCnt) % q->descriptorCount;
+	getReceiveStatus(r, q->taskTail)->value = 0;
+
+	*tailRegister = q->taskTail;
+}
+
+// the INTx cause is shared, so the last queue that finishes polling enables the interrupts again
+// frames received after the other queues finished are still in the cause register and interrupt again
+static void finishI8254xINTxPolling(I8254xReceive *r){
+	I8254xDevice *d = r->device;
+	acquireLock(&d->pollLock);
+	assert(r->isPolling && d->pollingQueueCount != 0);
+	r->isPolling = 0;
+	d->pollingQueueCount--;
+	if(d->pollingQueueCount == 0){
+		d->regs[INTERRUPT_MASK_SET_READ] = RECEIVE_INTERRUPT_BITS;
+	}
+	releaseLock(&d->pollLock);
+}
+
+// one task for each receive queue
 static void i8254xReceiveTask(void *arg){
-	I8254xDevice *d = *(I8254xDevice**)arg;
-	I8254xReceive *r = &d->receive;
+	I8254xReceive *r = *(I8254xReceive**)arg;
+	I8254xDevice *d = r->device;
 	I8254xDescriptorQueue *q = &r->queue;
-	printk("8254x (%d) receiver started\n", d->serialNumber);
+	printk("8254x (%d) receiver %d started\n", d->serialNumber, r->index);
 	while(1){
-		int doneCnt = acquireAllSemaphore(q->intSemaphore);
-		assert(doneCnt > 0);
-		// for debug
-		int a;
-		for(a = 0; a < doneCnt; a++){
-			uintptr_t bHead = (q->bufferHead + a) % q->bufferCount;
-			uintptr_t dHead = (q->taskHead + a) % q->descriptorCount;
-			const volatile ReceiveDescriptor *rd = &q->receive[dHead];
-			const ReceiveStatus rs = rd->status;
-			if(setBufferStatus(
-				&r->bufferStatus[bHead], getDescriptorQueueBuffer(q, bHead), rd->length,
-				r->bufferHeadHasHeader, 0, (rs.endOfPacket != 0)) == 0
-			){
-				printk("warning: wrong Ethernet frame");
+		// interrupt handlers mask interruptBits before releasing intSemaphore
+		acquireAllSemaphore(q->intSemaphore);
+		// poll until the ring is empty
+		while(1){
+			uintptr_t doneCnt = countDoneReceiveDescriptor(r, r->pollBudget);
+			if(doneCnt == 0 && d->useMSIX == 0){
+				finishI8254xINTxPolling(r);
+				break;
+			}
+			if(doneCnt == 0){
+				d->regs[INTERRUPT_MASK_SET_READ] = r->interruptBits;
+				// a frame may arrive before unmasking
+				if(countDoneReceiveDescriptor(r, 1) == 0)
+					break;
+				d->regs[INTERRUPT_MASK_CLEAR] = r->interruptBits;
+				continue;
 			}
-			r->bufferHeadHasHeader = (rs.endOfPacket != 0);
-			/* test
-			volatile EthernetHeader *h =
-				(volatile EthernetHeader*)getDescriptorQueueBuffer(q, bHead);
-			unsigned c;
-			for(c = 0; c < rd->length - sizeof(*h) && c < 10; c++){
-				printk("%c", (int)h->payload[c]);
+			processReceiveDescriptor(r, doneCnt);
+			if(doneCnt == r->pollBudget){
+				// the ring is busy; let readers run before the next round
+				cli();
+				schedule();
+				sti();
 			}
-			printk("receive: %d (%d) bytes; status = %x\n",
-				(int)rd->length, r->bufferStatus[bHead].payloadSize, (unsigned)rs.value);
-			*/
 		}
+	}
+	systemCall_terminate();
+}
 
-		acquireSemaphore(r->readerSemaphore);
-		q->bufferHead = (q->bufferHead + doneCnt) % q->descriptorCount;
-		I8254xReader *reader;
-		for(reader = r->reader; reader != NULL; reader = reader->next){
-			copyI8254xReadBuffer(reader);
-			dropI8254xReadBuffer(reader, doneCnt);
+// write a frame at taskTail and return the number of descriptors
+// the caller updates TRANSMIT_DESCRIPTORS_TAIL
+static uintptr_t writeI8254xTransmitFrame(I8254xTransmit *t, RWI8254xRequest *req, uint64_t srcMAC){
+	I8254xDescriptorQueue *q = &t->queue;
+	assert(req->rwSize <= MAX_PAYLOAD_SIZE || req->maxSegmentSize != 0);
+	assert(q->taskTail == q->bufferTail);
+	// the context descriptor occupies a descriptor and its buffer is not used
+	TransmitChecksumContext c;
+	const int hasContext = getTransmitChecksumContext(req, &c);
+	// checked in writeI8254x
+	assert(hasContext || req->maxSegmentSize == 0);
+	const int isSegmentation = (hasContext && c.maxSegmentSize != 0);
+	if(hasContext){
+		const uintptr_t ipBegin = sizeof(EthernetHeader);
+		initContextTransmitDescriptor(&q->context[q->taskTail],
+			ipBegin, ipBegin + c.ipHeaderSize, c.isTCP, c.tuChecksumOffset,
+			ipBegin + c.ipHeaderSize + c.tcpHeaderSize, ipBegin + req->rwSize, c.maxSegmentSize);
+	}
+	const uintptr_t firstData = (hasContext? 1: 0);
+	uintptr_t writtenSize = 0;
+	uintptr_t i;
+	// send an empty frame even if size == 0
+	for(i = firstData; writtenSize < req->rwSize || i == firstData; i++){
+		uintptr_t dTail = (q->taskTail + i) % q->descriptorCount;
+		uintptr_t bTail = (q->bufferTail + i) % q->bufferCount;
+		volatile uint8_t *buffer = getDescriptorQueueBuffer(q, bTail);
+		uintptr_t writingSize;
+		uintptr_t payloadSize;
+		volatile uint8_t *payloadBegin;
+		// see initTransmitDescriptor insertFCS = 1
+		if(i == firstData){
+			volatile EthernetHeader *h = (volatile EthernetHeader*)buffer;
+			toMACAddress(h->dstMACAddress, req->destinationAddress);
+			toMACAddress(h->srcMACAddress, srcMAC);
+			h->etherType = req->etherType;
+			payloadBegin = h->payload;
+			payloadSize = MIN(req->rwSize - writtenSize, q->maxBufferSize - sizeof(*h));
+			writingSize = payloadSize + sizeof(*h);
 		}
-		releaseSemaphore(r->readerSemaphore);
-		q->bufferTail = (q->bufferTail + doneCnt) % q->bufferCount;
-
-		assert(d->regs[RECEIVE_DESCRIPTORS_TAIL] == q->taskTail);
-		assert(q->receive[q->taskTail].status.value == 0);
-		//next buffer
-		int i;
-		for(i = 0; i < doneCnt; i++){
-			uintptr_t dTail = (q->taskTail + i) % q->descriptorCount;
-			uintptr_t bTail = (q->bufferTail + i) % q->bufferCount;
-			initReceiveDescriptor(&q->receive[dTail], getDescriptorQueueBuffer(q, bTail));
+		else{
+			payloadBegin = buffer;
+			payloadSize = MIN(req->rwSize - writtenSize, q->maxBufferSize);
+			writingSize = payloadSize;
 		}
-		q->taskHead = (q->taskHead + doneCnt) % q->descriptorCount;
-		q->taskTail = (q->taskTail + doneCnt) % q->descriptorCount;
-		q->receive[q->taskTail].status.value = 0;
+		memcpy_volatile(payloadBegin, req->buffer + writtenSize, payloadSize);
+		if(i == firstData && payloadSize < MIN_PAYLOAD_SIZE){
+			memset_volatile(payloadBegin + payloadSize, 0, MIN_PAYLOAD_SIZE - payloadSize);
+		}
+		// the headers are in the first buffer
+		if(i == firstData && isSegmentation){
+			excludeTCPLengthFromChecksum(payloadBegin + c.ipHeaderSize, req->rwSize - c.ipHeaderSize);
+		}
+		writtenSize += payloadSize;
+		const int isEndOfFrame = (writtenSize == req->rwSize);
+		int ok;
+		if(hasContext){
+			// packet options are read from the first data descriptor
+			ok = initDataTransmitDescriptor(&q->data[dTail], buffer, writingSize, isEndOfFrame, isSegmentation,
+				(i == firstData? c.packetOption: 0));
+		}
+		else{
+			ok = initTransmitDescriptor(&q->legacy[dTail], buffer, writingSize, isEndOfFrame);
+		}
+		if(ok == 0){
+			panic("init transmit desc error\n");
+		}
+	}
+	const uintptr_t writeDescCnt = i;
+	assert(writeDescCnt == getTransmitDescriptorCount(q, req));
+	t->frame[q->taskTail].request = req;
+	t->frame[q->taskTail].descriptorCount = writeDescCnt;
+	q->taskTail = (q->taskTail + writeDescCnt) % q->descriptorCount;
+	q->bufferTail = (q->bufferTail + writeDescCnt) % q->bufferCount;
+	return writeDescCnt;
+}
+
+// a frame cut by hardware is recorded as one large frame
+static void captureI8254xTransmitFrame(I8254xDevice *d, const RWI8254xRequest *req){
+	uint8_t snapshot[PACKET_CAPTURE_SNAPSHOT_LENGTH];
+	static_assert(sizeof(snapshot) >= sizeof(EthernetHeader));
+	EthernetHeader *h = (EthernetHeader*)snapshot;
+	toMACAddress(h->dstMACAddress, req->destinationAddress);
+	toMACAddress(h->srcMACAddress, d->macAddress);
+	h->etherType = req->etherType;
+	const uintptr_t payloadSize = MIN(req->rwSize, sizeof(snapshot) - sizeof(*h));
+	memcpy(h->payload, req->buffer, payloadSize);
+	capturePacket(d->capture, rdtsc(), snapshot, sizeof(*h) + payloadSize,
+		sizeof(*h) + MAX(req->rwSize, MIN_PAYLOAD_SIZE));
+}
 
-		d->regs[RECEIVE_DESCRIPTORS_TAIL] = q->taskTail;
+// complete the frames sent by hardware, from taskHead to the first undone frame
+static void reclaimI8254xTransmit(I8254xTransmit *t){
+	I8254xDescriptorQueue *q = &t->queue;
+	while(q->taskHead != q->taskTail){
+		struct I8254xTransmitFrame *f = &t->frame[q->taskHead];
+		const uintptr_t last = (q->taskHead + f->descriptorCount - 1) % q->descriptorCount;
+		// legacy and data descriptors have the done bit at the same position
+		if(q->legacy[last].status.done == 0){
+			break;
+		}
+		RWI8254xRequest *req = f->request;
+		completeRWFileIO(req->rwfr, req->rwSize + req->prefixSize, 0);
+		DELETE(req);
+		q->taskHead = (q->taskHead + f->descriptorCount) % q->descriptorCount;
+		q->bufferHead = (q->bufferHead + f->descriptorCount) % q->bufferCount;
+		f->request = NULL;
+		f->descriptorCount = 0;
 	}
-	systemCall_terminate();
 }
 
 static void i8254xTransmitTask(void *arg){
@@ -823,64 +1653,28 @@ static void i8254xTransmitTask(void *arg){
 	uint64_t srcMAC = d->macAddress;
 	printk("8254x (%d) transmitter started\n", d->serialNumber);
 	while(1){
-		RWI8254xRequest *req = removeRWI8254xRequest(t);
-		// at most head - tail - 1 frames
-		assert(req->rwSize <= MAX_PAYLOAD_SIZE);
-		// write descriptors
-		uintptr_t writtenSize = 0;
-		uintptr_t i;
-		// send an empty frame even if size == 0
-		for(i = 0; writtenSize < req->rwSize || i == 0; i++){
-			uintptr_t dtail = (q->taskTail + i) % q->descriptorCount;
-			uintptr_t bTail = (q->bufferTail + i) % q->bufferCount;
-			volatile uint8_t *buffer = getDescriptorQueueBuffer(q, bTail);
-			uintptr_t writingSize;
-			uintptr_t payloadSize;
-			volatile uint8_t *payloadBegin;
-			// see initTransmitDescriptor insertFCS = 1
-			if(i == 0){
-				volatile EthernetHeader *h = (volatile EthernetHeader*)buffer;
-				// TODO: destination address as a parameter of openFile
-				toMACAddress(h->dstMACAddress, BROADCAST_MAC_ADDRESS);
-				toMACAddress(h->srcMACAddress, srcMAC);
-				h->etherType = req->etherType;
-				payloadBegin = h->payload;
-				payloadSize = MIN(req->rwSize - writtenSize, q->maxBufferSize - sizeof(*h));
-				writingSize = payloadSize + sizeof(*h);
-			}
-			else{
-				payloadBegin = buffer;
-				payloadSize = MIN(req->rwSize - writtenSize, q->maxBufferSize);
-				writingSize = payloadSize;
-			}
-			memcpy_volatile(payloadBegin, req->buffer + writtenSize, payloadSize);
-			if(i == 0 && payloadSize < MIN_PAYLOAD_SIZE){
-				memset_volatile(payloadBegin + payloadSize, 0, MIN_PAYLOAD_SIZE - payloadSize);
+		// wait for new requests or sent frames
+		acquireAllSemaphore(t->taskSemaphore);
+		reclaimI8254xTransmit(t);
+		// fill the ring with as many pending requests as possible
+		uintptr_t writeDescCnt = 0;
+		while(1){
+			// at most descriptorCount - 1 descriptors, or TAIL == HEAD means empty ring
+			const uintptr_t usedDescCnt = (q->descriptorCount + q->taskTail - q->taskHead) % q->descriptorCount;
+			RWI8254xRequest *req = removeRWI8254xRequest(t, q->descriptorCount - 1 - usedDescCnt);
+			if(req == NULL){
+				// if the ring is full, the interrupt of sent frames releases taskSemaphore
+				break;
 			}
-			writtenSize += payloadSize;
-			if(initTransmitDescriptor(&q->legacy[dtail], buffer, writingSize, (writtenSize == req->rwSize)) == 0){
-				panic("init transmit desc error\n");
+			if(d->isCapturing){
+				captureI8254xTransmitFrame(d, req);
 			}
+			writeDescCnt += writeI8254xTransmitFrame(t, req, srcMAC);
 		}
-		const uintptr_t writeDescCnt = i;
-		assert(q->taskTail == q->bufferTail);
-		assert(d->regs[TRANSMIT_DESCRIPTORS_TAIL] == q->taskTail);
-		q->taskTail = (q->taskTail + writeDescCnt) % q->descriptorCount;
-		q->bufferTail = (q->bufferTail + writeDescCnt) % q->bufferCount;
-		// put a done == 0 descriptor at tail. see descriptor queue handler
-		q->legacy[q->taskTail].status.value = 0;
-		d->regs[TRANSMIT_DESCRIPTORS_TAIL] = q->taskTail;
-		// wait for interrupt
-		for(i = 0; i < writeDescCnt; i++){
-			//TODO: reduce number of calls
-			acquireSemaphore(q->intSemaphore);
+		// one register write for the whole batch
+		if(writeDescCnt != 0){
+			d->regs[TRANSMIT_DESCRIPTORS_TAIL] = q->taskTail;
 		}
-		assert(q->taskHead == q->bufferHead);
-		q->taskHead = (q->taskHead + writeDescCnt) % q->descriptorCount;
-		q->bufferHead = (q->bufferHead + writeDescCnt) % q->descriptorCount;
-		assert(q->legacy[q->taskTail].status.value == 0);
-		completeRWFileIO(req->rwfr, writtenSize, 0);
-		DELETE(req);
 	}
 	panic("transmitTask");
 	systemCall_terminate();
@@ -895,17 +1689,39 @@ static I8254xDevice *createI8254xDevice(PCIConfigRegisters0 *pciRegs, int number
 	EXPECT(device->regs != NULL);
 
 	device->macAddress = COMBINE64(device->regs[RECEIVE_ADDRESS_0_HIGH] & 0xffff, device->regs[RECEIVE_ADDRESS_0_LOW]);
+	initI8254xAddressFilter(&device->filter);
 	device->terminateFlag = 0;
-	int ok = initI8254Receive(&device->receive, device->regs);
+	device->useMSIX = 0;
+	device->pollLock = initialSpinlock;
+	device->pollingQueueCount = 0;
+	device->isCapturing = 0;
+	{
+		char name[20];
+		uintptr_t nameLength = snprintf(name, LENGTH_OF(name), "eth%d", number);
+		device->capture = createPacketCapture(name, nameLength);
+	}
+	EXPECT(device->capture != NULL);
+	int ok = initI8254xReceiveQueues(device, pciRegs->deviceID);
 	EXPECT(ok);
+	enableI8254xReceive(device);
 	ok = initI8254xTransmit(&device->transmit, device->regs);
 	EXPECT(ok);
-	device->receiveTask = createSharedMemoryTask(i8254xReceiveTask, &device, sizeof(device), processorLocalTask());
-	EXPECT(device->receiveTask != NULL);
+	// see initI8254xMSIX for the affinity of the receive tasks
+	uintptr_t i;
+	for(i = 0; i < device->receiveQueueCount; i++){
+		I8254xReceive *r = &device->receive[i];
+		r->isPolling = 0;
+		device->receiveTask[i] = createSharedMemoryTask(i8254xReceiveTask, &r, sizeof(r), processorLocalTask());
+		if(device->receiveTask[i] == NULL)
+			break;
+	}
+	EXPECT(i == device->receiveQueueCount);
 	device->transmitTask = createSharedMemoryTask(i8254xTransmitTask, &device, sizeof(device), processorLocalTask());
 	EXPECT(device->transmitTask != NULL);
 
-	resume(device->receiveTask);
+	for(i = 0; i < device->receiveQueueCount; i++){
+		resume(device->receiveTask[i]);
+	}
 	resume(device->transmitTask);
 
 	return device;
@@ -917,7 +1733,9 @@ static I8254xDevice *createI8254xDevice(PCIConfigRegisters0 *pciRegs, int number
 	//while(device->regs[DEVICE_CONTROL] & (1 << 26)); poll until the bit is cleared
 	destroyI8254xTransmit(&device->transmit);
 	ON_ERROR;
-	destroyI8254xReceive(&device->receive);
+	destroyI8254xReceiveQueues(device);
+	ON_ERROR;
+	deletePacketCapture(device->capture);
 	ON_ERROR;
 	unmapKernelPages((void*)device->regs);
 	ON_ERROR;
@@ -926,22 +1744,6 @@ static I8254xDevice *createI8254xDevice(PCIConfigRegisters0 *pciRegs, int number
 	return NULL;
 }
 
-static int descriptorQueueHandler(I8254xDescriptorQueue *q, uint32_t regsHead){
-	int handled = 0, reachedHead = 0;
-	while(1){
-		if(q->intHead == regsHead)
-			reachedHead = 1;
-		// until the first not-done descriptor after HEAD
-		if(reachedHead && (q->generic[q->intHead].status & 1) == 0)
-			break;
-		q->intHead = (q->intHead + 1) % q->descriptorCount;
-		// send to receiver or transmit service
-		releaseSemaphore(q->intSemaphore);
-		handled = 1;
-	}
-	return handled;
-}
-
 static int i8254xHandler(const InterruptParam *p){
 	I8254xDevice *i8254x = (I8254xDevice*)p->argument;
 	// reading the register implicitly clears interrupt status
@@ -951,41 +1753,255 @@ static int i8254xHandler(const InterruptParam *p){
 		printk("link status change: %x\n", ((i8254x->regs[DEVICE_STATUS] >> 1) & 1));
 	}
 	if(cause & RECEIVE_INTERRUPT_BITS){
-		descriptorQueueHandler(&i8254x->receive.queue,  i8254x->regs[RECEIVE_DESCRIPTORS_HEAD]);
+		// the queues share the cause; see finishI8254xINTxPolling
+		i8254x->regs[INTERRUPT_MASK_CLEAR] = RECEIVE_INTERRUPT_BITS;
+		acquireLock(&i8254x->pollLock);
+		uintptr_t i;
+		for(i = 0; i < i8254x->receiveQueueCount; i++){
+			I8254xReceive *r = &i8254x->receive[i];
+			if(r->isPolling == 0){
+				r->isPolling = 1;
+				i8254x->pollingQueueCount++;
+				releaseSemaphore(r->queue.intSemaphore);
+			}
+		}
+		releaseLock(&i8254x->pollLock);
 	}
 	if(cause & TRANSMIT_INTERRUPT_BITS){
-		descriptorQueueHandler(&i8254x->transmit.queue, i8254x->regs[TRANSMIT_DESCRIPTORS_TAIL]);
+		// i8254xTransmitTask checks the done bit of descriptors
+		releaseSemaphore(i8254x->transmit.taskSemaphore);
 	}
 	return handled;
 }
 
+// MSI-X handlers are not chained
+// INTERRUPT_AUTO_CLEAR clears the queue causes when the message is sent
+static void i8254xReceiveQueueHandler(InterruptParam *p){
+	I8254xReceive *r = (I8254xReceive*)p->argument;
+	r->device->regs[INTERRUPT_MASK_CLEAR] = r->interruptBits;
+	releaseSemaphore(r->queue.intSemaphore);
+	processorLocalPIC()->endOfInterrupt(p);
+	// run the woken task now; see resume
+	scheduleIfPreempted();
+}
+
+static void i8254xTransmitQueueHandler(InterruptParam *p){
+	I8254xDevice *i8254x = (I8254xDevice*)p->argument;
+	releaseSemaphore(i8254x->transmit.taskSemaphore);
+	processorLocalPIC()->endOfInterrupt(p);
+	// run the woken task now; see resume
+	scheduleIfPreempted();
+}
+
+static void i8254xOtherCauseHandler(InterruptParam *p){
+	I8254xDevice *i8254x = (I8254xDevice*)p->argument;
+	uint32_t cause = i8254x->regs[INTERRUPT_CAUSE_READ];
+	if(cause & LINK_STATUS_CHANGE_BIT){
+		printk("link status change: %x\n", ((i8254x->regs[DEVICE_STATUS] >> 1) & 1));
+	}
+	i8254x->regs[INTERRUPT_MASK_SET_READ] = (OTHER_CAUSE_BIT | LINK_STATUS_CHANGE_BIT);
+	processorLocalPIC()->endOfInterrupt(p);
+}
+
+typedef struct{
+	uint32_t addressLow;
+	uint32_t addressHigh;
+	uint32_t data;
+	// bit 0 = masked
+	uint32_t vectorControl;
+}MSIXTableEntry;
+
+static_assert(sizeof(MSIXTableEntry) == 16);
+
+// MSI-X capability; message control is in bit 16~31 of the first register
+#define MSIX_TABLE_SIZE_MASK (0x7ff)
+#define MSIX_FUNCTION_MASK (1 << 30)
+#define MSIX_ENABLE (((uint32_t)1) << 31)
+
+// one vector for each receive queue, then transmit queue 0 and other causes
+// receive queue i interrupts the processor i % numberOfProcessors
+// return 0 if the device or interrupt controller does not support MSI-X
+static int initI8254xMSIX(I8254xDevice *d, uintptr_t pciHandle, const PCIConfigRegisters0 *pciRegs){
+	const uintptr_t vectorCount = d->receiveQueueCount + 2;
+	const uintptr_t capability = findPCICapability(pciHandle, PCI_CAPABILITY_MSIX);
+	EXPECT(capability != 0);
+	uint32_t capRegs[2];
+	uintptr_t readSize = sizeof(capRegs);
+	uintptr_t r = syncSeekReadFile(pciHandle, capRegs, capability, &readSize);
+	EXPECT(r != IO_REQUEST_FAILURE && readSize == sizeof(capRegs));
+	EXPECT(((capRegs[0] >> 16) & MSIX_TABLE_SIZE_MASK) + 1 >= vectorCount);
+	// the table is in the 32-bit memory BAR indicated by bit 0~2
+	EXPECT((capRegs[1] & 7) < 6);
+	const uint32_t bar = (&pciRegs->bar0)[capRegs[1] & 7];
+	EXPECT((bar & 1) == 0 && ((bar >> 1) & 3) == 0);
+	const uintptr_t tableAddress = (bar & 0xfffffff0) + (capRegs[1] & ~7);
+	const uintptr_t tableOffset = tableAddress % PAGE_SIZE;
+	PhysicalAddress pa = {tableAddress - tableOffset};
+	volatile MSIXTableEntry *table = mapKernelPages(pa,
+		CEIL(tableOffset + vectorCount * sizeof(MSIXTableEntry), PAGE_SIZE), KERNEL_NON_CACHED_PAGE);
+	EXPECT(table != NULL);
+	table = (volatile MSIXTableEntry*)(((uintptr_t)table) + tableOffset);
+	PIC *pic = processorLocalPIC();
+	InterruptVector *vectors[MAX_RECEIVE_QUEUE_COUNT + 2];
+	uintptr_t registeredCount = 0;
+	uintptr_t i;
+	for(i = 0; i < vectorCount; i++){
+		InterruptVector *v;
+		int processorIndex = 0;
+		if(i < d->receiveQueueCount){
+			v = registerGeneralInterrupt(global.idt, i8254xReceiveQueueHandler, (uintptr_t)&d->receive[i]);
+			processorIndex = i % pic->numberOfProcessors;
+		}
+		else if(i == d->receiveQueueCount){
+			v = registerGeneralInterrupt(global.idt, i8254xTransmitQueueHandler, (uintptr_t)d);
+		}
+		else{
+			v = registerGeneralInterrupt(global.idt, i8254xOtherCauseHandler, (uintptr_t)d);
+		}
+		vectors[registeredCount] = v;
+		registeredCount++;
+		uint64_t address;
+		uint32_t data;
+		if(pic->getMSIMessage(pic, processorIndex, v, &address, &data) == 0)
+			break;
+		table[i].addressLow = LOW64(address);
+		table[i].addressHigh = HIGH64(address);
+		table[i].data = data;
+		table[i].vectorControl = 0;
+	}
+	EXPECT(i == vectorCount);
+	// route the causes to the table entries
+	uint32_t allocation = VECTOR_ALLOCATION_EVERY_WRITE_BACK;
+	uint32_t queueBits = 0;
+	for(i = 0; i < d->receiveQueueCount; i++){
+		allocation |= ((VECTOR_ALLOCATION_VALID | i) << VECTOR_ALLOCATION_RECEIVE_QUEUE(i));
+		d->receive[i].interruptBits = (RECEIVE_QUEUE_0_BIT << i);
+		queueBits |= d->receive[i].interruptBits;
+	}
+	allocation |= ((VECTOR_ALLOCATION_VALID | d->receiveQueueCount) << VECTOR_ALLOCATION_TRANSMIT_QUEUE_0);
+	allocation |= ((VECTOR_ALLOCATION_VALID | (d->receiveQueueCount + 1)) << VECTOR_ALLOCATION_OTHER);
+	queueBits |= TRANSMIT_QUEUE_0_BIT;
+	d->regs[INTERRUPT_MASK_CLEAR] = 0xffffffff;
+	d->regs[INTERRUPT_VECTOR_ALLOCATION] = allocation;
+	d->regs[EXTENDED_DEVICE_CONTROL] |= PBA_CLEAR_ON_MSIX;
+	d->regs[INTERRUPT_ACK_AUTO_MASK] = 0;
+	d->regs[INTERRUPT_AUTO_CLEAR] = queueBits;
+	uint32_t control = ((capRegs[0] | MSIX_ENABLE) & ~MSIX_FUNCTION_MASK);
+	uintptr_t writeSize = sizeof(control);
+	r = syncSeekWriteFile(pciHandle, &control, capability, &writeSize);
+	EXPECT(r != IO_REQUEST_FAILURE && writeSize == sizeof(control));
+	d->useMSIX = 1;
+	// run the receive tasks on the processors of their vectors
+	for(i = 0; i < d->receiveQueueCount; i++){
+		setTaskAffinity(d->receiveTask[i], PROCESSOR_BIT(i % pic->numberOfProcessors));
+	}
+	d->regs[INTERRUPT_MASK_SET_READ] = (queueBits | OTHER_CAUSE_BIT | LINK_STATUS_CHANGE_BIT);
+	// the table stays mapped
+	return 1;
+	ON_ERROR;
+	// back to INTx; see i8254xHandler
+	for(i = 0; i < d->receiveQueueCount; i++){
+		d->receive[i].interruptBits = RECEIVE_INTERRUPT_BITS;
+	}
+	d->regs[INTERRUPT_MASK_CLEAR] = 0xffffffff;
+	d->regs[INTERRUPT_VECTOR_ALLOCATION] = 0;
+	d->regs[INTERRUPT_AUTO_CLEAR] = 0;
+	d->regs[INTERRUPT_MASK_SET_READ] = (LINK_STATUS_CHANGE_BIT | RECEIVE_INTERRUPT_BITS | TRANSMIT_INTERRUPT_BITS);
+	ON_ERROR;
+	// the affinity of the receive tasks is not set
+	while(registeredCount != 0){
+		registeredCount--;
+		releaseGeneralInterrupt(global.idt, vectors[registeredCount]);
+	}
+	unmapKernelPages((void*)(((uintptr_t)table) - tableOffset));
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
 static int readI8254x(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uintptr_t readSize){
 	OpenedI8254xDevice *od = getFileInstance(of);
 	// TODO: filter received packet by EtherType
-	RWI8254xRequest *r = createRWI8254xRequest(rwfr, buffer, readSize, ETHERTYPE_0);
+	EXPECT(od->checksumOffload == 0 || readSize >= CHECKSUM_OFFLOAD_STATUS_SIZE);
+	RWI8254xRequest *r = createRWI8254xRequest(rwfr, buffer, readSize, ETHERTYPE_0, od->checksumOffload);
 	EXPECT(r != NULL);
 	addReadI8254xRequest(&od->reader, r);
 	return 1;
 
+	ON_ERROR;
 	ON_ERROR;
 	return 0;
 }
 
 static int writeI8254x(RWFileRequest *rwfr, OpenedFile *of, const uint8_t *buffer, uintptr_t writeSize){
-	EXPECT(writeSize <= MAX_PAYLOAD_SIZE);
 	OpenedI8254xDevice *od = getFileInstance(of);
-	RWI8254xRequest *w = createRWI8254xRequest(rwfr, (uint8_t *)buffer, writeSize, od->transmitEtherType);
+	uint64_t destination = od->destinationAddress;
+	const uintptr_t prefixSize = (od->destinationPrefix? DESTINATION_PREFIX_SIZE: 0);
+	EXPECT(writeSize >= prefixSize);
+	uintptr_t maxSegmentSize = 0;
+	if(prefixSize != 0){
+		memcpy(&destination, buffer, sizeof(destination));
+		maxSegmentSize = (uintptr_t)(destination >> SEGMENTATION_PREFIX_SHIFT);
+		destination &= BROADCAST_MAC_ADDRESS;
+	}
+	EXPECT(maxSegmentSize == 0 || od->segmentationOffload);
+	// the descriptors of a frame must fit in the transmit queue
+	EXPECT(writeSize - prefixSize <= (maxSegmentSize == 0? MAX_PAYLOAD_SIZE: MAX_IP_PACKET_SIZE));
+	RWI8254xRequest *w = createRWI8254xRequest(rwfr, (uint8_t *)buffer + prefixSize, writeSize - prefixSize,
+		od->transmitEtherType, od->checksumOffload);
 	EXPECT(w != NULL);
+	w->destinationAddress = destination;
+	w->prefixSize = prefixSize;
+	w->maxSegmentSize = maxSegmentSize;
+	TransmitChecksumContext c;
+	EXPECT(maxSegmentSize == 0 || getTransmitChecksumContext(w, &c));
 	addPendingRWI8254xRequest(&od->device->transmit, w);
 	return 1;
 
+	ON_ERROR;
+	DELETE(w);
+	ON_ERROR;
+	ON_ERROR;
 	ON_ERROR;
 	ON_ERROR;
 	return 0;
 }
 
+// return 0 if the parameter is not a delay register
+static int toModerationRegister(uintptr_t parameterCode, enum I8254xRegisterIndex *r){
+	switch(parameterCode){
+	case FILE_PARAM_INTERRUPT_THROTTLING:
+		*r = INTERRUPT_THROTTLING;
+		break;
+	case FILE_PARAM_RECEIVE_DELAY:
+		*r = RECEIVE_DELAY_TIMER;
+		break;
+	case FILE_PARAM_RECEIVE_ABSOLUTE_DELAY:
+		*r = RECEIVE_ABSOLUTE_DELAY_TIMER;
+		break;
+	case FILE_PARAM_TRANSMIT_DELAY:
+		*r = TRANSMIT_DELAY_TIMER;
+		break;
+	case FILE_PARAM_TRANSMIT_ABSOLUTE_DELAY:
+		*r = TRANSMIT_ABSOLUTE_DELAY_TIMER;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
 static int getI8254xParameter(FileIORequest2 *r2, OpenedFile *of, uintptr_t parameterCode){
 	OpenedI8254xDevice *od = getFileInstance(of);
+	enum I8254xRegisterIndex reg;
+	if(toModerationRegister(parameterCode, &reg)){
+		completeFileIO64(r2, od->device->regs[reg] & MAX_DELAY_REGISTER_VALUE);
+		return 1;
+	}
 	switch(parameterCode){
 	case FILE_PARAM_MAX_WRITE_SIZE:
 		completeFileIO1(r2, MAX_PAYLOAD_SIZE);
@@ -999,6 +2015,38 @@ static int getI8254xParameter(FileIORequest2 *r2, OpenedFile *of, uintptr_t para
 	case FILE_PARAM_TRANSMIT_ETHERTYPE:
 		completeFileIO64(r2, od->transmitEtherType);
 		break;
+	case FILE_PARAM_POLL_BUDGET:
+		completeFileIO64(r2, od->reader.receive->pollBudget);
+		break;
+	case FILE_PARAM_RECEIVE_QUEUE_COUNT:
+		completeFileIO64(r2, od->device->receiveQueueCount);
+		break;
+	case FILE_PARAM_RECEIVE_QUEUE:
+		completeFileIO64(r2, od->reader.receive->index);
+		break;
+	case FILE_PARAM_CHECKSUM_OFFLOAD:
+		completeFileIO64(r2, od->checksumOffload);
+		break;
+	case FILE_PARAM_DESTINATION_ADDRESS:
+		completeFileIO64(r2, od->destinationAddress);
+		break;
+	case FILE_PARAM_DESTINATION_PREFIX:
+		completeFileIO64(r2, od->destinationPrefix);
+		break;
+	case FILE_PARAM_SEGMENTATION_OFFLOAD:
+		completeFileIO64(r2, od->segmentationOffload);
+		break;
+	case FILE_PARAM_PACKET_CAPTURE:
+		completeFileIO64(r2, od->device->isCapturing);
+		break;
+	case FILE_PARAM_RECEIVE_FILTERED_COUNT:
+	case FILE_PARAM_RECEIVE_MISSED_COUNT:
+		{
+			uint64_t filteredCount, missedCount;
+			getI8254xDropCount(od->device, &filteredCount, &missedCount);
+			completeFileIO64(r2, (parameterCode == FILE_PARAM_RECEIVE_FILTERED_COUNT? filteredCount: missedCount));
+		}
+		break;
 	default:
 		return 0;
 	}
@@ -1007,15 +2055,81 @@ static int getI8254xParameter(FileIORequest2 *r2, OpenedFile *of, uintptr_t para
 
 static int setI8254xParameter(FileIORequest2 *r2, OpenedFile *of, uintptr_t parameterCode, uint64_t value){
 	OpenedI8254xDevice *od = getFileInstance(of);
+	enum I8254xRegisterIndex reg;
+	if(toModerationRegister(parameterCode, &reg)){
+		if(value > MAX_DELAY_REGISTER_VALUE)
+			return 0;
+		od->device->regs[reg] = (uint32_t)value;
+		completeFileIO0(r2);
+		return 1;
+	}
 	switch(parameterCode){
-//	case FILE_PARAM_DESTINATION_ADDRESS:
-//		od->destinationAddress = value;
-//		completeFileIO0(r2);
-//		break;
+	case FILE_PARAM_DESTINATION_ADDRESS:
+		if((value & ~BROADCAST_MAC_ADDRESS) != 0)
+			return 0;
+		od->destinationAddress = value;
+		completeFileIO0(r2);
+		break;
+	case FILE_PARAM_DESTINATION_PREFIX:
+		if(value > 1)
+			return 0;
+		od->destinationPrefix = (int)value;
+		completeFileIO0(r2);
+		break;
+	case FILE_PARAM_SEGMENTATION_OFFLOAD:
+		if(value > 1)
+			return 0;
+		od->segmentationOffload = (int)value;
+		completeFileIO0(r2);
+		break;
+	case FILE_PARAM_PACKET_CAPTURE:
+		if(value > 1)
+			return 0;
+		od->device->isCapturing = (int)value;
+		completeFileIO0(r2);
+		break;
+	case FILE_PARAM_ADD_RECEIVE_ADDRESS:
+		if((value & ~BROADCAST_MAC_ADDRESS) != 0 || value == BROADCAST_MAC_ADDRESS)
+			return 0;
+		if(addI8254xFilterAddress(od->device, value) == 0)
+			return 0;
+		completeFileIO0(r2);
+		break;
+	case FILE_PARAM_REMOVE_RECEIVE_ADDRESS:
+		if(removeI8254xFilterAddress(od->device, value) == 0)
+			return 0;
+		completeFileIO0(r2);
+		break;
 	case FILE_PARAM_TRANSMIT_ETHERTYPE:
 		od->transmitEtherType = (EtherType)value;
 		completeFileIO0(r2);
 		break;
+	case FILE_PARAM_POLL_BUDGET:
+		if(value == 0 || value >= od->reader.receive->queue.descriptorCount)
+			return 0;
+		{
+			uintptr_t i;
+			for(i = 0; i < od->device->receiveQueueCount; i++){
+				od->device->receive[i].pollBudget = (uintptr_t)value;
+			}
+		}
+		completeFileIO0(r2);
+		break;
+	case FILE_PARAM_RECEIVE_QUEUE:
+		if(value >= od->device->receiveQueueCount)
+			return 0;
+		// fail if a read request is pending
+		if(moveI8254xReader(&od->reader, &od->device->receive[value]) == 0)
+			return 0;
+		completeFileIO0(r2);
+		break;
+	case FILE_PARAM_CHECKSUM_OFFLOAD:
+		if((value & ~(uint64_t)(CHECKSUM_OFFLOAD_IPV4_HEADER | CHECKSUM_OFFLOAD_IPV4_DATA)) != 0)
+			return 0;
+		// IMPROVE: pending reads and writes use the previous value
+		od->checksumOffload = (int)value;
+		completeFileIO0(r2);
+		break;
 	default:
 		return 0;
 	}
@@ -1099,6 +2213,10 @@ void i8254xDriver(void){
 		printk("failed to enum PCI\n");
 		systemCall_terminate();
 	}
+	if(initPacketCapture() == 0){
+		printk("cannot register packet capture as file system\n");
+		systemCall_terminate();
+	}
 	const char *driverName = "8254x";
 	FileNameFunctions ff = INITIAL_FILE_NAME_FUNCTIONS;
 	ff.open = openI8254x;
@@ -1108,8 +2226,15 @@ void i8254xDriver(void){
 	}
 	int deviceNumber;
 	for(deviceNumber = 0; 1; deviceNumber++){
+		// writable for MSI-X
+		uintptr_t pciHandle = openNextPCIConfigSpace(pci, 1);
+		if(pciHandle == IO_REQUEST_FAILURE){
+			break;
+		}
 		PCIConfigRegisters regs;
-		if(nextPCIConfigRegisters(pci, &regs, sizeof(regs.regs0)) != sizeof(regs.regs0)){
+		uintptr_t readSize = sizeof(regs.regs0);
+		if(syncSeekReadFile(pciHandle, &regs, 0, &readSize) == IO_REQUEST_FAILURE || readSize != sizeof(regs.regs0)){
+			syncCloseFile(pciHandle);
 			break;
 		}
 		PCIConfigRegisters0 *const regs0 = &regs.regs0;
@@ -1123,17 +2248,24 @@ void i8254xDriver(void){
 			supported = 0;
 		}
 		if(supported == 0){
+			syncCloseFile(pciHandle);
 			continue;
 		}
 		I8254xDevice *i8254x = createI8254xDevice(regs0, deviceNumber);
 		if(i8254x == NULL){
 			printk("cannot initialize 8254x device");
+			syncCloseFile(pciHandle);
 			continue;
 		}
 		addI8254xDeviceList(i8254x);
-		PIC *pic = processorLocalPIC();
-		addHandler(pic->irqToVector(pic, regs0->interruptLine),i8254xHandler, (uintptr_t)i8254x);
-		pic->setPICMask(pic, regs0->interruptLine, 0);
+		if(initI8254xMSIX(i8254x, pciHandle, regs0) == 0){
+			PIC *pic = processorLocalPIC();
+			addHandler(pic->irqToVector(pic, regs0->interruptLine),i8254xHandler, (uintptr_t)i8254x);
+			pic->setPICMask(pic, regs0->interruptLine, 0);
+		}
+		syncCloseFile(pciHandle);
+		printk("8254x (%d): %d receive queues, %s\n", deviceNumber, i8254x->receiveQueueCount,
+			(i8254x->useMSIX? "MSI-X": "INTx"));
 		// set link up
 		i8254x->regs[DEVICE_CONTROL] |= (1 << 6);
 		printk("link status: %x\n", ((i8254x->regs[DEVICE_STATUS] >> 1) & 1));
@@ -162,6 +162,14 @@ typedef union{
 uintptr_t enumeratePCI(uint32_t classCode, uint32_t classMask);
 
 uintptr_t nextPCIConfigRegisters(uintptr_t pciEnumHandle, PCIConfigRegisters *regs, uintptr_t readSize);
+// open the configuration space of the next PCI path
+// the file supports seekRead, and seekWrite of 32-bit registers if writable
+uintptr_t openNextPCIConfigSpace(uintptr_t pciEnumHandle, int writable);
+
+#define PCI_CONFIG_SPACE_SIZE (256)
+#define PCI_CAPABILITY_MSIX (0x11)
+// return the offset of the capability, or 0 if not found
+uintptr_t findPCICapability(uintptr_t pciHandle, uint8_t capabilityID);
 
 // ahci.c
 void ahciDriver(void);
@@ -108,7 +108,9 @@ static void writeData(uint16_t port, uint8_t data){
 }
 
 typedef struct{
-	FIFO *intFIFO, *kbFIFO, *mouseFIFO;
+	// written by the handlers of both IRQs
+	MPMCFIFO *intFIFO;
+	FIFO *kbFIFO, *mouseFIFO;
 }PS2FIFO;
 
 // ps2Handler -> ps2Driver -> keyboardInput ->syscall_keyboard
@@ -124,7 +126,7 @@ static int ps2Handler(const InterruptParam *p){
 	if(d.status & READABLE_FLAG){
 		d.data = readData();
 		PS2FIFO *ps2 = (PS2FIFO*)(p->argument);
-		writeFIFO(ps2->intFIFO, &d);
+		writeMPMCFIFO(ps2->intFIFO, &d, 1);
 	}
 	return 1;
 }
@@ -274,7 +276,7 @@ static void initPS2Driver(PIC* pic){
 	initMouse();
 	initKeyboard();
 
-	ps2.intFIFO = createFIFO(64, sizeof(PS2Data));
+	ps2.intFIFO = createMPMCFIFO(64, sizeof(PS2Data));
 	ps2.kbFIFO = createFIFO(32, sizeof(KeyboardEvent));
 	ps2.mouseFIFO = createFIFO(64, sizeof(MouseEvent));
 	//ps2.sysFIFO = createFIFO(128, sizeof(MouseEvent));
@@ -293,7 +295,7 @@ void ps2Driver(void){
 	initPS2Driver(processorLocalPIC());
 	while(1){
 		PS2Data d;
-		readFIFO(ps2.intFIFO, &d);
+		readMPMCFIFO(ps2.intFIFO, &d, 1);
 		if(d.status & DATA_FROM_MOUSE_FLAG){
 			mouseInput(d.data, ps2.mouseFIFO);
 		}
@@ -2,6 +2,8 @@
 #include"multiprocessor/processorlocal.h"
 #include"ethernet.h"
 #include"network.h"
+#include"io/io.h"
+#include"memory/memory.h"
 
 #pragma pack(1)
 
@@ -21,107 +23,322 @@ typedef struct __attribute__((__packed__)){
 
 static_assert(sizeof(ARPPacket) == 28);
 
-static void initARPReplyPacket(ARPPacket *reply, uint64_t localMACAddress, const ARPPacket *request){
-	uint8_t replyMACAddress[MAC_ADDRESS_SIZE];
-	toMACAddress(replyMACAddress, localMACAddress);
-	reply->hardwareType = TO_BIG_ENDIAN_16(1); // Ethernet
-	reply->protocolType = ETHERTYPE_IPV4;
-	reply->hardwareAddressLength = MAC_ADDRESS_SIZE;
-	reply->protocolAddressLength = sizeof(IPV4Address);
-	reply->operation = TO_BIG_ENDIAN_16(2); // reply
-	memcpy(reply->senderHardwareAddress, replyMACAddress, MAC_ADDRESS_SIZE);
-	reply->senderProtocolAddress = request->targetProtocolAddress;
-	memcpy(reply->targetHardwareAddress, request->senderHardwareAddress, MAC_ADDRESS_SIZE);
-	reply->targetProtocolAddress = request->senderProtocolAddress;
-}
-
-static int checkRequestPacket(const ARPPacket *request, uintptr_t readSize){
-	if(readSize < sizeof(*request)){
+enum ARPOperation{
+	ARP_OPERATION_REQUEST = TO_BIG_ENDIAN_16(1),
+	ARP_OPERATION_REPLY = TO_BIG_ENDIAN_16(2)
+};
+
+static uint64_t fromMACAddress(const uint8_t *address){
+	uint64_t macAddress = 0;
+	int a;
+	for(a = 0; a < MAC_ADDRESS_SIZE; a++){
+		macAddress |= (((uint64_t)address[a]) << (a * 8));
+	}
+	return macAddress;
+}
+
+static void initARPPacket(ARPPacket *p, enum ARPOperation operation,
+	uint64_t senderMACAddress, IPV4Address senderIPAddress,
+	uint64_t targetMACAddress, IPV4Address targetIPAddress
+){
+	p->hardwareType = TO_BIG_ENDIAN_16(1); // Ethernet
+	p->protocolType = ETHERTYPE_IPV4;
+	p->hardwareAddressLength = MAC_ADDRESS_SIZE;
+	p->protocolAddressLength = sizeof(IPV4Address);
+	p->operation = operation;
+	toMACAddress(p->senderHardwareAddress, senderMACAddress);
+	p->senderProtocolAddress = senderIPAddress;
+	toMACAddress(p->targetHardwareAddress, targetMACAddress);
+	p->targetProtocolAddress = targetIPAddress;
+}
+
+static int checkARPPacket(const ARPPacket *p, uintptr_t readSize){
+	if(readSize < sizeof(*p)){
 		return 0;
 	}
 	if(
-		request->hardwareType != TO_BIG_ENDIAN_16(1) ||
-		request->protocolType != ETHERTYPE_IPV4 ||
-		request->hardwareAddressLength != MAC_ADDRESS_SIZE ||
-		request->protocolAddressLength != sizeof(IPV4Address) ||
-		request->operation != TO_BIG_ENDIAN_16(1)
+		p->hardwareType != TO_BIG_ENDIAN_16(1) ||
+		p->protocolType != ETHERTYPE_IPV4 ||
+		p->hardwareAddressLength != MAC_ADDRESS_SIZE ||
+		p->protocolAddressLength != sizeof(IPV4Address) ||
+		(p->operation != ARP_OPERATION_REQUEST && p->operation != ARP_OPERATION_REPLY)
 	){
 		return 0;
 	}
 	return 1;
 }
 
+// neighbor cache
+#define ARP_TIMER_PERIOD (1000)
+// in ARP_TIMER_PERIOD
+#define ARP_REACHABLE_TIME (60)
+#define ARP_MAX_REQUEST_COUNT (3)
+#define ARP_MAX_PENDING_FRAME_COUNT (3)
+#define ARP_MAX_ENTRY_COUNT (64)
+
+typedef struct ARPEntry{
+	IPV4Address ipAddress;
+	uint64_t macAddress;
+	int isResolved;
+	// if resolved, the remaining time before expiration
+	// otherwise, the number of sent requests
+	uintptr_t timer;
+	// frames waiting for resolution, oldest first
+	uintptr_t pendingCount;
+	PacketBuffer *pending[ARP_MAX_PENDING_FRAME_COUNT];
+
+	struct ARPEntry **prev, *next;
+}ARPEntry;
+
 static void arpService(void *voidArg);
+static void arpTimer(void *voidArg);
 
 // IMPORVE: the structure is the same as DHCPClient
 struct ARPServer{
 	uintptr_t deviceFile;
+	// IP frames are written to ipDeviceFile with DESTINATION_PREFIX_SIZE
+	uintptr_t ipDeviceFile;
 	uint64_t macAddress;
 	const IPConfig *ipConfig;
 	Spinlock *ipConfigLock;
 
+	Spinlock cacheLock;
+	ARPEntry *cacheHead;
+	uintptr_t cacheCount;
 };
 
-ARPServer *createARPServer(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock, uint64_t macAddress){
+ARPServer *createARPServer(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock,
+	uint64_t macAddress, uintptr_t ipDeviceFile){
 	ARPServer *NEW(arp);
+	EXPECT(arp != NULL);
 	arp->deviceFile = syncOpenFileN(fe->name, fe->nameLength, OPEN_FILE_MODE_WRITABLE);
 	EXPECT(arp->deviceFile != IO_REQUEST_FAILURE);
 	uintptr_t r = syncSetFileParameter(arp->deviceFile, FILE_PARAM_TRANSMIT_ETHERTYPE, ETHERTYPE_ARP);
 	EXPECT(r != IO_REQUEST_FAILURE);
+	r = syncSetFileParameter(arp->deviceFile, FILE_PARAM_DESTINATION_PREFIX, 1);
+	EXPECT(r != IO_REQUEST_FAILURE);
+	arp->ipDeviceFile = ipDeviceFile;
 	arp->ipConfig = ipConfig;
 	arp->ipConfigLock = ipConfigLock;
 	arp->macAddress = macAddress;
+	arp->cacheLock = initialSpinlock;
+	arp->cacheHead = NULL;
+	arp->cacheCount = 0;
+	// both tasks use arp, so resume them after all allocations succeed
 	Task *t = createSharedMemoryTask(arpService, &arp, sizeof(arp), processorLocalTask());
 	EXPECT(t != NULL);
+	Task *t2 = createSharedMemoryTask(arpTimer, &arp, sizeof(arp), processorLocalTask());
+	EXPECT(t2 != NULL);
 	resume(t);
+	resume(t2);
 	return arp;
-	//DELETE(t);
+	ON_ERROR;
+	deleteUnstartedTask(t);
+	ON_ERROR;
+	// set destination prefix
 	ON_ERROR;
 	// set transmit EtherType
 	ON_ERROR;
 	syncCloseFile(arp->deviceFile);
 	ON_ERROR;
+	DELETE(arp);
+	ON_ERROR;
 	return NULL;
 }
 
-// return 0 if internal error (memory, file, ...) occurred
-// otherwise, return 1
-static int listenARP(ARPServer *arp){
-	int dataOK = 1;
-	ARPPacket *NEW(request);
-	EXPECT(request != NULL);
-	ARPPacket *NEW(reply);
-	EXPECT(reply != NULL);
-	uintptr_t readSize = sizeof(*request);
-	uintptr_t r = syncReadFile(arp->deviceFile, request, &readSize);
-	EXPECT(r != IO_REQUEST_FAILURE);
-	// format
-	dataOK = checkRequestPacket(request, readSize);
-	EXPECT(dataOK);
+// the MAC address in the first DESTINATION_PREFIX_SIZE bytes of frame is overwritten
+// the bits above it are kept; see SEGMENTATION_PREFIX_SHIFT
+static int writeFrameTo(uintptr_t file, uint64_t destination, uint8_t *frame, uintptr_t frameSize){
+	uint64_t prefix;
+	memcpy(&prefix, frame, DESTINATION_PREFIX_SIZE);
+	prefix = ((prefix & ~BROADCAST_MAC_ADDRESS) | destination);
+	memcpy(frame, &prefix, DESTINATION_PREFIX_SIZE);
+	uintptr_t writeSize = frameSize;
+	uintptr_t r = syncWriteFile(file, frame, &writeSize);
+	return (r != IO_REQUEST_FAILURE && writeSize == frameSize);
+}
+
+static int sendARPPacket(ARPServer *arp, enum ARPOperation operation,
+	uint64_t targetMACAddress, IPV4Address targetIPAddress){
+	struct{
+		uint64_t prefix;
+		ARPPacket packet;
+	}__attribute__((__packed__)) *NEW(frame);
+	static_assert(sizeof(frame->prefix) == DESTINATION_PREFIX_SIZE);
+	EXPECT(frame != NULL);
+	frame->prefix = 0;
 	acquireLock(arp->ipConfigLock);
 	IPV4Address localAddress = arp->ipConfig->localAddress;
 	releaseLock(arp->ipConfigLock);
-	// requested IP
-	dataOK = (request->targetProtocolAddress.value == localAddress.value);
-	EXPECT(dataOK);
+	const int isRequest = (operation == ARP_OPERATION_REQUEST);
+	initARPPacket(&frame->packet, operation, arp->macAddress, localAddress,
+		(isRequest? 0: targetMACAddress), targetIPAddress);
+	int ok = writeFrameTo(arp->deviceFile, (isRequest? BROADCAST_MAC_ADDRESS: targetMACAddress),
+		(uint8_t*)frame, sizeof(*frame));
+	DELETE(frame);
+	return ok;
+	ON_ERROR;
+	return 0;
+}
+
+static ARPEntry *searchARPEntry(ARPServer *arp, IPV4Address ipAddress){
+	ARPEntry *e;
+	for(e = arp->cacheHead; e != NULL; e = e->next){
+		if(e->ipAddress.value == ipAddress.value)
+			break;
+	}
+	return e;
+}
 
-	initARPReplyPacket(reply, arp->macAddress, request);
-	readSize = sizeof(*reply);
-	r = syncWriteFile(arp->deviceFile, reply, &readSize);
-	EXPECT(r != IO_REQUEST_FAILURE && readSize == sizeof(*reply));
+// if the cache is full, reuse the least recently added entry without pending frames
+static ARPEntry *createARPEntry(ARPServer *arp, IPV4Address ipAddress){
+	ARPEntry *e = NULL;
+	if(arp->cacheCount >= ARP_MAX_ENTRY_COUNT){
+		ARPEntry *i;
+		for(i = arp->cacheHead; i != NULL; i = i->next){
+			if(i->pendingCount == 0)
+				e = i;
+		}
+		if(e == NULL){
+			return NULL;
+		}
+		REMOVE_FROM_DQUEUE(e);
+	}
+	else{
+		NEW(e);
+		if(e == NULL){
+			return NULL;
+		}
+		arp->cacheCount++;
+	}
+	e->ipAddress = ipAddress;
+	e->macAddress = BROADCAST_MAC_ADDRESS;
+	e->isResolved = 0;
+	e->timer = 0;
+	e->pendingCount = 0;
+	e->prev = NULL;
+	e->next = NULL;
+	ADD_TO_DQUEUE(e, &arp->cacheHead);
+	return e;
+}
+
+static void removeARPEntry(ARPServer *arp, ARPEntry *e){
+	REMOVE_FROM_DQUEUE(e);
+	arp->cacheCount--;
+}
 
-	DELETE(reply);
-	DELETE(request);
+// move the pending frames of e to frames and return the count
+static uintptr_t takePendingFrames(ARPEntry *e, PacketBuffer **frames){
+	const uintptr_t n = e->pendingCount;
+	memcpy(frames, e->pending, n * sizeof(frames[0]));
+	e->pendingCount = 0;
+	return n;
+}
+
+static void flushPendingFrames(ARPServer *arp, uint64_t macAddress, PacketBuffer **frames, uintptr_t count){
+	uintptr_t i;
+	for(i = 0; i < count; i++){
+		if(macAddress != BROADCAST_MAC_ADDRESS){
+			writeFrameTo(arp->ipDeviceFile, macAddress, getPacketData(frames[i]), getPacketSize(frames[i]));
+		}
+		releasePacketBuffer(frames[i]);
+	}
+}
+
+int transmitToNeighbor(ARPServer *arp, IPV4Address nextHop, PacketBuffer *frame){
+	PacketBuffer *dropped = NULL;
+	int needRequest = 0;
+	uint64_t macAddress = BROADCAST_MAC_ADDRESS;
+	acquireLock(&arp->cacheLock);
+	ARPEntry *e = searchARPEntry(arp, nextHop);
+	if(e == NULL){
+		e = createARPEntry(arp, nextHop);
+		needRequest = (e != NULL);
+	}
+	if(e == NULL){
+		dropped = frame;
+	}
+	else if(e->isResolved){
+		macAddress = e->macAddress;
+	}
+	else{
+		if(e->pendingCount == ARP_MAX_PENDING_FRAME_COUNT){
+			dropped = e->pending[0];
+			e->pendingCount--;
+			memcpy(e->pending, e->pending + 1, e->pendingCount * sizeof(e->pending[0]));
+		}
+		e->pending[e->pendingCount] = frame;
+		e->pendingCount++;
+		if(needRequest){
+			e->timer = 1;
+		}
+	}
+	releaseLock(&arp->cacheLock);
+
+	if(dropped != NULL){
+		releasePacketBuffer(dropped);
+	}
+	if(needRequest){
+		sendARPPacket(arp, ARP_OPERATION_REQUEST, BROADCAST_MAC_ADDRESS, nextHop);
+	}
+	if(macAddress == BROADCAST_MAC_ADDRESS){
+		return (e != NULL);
+	}
+	int ok = writeFrameTo(arp->ipDeviceFile, macAddress, getPacketData(frame), getPacketSize(frame));
+	releasePacketBuffer(frame);
+	return ok;
+}
+
+// RFC 826: update the sender if it is in the cache; add it if we are the target
+static void mergeARPSender(ARPServer *arp, const ARPPacket *p, int isTargetLocal){
+	PacketBuffer *frames[ARP_MAX_PENDING_FRAME_COUNT];
+	uintptr_t frameCount = 0;
+	const uint64_t macAddress = fromMACAddress(p->senderHardwareAddress);
+	if(p->senderProtocolAddress.value == ANY_IPV4_ADDRESS.value || macAddress == BROADCAST_MAC_ADDRESS){
+		return;
+	}
+	acquireLock(&arp->cacheLock);
+	ARPEntry *e = searchARPEntry(arp, p->senderProtocolAddress);
+	if(e == NULL && isTargetLocal){
+		e = createARPEntry(arp, p->senderProtocolAddress);
+	}
+	if(e != NULL){
+		e->macAddress = macAddress;
+		e->isResolved = 1;
+		e->timer = ARP_REACHABLE_TIME;
+		frameCount = takePendingFrames(e, frames);
+	}
+	releaseLock(&arp->cacheLock);
+	flushPendingFrames(arp, macAddress, frames, frameCount);
+}
+
+// return 0 if internal error (memory, file, ...) occurred
+// otherwise, return 1
+static int listenARP(ARPServer *arp){
+	ARPPacket *NEW(packet);
+	EXPECT(packet != NULL);
+	uintptr_t readSize = sizeof(*packet);
+	uintptr_t r = syncReadFile(arp->deviceFile, packet, &readSize);
+	EXPECT(r != IO_REQUEST_FAILURE);
+	// format
+	if(checkARPPacket(packet, readSize)){
+		acquireLock(arp->ipConfigLock);
+		IPV4Address localAddress = arp->ipConfig->localAddress;
+		releaseLock(arp->ipConfigLock);
+		const int isTargetLocal = (localAddress.value != ANY_IPV4_ADDRESS.value &&
+			packet->targetProtocolAddress.value == localAddress.value);
+		mergeARPSender(arp, packet, isTargetLocal);
+		if(isTargetLocal && packet->operation == ARP_OPERATION_REQUEST){
+			sendARPPacket(arp, ARP_OPERATION_REPLY,
+				fromMACAddress(packet->senderHardwareAddress), packet->senderProtocolAddress);
+		}
+	}
+	DELETE(packet);
 	return 1;
 	ON_ERROR;
+	DELETE(packet);
 	ON_ERROR;
-	ON_ERROR;
-	ON_ERROR;
-	DELETE(reply);
-	ON_ERROR;
-	DELETE(request);
-	ON_ERROR;
-	return (dataOK == 0?1 : 0);
+	return 0;
 }
 
 static void arpService(void *voidArg){
@@ -131,3 +348,49 @@ static void arpService(void *voidArg){
 	}
 	systemCall_terminate();
 }
+
+// retry requests, drop unresolved entries and expire resolved entries
+static void updateARPCache(ARPServer *arp){
+	IPV4Address retry[ARP_MAX_ENTRY_COUNT];
+	uintptr_t retryCount = 0;
+	ARPEntry *removedHead = NULL;
+	acquireLock(&arp->cacheLock);
+	ARPEntry *e, *next;
+	for(e = arp->cacheHead; e != NULL; e = next){
+		next = e->next;
+		if(e->isResolved? (e->timer <= 1): (e->timer >= ARP_MAX_REQUEST_COUNT)){
+			removeARPEntry(arp, e);
+			ADD_TO_DQUEUE(e, &removedHead);
+		}
+		else if(e->isResolved){
+			e->timer--;
+		}
+		else{
+			e->timer++;
+			retry[retryCount] = e->ipAddress;
+			retryCount++;
+		}
+	}
+	releaseLock(&arp->cacheLock);
+	while(removedHead != NULL){
+		e = removedHead;
+		REMOVE_FROM_DQUEUE(e);
+		// drop the frames waiting for an unreachable neighbor
+		PacketBuffer *frames[ARP_MAX_PENDING_FRAME_COUNT];
+		uintptr_t frameCount = takePendingFrames(e, frames);
+		flushPendingFrames(arp, BROADCAST_MAC_ADDRESS, frames, frameCount);
+		DELETE(e);
+	}
+	uintptr_t i;
+	for(i = 0; i < retryCount; i++){
+		sendARPPacket(arp, ARP_OPERATION_REQUEST, BROADCAST_MAC_ADDRESS, retry[i]);
+	}
+}
+
+static void arpTimer(void *voidArg){
+	ARPServer *arp = *(ARPServer**)voidArg;
+	while(1){
+		sleep(ARP_TIMER_PERIOD);
+		updateARPCache(arp);
+	}
+}
@@ -0,0 +1,277 @@
+#include"std.h"
+#include"memory/memory.h"
+#include"task/exclusivelock.h"
+#include"assembly/assembly.h"
+#include"io/io.h"
+#include"file/file.h"
+#include"network.h"
+
+// https://wiki.wireshark.org/Development/LibpcapFileFormat
+typedef struct{
+	uint32_t magicNumber;
+	uint16_t majorVersion, minorVersion;
+	uint32_t timeZone;
+	uint32_t timestampAccuracy;
+	uint32_t snapshotLength;
+	uint32_t linkType;
+}PcapFileHeader;
+
+static_assert(sizeof(PcapFileHeader) == 24);
+
+typedef struct{
+	uint32_t second, microsecond;
+	uint32_t capturedLength, originalLength;
+}PcapRecordHeader;
+
+static_assert(sizeof(PcapRecordHeader) == 16);
+
+#define PCAP_MAGIC_NUMBER (0xa1b2c3d4)
+#define PCAP_LINK_TYPE_ETHERNET (1)
+#define MAX_PCAP_RECORD_SIZE (sizeof(PcapRecordHeader) + PACKET_CAPTURE_SNAPSHOT_LENGTH)
+// the oldest records are overwritten
+#define PACKET_CAPTURE_RECORD_COUNT (256)
+#define TSC_CALIBRATION_MILLISECOND (200)
+
+typedef struct{
+	uint64_t timestamp;
+	uint32_t capturedLength, originalLength;
+	uint8_t data[PACKET_CAPTURE_SNAPSHOT_LENGTH];
+}CapturedPacket;
+
+struct PacketCapture{
+	char name[MAX_FILE_ENUM_NAME_LENGTH];
+	uintptr_t nameLength;
+	Spinlock lock;
+	// the record of sequence number s is record[s % PACKET_CAPTURE_RECORD_COUNT]
+	uint64_t writeSequence;
+	CapturedPacket record[PACKET_CAPTURE_RECORD_COUNT];
+	struct PacketCapture **prev, *next;
+};
+
+typedef struct{
+	Spinlock lock;
+	PacketCapture *list;
+	// TSC ticks per second; see initPacketCapture
+	uint64_t tscFrequency;
+}PacketCaptureList;
+
+static PacketCaptureList captureList = {INITIAL_SPINLOCK, NULL, 0};
+
+PacketCapture *createPacketCapture(const char *name, uintptr_t nameLength){
+	if(nameLength > MAX_FILE_ENUM_NAME_LENGTH){
+		return NULL;
+	}
+	PacketCapture *NEW(c);
+	if(c == NULL){
+		return NULL;
+	}
+	memcpy(c->name, name, nameLength);
+	c->nameLength = nameLength;
+	c->lock = initialSpinlock;
+	c->writeSequence = 0;
+	acquireLock(&captureList.lock);
+	ADD_TO_DQUEUE(c, &captureList.list);
+	releaseLock(&captureList.lock);
+	return c;
+}
+
+void deletePacketCapture(PacketCapture *c){
+	acquireLock(&captureList.lock);
+	REMOVE_FROM_DQUEUE(c);
+	releaseLock(&captureList.lock);
+	DELETE(c);
+}
+
+void capturePacket(PacketCapture *c, uint64_t timestamp, const uint8_t *data, uintptr_t dataSize, uintptr_t frameSize){
+	assert(dataSize <= PACKET_CAPTURE_SNAPSHOT_LENGTH && dataSize <= frameSize);
+	acquireLock(&c->lock);
+	CapturedPacket *p = &c->record[c->writeSequence % PACKET_CAPTURE_RECORD_COUNT];
+	p->timestamp = timestamp;
+	p->capturedLength = dataSize;
+	p->originalLength = frameSize;
+	memcpy(p->data, data, dataSize);
+	c->writeSequence++;
+	releaseLock(&c->lock);
+}
+
+typedef struct{
+	PacketCapture *capture;
+	int hasReadHeader;
+	uint64_t readSequence;
+}OpenedPacketCapture;
+
+static void initPcapFileHeader(PcapFileHeader *h){
+	h->magicNumber = PCAP_MAGIC_NUMBER;
+	h->majorVersion = 2;
+	h->minorVersion = 4;
+	h->timeZone = 0;
+	h->timestampAccuracy = 0;
+	h->snapshotLength = PACKET_CAPTURE_SNAPSHOT_LENGTH;
+	h->linkType = PCAP_LINK_TYPE_ETHERNET;
+}
+
+// the time since the TSC was reset
+static void toPcapTimestamp(uint64_t timestamp, PcapRecordHeader *h){
+	const uint64_t f = captureList.tscFrequency;
+	if(f == 0){
+		h->second = 0;
+		h->microsecond = 0;
+		return;
+	}
+	h->second = (uint32_t)(timestamp / f);
+	h->microsecond = (uint32_t)(((timestamp % f) * 1000000) / f);
+}
+
+// return the size of the record, or 0 if no more frames are captured
+// if the writer has overwritten the next record, skip to the oldest one
+static uintptr_t readPcapRecord(OpenedPacketCapture *opc, uint8_t *buffer){
+	PacketCapture *c = opc->capture;
+	CapturedPacket p;
+	acquireLock(&c->lock);
+	const int hasRecord = (opc->readSequence != c->writeSequence);
+	if(hasRecord){
+		if(c->writeSequence - opc->readSequence > PACKET_CAPTURE_RECORD_COUNT){
+			opc->readSequence = c->writeSequence - PACKET_CAPTURE_RECORD_COUNT;
+		}
+		const CapturedPacket *r = &c->record[opc->readSequence % PACKET_CAPTURE_RECORD_COUNT];
+		p.timestamp = r->timestamp;
+		p.capturedLength = r->capturedLength;
+		p.originalLength = r->originalLength;
+		memcpy(p.data, r->data, r->capturedLength);
+		opc->readSequence++;
+	}
+	releaseLock(&c->lock);
+	if(hasRecord == 0){
+		return 0;
+	}
+	PcapRecordHeader h;
+	toPcapTimestamp(p.timestamp, &h);
+	h.capturedLength = p.capturedLength;
+	h.originalLength = p.originalLength;
+	memcpy(buffer, &h, sizeof(h));
+	memcpy(buffer + sizeof(h), p.data, p.capturedLength);
+	return sizeof(h) + p.capturedLength;
+}
+
+// the first read begins with the file header
+// return 0 bytes if no frame is captured since the last read
+static int readPacketCapture(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uintptr_t bufferSize){
+	OpenedPacketCapture *opc = getFileInstance(of);
+	// see FILE_PARAM_MIN_READ_SIZE
+	if(bufferSize < sizeof(PcapFileHeader) + MAX_PCAP_RECORD_SIZE){
+		return 0;
+	}
+	uintptr_t readSize = 0;
+	if(opc->hasReadHeader == 0){
+		PcapFileHeader h;
+		initPcapFileHeader(&h);
+		memcpy(buffer, &h, sizeof(h));
+		readSize += sizeof(h);
+		opc->hasReadHeader = 1;
+	}
+	while(bufferSize - readSize >= MAX_PCAP_RECORD_SIZE){
+		uintptr_t recordSize = readPcapRecord(opc, buffer + readSize);
+		if(recordSize == 0)
+			break;
+		readSize += recordSize;
+	}
+	completeRWFileIO(rwfr, readSize, 0);
+	return 1;
+}
+
+static int getPacketCaptureParameter(FileIORequest2 *r2, __attribute__((__unused__)) OpenedFile *of,
+	uintptr_t parameterCode){
+	switch(parameterCode){
+	case FILE_PARAM_MIN_READ_SIZE:
+		completeFileIO1(r2, sizeof(PcapFileHeader) + MAX_PCAP_RECORD_SIZE);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static void closePacketCapture(CloseFileRequest *cfr, OpenedFile *of){
+	OpenedPacketCapture *opc = getFileInstance(of);
+	DELETE(opc);
+	completeCloseFile(cfr);
+}
+
+static PacketCapture *searchPacketCapture(const char *name, uintptr_t nameLength){
+	acquireLock(&captureList.lock);
+	PacketCapture *c;
+	for(c = captureList.list; c != NULL; c = c->next){
+		if(c->nameLength == nameLength && strncmp(c->name, name, nameLength) == 0)
+			break;
+	}
+	releaseLock(&captureList.lock);
+	return c;
+}
+
+static int openPacketCapture(OpenFileRequest *ofr, const char *name, uintptr_t nameLength, OpenFileMode mode){
+	if(mode.enumeration || mode.writable){
+		return 0;
+	}
+	PacketCapture *c = searchPacketCapture(name, nameLength);
+	EXPECT(c != NULL);
+	OpenedPacketCapture *NEW(opc);
+	EXPECT(opc != NULL);
+	opc->capture = c;
+	opc->hasReadHeader = 0;
+	// begin with the oldest record in the ring
+	acquireLock(&c->lock);
+	opc->readSequence = (c->writeSequence > PACKET_CAPTURE_RECORD_COUNT?
+		c->writeSequence - PACKET_CAPTURE_RECORD_COUNT: 0);
+	releaseLock(&c->lock);
+	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
+	ff.read = readPacketCapture;
+	ff.getParameter = getPacketCaptureParameter;
+	ff.close = closePacketCapture;
+	completeOpenFile(ofr, opc, &ff);
+	return 1;
+	//DELETE(opc);
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+int initPacketCapture(void){
+	// begin at a timer tick, so that the error is less than one tick
+	sleep(1);
+	uint64_t t0 = rdtsc();
+	sleep(TSC_CALIBRATION_MILLISECOND);
+	uint64_t t1 = rdtsc();
+	captureList.tscFrequency = ((t1 - t0) * 1000) / TSC_CALIBRATION_MILLISECOND;
+
+	FileNameFunctions ff = INITIAL_FILE_NAME_FUNCTIONS;
+	ff.open = openPacketCapture;
+	return addFileSystem(&ff, "capture", strlen("capture"));
+}
+
+#ifndef NDEBUG
+
+void testPacketCapture(void);
+void testPacketCapture(void){
+	PacketCapture *c = createPacketCapture("test", strlen("test"));
+	assert(c != NULL && searchPacketCapture("test", strlen("test")) == c);
+	OpenedPacketCapture opc = {c, 0, 0};
+	uint8_t buffer[MAX_PCAP_RECORD_SIZE];
+	assert(readPcapRecord(&opc, buffer) == 0);
+	uint8_t frame[PACKET_CAPTURE_SNAPSHOT_LENGTH + 1];
+	uintptr_t i;
+	for(i = 0; i < PACKET_CAPTURE_RECORD_COUNT + 1; i++){
+		memset(frame, (int)i, sizeof(frame));
+		capturePacket(c, i, frame, PACKET_CAPTURE_SNAPSHOT_LENGTH, sizeof(frame));
+	}
+	// the first record is overwritten
+	assert(readPcapRecord(&opc, buffer) == MAX_PCAP_RECORD_SIZE);
+	const PcapRecordHeader *h = (const PcapRecordHeader*)buffer;
+	assert(h->capturedLength == PACKET_CAPTURE_SNAPSHOT_LENGTH && h->originalLength == sizeof(frame));
+	assert(buffer[sizeof(*h)] == 1 && opc.readSequence == 2);
+	opc.readSequence = c->writeSequence;
+	assert(readPcapRecord(&opc, buffer) == 0);
+	deletePacketCapture(c);
+	printk("test packet capture ok\n");
+}
+
+#endif
@@ -9,6 +9,7 @@ struct DHCPClient{
 	uint64_t macAddress;
 	IPConfig *outputIPConfig;
 	Spinlock *outputLock;
+	struct DataLinkDevice *device;
 };
 
 static void dhcpClientTask(void *arg);
@@ -27,7 +28,8 @@ static uintptr_t openDHCPOnDevice(const FileEnumeration *fe){
 	return IO_REQUEST_FAILURE;
 }
 
-DHCPClient *createDHCPClient(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock, uint64_t macAddress){
+DHCPClient *createDHCPClient(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock,
+	uint64_t macAddress, struct DataLinkDevice *device){
 	DHCPClient *NEW(dhcp);
 	EXPECT(dhcp != NULL);
 	dhcp->udpFile = openDHCPOnDevice(fe);
@@ -35,6 +37,7 @@ DHCPClient *createDHCPClient(const FileEnumeration *fe, IPConfig *ipConfig, Spin
 	dhcp->outputLock = ipConfigLock;
 	dhcp->outputIPConfig = ipConfig;
 	dhcp->macAddress = macAddress;
+	dhcp->device = device;
 	Task *t = createSharedMemoryTask(dhcpClientTask, &dhcp, sizeof(dhcp), processorLocalTask());
 	EXPECT(t != NULL);
 	resume(t);
@@ -385,6 +388,9 @@ static uintptr_t dhcpTransaction(DHCPClient *dhcp, uint32_t id, uintptr_t replyT
 	acquireLock(dhcp->outputLock);
 	(*dhcp->outputIPConfig) = ipConf;
 	releaseLock(dhcp->outputLock);
+	if(setDHCPRoutes(dhcp->device, &ipConf) == 0){
+		printk("warning: cannot add DHCP routes\n");
+	}
 
 	printk("DHCP offer\n");
 	printk("local addr : %I\n", ipConf.localAddress);
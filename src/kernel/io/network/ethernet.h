@@ -1,3 +1,6 @@
+#ifndef ETHERNET_H_INCLUDED
+#define ETHERNET_H_INCLUDED
+
 #include"common.h"
 
 #define TO_BIG_ENDIAN_16(X) ((uint16_t)((((X) << 8) & 0xff00) | (((X) >> 8) & 0xff)))
@@ -11,4 +14,31 @@ typedef uint16_t EtherType;
 
 
 #define MAC_ADDRESS_SIZE (6)
+#define BROADCAST_MAC_ADDRESS ((((uint64_t)0xffff) << 32) | 0xffffffff)
 void toMACAddress(volatile uint8_t *outAddress, uint64_t macAddress);
+
+// see FILE_PARAM_CHECKSUM_OFFLOAD
+// when enabled, the device
+// inserts the checksums of written IPv4 packets.
+// the writer sets IPv4 header checksum to 0 and TCP/UDP checksum to the sum of pseudo header
+// prepends a uint32_t of verified ChecksumOffload bits to every read frame
+enum ChecksumOffload{
+	CHECKSUM_OFFLOAD_IPV4_HEADER = 1,
+	CHECKSUM_OFFLOAD_IPV4_DATA = 2 // TCP and UDP
+};
+#define CHECKSUM_OFFLOAD_STATUS_SIZE (sizeof(uint32_t))
+
+// see FILE_PARAM_DESTINATION_PREFIX
+// when enabled, every written frame begins with a uint64_t destination MAC address
+// the written size includes the prefix
+// otherwise, frames are sent to FILE_PARAM_DESTINATION_ADDRESS (broadcast by default)
+#define DESTINATION_PREFIX_SIZE (sizeof(uint64_t))
+
+// see FILE_PARAM_SEGMENTATION_OFFLOAD
+// when enabled together with the destination prefix and both checksum offloads,
+// the bits above SEGMENTATION_PREFIX_SHIFT of the prefix are the TCP maximum segment size.
+// if they are not 0, the written frame is a TCP/IPv4 packet larger than the MTU
+// and the device cuts its data into segments with a copy of the headers
+#define SEGMENTATION_PREFIX_SHIFT (48)
+
+#endif
@@ -0,0 +1,391 @@
+#include"std.h"
+#include"memory/memory.h"
+#include"task/task.h"
+#include"task/exclusivelock.h"
+#include"multiprocessor/processorlocal.h"
+#include"io/io.h"
+#include"network.h"
+
+// fragment header fields
+
+uintptr_t getIPFragmentOffset(const IPV4Header *h){
+	return ((((uintptr_t)h->fragmentOffsetHigh) << 8) | h->fragmentOffsetLow) * 8;
+}
+
+int isIPFragment(const IPV4Header *h){
+	return (h->flags & IP_FLAG_MORE_FRAGMENTS) != 0 || getIPFragmentOffset(h) != 0;
+}
+
+void setIPFragmentOffset(IPV4Header *h, uintptr_t offset, int moreFragments){
+	assert(offset % 8 == 0);
+	offset /= 8;
+	h->flags = (moreFragments? IP_FLAG_MORE_FRAGMENTS: 0);
+	h->fragmentOffsetHigh = ((offset >> 8) & 0x1f);
+	h->fragmentOffsetLow = (offset & 0xff);
+}
+
+static Spinlock identificationLock = INITIAL_SPINLOCK;
+static uint16_t identification = 0;
+
+uint16_t nextIPIdentification(void){
+	acquireLock(&identificationLock);
+	const uint16_t i = identification;
+	identification++;
+	releaseLock(&identificationLock);
+	return changeEndian16(i);
+}
+
+// reassembly, RFC 815
+#define IP_REASSEMBLY_BUCKET_COUNT (64)
+#define IP_REASSEMBLY_MAX_ENTRY_COUNT (32)
+// including the entries and the fragment data
+#define IP_REASSEMBLY_MAX_MEMORY_SIZE (512 * 1024)
+// seconds
+#define IP_REASSEMBLY_TIMEOUT (30)
+#define IP_REASSEMBLY_TIMER_PERIOD (1000)
+
+typedef struct IPFragment{
+	// offset in the reassembled data
+	uintptr_t offset;
+	uintptr_t size;
+	struct IPFragment *next;
+	uint8_t data[];
+}IPFragment;
+
+typedef struct IPReassembly{
+	// key
+	IPV4Address source, destination;
+	uint16_t identification;
+	uint8_t protocol;
+
+	// the remaining seconds before timeout
+	uintptr_t timer;
+	// sizeof(IPReassembly) and fragments
+	uintptr_t memorySize;
+	// the header of the first fragment; headerSize is 0 before it is received
+	uintptr_t headerSize;
+	uint8_t header[MAX_IP_HEADER_SIZE];
+	// dataSize is 0 before the last fragment is received
+	uintptr_t dataSize, receivedSize;
+	// sorted by offset, not overlapping
+	IPFragment *fragmentList;
+
+	struct IPReassembly **prev, *next;
+}IPReassembly;
+
+typedef struct{
+	Spinlock lock;
+	uintptr_t entryCount;
+	uintptr_t memorySize;
+	IPReassembly *bucket[IP_REASSEMBLY_BUCKET_COUNT];
+}IPReassemblyTable;
+
+static IPReassemblyTable reassemblyTable = {INITIAL_SPINLOCK, 0, 0, {NULL}};
+
+static uintptr_t hashIPReassemblyKey(const IPV4Header *h){
+	uint32_t x = h->source.value ^ h->destination.value ^ (((uint32_t)h->identification) << 8) ^ h->protocol;
+	x ^= (x >> 16);
+	x *= 0x45d9f3b;
+	x ^= (x >> 16);
+	return x % IP_REASSEMBLY_BUCKET_COUNT;
+}
+
+static int isIPReassemblyKeyEqual(const IPReassembly *r, const IPV4Header *h){
+	return r->source.value == h->source.value && r->destination.value == h->destination.value &&
+		r->identification == h->identification && r->protocol == h->protocol;
+}
+
+static IPReassembly *searchIPReassembly(IPReassemblyTable *t, const IPV4Header *h){
+	IPReassembly *r;
+	for(r = t->bucket[hashIPReassemblyKey(h)]; r != NULL; r = r->next){
+		if(isIPReassemblyKeyEqual(r, h))
+			break;
+	}
+	return r;
+}
+
+static IPReassembly *createIPReassembly(IPReassemblyTable *t, const IPV4Header *h){
+	IPReassembly *NEW(r);
+	if(r == NULL){
+		return NULL;
+	}
+	r->source = h->source;
+	r->destination = h->destination;
+	r->identification = h->identification;
+	r->protocol = h->protocol;
+	r->timer = IP_REASSEMBLY_TIMEOUT;
+	r->memorySize = sizeof(*r);
+	r->headerSize = 0;
+	r->dataSize = 0;
+	r->receivedSize = 0;
+	r->fragmentList = NULL;
+	r->prev = NULL;
+	r->next = NULL;
+	ADD_TO_DQUEUE(r, &t->bucket[hashIPReassemblyKey(h)]);
+	t->entryCount++;
+	t->memorySize += r->memorySize;
+	return r;
+}
+
+static void removeIPReassembly(IPReassemblyTable *t, IPReassembly *r){
+	REMOVE_FROM_DQUEUE(r);
+	t->entryCount--;
+	t->memorySize -= r->memorySize;
+}
+
+static void deleteIPReassembly(IPReassembly *r){
+	while(r->fragmentList != NULL){
+		IPFragment *f = r->fragmentList;
+		r->fragmentList = f->next;
+		releaseKernelMemory(f);
+	}
+	DELETE(r);
+}
+
+// remove the entry closest to timeout except keep
+static IPReassembly *removeOldestIPReassembly(IPReassemblyTable *t, IPReassembly *keep){
+	IPReassembly *oldest = NULL;
+	uintptr_t b;
+	for(b = 0; b < IP_REASSEMBLY_BUCKET_COUNT; b++){
+		IPReassembly *r;
+		for(r = t->bucket[b]; r != NULL; r = r->next){
+			if(r != keep && (oldest == NULL || r->timer < oldest->timer)){
+				oldest = r;
+			}
+		}
+	}
+	if(oldest != NULL){
+		removeIPReassembly(t, oldest);
+	}
+	return oldest;
+}
+
+// return 1 if f is added; 0 if f is a duplicate; -1 if f is inconsistent with r
+static int addIPFragment(IPReassembly *r, IPFragment *f, int isLast){
+	const uintptr_t end = f->offset + f->size;
+	if(r->dataSize != 0 && (end > r->dataSize || (isLast && end != r->dataSize))){
+		return -1;
+	}
+	IPFragment **p = &r->fragmentList;
+	while(*p != NULL && (*p)->offset + (*p)->size <= f->offset){
+		p = &(*p)->next;
+	}
+	// overlapping fragments are not merged, like RFC 5722 for IPv6
+	if(*p != NULL && (*p)->offset < end){
+		return ((*p)->offset == f->offset && (*p)->size == f->size? 0: -1);
+	}
+	if(isLast){
+		// no data after the last fragment
+		if(*p != NULL){
+			return -1;
+		}
+		r->dataSize = end;
+	}
+	f->next = *p;
+	*p = f;
+	r->receivedSize += f->size;
+	r->memorySize += sizeof(*f) + f->size;
+	return 1;
+}
+
+static uint16_t getFragmentField(const IPV4Header *h){
+	uint16_t v;
+	memcpy(&v, ((const uint8_t*)&h->identification) + sizeof(h->identification), sizeof(v));
+	return v;
+}
+
+static IPV4Header *createReassembledPacket(const IPReassembly *r){
+	IPV4Header *h = allocateKernelMemory(r->headerSize + r->dataSize);
+	if(h == NULL){
+		return NULL;
+	}
+	memcpy(h, r->header, r->headerSize);
+	const IPFragment *f;
+	for(f = r->fragmentList; f != NULL; f = f->next){
+		memcpy(((uint8_t*)h) + r->headerSize + f->offset, f->data, f->size);
+	}
+	const uint16_t oldLength = h->totalLength, oldFragment = getFragmentField(h);
+	h->totalLength = changeEndian16(r->headerSize + r->dataSize);
+	setIPFragmentOffset(h, 0, 0);
+	h->headerChecksum = updateChecksum16(h->headerChecksum, oldLength, h->totalLength);
+	h->headerChecksum = updateChecksum16(h->headerChecksum, oldFragment, getFragmentField(h));
+	return h;
+}
+
+static IPV4Header *reassembleInTable(IPReassemblyTable *t, const IPV4Header *packet){
+	const uintptr_t headerSize = getIPHeaderSize(packet), size = getIPDataSize(packet);
+	const uintptr_t offset = getIPFragmentOffset(packet);
+	const int isLast = ((packet->flags & IP_FLAG_MORE_FRAGMENTS) == 0);
+	// every fragment but the last carries a multiple of 8 bytes
+	if(size == 0 || (isLast == 0 && size % 8 != 0) || offset + size > MAX_IP_PACKET_SIZE - headerSize){
+		return NULL;
+	}
+	IPFragment *f = allocateKernelMemory(sizeof(*f) + size);
+	if(f == NULL){
+		return NULL;
+	}
+	f->offset = offset;
+	f->size = size;
+	f->next = NULL;
+	memcpy(f->data, getIPData(packet), size);
+
+	IPReassembly *removedHead = NULL, *complete = NULL;
+	int added = 0;
+	acquireLock(&t->lock);
+	IPReassembly *r = searchIPReassembly(t, packet);
+	const uintptr_t needSize = sizeof(*f) + size + (r == NULL? sizeof(*r): 0);
+	// drop the oldest datagrams to bound memory
+	while(t->memorySize + needSize > IP_REASSEMBLY_MAX_MEMORY_SIZE ||
+		(r == NULL && t->entryCount >= IP_REASSEMBLY_MAX_ENTRY_COUNT)){
+		IPReassembly *e = removeOldestIPReassembly(t, r);
+		if(e == NULL)
+			break;
+		ADD_TO_DQUEUE(e, &removedHead);
+	}
+	if(t->memorySize + needSize <= IP_REASSEMBLY_MAX_MEMORY_SIZE){
+		if(r == NULL){
+			r = createIPReassembly(t, packet);
+		}
+		if(r != NULL){
+			const uintptr_t oldMemorySize = r->memorySize;
+			added = addIPFragment(r, f, isLast);
+			t->memorySize += r->memorySize - oldMemorySize;
+			if(added == 1 && offset == 0){
+				memcpy(r->header, packet, headerSize);
+				r->headerSize = headerSize;
+			}
+			if(added < 0){
+				removeIPReassembly(t, r);
+				ADD_TO_DQUEUE(r, &removedHead);
+			}
+			else if(r->dataSize != 0 && r->receivedSize == r->dataSize){
+				removeIPReassembly(t, r);
+				complete = r;
+			}
+		}
+	}
+	releaseLock(&t->lock);
+
+	if(added != 1){
+		releaseKernelMemory(f);
+	}
+	while(removedHead != NULL){
+		IPReassembly *e = removedHead;
+		REMOVE_FROM_DQUEUE(e);
+		deleteIPReassembly(e);
+	}
+	IPV4Header *reassembled = NULL;
+	if(complete != NULL){
+		// the fragments cover [0, dataSize) so the first fragment is received
+		assert(complete->headerSize != 0);
+		reassembled = createReassembledPacket(complete);
+		deleteIPReassembly(complete);
+	}
+	return reassembled;
+}
+
+static void removeExpiredIPReassembly(IPReassemblyTable *t){
+	IPReassembly *removedHead = NULL;
+	acquireLock(&t->lock);
+	uintptr_t b;
+	for(b = 0; b < IP_REASSEMBLY_BUCKET_COUNT; b++){
+		IPReassembly *r = t->bucket[b];
+		while(r != NULL){
+			IPReassembly *next = r->next;
+			r->timer--;
+			if(r->timer == 0){
+				removeIPReassembly(t, r);
+				ADD_TO_DQUEUE(r, &removedHead);
+			}
+			r = next;
+		}
+	}
+	releaseLock(&t->lock);
+	while(removedHead != NULL){
+		IPReassembly *r = removedHead;
+		REMOVE_FROM_DQUEUE(r);
+		deleteIPReassembly(r);
+	}
+}
+
+IPV4Header *reassembleIPPacket(const IPV4Header *fragment){
+	return reassembleInTable(&reassemblyTable, fragment);
+}
+
+static void ipReassemblyTimer(__attribute__((__unused__)) void *arg){
+	while(1){
+		sleep(IP_REASSEMBLY_TIMER_PERIOD);
+		removeExpiredIPReassembly(&reassemblyTable);
+	}
+}
+
+void initIPReassembly(void){
+	Task *t = createSharedMemoryTask(ipReassemblyTimer, NULL, 0, processorLocalTask());
+	if(t == NULL){
+		panic("cannot create IP reassembly timer");
+	}
+	resume(t);
+}
+
+#ifndef NDEBUG
+
+static IPV4Header *createTestFragment(uint16_t id, uintptr_t offset, uintptr_t size, int moreFragments){
+	IPV4Header *h = allocateKernelMemory(sizeof(*h) + size);
+	assert(h != NULL);
+	initIPV4Header(h, size, ANY_IPV4_ADDRESS, ANY_IPV4_ADDRESS, IP_DATA_PROTOCOL_UDP);
+	h->identification = id;
+	setIPFragmentOffset(h, offset, moreFragments);
+	uintptr_t i;
+	for(i = 0; i < size; i++){
+		((uint8_t*)getIPData(h))[i] = (uint8_t)(offset + i);
+	}
+	return h;
+}
+
+static IPV4Header *reassembleTestFragment(IPReassemblyTable *t, uint16_t id, uintptr_t offset, uintptr_t size, int moreFragments){
+	IPV4Header *f = createTestFragment(id, offset, size, moreFragments);
+	IPV4Header *h = reassembleInTable(t, f);
+	releaseKernelMemory(f);
+	return h;
+}
+
+void testIPReassembly(void);
+void testIPReassembly(void){
+	IPReassemblyTable t = {INITIAL_SPINLOCK, 0, 0, {NULL}};
+	// out of order with a duplicate
+	assert(reassembleTestFragment(&t, 1, 16, 8, 1) == NULL);
+	assert(reassembleTestFragment(&t, 1, 24, 5, 0) == NULL);
+	assert(reassembleTestFragment(&t, 1, 16, 8, 1) == NULL);
+	assert(t.entryCount == 1);
+	IPV4Header *h = reassembleTestFragment(&t, 1, 0, 16, 1);
+	assert(h != NULL && t.entryCount == 0 && t.memorySize == 0);
+	assert(getIPDataSize(h) == 29 && isIPFragment(h) == 0);
+	uintptr_t i;
+	for(i = 0; i < 29; i++){
+		assert(((uint8_t*)getIPData(h))[i] == i);
+	}
+	releaseKernelMemory(h);
+	// overlapping fragments drop the datagram
+	assert(reassembleTestFragment(&t, 2, 0, 16, 1) == NULL);
+	assert(reassembleTestFragment(&t, 2, 8, 16, 0) == NULL);
+	assert(t.entryCount == 0);
+	// timeout
+	assert(reassembleTestFragment(&t, 3, 0, 8, 1) == NULL);
+	for(i = 0; i < IP_REASSEMBLY_TIMEOUT; i++){
+		assert(t.entryCount == 1);
+		removeExpiredIPReassembly(&t);
+	}
+	assert(t.entryCount == 0 && t.memorySize == 0);
+	// the oldest datagram is dropped if the table is full
+	for(i = 0; i <= IP_REASSEMBLY_MAX_ENTRY_COUNT; i++){
+		assert(reassembleTestFragment(&t, 100 + i, 0, 8, 1) == NULL);
+	}
+	assert(t.entryCount == IP_REASSEMBLY_MAX_ENTRY_COUNT);
+	for(i = 0; i < IP_REASSEMBLY_TIMEOUT; i++){
+		removeExpiredIPReassembly(&t);
+	}
+	assert(t.entryCount == 0 && t.memorySize == 0);
+	printk("test IP reassembly ok\n");
+}
+
+#endif
@@ -0,0 +1,204 @@
+#include"std.h"
+#include"task/exclusivelock.h"
+#include"memory/memory.h"
+#include"ethernet.h"
+#include"network.h"
+
+// RFC 2236 IGMPv2
+typedef struct{
+	uint8_t type;
+	uint8_t maxResponseTime;
+	uint16_t checksum;
+	IPV4Address group;
+}IGMPMessage;
+
+static_assert(sizeof(IGMPMessage) == 8);
+
+enum IGMPType{
+	IGMP_MEMBERSHIP_REPORT = 0x16,
+	IGMP_LEAVE_GROUP = 0x17
+};
+
+// 224.0.0.1 and 224.0.0.2
+#define ALL_SYSTEMS_GROUP ((IPV4Address)(uint32_t)0x010000e0)
+#define ALL_ROUTERS_GROUP ((IPV4Address)(uint32_t)0x020000e0)
+
+typedef struct IGMPGroup{
+	IPV4Address address;
+	uintptr_t referenceCount;
+	struct IGMPGroup **prev, *next;
+}IGMPGroup;
+
+struct IGMPClient{
+	// opened with FILE_PARAM_ADD_RECEIVE_ADDRESS
+	uintptr_t deviceFile;
+	FileEnumeration fileEnumeration;
+
+	Spinlock lock;
+	IGMPGroup *groupList;
+};
+
+int isMulticastIPV4Address(IPV4Address a){
+	return ((a.bytes[0] & 0xf0) == 0xe0);
+}
+
+// 224.0.0.0/4 maps to 01:00:5e and the low 23 bits
+uint64_t toMulticastMACAddress(IPV4Address a){
+	return 0x5e0001 | (((uint64_t)(a.bytes[1] & 0x7f)) << 24) |
+		(((uint64_t)a.bytes[2]) << 32) | (((uint64_t)a.bytes[3]) << 40);
+}
+
+static uint16_t calculateIGMPChecksum(const IGMPMessage *m){
+	return foldChecksum(addChecksum(0, m, sizeof(*m))) ^ 0xffff;
+}
+
+static int createIGMPPacket(
+	__attribute__((__unused__)) IPSocket *ips, PacketBuffer *packet, IPV4Address src, IPV4Address dst,
+	const uint8_t *buffer, uintptr_t dataSize, int checksumOffload
+){
+	uint8_t *data = appendPacketBuffer(packet, dataSize);
+	if(data == NULL){
+		return 0;
+	}
+	memcpy(data, buffer, dataSize);
+	IPV4Header *h = prependIPV4Header(packet, src, dst, IP_DATA_PROTOCOL_IGMP, checksumOffload);
+	if(h == NULL){
+		return 0;
+	}
+	// IGMP messages are not forwarded by routers
+	uint16_t oldValue, newValue;
+	memcpy(&oldValue, &h->timeToLive, sizeof(oldValue));
+	h->timeToLive = 1;
+	memcpy(&newValue, &h->timeToLive, sizeof(newValue));
+	if((checksumOffload & CHECKSUM_OFFLOAD_IPV4_HEADER) == 0){
+		h->headerChecksum = updateChecksum16(h->headerChecksum, oldValue, newValue);
+	}
+	return 1;
+}
+
+// reports are sent to the group, and leave messages to all routers
+static int sendIGMPMessage(IGMPClient *igmp, enum IGMPType type, IPV4Address group){
+	IGMPMessage m;
+	m.type = type;
+	m.maxResponseTime = 0;
+	m.checksum = 0;
+	m.group = group;
+	m.checksum = calculateIGMPChecksum(&m);
+	IPSocket s;
+	initIPSocket(&s, NULL, createIGMPPacket, NULL, NULL, NULL);
+	setIPSocketBindingDevice(&s, igmp->fileEnumeration.name, igmp->fileEnumeration.nameLength);
+	setIPSocketRemoteAddress(&s, (type == IGMP_LEAVE_GROUP? ALL_ROUTERS_GROUP: group));
+	return transmitIP(&s, (const uint8_t*)&m, sizeof(m));
+}
+
+IGMPClient *createIGMPClient(const FileEnumeration *fe, uintptr_t deviceFile){
+	IGMPClient *NEW(igmp);
+	if(igmp == NULL){
+		return NULL;
+	}
+	igmp->deviceFile = deviceFile;
+	igmp->fileEnumeration = *fe;
+	igmp->lock = initialSpinlock;
+	igmp->groupList = NULL;
+	return igmp;
+}
+
+void deleteIGMPClient(IGMPClient *igmp){
+	assert(igmp->groupList == NULL);
+	DELETE(igmp);
+}
+
+static IGMPGroup *searchIGMPGroup(IGMPClient *igmp, IPV4Address group){
+	IGMPGroup *g;
+	for(g = igmp->groupList; g != NULL; g = g->next){
+		if(g->address.value == group.value)
+			break;
+	}
+	return g;
+}
+
+int joinIPGroup(IGMPClient *igmp, IPV4Address group){
+	EXPECT(isMulticastIPV4Address(group) && group.value != ALL_SYSTEMS_GROUP.value);
+	IGMPGroup *NEW(newGroup);
+	EXPECT(newGroup != NULL);
+	newGroup->address = group;
+	newGroup->referenceCount = 1;
+	acquireLock(&igmp->lock);
+	IGMPGroup *g = searchIGMPGroup(igmp, group);
+	if(g != NULL){
+		g->referenceCount++;
+	}
+	else{
+		ADD_TO_DQUEUE(newGroup, &igmp->groupList);
+	}
+	releaseLock(&igmp->lock);
+	if(g != NULL){
+		DELETE(newGroup);
+		return 1;
+	}
+	// frames to the group are dropped by the device until the address is added
+	uintptr_t r = syncSetFileParameter(igmp->deviceFile, FILE_PARAM_ADD_RECEIVE_ADDRESS,
+		toMulticastMACAddress(group));
+	EXPECT(r != IO_REQUEST_FAILURE);
+	// RFC 2236: unsolicited report
+	sendIGMPMessage(igmp, IGMP_MEMBERSHIP_REPORT, group);
+	return 1;
+	ON_ERROR;
+	// the group may have been joined again
+	acquireLock(&igmp->lock);
+	newGroup->referenceCount--;
+	const int isLast = (newGroup->referenceCount == 0);
+	if(isLast){
+		REMOVE_FROM_DQUEUE(newGroup);
+	}
+	releaseLock(&igmp->lock);
+	if(isLast){
+		DELETE(newGroup);
+	}
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+int leaveIPGroup(IGMPClient *igmp, IPV4Address group){
+	acquireLock(&igmp->lock);
+	IGMPGroup *g = searchIGMPGroup(igmp, group);
+	int isLast = 0;
+	if(g != NULL){
+		g->referenceCount--;
+		isLast = (g->referenceCount == 0);
+		if(isLast){
+			REMOVE_FROM_DQUEUE(g);
+		}
+	}
+	releaseLock(&igmp->lock);
+	if(g == NULL){
+		return 0;
+	}
+	if(isLast){
+		DELETE(g);
+		sendIGMPMessage(igmp, IGMP_LEAVE_GROUP, group);
+		syncSetFileParameter(igmp->deviceFile, FILE_PARAM_REMOVE_RECEIVE_ADDRESS, toMulticastMACAddress(group));
+	}
+	return 1;
+}
+
+#ifndef NDEBUG
+
+void testIGMP(void);
+void testIGMP(void){
+	// 224.0.0.251 -> 01:00:5e:00:00:fb
+	IPV4Address a = {bytes: {224, 0, 0, 251}};
+	assert(isMulticastIPV4Address(a) && toMulticastMACAddress(a) == 0xfb00005e0001ull);
+	// the high bit of the second byte is ignored
+	IPV4Address b = {bytes: {239, 128, 0, 251}};
+	assert(toMulticastMACAddress(b) == toMulticastMACAddress(a));
+	IPV4Address c = {bytes: {192, 168, 0, 1}};
+	assert(isMulticastIPV4Address(c) == 0);
+	IGMPMessage m = {IGMP_MEMBERSHIP_REPORT, 0, 0, a};
+	m.checksum = calculateIGMPChecksum(&m);
+	assert(calculateIGMPChecksum(&m) == 0);
+	printk("test IGMP ok\n");
+}
+
+#endif
@@ -4,7 +4,9 @@
 #include"task/task.h"
 #include"task/exclusivelock.h"
 #include"multiprocessor/processorlocal.h"
-#include"io/fifo.h"
+#include"interrupt/controller/pic.h"
+#include"assembly/assembly.h"
+#include"interrupt/systemcall.h"
 #include"network.h"
 
 static_assert(sizeof(IPV4Address) == 4);
@@ -26,52 +28,83 @@ void *getIPData(const IPV4Header *h){
 	return ((uint8_t*)h) + getIPHeaderSize(h);
 }
 
-// return big endian number
-static uint16_t calculateIPHeaderChecksum(const IPV4Header *h){
-	uint32_t cs = 0;
-	uintptr_t i;
-	uintptr_t headerSize = getIPHeaderSize(h);
-	for(i = 0; i * 2  + 1 < headerSize; i++){
-		cs += (uint32_t)changeEndian16(((uint16_t*)h)[i]);
+// one's complement sum does not depend on byte order
+// so the data is added as little endian 32-bit words and swapped only once, see foldChecksum
+// the carries are accumulated in the high 32 bits
+uint64_t addChecksum(uint64_t sum, const void *data, uintptr_t size){
+	const uint8_t *d = data;
+	while(size >= sizeof(uint32_t) * 4){
+		sum += ((const uint32_t*)d)[0];
+		sum += ((const uint32_t*)d)[1];
+		sum += ((const uint32_t*)d)[2];
+		sum += ((const uint32_t*)d)[3];
+		d += sizeof(uint32_t) * 4;
+		size -= sizeof(uint32_t) * 4;
+	}
+	while(size >= sizeof(uint32_t)){
+		sum += *(const uint32_t*)d;
+		d += sizeof(uint32_t);
+		size -= sizeof(uint32_t);
+	}
+	if(size >= sizeof(uint16_t)){
+		sum += *(const uint16_t*)d;
+		d += sizeof(uint16_t);
+		size -= sizeof(uint16_t);
 	}
-	while(cs > 0xffff){
-		cs = (cs & 0xffff) + (cs >> 16);
+	// padding
+	if(size != 0){
+		sum += *d;
 	}
-	return changeEndian16(cs ^ 0xffff);
+	return sum;
 }
 
-// return little endian number which can be greater than 0xffff
-static uint32_t calculatePseudoIPHeaderChecksum(const IPV4Header *h){
-	uint32_t cs = 0;
-	cs += changeEndian16(h->source.value & 0xffff);
-	cs += changeEndian16(h->source.value >> 16);
-	cs += changeEndian16(h->destination.value & 0xffff);
-	cs += changeEndian16(h->destination.value >> 16);
-	cs += h->protocol;
-	cs += getIPDataSize(h);
+// return big endian number
+uint16_t foldChecksum(uint64_t sum){
+	while(sum > 0xffff){
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t)sum;
+}
+
+// return big endian number
+static uint16_t calculateIPHeaderChecksum(const IPV4Header *h){
+	return foldChecksum(addChecksum(0, h, getIPHeaderSize(h))) ^ 0xffff;
+}
+
+// return unfolded sum. see addChecksum
+static uint64_t calculatePseudoIPHeaderChecksum(const IPV4Header *h){
+	uint64_t cs = 0;
+	cs += h->source.value;
+	cs += h->destination.value;
+	cs += changeEndian16(h->protocol);
+	cs += changeEndian16(getIPDataSize(h));
 	return cs;
 }
 
 uint16_t calculateIPDataChecksum(const IPV4Header *h){
 	// pseudo ip header
-	uint32_t cs = calculatePseudoIPHeaderChecksum(h);
+	uint64_t cs = calculatePseudoIPHeaderChecksum(h);
 	// udp header + udp data
-	const uint16_t *data = getIPData(h);
-	const uintptr_t dataSize = getIPDataSize(h);
-	uintptr_t i;
-	for(i = 0; (i + 1) * sizeof(uint16_t) <= dataSize; i++){
-		cs += (uint32_t)changeEndian16((data)[i]);
-	}
-	// padding
-	if(dataSize % sizeof(uint16_t) != 0){
-		uint16_t lastByte = (uint16_t)(((const uint8_t*)data)[dataSize - 1]);
-		cs += (uint32_t)changeEndian16(lastByte);
-	}
-	while(cs > 0xffff){
-		cs = (cs & 0xffff) + (cs >> 16);
-	}
-	cs = changeEndian16(cs ^ 0xffff);
-	return cs;
+	cs = addChecksum(cs, getIPData(h), getIPDataSize(h));
+	return foldChecksum(cs) ^ 0xffff;
+}
+
+// return big endian number
+uint16_t calculatePseudoIPHeaderSum(const IPV4Header *h){
+	return foldChecksum(calculatePseudoIPHeaderChecksum(h));
+}
+
+// RFC 1624: HC' = ~(~HC + ~m + m')
+uint16_t updateChecksum16(uint16_t checksum, uint16_t oldValue, uint16_t newValue){
+	uint64_t cs = (uint16_t)~checksum;
+	cs += (uint16_t)~oldValue;
+	cs += newValue;
+	return foldChecksum(cs) ^ 0xffff;
+}
+
+uint16_t updateChecksum32(uint16_t checksum, uint32_t oldValue, uint32_t newValue){
+	checksum = updateChecksum16(checksum, (uint16_t)(oldValue & 0xffff), (uint16_t)(newValue & 0xffff));
+	return updateChecksum16(checksum, (uint16_t)(oldValue >> 16), (uint16_t)(newValue >> 16));
 }
 
 void initIPV4Header(
@@ -86,7 +119,8 @@ void initIPV4Header(
 	h->totalLength = changeEndian16(sizeof(IPV4Header) + dataSize);
 	h->identification = changeEndian16(0);
 	h->fragmentOffsetHigh = 0;
-	h->flags = 2; // 2 = don't fragment; 4 = more fragment
+	// fragments are created by fragmentIPPacket
+	h->flags = IP_FLAG_DONT_FRAGMENT;
 	h->fragmentOffsetLow = 0;
 	h->fragmentOffsetHigh = 0;
 	h->timeToLive = 32;
@@ -101,14 +135,19 @@ void initIPV4Header(
 
 #define MAX_IP_PAYLOAD_SIZE (MAX_IP_PACKET_SIZE - sizeof(IPV4Header))
 
-static IPV4Header *createIPV4Header(uintptr_t dataSize, IPV4Address localAddr, IPV4Address remoteAddr){
+IPV4Header *prependIPV4Header(PacketBuffer *b, IPV4Address srcAddress, IPV4Address dstAddress,
+	enum IPDataProtocol dataProtocol, int checksumOffload){
+	const uintptr_t dataSize = getPacketSize(b);
 	if(dataSize > MAX_IP_PAYLOAD_SIZE)
 		return NULL;
-	IPV4Header *h = allocateKernelMemory(sizeof(IPV4Header) + dataSize);
+	IPV4Header *h = prependPacketBuffer(b, sizeof(*h));
 	if(h == NULL){
 		return NULL;
 	}
-	initIPV4Header(h, dataSize, localAddr, remoteAddr, IP_DATA_PROTOCOL_TEST254);
+	initIPV4Header(h, dataSize, srcAddress, dstAddress, dataProtocol);
+	if(checksumOffload & CHECKSUM_OFFLOAD_IPV4_HEADER){
+		h->headerChecksum = 0;
+	}
 	return h;
 }
 
@@ -127,45 +166,18 @@ static uintptr_t enumNextDataLinkDevice(uintptr_t f, const char *namePattern, Fi
 }
 
 struct RWIPQueue{
-	Semaphore *argCount;
 	Spinlock lock;
 	struct RWIPRequest *argList;
-	int terminateFlag;
 	IPSocket *socket;
 };
 
 static void addIPSocketReference(IPSocket *ips, int v);
+static void scheduleIPSocket(IPSocket *ips);
 
-// the device file is opened by the internetService() thread,
-// so it is not writable by the socket thread
-// the sharedMemoryTask should be
-static RWIPQueue *createRWIPQueue(void (*taskEntry)(void*), IPSocket *ipSocket, Task *sharedMemoryTask){
-	RWIPQueue *NEW(t);
-	EXPECT(t != NULL);
-	t->argCount = createSemaphore(0);
-	EXPECT(t->argCount != NULL);
-	t->lock = initialSpinlock;
-	t->argList = NULL;
-	t->terminateFlag = 0;
-	t->socket = ipSocket;
-	Task *task = createSharedMemoryTask(taskEntry, &t, sizeof(t), sharedMemoryTask);
-	EXPECT(task != NULL);
-	addIPSocketReference(t->socket, 1);
-	resume(task);
-	return t;
-	// terminate task
-	ON_ERROR;
-	deleteSemaphore(t->argCount);
-	ON_ERROR;
-	DELETE(t);
-	ON_ERROR;
-	return NULL;
-}
-
-static void deleteRWIPQueue(RWIPQueue *t){
-	addIPSocketReference(t->socket, -1);
-	deleteSemaphore(t->argCount);
-	DELETE(t);
+static void initRWIPQueue(RWIPQueue *q, IPSocket *ipSocket){
+	q->lock = initialSpinlock;
+	q->argList = NULL;
+	q->socket = ipSocket;
 }
 
 typedef struct RWIPRequest{
@@ -196,10 +208,6 @@ static RWIPRequest *createRWIPArgument(RWFileRequest *rwfr, IPSocket *ips, uint8
 
 static void cancelRWIPRequest(void *voidArg){
 	RWIPRequest *arg = voidArg;
-	int ok = tryAcquireSemaphore(arg->queue->argCount);
-	if(!ok){
-		assert(0);
-	}
 	acquireLock(&arg->queue->lock);
 	REMOVE_FROM_DQUEUE(arg);
 	releaseLock(&arg->queue->lock);
@@ -213,7 +221,7 @@ static void addToRWIPQueue(RWIPQueue *q, RWIPRequest *arg){
 	ADD_TO_DQUEUE(arg, &q->argList);
 	setRWFileIOCancellable(arg->rwfr, arg, cancelRWIPRequest);
 	releaseLock(&q->lock);
-	releaseSemaphore(q->argCount);
+	scheduleIPSocket(q->socket);
 }
 
 int createAddRWIPArgument(RWIPQueue *q, RWFileRequest *rwfr, IPSocket *ips, uint8_t *buffer, uintptr_t size){
@@ -226,30 +234,21 @@ int createAddRWIPArgument(RWIPQueue *q, RWFileRequest *rwfr, IPSocket *ips, uint
 	return 1;
 }
 
-static void setIPTaskTerminateFlag(RWIPQueue *t){
-	acquireLock(&t->lock);
-	assert(t->terminateFlag == 0);
-	t->terminateFlag = 1;
-	releaseLock(&t->lock);
-	releaseSemaphore(t->argCount);
-}
-
-// if success, return 1
-// if@the socket is closed, return 0
+// if a request is available, return 1
+// otherwise, return 0
 int nextRWIPRequest(RWIPQueue *q, RWFileRequest **rwfr, uint8_t **buffer, uintptr_t *size){
-	assert(q->argCount != NULL);
-	acquireSemaphore(q->argCount);
 	acquireLock(&q->lock);
-	const int t = q->terminateFlag;
-	RWIPRequest *r = q->argList;
-	if(t == 0){
-		assert(r != NULL && r->queue == q);
+	RWIPRequest *r;
+	for(r = q->argList; r != NULL; r = r->next){
+		// skip the requests being cancelled; see cancelRWIPRequest
+		if(setRWFileIONotCancellable(r->rwfr)){
+			assert(r->queue == q);
 			REMOVE_FROM_DQUEUE(r);
-			setRWFileIONotCancellable(r->rwfr);
 			r->queue = NULL;
+			break;
+		}
 	}
 	releaseLock(&q->lock);
-	assert(r != NULL || t != 0);
 	if(r != NULL){
 		*rwfr = r->rwfr;
 		*buffer = r->buffer;
@@ -268,35 +267,145 @@ enum DeviceIPAddressType{
 typedef struct DataLinkDevice{
 	IPConfig ipConfig;
 	Spinlock ipConfigLock;
+	// see createLoopbackDevice
+	int isLoopback;
 
 	uintptr_t mtu;
+	// enum ChecksumOffload
+	int checksumOffload;
+	// see SEGMENTATION_PREFIX_SHIFT
+	int segmentationOffload;
+	// transmit buffers of mtu bytes
+	PacketPool *packetPool;
 	FileEnumeration fileEnumeration;
 	uintptr_t fileHandle;
 
 	DHCPClient *dhcpClient;
+	// NULL if the device does not support FILE_PARAM_DESTINATION_PREFIX
 	ARPServer *arpServer;
+	IGMPClient *igmpClient;
 
 	struct DataLinkDevice **prev, *next;
 }DataLinkDevice;
 
 typedef struct{
+	// read without the lock; see searchDeviceByName
 	DataLinkDevice *head;
 	Spinlock lock;
 }DataLinkDeviceList;
 static DataLinkDeviceList dataLinkDevList = {NULL, INITIAL_SPINLOCK};
 // see initInternetService
 
+typedef struct{
+	DataLinkDevice *device;
+	// reads one receive queue
+	uintptr_t fileHandle;
+}IPDeviceReaderArgument;
+
 static void ipDeviceReader(void *voidArg);
+static int deliverLoopbackPacket(DataLinkDevice *d, PacketBuffer *packet);
+
+// includes the frames waiting for ARP resolution; see arp.c
+#define DEVICE_PACKET_POOL_SIZE (256)
+
+// d->fileHandle reads queue 0
+static uintptr_t openDeviceReceiveQueue(DataLinkDevice *d, uintptr_t queue){
+	if(queue == 0){
+		return d->fileHandle;
+	}
+	const FileEnumeration *fe = &d->fileEnumeration;
+	uintptr_t f = syncOpenFileN(fe->name, fe->nameLength, OPEN_FILE_MODE_0);
+	EXPECT(f != IO_REQUEST_FAILURE);
+	uintptr_t r = syncSetFileParameter(f, FILE_PARAM_RECEIVE_QUEUE, queue);
+	EXPECT(r != IO_REQUEST_FAILURE);
+	// same read format as d->fileHandle
+	EXPECT(d->checksumOffload == 0 ||
+		syncSetFileParameter(f, FILE_PARAM_CHECKSUM_OFFLOAD, d->checksumOffload) != IO_REQUEST_FAILURE);
+	return f;
+	ON_ERROR;
+	ON_ERROR;
+	syncCloseFile(f);
+	ON_ERROR;
+	return IO_REQUEST_FAILURE;
+}
+
+static void closeDeviceReceiveQueue(DataLinkDevice *d, uintptr_t f){
+	if(f != d->fileHandle){
+		syncCloseFile(f);
+	}
+}
+
+// one reader task for each receive queue of the device
+// the readers are resumed after all of them are created, so d is not used if this function fails
+static int startIPDeviceReaders(DataLinkDevice *d){
+	uint64_t queueCount;
+	// optional
+	if(syncGetFileParameter(d->fileHandle, FILE_PARAM_RECEIVE_QUEUE_COUNT, &queueCount) == IO_REQUEST_FAILURE){
+		queueCount = 1;
+	}
+	IPDeviceReaderArgument *NEW_ARRAY(args, queueCount);
+	EXPECT(args != NULL);
+	Task **NEW_ARRAY(tasks, queueCount);
+	EXPECT(tasks != NULL);
+	uintptr_t i;
+	for(i = 0; i < queueCount; i++){
+		args[i].device = d;
+		args[i].fileHandle = openDeviceReceiveQueue(d, i);
+		if(args[i].fileHandle == IO_REQUEST_FAILURE){
+			break;
+		}
+		tasks[i] = createSharedMemoryTask(ipDeviceReader, args + i, sizeof(args[i]), processorLocalTask());
+		if(tasks[i] == NULL){
+			closeDeviceReceiveQueue(d, args[i].fileHandle);
+			break;
+		}
+	}
+	EXPECT(i == queueCount);
+	for(i = 0; i < queueCount; i++){
+		resume(tasks[i]);
+	}
+	DELETE(tasks);
+	DELETE(args);
+	return 1;
+	ON_ERROR;
+	while(i != 0){
+		i--;
+		deleteUnstartedTask(tasks[i]);
+		closeDeviceReceiveQueue(d, args[i].fileHandle);
+	}
+	DELETE(tasks);
+	ON_ERROR;
+	DELETE(args);
+	ON_ERROR;
+	return 0;
+}
 
 static DataLinkDevice *createDataLinkDevice(const FileEnumeration *fe){
 	DataLinkDevice *NEW(d);
 	EXPECT(d != NULL);
 
+	d->isLoopback = 0;
 	d->fileEnumeration = *fe;
 	d->fileHandle = syncOpenFileN(fe->name, fe->nameLength, OPEN_FILE_MODE_WRITABLE);
 	EXPECT(d->fileHandle != IO_REQUEST_FAILURE);
 	uintptr_t r = syncMaxWriteSizeOfFile(d->fileHandle, &d->mtu);
 	EXPECT(r != IO_REQUEST_FAILURE);
+	d->packetPool = createPacketPool(d->mtu, DEVICE_PACKET_POOL_SIZE);
+	EXPECT(d->packetPool != NULL);
+	// optional
+	r = syncSetFileParameter(d->fileHandle, FILE_PARAM_DESTINATION_PREFIX, 1);
+	const int hasDestinationPrefix = (r != IO_REQUEST_FAILURE);
+	d->checksumOffload = (CHECKSUM_OFFLOAD_IPV4_HEADER | CHECKSUM_OFFLOAD_IPV4_DATA);
+	r = syncSetFileParameter(d->fileHandle, FILE_PARAM_CHECKSUM_OFFLOAD, d->checksumOffload);
+	if(r == IO_REQUEST_FAILURE){
+		d->checksumOffload = 0;
+	}
+	// optional; the segment size is carried in the destination prefix
+	d->segmentationOffload = 0;
+	if(hasDestinationPrefix && d->checksumOffload == (CHECKSUM_OFFLOAD_IPV4_HEADER | CHECKSUM_OFFLOAD_IPV4_DATA)){
+		r = syncSetFileParameter(d->fileHandle, FILE_PARAM_SEGMENTATION_OFFLOAD, 1);
+		d->segmentationOffload = (r != IO_REQUEST_FAILURE);
+	}
 	d->ipConfigLock = initialSpinlock;
 	d->ipConfig.localAddress = ANY_IPV4_ADDRESS;
 	d->ipConfig.subnetMask = ANY_IPV4_ADDRESS; // broadcast address = 255.255.255.255
@@ -306,17 +415,24 @@ static DataLinkDevice *createDataLinkDevice(const FileEnumeration *fe){
 	uint64_t macAddress;
 	r = syncGetFileParameter(d->fileHandle, FILE_PARAM_SOURCE_ADDRESS, &macAddress);
 	EXPECT(r != IO_REQUEST_FAILURE);
-	d->dhcpClient = createDHCPClient(fe, &d->ipConfig, &d->ipConfigLock, macAddress);
+	d->dhcpClient = createDHCPClient(fe, &d->ipConfig, &d->ipConfigLock, macAddress, d);
 	EXPECT(d->dhcpClient != NULL);
-	d->arpServer = createARPServer(fe, &d->ipConfig, &d->ipConfigLock, macAddress);
-	EXPECT(d->arpServer != NULL);
+	// without destination prefix, frames are broadcast and ARP is not used
+	d->arpServer = NULL;
+	if(hasDestinationPrefix){
+		d->arpServer = createARPServer(fe, &d->ipConfig, &d->ipConfigLock, macAddress, d->fileHandle);
+	}
+	EXPECT(hasDestinationPrefix == 0 || d->arpServer != NULL);
+	d->igmpClient = createIGMPClient(fe, d->fileHandle);
+	EXPECT(d->igmpClient != NULL);
 	d->prev = NULL;
 	d->next = NULL;
-	Task *t = createSharedMemoryTask(ipDeviceReader, &d, sizeof(d), processorLocalTask());
-	EXPECT(t != NULL);
-	resume(t);
+	int ok = startIPDeviceReaders(d);
+	EXPECT(ok);
 	return d;
-	// terminate task
+	// no reader is started
+	ON_ERROR;
+	deleteIGMPClient(d->igmpClient);
 	ON_ERROR;
 	// TODO: terminate ARP server
 	ON_ERROR;
@@ -324,6 +440,9 @@ static DataLinkDevice *createDataLinkDevice(const FileEnumeration *fe){
 	ON_ERROR;
 	// mac address
 	ON_ERROR;
+	// the device is not in dataLinkDevList, so no packet is allocated from the pool
+	deletePacketPool(d->packetPool);
+	ON_ERROR;
 	// mtu
 	ON_ERROR;
 	syncCloseFile(d->fileHandle);
@@ -340,36 +459,117 @@ static void deleteDataLinkDevice(DataLinkDevice *d){
 */
 static void addDataLinkDevice(DataLinkDeviceList *dlList, DataLinkDevice *d){
 	acquireLock(&dlList->lock);
-	ADD_TO_DQUEUE(d, &dlList->head);
+	RCU_ADD_TO_DQUEUE(d, &dlList->head);
 	releaseLock(&dlList->lock);
 }
 
+#define LOOPBACK_DEVICE_NAME "lo"
+// 127.0.0.1/8
+#define LOOPBACK_ADDRESS ((IPV4Address)(uint32_t)0x0100007f)
+#define LOOPBACK_SUBNET_MASK ((IPV4Address)(uint32_t)0x000000ff)
+#define LOOPBACK_PREFIX_LENGTH (8)
+// every IP packet is delivered in one buffer without fragmentation
+#define LOOPBACK_MTU (MAX_IP_PACKET_SIZE)
+// the buffers are larger than those of other devices
+#define LOOPBACK_PACKET_POOL_SIZE (64)
+
+// the loopback device has no file; see writeIPPacket
+static DataLinkDevice *createLoopbackDevice(void){
+	DataLinkDevice *NEW(d);
+	EXPECT(d != NULL);
+	d->isLoopback = 1;
+	initFileEnumeration(&d->fileEnumeration, LOOPBACK_DEVICE_NAME, strlen(LOOPBACK_DEVICE_NAME));
+	d->fileHandle = IO_REQUEST_FAILURE;
+	d->mtu = LOOPBACK_MTU;
+	// the senders skip the checksums and the receivers do not verify them
+	d->checksumOffload = (CHECKSUM_OFFLOAD_IPV4_HEADER | CHECKSUM_OFFLOAD_IPV4_DATA);
+	// large TCP packets are delivered without segmentation
+	d->segmentationOffload = 1;
+	d->packetPool = createPacketPool(d->mtu, LOOPBACK_PACKET_POOL_SIZE);
+	EXPECT(d->packetPool != NULL);
+	d->ipConfigLock = initialSpinlock;
+	d->ipConfig.localAddress = LOOPBACK_ADDRESS;
+	d->ipConfig.subnetMask = LOOPBACK_SUBNET_MASK;
+	d->ipConfig.dhcpServer = ANY_IPV4_ADDRESS;
+	d->ipConfig.gateway = ANY_IPV4_ADDRESS;
+	d->ipConfig.dnsServer = ANY_IPV4_ADDRESS;
+	d->dhcpClient = NULL;
+	d->arpServer = NULL;
+	d->igmpClient = NULL;
+	d->prev = NULL;
+	d->next = NULL;
+	int ok = addStaticRoute(LOOPBACK_ADDRESS, LOOPBACK_PREFIX_LENGTH, ANY_IPV4_ADDRESS, d);
+	EXPECT(ok);
+	return d;
+	ON_ERROR;
+	deletePacketPool(d->packetPool);
+	ON_ERROR;
+	DELETE(d);
+	ON_ERROR;
+	return NULL;
+}
+
+// the devices are never deleted, so d is valid after rcuReadUnlock
 static DataLinkDevice *searchDeviceByName(DataLinkDeviceList *devList, const char *name, uintptr_t nameLength){
-	acquireLock(&devList->lock);
+	int interruptEnabled = rcuReadLock();
 	DataLinkDevice *d;
 	for(d= devList->head; d != NULL; d = d->next){
 		if(isStringEqual(d->fileEnumeration.name, d->fileEnumeration.nameLength, name, nameLength)){
 			break;
 		}
 	}
-	releaseLock(&devList->lock);
+	rcuReadUnlock(interruptEnabled);
 	return d;
 }
 
-static DataLinkDevice *searchDeviceByRoutingTable(DataLinkDeviceList *devList, __attribute__((__unused__)) IPV4Address address){
-	acquireLock(&devList->lock);
-	DataLinkDevice *d;
-	// TODO:
-	for(d = devList->head; d != NULL; d = d->next){
-		int ok = 1;
-		// (d->ipConfig.bindingAddress.value & d->ipConfig.subnetMask.value) ==
-		// (address.value & d->ipConfig.subnetMask.value);
-		if(ok){
+// the group is joined on the bound device, or the device of the route to the group
+static IGMPClient *searchGroupClient(IPSocket *s, IPV4Address group){
+	DataLinkDevice *d = NULL;
+	if(s->bindToDevice){
+		d = searchDeviceByName(&dataLinkDevList, s->deviceName, s->deviceNameLength);
+	}
+	else{
+		Route r;
+		d = (searchRoute(group, &r)? r.device: NULL);
+	}
+	return (d == NULL? NULL: d->igmpClient);
+}
+
+static uintptr_t searchIPSocketGroup(const IPSocket *s, IPV4Address group){
+	uintptr_t i;
+	for(i = 0; i < s->groupCount; i++){
+		if(s->group[i].value == group.value)
 			break;
-		}
 	}
-	releaseLock(&devList->lock);
-	return d;
+	return i;
+}
+
+static int joinIPSocketGroup(IPSocket *s, IPV4Address group){
+	EXPECT(s->groupCount < MAX_IP_SOCKET_GROUP_COUNT && searchIPSocketGroup(s, group) == s->groupCount);
+	IGMPClient *c = searchGroupClient(s, group);
+	EXPECT(c != NULL);
+	int ok = joinIPGroup(c, group);
+	EXPECT(ok);
+	s->group[s->groupCount] = group;
+	s->groupClient[s->groupCount] = c;
+	s->groupCount++;
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+static int leaveIPSocketGroup(IPSocket *s, IPV4Address group){
+	const uintptr_t i = searchIPSocketGroup(s, group);
+	if(i == s->groupCount){
+		return 0;
+	}
+	leaveIPGroup(s->groupClient[i], group);
+	s->groupCount--;
+	s->group[i] = s->group[s->groupCount];
+	s->groupClient[i] = s->groupClient[s->groupCount];
+	return 1;
 }
 
 int setIPAddress(IPSocket *ips, uintptr_t param, uint64_t value){
@@ -380,6 +580,10 @@ int setIPAddress(IPSocket *ips, uintptr_t param, uint64_t value){
 	case FILE_PARAM_DESTINATION_ADDRESS:
 		setIPSocketRemoteAddress(ips, (IPV4Address)(uint32_t)value);
 		break;
+	case FILE_PARAM_JOIN_IP_GROUP:
+		return joinIPSocketGroup(ips, (IPV4Address)(uint32_t)value);
+	case FILE_PARAM_LEAVE_IP_GROUP:
+		return leaveIPSocketGroup(ips, (IPV4Address)(uint32_t)value);
 	default:
 		return 0;
 	}
@@ -400,14 +604,39 @@ static int writeIPSocket(RWFileRequest *rwfr, OpenedFile *of, const uint8_t *buf
 	return createAddRWIPArgument(ips->transmit, rwfr, ips, (uint8_t*)buffer, size);
 }
 
-static DataLinkDevice *resolveLocalAddress(DataLinkDeviceList *devList, const IPSocket *s, IPV4Address *a){
+// sockets bound to a device send to the gateway of the device if the destination is not on-link
+static IPV4Address getDeviceNextHop(DataLinkDevice *d, IPV4Address dst){
+	acquireLock(&d->ipConfigLock);
+	const IPConfig c = d->ipConfig;
+	releaseLock(&d->ipConfigLock);
+	const int isOnLink = ((dst.value & c.subnetMask.value) == (c.localAddress.value & c.subnetMask.value));
+	return ((isOnLink || c.gateway.value == ANY_IPV4_ADDRESS.value)? dst: c.gateway);
+}
+
+// the route is cached until the remote address or the routing table changes
+static DataLinkDevice *routeIPSocket(IPSocket *s, IPV4Address dst, IPV4Address *nextHop){
+	if(s->routeDestination.value != dst.value || isRouteValid(&s->route) == 0){
+		if(searchRoute(dst, &s->route) == 0){
+			return NULL;
+		}
+		s->routeDestination = dst;
+	}
+	*nextHop = (s->route.gateway.value == ANY_IPV4_ADDRESS.value? dst: s->route.gateway);
+	return s->route.device;
+}
+
+static DataLinkDevice *resolveLocalAddress(DataLinkDeviceList *devList, IPSocket *s, IPV4Address *a, IPV4Address *nextHop){
 	// device
 	DataLinkDevice *d = NULL;
+	const IPV4Address dst = s->remoteAddress;
 	if(s->bindToDevice){
 		d = searchDeviceByName(devList, s->deviceName, s->deviceNameLength);
+		if(d != NULL){
+			*nextHop = getDeviceNextHop(d, dst);
+		}
 	}
 	else{
-		d = searchDeviceByRoutingTable(devList, s->remoteAddress);
+		d = routeIPSocket(s, dst, nextHop);
 	}
 	if(d == NULL)
 		return NULL;
@@ -423,47 +652,206 @@ static DataLinkDevice *resolveLocalAddress(DataLinkDeviceList *devList, const IP
 	return d;
 }
 
-static int transmitIP(IPSocket *s, const uint8_t *buffer, uintptr_t size){
-	IPV4Address src, dst = s->remoteAddress;
-	DataLinkDevice *dld = resolveLocalAddress(&dataLinkDevList, s, &src);
-	EXPECT(dld != NULL);
-	IPV4Header *packet = s->createPacket(s, src, dst, buffer, size);
-	EXPECT(packet != NULL);
-	uintptr_t writeSize = getIPPacketSize(packet);
+// return 1 and set *macAddress if the destination is a broadcast or multicast address
+static int getGroupMACAddress(DataLinkDevice *d, IPV4Address dst, uint64_t *macAddress){
+	acquireLock(&d->ipConfigLock);
+	const IPConfig c = d->ipConfig;
+	releaseLock(&d->ipConfigLock);
+	if(isBroadcastIPV4Address(dst, c.localAddress, c.subnetMask)){
+		*macAddress = BROADCAST_MAC_ADDRESS;
+		return 1;
+	}
+	if(isMulticastIPV4Address(dst)){
+		*macAddress = toMulticastMACAddress(dst);
+		return 1;
+	}
+	return 0;
+}
 
-	EXPECT(writeSize <= dld->mtu);
-	uintptr_t r = syncWriteFile(dld->fileHandle, packet, &writeSize);
-	EXPECT(r != IO_REQUEST_FAILURE && writeSize == getIPPacketSize(packet));
-	s->deletePacket(packet);
-	return 1;
-	// cancel write
+// the packet is released
+// if maxSegmentSize != 0, the device cuts the packet into TCP segments
+static int writeIPPacket(DataLinkDevice *d, IPV4Address nextHop, PacketBuffer *packet, uintptr_t maxSegmentSize){
+	assert(maxSegmentSize == 0 || d->segmentationOffload);
+	if(d->isLoopback){
+		return deliverLoopbackPacket(d, packet);
+	}
+	if(d->arpServer != NULL){
+		const IPV4Header *h = getPacketData(packet);
+		uint64_t macAddress;
+		const int isGroup = getGroupMACAddress(d, h->destination, &macAddress);
+		// PACKET_HEADROOM always has room for the prefix
+		uint8_t *prefix = prependPacketBuffer(packet, DESTINATION_PREFIX_SIZE);
+		assert(prefix != NULL);
+		// transmitToNeighbor fills the MAC address and keeps the segment size
+		const uint64_t prefixValue = (isGroup? macAddress: 0) |
+			(((uint64_t)maxSegmentSize) << SEGMENTATION_PREFIX_SHIFT);
+		memcpy(prefix, &prefixValue, DESTINATION_PREFIX_SIZE);
+		if(isGroup == 0){
+			return transmitToNeighbor(d->arpServer, nextHop, packet);
+		}
+	}
+	const uintptr_t packetSize = getPacketSize(packet);
+	uintptr_t writeSize = packetSize;
+	uintptr_t r = syncWriteFile(d->fileHandle, getPacketData(packet), &writeSize);
+	releasePacketBuffer(packet);
+	return (r != IO_REQUEST_FAILURE && writeSize == packetSize);
+}
+
+// the device cannot calculate the TCP/UDP checksum of a fragmented packet
+static void calculateTransportChecksum(IPV4Header *h){
+	uintptr_t checksumOffset;
+	switch(h->protocol){
+	case IP_DATA_PROTOCOL_TCP:
+		checksumOffset = TCP_CHECKSUM_OFFSET;
+		break;
+	case IP_DATA_PROTOCOL_UDP:
+		checksumOffset = UDP_CHECKSUM_OFFSET;
+		break;
+	default:
+		return;
+	}
+	if(getIPDataSize(h) < checksumOffset + sizeof(uint16_t)){
+		return;
+	}
+	uint8_t *checksum = ((uint8_t*)getIPData(h)) + checksumOffset;
+	memset(checksum, 0, sizeof(uint16_t));
+	uint16_t c = calculateIPDataChecksum(h);
+	if(c == 0 && h->protocol == IP_DATA_PROTOCOL_UDP){
+		c = 0xffff;
+	}
+	memcpy(checksum, &c, sizeof(c));
+}
+
+// send packet in fragments of at most mtu bytes
+// packets created by initIPV4Header have no options, so every fragment has the same header
+static int fragmentIPPacket(DataLinkDevice *d, IPV4Address nextHop, IPV4Header *packet){
+	const uintptr_t headerSize = getIPHeaderSize(packet), dataSize = getIPDataSize(packet);
+	// the offsets of fragments are multiples of 8
+	const uintptr_t maxFragmentSize = ((d->mtu - headerSize) & ~(uintptr_t)7);
+	EXPECT(d->mtu > headerSize + 8);
+	if(d->checksumOffload & CHECKSUM_OFFLOAD_IPV4_DATA){
+		calculateTransportChecksum(packet);
+	}
+	packet->identification = nextIPIdentification();
+	const uint8_t *data = getIPData(packet);
+	uintptr_t offset;
+	int ok = 1;
+	for(offset = 0; ok && offset < dataSize; offset += maxFragmentSize){
+		const uintptr_t fragmentSize = MIN(maxFragmentSize, dataSize - offset);
+		PacketBuffer *f = allocatePacketBuffer(d->packetPool);
+		if(f == NULL){
+			ok = 0;
+			break;
+		}
+		// PACKET_HEADROOM and mtu are enough for the header and the fragment
+		uint8_t *fragmentData = appendPacketBuffer(f, fragmentSize);
+		IPV4Header *h = prependPacketBuffer(f, headerSize);
+		assert(fragmentData != NULL && h != NULL);
+		memcpy(fragmentData, data + offset, fragmentSize);
+		memcpy(h, packet, headerSize);
+		h->totalLength = changeEndian16(headerSize + fragmentSize);
+		setIPFragmentOffset(h, offset, offset + fragmentSize < dataSize);
+		h->headerChecksum = 0;
+		if((d->checksumOffload & CHECKSUM_OFFLOAD_IPV4_HEADER) == 0){
+			h->headerChecksum = calculateIPHeaderChecksum(h);
+		}
+		ok = writeIPPacket(d, nextHop, f, 0);
+	}
+	return ok;
 	ON_ERROR;
-	// larger than MTU
+	return 0;
+}
+
+// send the data of a TCP packet in segments of at most maxSegmentSize bytes
+// every segment has a copy of the headers; FIN and PSH are set only in the last segment
+static int segmentTCPPacket(DataLinkDevice *d, IPV4Address nextHop, const IPV4Header *packet, uintptr_t maxSegmentSize){
+	const uintptr_t ipHeaderSize = getIPHeaderSize(packet);
+	const uint8_t *tcpHeader = getIPData(packet);
+	const uintptr_t tcpHeaderSize = GET_TCP_HEADER_SIZE(tcpHeader);
+	const uintptr_t headerSize = ipHeaderSize + tcpHeaderSize;
+	EXPECT(packet->protocol == IP_DATA_PROTOCOL_TCP && headerSize + maxSegmentSize <= d->mtu);
+	const uintptr_t dataSize = getIPDataSize(packet) - tcpHeaderSize;
+	uint32_t sequence;
+	memcpy(&sequence, tcpHeader + TCP_SEQUENCE_OFFSET, sizeof(sequence));
+	sequence = changeEndian32(sequence);
+	const uint8_t lastFlags = tcpHeader[TCP_FLAGS_OFFSET];
+	uintptr_t offset;
+	int ok = 1;
+	for(offset = 0; ok && offset < dataSize; offset += maxSegmentSize){
+		const uintptr_t segmentSize = MIN(maxSegmentSize, dataSize - offset);
+		PacketBuffer *s = allocatePacketBuffer(d->packetPool);
+		if(s == NULL){
+			ok = 0;
+			break;
+		}
+		uint8_t *segmentData = appendPacketBuffer(s, segmentSize);
+		IPV4Header *h = prependPacketBuffer(s, headerSize);
+		assert(segmentData != NULL && h != NULL);
+		memcpy(segmentData, tcpHeader + tcpHeaderSize + offset, segmentSize);
+		memcpy(h, packet, headerSize);
+		h->totalLength = changeEndian16(headerSize + segmentSize);
+		h->identification = nextIPIdentification();
+		h->headerChecksum = 0;
+		if((d->checksumOffload & CHECKSUM_OFFLOAD_IPV4_HEADER) == 0){
+			h->headerChecksum = calculateIPHeaderChecksum(h);
+		}
+		uint8_t *t = getIPData(h);
+		const uint32_t segmentSequence = changeEndian32(sequence + offset);
+		memcpy(t + TCP_SEQUENCE_OFFSET, &segmentSequence, sizeof(segmentSequence));
+		if(offset + segmentSize < dataSize){
+			t[TCP_FLAGS_OFFSET] = (lastFlags & ~(TCP_FLAG_FIN | TCP_FLAG_PSH));
+		}
+		if(d->checksumOffload & CHECKSUM_OFFLOAD_IPV4_DATA){
+			const uint16_t c = calculatePseudoIPHeaderSum(h);
+			memcpy(t + TCP_CHECKSUM_OFFSET, &c, sizeof(c));
+		}
+		else{
+			calculateTransportChecksum(h);
+		}
+		ok = writeIPPacket(d, nextHop, s, 0);
+	}
+	return ok;
 	ON_ERROR;
-	s->deletePacket(packet);
+	return 0;
+}
+
+// maxSegmentSize is 0 if the packet is fragmented instead of segmented
+static int transmitIPPacket(IPSocket *s, const uint8_t *buffer, uintptr_t size, uintptr_t maxSegmentSize){
+	IPV4Address src, nextHop, dst = s->remoteAddress;
+	DataLinkDevice *dld = resolveLocalAddress(&dataLinkDevList, s, &src, &nextHop);
+	EXPECT(dld != NULL);
+	// large packets are built in a temporary buffer and fragmented or segmented
+	PacketBuffer *packet = (size <= dld->mtu? allocatePacketBuffer(dld->packetPool): createPacketBuffer(size));
+	EXPECT(packet != NULL);
+	int ok = s->createPacket(s, packet, src, dst, buffer, size, dld->checksumOffload);
+	EXPECT(ok);
+	if(getPacketSize(packet) <= dld->mtu){
+		return writeIPPacket(dld, nextHop, packet, 0);
+	}
+	if(maxSegmentSize != 0 && dld->segmentationOffload){
+		return writeIPPacket(dld, nextHop, packet, maxSegmentSize);
+	}
+	ok = (maxSegmentSize != 0?
+		segmentTCPPacket(dld, nextHop, getPacketData(packet), maxSegmentSize):
+		fragmentIPPacket(dld, nextHop, getPacketData(packet)));
+	releasePacketBuffer(packet);
+	return ok;
+	// no room
+	ON_ERROR;
+	releasePacketBuffer(packet);
 	ON_ERROR;
 	// no device
 	ON_ERROR;
 	return 0;
 }
 
-static void transmitIPTask(void *voidArg){
-	RWIPQueue *tran = *(RWIPQueue**)voidArg;
-	IPSocket *ips = tran->socket;
-	while(1){
-		RWFileRequest *rwfr;
-		uint8_t *buffer;
-		uintptr_t size;
+int transmitIP(IPSocket *s, const uint8_t *buffer, uintptr_t size){
+	return transmitIPPacket(s, buffer, size, 0);
+}
 
-		int ok = nextRWIPRequest(tran, &rwfr, &buffer, &size);
-		if(!ok){
-			break;
-		}
-		ok = transmitIP(ips, buffer, size);
-		completeRWFileIO(rwfr, (ok? size: 0), 0);
-	}
-	deleteRWIPQueue(tran);
-	systemCall_terminate();
+int transmitIPSegments(IPSocket *s, const uint8_t *buffer, uintptr_t size, uintptr_t maxSegmentSize){
+	assert(maxSegmentSize != 0);
+	return transmitIPPacket(s, buffer, size, maxSegmentSize);
 }
 
 static int readIPSocket(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uintptr_t size){
@@ -471,7 +859,7 @@ static int readIPSocket(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, ui
 	return createAddRWIPArgument(ips->receive, rwfr, ips, buffer, size);
 }
 
-static int validateIPV4Packet(const IPV4Header *packet, uintptr_t readSize/*TODO: src/dst address*/){
+static int validateIPV4Packet(const IPV4Header *packet, uintptr_t readSize, int checksumVerified/*TODO: src/dst address*/){
 	if(packet->version != 4 || readSize < sizeof(*packet)){
 		return 0;
 	}
@@ -485,72 +873,35 @@ static int validateIPV4Packet(const IPV4Header *packet, uintptr_t readSize/*TODO
 		printk("bad IP packet size %u; header size %u; read size %u\n", packetSize, headerSize, readSize);
 		return 0;
 	}
-	if(calculateIPHeaderChecksum(packet) != 0){
+	if((checksumVerified & CHECKSUM_OFFLOAD_IPV4_HEADER) == 0 && calculateIPHeaderChecksum(packet) != 0){
 		printk("bad IP packet checksum\n");
 		return 0;
 	}
-	//TODO: if packet->flags
+	// fragments are checked in reassembleIPPacket
 	//TODO: if(packet->destination.value & thisAddress.value){
 	//
 	//}
 	return 1;
 }
 
-typedef struct IPFIFO{
-	FIFO *fifo;
-	struct IPFIFO **prev, *next;
-}IPFIFO;
-
-struct IPFIFOList{
-	Semaphore *semaphore;
-	IPFIFO *head;
-};
-
-static int initIPFIFOList(struct IPFIFOList *ifl){
-	ifl->semaphore = createSemaphore(1);
-	if(ifl->semaphore == NULL){
-		return 0;
-	}
-	ifl->head = NULL;
-
-	return 1;
-}
-
-static void addToIPFIFOList(struct IPFIFOList *ifl, IPFIFO *ipf){
-	acquireSemaphore(ifl->semaphore);
-	ADD_TO_DQUEUE(ipf, &ifl->head);
-	releaseSemaphore(ifl->semaphore);
-}
-
-static void removeFromIPFIFOList(struct IPFIFOList *ifl, IPFIFO *ipf){
-	acquireSemaphore(ifl->semaphore);
-	REMOVE_FROM_DQUEUE(ipf);
-	releaseSemaphore(ifl->semaphore);
-}
-
 typedef struct QueuedPacket{
 	DataLinkDevice *fromDevice;
 	int isBoradcast;
+	// enum ChecksumOffload
+	int checksumVerified;
 	ReferenceCount referenceCount;
-	IPV4Header packet[];
+	// points to data, a reassembled packet, or the data of buffer
+	IPV4Header *packet;
+	// the buffer written to the loopback device
+	PacketBuffer *buffer;
+	uint8_t data[];
 }QueuedPacket;
 
-static IPFIFO *createIPFIFO(uintptr_t maxLength){
-	IPFIFO *NEW(ipf);
-	EXPECT(ipf != NULL);
-	ipf->fifo = createFIFO(maxLength, sizeof(QueuedPacket*));
-	EXPECT(ipf->fifo != NULL);
-	ipf->prev = NULL;
-	ipf->next = NULL;
-	return ipf;
-	ON_ERROR;
-	ON_ERROR;
-	return NULL;
-}
-
-static QueuedPacket *createQueuedPacket(IPV4Header *packet, DataLinkDevice *device){
-	const uintptr_t packetSize = getIPPacketSize(packet);
-	QueuedPacket *p = allocateKernelMemory(sizeof(QueuedPacket) + packetSize);
+// a reassembled packet is not copied and is released with the QueuedPacket
+// so is a loopback packet; see deliverLoopbackPacket
+static QueuedPacket *createQueuedPacket(IPV4Header *packet, DataLinkDevice *device, int checksumVerified, int isReassembled){
+	const uintptr_t copySize = (isReassembled? 0: getIPPacketSize(packet));
+	QueuedPacket *p = allocateKernelMemory(sizeof(QueuedPacket) + copySize);
 	if(p == NULL){
 		return NULL;
 	}
@@ -559,99 +910,342 @@ static QueuedPacket *createQueuedPacket(IPV4Header *packet, DataLinkDevice *devi
 	IPV4Address devAddress = device->ipConfig.localAddress, devMask = device->ipConfig.subnetMask;
 	releaseLock(&device->ipConfigLock);
 	p->isBoradcast = isBroadcastIPV4Address(packet->destination, devAddress, devMask);
+	p->checksumVerified = checksumVerified;
 	initReferenceCount(&p->referenceCount, 0);
-	memcpy(p->packet, packet, packetSize);
+	p->packet = packet;
+	p->buffer = NULL;
+	if(isReassembled == 0){
+		memcpy(p->data, packet, copySize);
+		p->packet = (IPV4Header*)p->data;
+	}
 	return p;
 }
 
 static void addQueuedPacketRef(QueuedPacket *p, int n){
 	if(addReference(&p->referenceCount, n) == 0){
+		if(p->buffer != NULL){
+			releasePacketBuffer(p->buffer);
+		}
+		else if(p->packet != (IPV4Header*)p->data){
+			releaseKernelMemory(p->packet);
+		}
 		releaseKernelMemory(p);
 	}
 }
 
-static void overwriteIPFIFO(IPFIFO *f, QueuedPacket *p){
+// socket engine
+// sockets are state objects; a few worker tasks process the sockets which have events
+// an event is a read/write request, a received packet or closing the socket
+#define IP_SOCKET_PACKET_QUEUE_LENGTH (64)
+#define MAX_IP_WORKER_COUNT (8)
+#define IP_SOCKET_BUCKET_COUNT (4096)
+
+struct IPWorker;
+
+typedef struct IPSocketEngine{
+	IPSocket *socket;
+	Spinlock lock;
+	// in the ready queue of worker
+	int isScheduled;
+	// see stopIPSocketTasks
+	int isStopping;
+	// not in IPService.rawSocketList or socketBucket
+	int isRemoved;
+	struct IPWorker *worker;
+	struct IPSocketEngine *nextReady;
+	// received packets waiting for read requests; the oldest one is dropped if full
+	uintptr_t packetHead, packetCount;
+	QueuedPacket *packets[IP_SOCKET_PACKET_QUEUE_LENGTH];
+	RWIPQueue receive, transmit;
+
+	struct IPSocketEngine **prev, *next;
+}IPSocketEngine;
+
+typedef struct IPWorker{
+	Semaphore *readyCount;
+	Spinlock lock;
+	IPSocketEngine *readyHead, **readyTail;
+}IPWorker;
+
+struct IPService{
+	// protect rawSocketList and socketBucket
+	ReaderWriterLock *socketListLock;
+	// IPSocket.protocol == 0; every packet is dispatched to them
+	IPSocketEngine *rawSocketList;
+	// keyed by IPSocket.protocol, localAddress and localPort; see dispatchQueuedPacket
+	IPSocketEngine *socketBucket[IP_SOCKET_BUCKET_COUNT];
+	uintptr_t nextWorker;
+	uintptr_t workerCount;
+	IPWorker worker[MAX_IP_WORKER_COUNT];
+	Task *mainTask;
+};
+
+static struct IPService ipService;
+
+static uintptr_t hashIPSocketKey(int protocol, IPV4Address localAddress, uint16_t localPort){
+	uint32_t x = localAddress.value ^ (((uint32_t)localPort) << 8) ^ protocol;
+	x ^= (x >> 16);
+	x *= 0x45d9f3b;
+	x ^= (x >> 16);
+	return x % IP_SOCKET_BUCKET_COUNT;
+}
+
+static IPSocketEngine **getIPSocketList(const IPSocket *s){
+	if(s->protocol == 0){
+		return &ipService.rawSocketList;
+	}
+	return &ipService.socketBucket[hashIPSocketKey(s->protocol, s->localAddress, s->localPort)];
+}
+
+// the caller has a reference of qp
+static void pushIPSocketPacket(IPSocketEngine *e, QueuedPacket *qp){
 	QueuedPacket *dropped = NULL;
-	addQueuedPacketRef(p, 1);
-	if(overwriteFIFO(f->fifo, &p, &dropped) == 0){
+	addQueuedPacketRef(qp, 1);
+	acquireLock(&e->lock);
+	if(e->packetCount == IP_SOCKET_PACKET_QUEUE_LENGTH){
+		dropped = e->packets[e->packetHead];
+		e->packetHead = (e->packetHead + 1) % IP_SOCKET_PACKET_QUEUE_LENGTH;
+		e->packetCount--;
+	}
+	e->packets[(e->packetHead + e->packetCount) % IP_SOCKET_PACKET_QUEUE_LENGTH] = qp;
+	e->packetCount++;
+	releaseLock(&e->lock);
+	if(dropped != NULL){
 		addQueuedPacketRef(dropped, -1);
 	}
 }
 
-static QueuedPacket *readIPFIFO(IPFIFO *f){
-	QueuedPacket *r;
-	readFIFO(f->fifo, &r);
-	return r;
+static QueuedPacket *popIPSocketPacket(IPSocketEngine *e){
+	QueuedPacket *qp = NULL;
+	acquireLock(&e->lock);
+	if(e->packetCount != 0){
+		qp = e->packets[e->packetHead];
+		e->packetHead = (e->packetHead + 1) % IP_SOCKET_PACKET_QUEUE_LENGTH;
+		e->packetCount--;
+	}
+	releaseLock(&e->lock);
+	return qp;
 }
 
-static void deleteIPFIFO(IPFIFO *ipf){
-	assert(IS_IN_DQUEUE(ipf) == 0);
-	QueuedPacket *p;
-	while(readFIFONonBlock(ipf->fifo, &p) != 0){
-		addQueuedPacketRef(p, -1);
+// return the packet to the head of queue
+// if the queue is filled by new packets, drop it
+static void unpopIPSocketPacket(IPSocketEngine *e, QueuedPacket *qp){
+	int isDropped = 1;
+	acquireLock(&e->lock);
+	if(e->packetCount != IP_SOCKET_PACKET_QUEUE_LENGTH){
+		e->packetHead = (e->packetHead + IP_SOCKET_PACKET_QUEUE_LENGTH - 1) % IP_SOCKET_PACKET_QUEUE_LENGTH;
+		e->packets[e->packetHead] = qp;
+		e->packetCount++;
+		isDropped = 0;
+	}
+	releaseLock(&e->lock);
+	if(isDropped){
+		addQueuedPacketRef(qp, -1);
 	}
-	deleteFIFO(ipf->fifo);
-	DELETE(ipf);
 }
 
-struct IPService{
-	struct IPFIFOList readFIFOList;
-	Task *mainTask;
-};
-
-static struct IPService ipService;
+static void scheduleIPSocketEngine(IPSocketEngine *e){
+	acquireLock(&e->lock);
+	const int isScheduled = e->isScheduled;
+	e->isScheduled = 1;
+	releaseLock(&e->lock);
+	if(isScheduled){
+		return;
+	}
+	IPWorker *w = e->worker;
+	acquireLock(&w->lock);
+	e->nextReady = NULL;
+	*w->readyTail = e;
+	w->readyTail = &e->nextReady;
+	releaseLock(&w->lock);
+	releaseSemaphore(w->readyCount);
+}
 
-static int openIPSocket(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm);
+static void scheduleIPSocket(IPSocket *ips){
+	scheduleIPSocketEngine(ips->engine);
+}
 
-static void initIP(void){
-	if(initIPFIFOList(&ipService.readFIFOList) == 0){
-		panic("cannot initialize IP FIFO");
+static IPSocketEngine *nextReadyIPSocket(IPWorker *w){
+	acquireLock(&w->lock);
+	IPSocketEngine *e = w->readyHead;
+	if(e != NULL){
+		w->readyHead = e->nextReady;
+		if(w->readyHead == NULL){
+			w->readyTail = &w->readyHead;
+		}
 	}
-	ipService.mainTask = processorLocalTask();
+	releaseLock(&w->lock);
+	if(e != NULL){
+		// events after this are handled in the next round
+		acquireLock(&e->lock);
+		e->isScheduled = 0;
+		releaseLock(&e->lock);
+	}
+	return e;
+}
 
-	FileNameFunctions fnf = INITIAL_FILE_NAME_FUNCTIONS;
-	fnf.open = openIPSocket;
-	if(addFileSystem(&fnf, "ip", strlen("ip")) == 0){
-		panic("cannot create IP service");
+static void deleteIPSocketEngine(IPSocketEngine *e){
+	IPSocket *s = e->socket;
+	assert(e->packetCount == 0 && e->receive.argList == NULL && e->transmit.argList == NULL);
+	DELETE(e);
+	addIPSocketReference(s, -1);
+}
+
+static void stopIPSocketEngine(IPSocketEngine *e){
+	acquireWriterLock(ipService.socketListLock);
+	REMOVE_FROM_DQUEUE(e);
+	releaseReaderWriterLock(ipService.socketListLock);
+	// usually empty because the file is closed after all requests are finished
+	RWFileRequest *rwfr;
+	uint8_t *buffer;
+	uintptr_t size;
+	while(nextRWIPRequest(&e->receive, &rwfr, &buffer, &size)){
+		completeRWFileIO(rwfr, 0, 0);
+	}
+	while(nextRWIPRequest(&e->transmit, &rwfr, &buffer, &size)){
+		completeRWFileIO(rwfr, 0, 0);
+	}
+	QueuedPacket *qp;
+	while((qp = popIPSocketPacket(e)) != NULL){
+		addQueuedPacketRef(qp, -1);
+	}
+	// a device reader may have scheduled the socket before it was removed
+	acquireLock(&e->lock);
+	e->isRemoved = 1;
+	const int isScheduled = e->isScheduled;
+	releaseLock(&e->lock);
+	if(isScheduled == 0){
+		deleteIPSocketEngine(e);
 	}
 }
 
-static void ipDeviceReader(void *voidArg){
-	DataLinkDevice *dev = *(DataLinkDevice**)voidArg;
-	const uintptr_t fileHandle = dev->fileHandle;
-	const uintptr_t mtu = dev->mtu;
-	const struct IPFIFOList *const ipFIFOList = &ipService.readFIFOList;
-	uintptr_t r;
-	IPV4Header *const packet = allocateKernelMemory(mtu);
-	if(packet == NULL){
-		systemCall_terminate();
+static void processIPSocket(IPSocketEngine *e){
+	IPSocket *const s = e->socket;
+	acquireLock(&e->lock);
+	const int isStopping = e->isStopping, isRemoved = e->isRemoved;
+	releaseLock(&e->lock);
+	if(isRemoved){
+		deleteIPSocketEngine(e);
+		return;
+	}
+	if(isStopping){
+		stopIPSocketEngine(e);
+		return;
+	}
+	RWFileRequest *rwfr;
+	uint8_t *buffer;
+	uintptr_t size;
+	while(nextRWIPRequest(&e->transmit, &rwfr, &buffer, &size)){
+		int ok = transmitIP(s, buffer, size);
+		completeRWFileIO(rwfr, (ok? size: 0), 0);
 	}
 	while(1){
-		uintptr_t readSize = mtu;
-		r = syncReadFile(fileHandle, packet, &readSize);
-		if(r == IO_REQUEST_FAILURE){
+		QueuedPacket *qp = popIPSocketPacket(e);
+		if(qp == NULL){
 			break;
 		}
-		if(validateIPV4Packet(packet, readSize) == 0){
-			continue;
+		if(s->receivePacket(s, &e->receive, qp->packet) == 0){
+			// wait for the next read request
+			unpopIPSocketPacket(e, qp);
+			break;
 		}
-		QueuedPacket *qp = createQueuedPacket(packet, dev);
-		if(qp == NULL){
-			printk("warning: insufficient memory for IP buffer\n");
-			continue;
+		addQueuedPacketRef(qp, -1);
+	}
+}
+
+static void ipWorkerTask(void *voidArg){
+	IPWorker *w = *(IPWorker**)voidArg;
+	while(1){
+		acquireAllSemaphore(w->readyCount);
+		IPSocketEngine *e;
+		while((e = nextReadyIPSocket(w)) != NULL){
+			processIPSocket(e);
 		}
-		addQueuedPacketRef(qp, 1);
-		acquireSemaphore(ipFIFOList->semaphore);
-		IPFIFO *ipf;
-		for(ipf = ipFIFOList->head; ipf != NULL; ipf = ipf->next){
-			// IMPROVE: check socket's IP address, device name... here
-			overwriteIPFIFO(ipf, qp);
+	}
+}
+
+static int openIPSocket(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm);
+
+// copy from the memory of the current task
+// return 0 if the name is too long or not mapped
+static int copyUserDeviceName(char *name, const char *userName, uintptr_t nameLength){
+	EXPECT(nameLength != 0 && nameLength <= MAX_FILE_ENUM_NAME_LENGTH &&
+		(uintptr_t)userName + nameLength > (uintptr_t)userName);
+	const uintptr_t pageBegin = FLOOR((uintptr_t)userName, PAGE_SIZE);
+	const uintptr_t pageSize = CEIL((uintptr_t)userName + nameLength, PAGE_SIZE) - pageBegin;
+	const char *mappedPage = checkAndMapExistingPages(kernelLinear, getTaskLinearMemory(processorLocalTask()),
+		pageBegin, pageSize, KERNEL_PAGE, 0);
+	EXPECT(mappedPage != NULL);
+	memcpy(name, mappedPage + ((uintptr_t)userName - pageBegin), nameLength);
+	unmapPages(kernelLinear, (void*)mappedPage);
+	return 1;
+	ON_ERROR;
+	ON_ERROR;
+	return 0;
+}
+
+static void addRouteHandler(InterruptParam *p){
+	const IPV4Address subnet = (IPV4Address)(uint32_t)SYSTEM_CALL_ARGUMENT_0(p);
+	const uintptr_t prefixLength = SYSTEM_CALL_ARGUMENT_1(p);
+	const IPV4Address gateway = (IPV4Address)(uint32_t)SYSTEM_CALL_ARGUMENT_2(p);
+	const char *userDeviceName = (const char*)SYSTEM_CALL_ARGUMENT_3(p);
+	const uintptr_t nameLength = SYSTEM_CALL_ARGUMENT_4(p);
+	char deviceName[MAX_FILE_ENUM_NAME_LENGTH];
+	int ok = 0;
+	if(copyUserDeviceName(deviceName, userDeviceName, nameLength)){
+		DataLinkDevice *d = searchDeviceByName(&dataLinkDevList, deviceName, nameLength);
+		if(d != NULL){
+			ok = addStaticRoute(subnet, prefixLength, gateway, d);
 		}
-		releaseSemaphore(ipFIFOList->semaphore);
-		addQueuedPacketRef(qp, -1);
 	}
-	releaseKernelMemory(packet);
-	systemCall_terminate();
+	SYSTEM_CALL_RETURN_VALUE_0(p) = ok;
+}
+
+int systemCall_addRoute(IPV4Address subnet, uintptr_t prefixLength, IPV4Address gateway,
+	const char *deviceName, uintptr_t nameLength){
+	return (int)systemCall6(SYSCALL_ADD_ROUTE, subnet.value, prefixLength, gateway.value,
+		(uintptr_t)deviceName, nameLength);
+}
+
+static void initIP(void){
+	ipService.socketListLock = createReaderWriterLock(1);
+	if(ipService.socketListLock == NULL){
+		panic("cannot initialize IP socket list");
+	}
+	ipService.rawSocketList = NULL;
+	uintptr_t i;
+	for(i = 0; i < IP_SOCKET_BUCKET_COUNT; i++){
+		ipService.socketBucket[i] = NULL;
+	}
+	ipService.mainTask = processorLocalTask();
+	// one worker pinned to each processor
+	ipService.nextWorker = 0;
+	ipService.workerCount = MIN((uintptr_t)processorLocalPIC()->numberOfProcessors, MAX_IP_WORKER_COUNT);
+	if(ipService.workerCount == 0){
+		ipService.workerCount = 1;
+	}
+	for(i = 0; i < ipService.workerCount; i++){
+		IPWorker *w = &ipService.worker[i];
+		w->readyCount = createSemaphore(0);
+		w->lock = initialSpinlock;
+		w->readyHead = NULL;
+		w->readyTail = &w->readyHead;
+		// share the device files with internetService
+		Task *t = createSharedMemoryTask(ipWorkerTask, &w, sizeof(w), ipService.mainTask);
+		if(w->readyCount == NULL || t == NULL){
+			panic("cannot create IP worker");
+		}
+		setTaskAffinity(t, PROCESSOR_BIT(i));
+		resume(t);
+	}
+	initIPReassembly();
+	registerSystemCall(global.syscallTable, SYSCALL_ADD_ROUTE, addRouteHandler, 0);
+
+	FileNameFunctions fnf = INITIAL_FILE_NAME_FUNCTIONS;
+	fnf.open = openIPSocket;
+	if(addFileSystem(&fnf, "ip", strlen("ip")) == 0){
+		panic("cannot create IP service");
+	}
 }
 
 static int matchSocketBindingDevice(const IPSocket *s, const DataLinkDevice *d){
@@ -685,86 +1279,197 @@ static int filterQueuedPacket(IPSocket *s, QueuedPacket *qp){
 	if(isIPV4PacketAcceptable(s, qp->packet, qp->isBoradcast) == 0){
 		return 0;
 	}
-	if(s->filterPacket(s, qp->packet, getIPPacketSize(qp->packet)) == 0){
+	if(s->filterPacket(s, qp->packet, getIPPacketSize(qp->packet), qp->checksumVerified) == 0){
 		return 0;
 	}
 	return 1;
 }
 
-static int receiveIP(IPSocket *ips, RWIPQueue *rece, QueuedPacket *qp){
-	if(filterQueuedPacket(ips, qp)){
-		return ips->receivePacket(ips, rece, qp->packet);
+// return 0 if the packet is not TCP or UDP
+static int getIPDestinationPort(const IPV4Header *h, int *protocol, uint16_t *port){
+	if(h->protocol != IP_DATA_PROTOCOL_TCP && h->protocol != IP_DATA_PROTOCOL_UDP){
+		return 0;
+	}
+	// the destination port follows the source port in both headers
+	if(getIPHeaderSize(h) + 2 * sizeof(uint16_t) > getIPPacketSize(h)){
+		return 0;
 	}
+	uint16_t p;
+	memcpy(&p, ((const uint8_t*)getIPData(h)) + sizeof(uint16_t), sizeof(p));
+	*protocol = h->protocol;
+	*port = changeEndian16(p);
 	return 1;
 }
 
-static void receiveIPTask(void *voidArg){
-	RWIPQueue *rece = *(RWIPQueue**)voidArg;
-	IPSocket *ips = rece->socket;
-	IPFIFO *const ipFIFO = createIPFIFO(64);
-	struct IPFIFOList *const ipFIFOList = &ipService.readFIFOList;
-	EXPECT(ipFIFO != NULL);
-	addToIPFIFOList(ipFIFOList, ipFIFO);
-	while(1){
-		// wait for a valid IPv4 packet
-		QueuedPacket *qp = readIPFIFO(ipFIFO);
-		int continueFlag = receiveIP(ips, rece, qp);
-		addQueuedPacketRef(qp, -1);
-		if(continueFlag == 0){
-			break;
+// if protocol != 0, skip the sockets of other keys in the bucket
+static void dispatchToIPSocketList(IPSocketEngine *list, QueuedPacket *qp, int protocol, IPV4Address address, uint16_t port){
+	IPSocketEngine *e;
+	for(e = list; e != NULL; e = e->next){
+		const IPSocket *s = e->socket;
+		if(protocol != 0 &&
+		(s->protocol != protocol || s->localPort != port || s->localAddress.value != address.value)){
+			continue;
+		}
+		if(filterQueuedPacket(e->socket, qp)){
+			pushIPSocketPacket(e, qp);
+			scheduleIPSocketEngine(e);
 		}
 	}
-	removeFromIPFIFOList(ipFIFOList, ipFIFO);
-	deleteIPFIFO(ipFIFO);
-	deleteRWIPQueue(rece);
-	systemCall_terminate();
-	// no return
-	// 	deleteIPFIFO(ipFIFO);
-	ON_ERROR;
+}
+
+static void dispatchToIPSocketKey(QueuedPacket *qp, int protocol, IPV4Address address, uint16_t port){
+	dispatchToIPSocketList(ipService.socketBucket[hashIPSocketKey(protocol, address, port)], qp, protocol, address, port);
+}
+
+// push the packet to every socket that accepts it
+// TCP and UDP packets are matched with the sockets bound to the destination address and ANY_IPV4_ADDRESS
+// broadcast packets are also matched with the sockets bound to the address of the receiving device
+static void dispatchQueuedPacket(QueuedPacket *qp){
+	const IPV4Header *h = qp->packet;
+	addQueuedPacketRef(qp, 1);
+	acquireReaderLock(ipService.socketListLock);
+	dispatchToIPSocketList(ipService.rawSocketList, qp, 0, ANY_IPV4_ADDRESS, 0);
+	int protocol;
+	uint16_t port;
+	if(getIPDestinationPort(h, &protocol, &port)){
+		const IPV4Address dst = h->destination;
+		dispatchToIPSocketKey(qp, protocol, ANY_IPV4_ADDRESS, port);
+		if(dst.value != ANY_IPV4_ADDRESS.value){
+			dispatchToIPSocketKey(qp, protocol, dst, port);
+		}
+		if(qp->isBoradcast){
+			DataLinkDevice *d = qp->fromDevice;
+			acquireLock(&d->ipConfigLock);
+			const IPV4Address deviceAddress = d->ipConfig.localAddress;
+			releaseLock(&d->ipConfigLock);
+			if(deviceAddress.value != ANY_IPV4_ADDRESS.value && deviceAddress.value != dst.value){
+				dispatchToIPSocketKey(qp, protocol, deviceAddress, port);
+			}
+		}
+	}
+	releaseReaderWriterLock(ipService.socketListLock);
+	addQueuedPacketRef(qp, -1);
+}
+
+// the transmitted buffer is queued to the sockets without copying or verifying the checksums
+// the packet is released
+static int deliverLoopbackPacket(DataLinkDevice *d, PacketBuffer *packet){
+	const int checksumVerified = (CHECKSUM_OFFLOAD_IPV4_HEADER | CHECKSUM_OFFLOAD_IPV4_DATA);
+	IPV4Header *h = getPacketData(packet);
+	QueuedPacket *qp;
+	if(isIPFragment(h)){
+		IPV4Header *reassembled = reassembleIPPacket(h);
+		releasePacketBuffer(packet);
+		if(reassembled == NULL){
+			// wait for the other fragments
+			return 1;
+		}
+		qp = createQueuedPacket(reassembled, d, checksumVerified, 1);
+		if(qp == NULL){
+			releaseKernelMemory(reassembled);
+			return 0;
+		}
+	}
+	else{
+		qp = createQueuedPacket(h, d, checksumVerified, 1);
+		if(qp == NULL){
+			releasePacketBuffer(packet);
+			return 0;
+		}
+		qp->buffer = packet;
+	}
+	dispatchQueuedPacket(qp);
+	return 1;
+}
+
+static void ipDeviceReader(void *voidArg){
+	const IPDeviceReaderArgument *arg = voidArg;
+	DataLinkDevice *dev = arg->device;
+	const uintptr_t fileHandle = arg->fileHandle;
+	const uintptr_t mtu = dev->mtu;
+	// see CHECKSUM_OFFLOAD_STATUS_SIZE
+	const uintptr_t statusSize = (dev->checksumOffload? CHECKSUM_OFFLOAD_STATUS_SIZE: 0);
+	uintptr_t r;
+	uint8_t *const readBuffer = allocateKernelMemory(statusSize + mtu);
+	if(readBuffer == NULL){
+		systemCall_terminate();
+	}
+	IPV4Header *const packet = (IPV4Header*)(readBuffer + statusSize);
 	while(1){
-		RWFileRequest *rwfr;
-		uint8_t *buffer;
-		uintptr_t size;
-		if(nextRWIPRequest(rece, &rwfr, &buffer, &size) == 0){
+		uintptr_t readSize = statusSize + mtu;
+		r = syncReadFile(fileHandle, readBuffer, &readSize);
+		if(r == IO_REQUEST_FAILURE){
 			break;
 		}
-		completeRWFileIO(rwfr, 0, 0);
+		if(readSize < statusSize){
+			continue;
+		}
+		uint32_t checksumVerified = 0;
+		memcpy(&checksumVerified, readBuffer, statusSize);
+		readSize -= statusSize;
+		if(validateIPV4Packet(packet, readSize, checksumVerified) == 0){
+			continue;
+		}
+		IPV4Header *reassembled = NULL;
+		if(isIPFragment(packet)){
+			reassembled = reassembleIPPacket(packet);
+			if(reassembled == NULL){
+				continue;
+			}
+			// the device verifies the TCP/UDP checksum of each fragment only
+			checksumVerified &= ~CHECKSUM_OFFLOAD_IPV4_DATA;
+		}
+		QueuedPacket *qp = (reassembled == NULL?
+			createQueuedPacket(packet, dev, checksumVerified, 0):
+			createQueuedPacket(reassembled, dev, checksumVerified, 1));
+		if(qp == NULL){
+			printk("warning: insufficient memory for IP buffer\n");
+			if(reassembled != NULL){
+				releaseKernelMemory(reassembled);
+			}
+			continue;
+		}
+		dispatchQueuedPacket(qp);
 	}
-	deleteRWIPQueue(rece);
+	releaseKernelMemory(readBuffer);
 	systemCall_terminate();
 }
 
 void initIPSocket(
 	IPSocket *s, void *inst,
-	CreatePacket *c, FilterPacket *f, ReceivePacket *r, DeletePacket *d, DeleteSocket *ds
+	CreatePacket *c, FilterPacket *f, ReceivePacket *r, DeleteSocket *ds
 ){
 	s->instance = inst;
 	s->localAddress = ANY_IPV4_ADDRESS;
 	s->localPort = 0;
 	s->remoteAddress = ANY_IPV4_ADDRESS;
 	s->remotePort = 0;
+	s->protocol = 0;
 	s->bindToDevice = 0;
 	memset(s->deviceName, 0, sizeof(s->deviceName));
 	s->deviceNameLength = 0;
+	s->groupCount = 0;
+	s->routeDestination = ANY_IPV4_ADDRESS;
+	s->route.device = NULL;
 	s->createPacket = c;
 	s->filterPacket = f;
 	s->receivePacket = r;
-	s->deletePacket = d;
 	s->deleteSocket = ds;
 	initReferenceCount(&s->referenceCount, 1);
+	s->engine = NULL;
 	s->receive = NULL;
 	s->transmit = NULL;
 }
 
 static IPSocket *createIPSocket(
 	void *inst,
-	CreatePacket *c, FilterPacket *f, ReceivePacket *r, DeletePacket *d, DeleteSocket *ds
+	CreatePacket *c, FilterPacket *f, ReceivePacket *r, DeleteSocket *ds
 ){
 	IPSocket *NEW(s);
 	if(s == NULL){
 		return NULL;
 	}
-	initIPSocket(s, inst, c, f, r, d, ds);
+	initIPSocket(s, inst, c, f, r, ds);
 	return s;
 }
 
@@ -772,17 +1477,34 @@ static void deleteIPSocket(IPSocket *s){
 	DELETE(s);
 }
 
+void rehashIPSocket(IPSocket *s){
+	IPSocketEngine *e = s->engine;
+	if(e == NULL){
+		return;
+	}
+	acquireWriterLock(ipService.socketListLock);
+	// removed by stopIPSocketEngine
+	if(IS_IN_DQUEUE(e)){
+		REMOVE_FROM_DQUEUE(e);
+		ADD_TO_DQUEUE(e, getIPSocketList(s));
+	}
+	releaseReaderWriterLock(ipService.socketListLock);
+}
+
 void setIPSocketLocalAddress(IPSocket *s, IPV4Address a){
 	s->localAddress = a;
+	rehashIPSocket(s);
 }
 
 void setIPSocketRemoteAddress(IPSocket *s, IPV4Address a){
 	s->remoteAddress = a;
 }
-/*
 void setIPSocketBindingDevice(IPSocket *s, const char *deviceName, uintptr_t nameLength){
+	assert(nameLength <= LENGTH_OF(s->deviceName));
+	s->bindToDevice = 1;
+	s->deviceNameLength = nameLength;
+	memcpy(s->deviceName, deviceName, nameLength * sizeof(deviceName[0]));
 }
-*/
 static void addIPSocketReference(IPSocket *ips, int v){
 	if(addReference(&ips->referenceCount, v) == 0){
 		ips->deleteSocket(ips);
@@ -790,26 +1512,48 @@ static void addIPSocketReference(IPSocket *ips, int v){
 }
 
 int startIPSocketTasks(IPSocket *socket){
-	assert(socket->transmit == NULL && socket->receive == NULL);
-	socket->receive = createRWIPQueue(receiveIPTask, socket, ipService.mainTask);
-	EXPECT(socket->receive != NULL);
-	socket->transmit = createRWIPQueue(transmitIPTask, socket, ipService.mainTask);
-	EXPECT(socket->transmit != NULL);
+	assert(socket->engine == NULL);
+	IPSocketEngine *NEW(e);
+	EXPECT(e != NULL);
+	e->socket = socket;
+	e->lock = initialSpinlock;
+	e->isScheduled = 0;
+	e->isStopping = 0;
+	e->isRemoved = 0;
+	e->nextReady = NULL;
+	e->packetHead = 0;
+	e->packetCount = 0;
+	initRWIPQueue(&e->receive, socket);
+	initRWIPQueue(&e->transmit, socket);
+	e->prev = NULL;
+	e->next = NULL;
+	socket->engine = e;
+	socket->receive = &e->receive;
+	socket->transmit = &e->transmit;
+	// released in deleteIPSocketEngine
+	addIPSocketReference(socket, 1);
+	acquireWriterLock(ipService.socketListLock);
+	e->worker = &ipService.worker[ipService.nextWorker];
+	ipService.nextWorker = (ipService.nextWorker + 1) % ipService.workerCount;
+	ADD_TO_DQUEUE(e, getIPSocketList(socket));
+	releaseReaderWriterLock(ipService.socketListLock);
 	return 1;
-	//setIPTaskTerminateFlag(socket->transmit);
-	//socket->transmit = NULL;
-	ON_ERROR;
-	setIPTaskTerminateFlag(socket->receive);
-	socket->receive = NULL;
 	ON_ERROR;
 	return 0;
 }
 
 void stopIPSocketTasks(IPSocket *socket){
-	if(socket->receive != NULL)
-		setIPTaskTerminateFlag(socket->receive);
-	if(socket->transmit != NULL)
-		setIPTaskTerminateFlag(socket->transmit);
+	while(socket->groupCount != 0){
+		leaveIPSocketGroup(socket, socket->group[0]);
+	}
+	IPSocketEngine *e = socket->engine;
+	if(e != NULL){
+		acquireLock(&e->lock);
+		assert(e->isStopping == 0);
+		e->isStopping = 1;
+		releaseLock(&e->lock);
+		scheduleIPSocketEngine(e);
+	}
 	addIPSocketReference(socket, -1);
 }
 
@@ -819,22 +1563,23 @@ static void closeIPSocket(CloseFileRequest *cfr, OpenedFile *of){
 	completeCloseFile(cfr);
 }
 
-static IPV4Header *createIPV4Packet(
-	__attribute__((__unused__)) IPSocket *ips, IPV4Address src, IPV4Address dst,
-	const uint8_t *buffer, uintptr_t dataSize
+static int createIPV4Packet(
+	__attribute__((__unused__)) IPSocket *ips, PacketBuffer *packet, IPV4Address src, IPV4Address dst,
+	const uint8_t *buffer, uintptr_t dataSize, int checksumOffload
 ){
-	IPV4Header *h = createIPV4Header(dataSize, src, dst);
-	if(h == NULL){
-		return NULL;
+	uint8_t *data = appendPacketBuffer(packet, dataSize);
+	if(data == NULL){
+		return 0;
 	}
-	memcpy(((uint8_t*)h) + sizeof(*h), buffer, dataSize);
-	return h;
+	memcpy(data, buffer, dataSize);
+	return (prependIPV4Header(packet, src, dst, IP_DATA_PROTOCOL_TEST254, checksumOffload) != NULL);
 }
 
 static int filterIPV4Packet(
 	__attribute__((__unused__)) IPSocket *ipSocket,
 	__attribute__((__unused__)) const IPV4Header *packet,
-	__attribute__((__unused__)) uintptr_t packetSize
+	__attribute__((__unused__)) uintptr_t packetSize,
+	__attribute__((__unused__)) int checksumVerified
 ){
 	//see filterQueuedPacket
 	return 1;
@@ -857,10 +1602,6 @@ static int receiveIPV4Packet(__attribute__((__unused__)) IPSocket *ips, RWIPQueu
 	return 1;
 }
 
-static void deleteIPV4Packet(IPV4Header *h){
-	releaseKernelMemory(h);
-}
-
 static int scanPort(const char *name, uintptr_t nameLength, uint16_t *port, unsigned *scanLength){
 	unsigned p;
 	int scanCount = snscanf(name, nameLength, "%u%n", &p, scanLength);
@@ -1003,7 +1744,7 @@ int scanIPSocketArguments(IPSocket *s, const char *fileName, uintptr_t nameLengt
 }
 
 static int openIPSocket(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm){
-	IPSocket *socket = createIPSocket(NULL, createIPV4Packet, filterIPV4Packet, receiveIPV4Packet, deleteIPV4Packet, deleteIPSocket);
+	IPSocket *socket = createIPSocket(NULL, createIPV4Packet, filterIPV4Packet, receiveIPV4Packet, deleteIPSocket);
 	EXPECT(socket != NULL);
 	int ok = scanIPSocketArguments(socket, fileName, nameLength);
 	EXPECT(ok && ofm.writable);
@@ -1029,6 +1770,13 @@ void internetService(void){
 	initIP();
 	initUDP();
 	initTCP();
+	DataLinkDevice *lo = createLoopbackDevice();
+	if(lo == NULL){
+		printk("cannot create loopback device\n");
+	}
+	else{
+		addDataLinkDevice(&dataLinkDevList, lo);
+	}
 	uintptr_t enumDataLink = syncEnumerateFile(resourceTypeToFileName(RESOURCE_DATA_LINK_DEVICE));
 	while(1){
 		FileEnumeration fe;
@@ -1149,6 +1897,88 @@ void testIPFileName(void){
 	printk("test IP file name OK\n");
 }
 
+// the previous implementation, which swaps every 16-bit word
+static uint16_t referenceIPDataChecksum(const IPV4Header *h){
+	uint32_t cs = 0;
+	cs += changeEndian16(h->source.value & 0xffff);
+	cs += changeEndian16(h->source.value >> 16);
+	cs += changeEndian16(h->destination.value & 0xffff);
+	cs += changeEndian16(h->destination.value >> 16);
+	cs += h->protocol;
+	cs += getIPDataSize(h);
+	const uint16_t *data = getIPData(h);
+	const uintptr_t dataSize = getIPDataSize(h);
+	uintptr_t i;
+	for(i = 0; (i + 1) * sizeof(uint16_t) <= dataSize; i++){
+		cs += (uint32_t)changeEndian16((data)[i]);
+	}
+	if(dataSize % sizeof(uint16_t) != 0){
+		uint16_t lastByte = (uint16_t)(((const uint8_t*)data)[dataSize - 1]);
+		cs += (uint32_t)changeEndian16(lastByte);
+	}
+	while(cs > 0xffff){
+		cs = (cs & 0xffff) + (cs >> 16);
+	}
+	return changeEndian16(cs ^ 0xffff);
+}
+
+void testIPChecksum(void);
+void testIPChecksum(void){
+	const uintptr_t maxDataSize = 1500, maxAlign = 4;
+	uint8_t *buffer = allocateKernelMemory(sizeof(IPV4Header) + maxDataSize + maxAlign);
+	assert(buffer != NULL);
+	uint32_t random = 12345;
+	uintptr_t i;
+	for(i = 0; i < sizeof(IPV4Header) + maxDataSize + maxAlign; i++){
+		random = random * 1103515245 + 12345;
+		buffer[i] = (random >> 16) & 0xff;
+	}
+	IPV4Address src = {bytes: {192, 168, 0, 1}}, dst = {bytes: {10, 0, 255, 254}};
+	// correctness of all sizes and alignments
+	uintptr_t align, dataSize;
+	for(align = 0; align < maxAlign; align++){
+		for(dataSize = 0; dataSize <= maxDataSize; dataSize++){
+			IPV4Header *h = (IPV4Header*)(buffer + align);
+			initIPV4Header(h, dataSize, src, dst, IP_DATA_PROTOCOL_UDP);
+			assert(calculateIPDataChecksum(h) == referenceIPDataChecksum(h));
+		}
+	}
+	// incremental update
+	IPV4Header *h = (IPV4Header*)buffer;
+	initIPV4Header(h, 100, src, dst, IP_DATA_PROTOCOL_UDP);
+	for(i = 0; i < 1000; i++){
+		random = random * 1103515245 + 12345;
+		uint16_t oldTTL = ((uint16_t*)h)[4];
+		h->timeToLive = random >> 24;
+		h->headerChecksum = updateChecksum16(h->headerChecksum, oldTTL, ((uint16_t*)h)[4]);
+		assert(calculateIPHeaderChecksum(h) == 0);
+		IPV4Address oldDst = h->destination;
+		h->destination.value = random;
+		h->headerChecksum = updateChecksum32(h->headerChecksum, oldDst.value, h->destination.value);
+		assert(calculateIPHeaderChecksum(h) == 0);
+	}
+	// throughput
+	const int rounds = 1000;
+	initIPV4Header(h, maxDataSize, src, dst, IP_DATA_PROTOCOL_UDP);
+	uint16_t cs1 = 0, cs2 = 0;
+	int r;
+	uint64_t t0 = rdtsc();
+	for(r = 0; r < rounds; r++){
+		cs1 += referenceIPDataChecksum(h);
+	}
+	uint64_t t1 = rdtsc();
+	for(r = 0; r < rounds; r++){
+		cs2 += calculateIPDataChecksum(h);
+	}
+	uint64_t t2 = rdtsc();
+	assert(cs1 == cs2);
+	printk("checksum of %u bytes: old %u cycles, new %u cycles\n", maxDataSize,
+		(uint32_t)((t1 - t0) / rounds), (uint32_t)((t2 - t1) / rounds));
+	releaseKernelMemory(buffer);
+	printk("test IP checksum ok\n");
+	systemCall_terminate();
+}
+
 void testCancelRWIP(void);
 void testCancelRWIP(void){
 	sleep(2000);
@@ -1177,4 +2007,64 @@ void testCancelRWIP(void){
 	systemCall_terminate();
 }
 
+#define TEST_LOOPBACK_SIZE (32768)
+static volatile uintptr_t testLoopbackPacketSize;
+static volatile int testLoopbackFlags;
+
+// record the large UDP packet without queuing it
+static int filterTestLoopbackPacket(
+	__attribute__((__unused__)) IPSocket *ips, const IPV4Header *packet, uintptr_t packetSize,
+	__attribute__((__unused__)) int checksumVerified
+){
+	if(packet->protocol == IP_DATA_PROTOCOL_UDP && packetSize > TEST_LOOPBACK_SIZE){
+		testLoopbackFlags = packet->flags;
+		testLoopbackPacketSize = packetSize;
+	}
+	return 0;
+}
+
+void testLoopbackFragment(void);
+void testLoopbackFragment(void){
+	int ok = waitForFirstResource("udp", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	// wait for the loopback device
+	sleep(1000);
+	IPSocket *s = createIPSocket(NULL, createIPV4Packet, filterTestLoopbackPacket, receiveIPV4Packet, deleteIPSocket);
+	assert(s != NULL);
+	setIPSocketBindingDevice(s, LOOPBACK_DEVICE_NAME, strlen(LOOPBACK_DEVICE_NAME));
+	ok = startIPSocketTasks(s);
+	assert(ok);
+	testLoopbackPacketSize = 0;
+	const char *fileName = "udp:127.0.0.1:60002;src=127.0.0.1:60002";
+	uintptr_t f = syncOpenFileN(fileName, strlen(fileName), OPEN_FILE_MODE_WRITABLE);
+	assert(f != IO_REQUEST_FAILURE);
+	uint8_t *buffer = allocateKernelMemory(TEST_LOOPBACK_SIZE * 2);
+	assert(buffer != NULL);
+	uintptr_t i;
+	for(i = 0; i < TEST_LOOPBACK_SIZE; i++){
+		buffer[i] = i % 251;
+	}
+	uintptr_t rwSize = TEST_LOOPBACK_SIZE;
+	uintptr_t r = syncWriteFile(f, buffer, &rwSize);
+	assert(r != IO_REQUEST_FAILURE && rwSize == TEST_LOOPBACK_SIZE);
+	rwSize = TEST_LOOPBACK_SIZE;
+	r = syncReadFile(f, buffer + TEST_LOOPBACK_SIZE, &rwSize);
+	assert(r != IO_REQUEST_FAILURE && rwSize == TEST_LOOPBACK_SIZE);
+	for(i = 0; i < TEST_LOOPBACK_SIZE; i++){
+		assert(buffer[TEST_LOOPBACK_SIZE + i] == buffer[i]);
+	}
+	// the UDP socket may read the packet before s filters it
+	for(i = 0; i < 100 && testLoopbackPacketSize == 0; i++){
+		sleep(10);
+	}
+	// fragmentIPPacket clears IP_FLAG_DONT_FRAGMENT, and so does reassembly
+	assert(testLoopbackPacketSize != 0 && (testLoopbackFlags & IP_FLAG_DONT_FRAGMENT));
+	r = syncCloseFile(f);
+	assert(r != IO_REQUEST_FAILURE);
+	stopIPSocketTasks(s);
+	releaseKernelMemory(buffer);
+	printk("test loopback without fragmentation ok\n");
+	systemCall_terminate();
+}
+
 #endif
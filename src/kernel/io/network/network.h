@@ -1,6 +1,7 @@
 #include"std.h"
 #include"file/file.h"
 #include"memory/referencecount.h"
+#include"ethernet.h"
 
 typedef union{
 	uint32_t value;
@@ -11,12 +12,33 @@ typedef union{
 
 enum IPDataProtocol{
 	IP_DATA_PROTOCOL_ICMP = 1,
+	IP_DATA_PROTOCOL_IGMP = 2,
 	IP_DATA_PROTOCOL_TCP = 6,
 	IP_DATA_PROTOCOL_UDP = 17,
 	IP_DATA_PROTOCOL_TEST253 = 253,
 	IP_DATA_PROTOCOL_TEST254 = 254
 };
 
+// offset of the checksum in TCP/UDP header
+#define TCP_CHECKSUM_OFFSET (16)
+#define UDP_CHECKSUM_OFFSET (6)
+// see TCPHeader in tcp.c
+#define TCP_SEQUENCE_OFFSET (4)
+// the high 4 bits are the header size in 4 bytes
+#define TCP_DATA_OFFSET_OFFSET (12)
+#define TCP_FLAGS_OFFSET (13)
+#define GET_TCP_HEADER_SIZE(H) ((((const uint8_t*)(H))[TCP_DATA_OFFSET_OFFSET] >> 4) * 4)
+enum TCPFlag{
+	TCP_FLAG_FIN = (1 << 0),
+	TCP_FLAG_PSH = (1 << 3)
+};
+
+// IPV4Header.flags
+enum IPFlag{
+	IP_FLAG_MORE_FRAGMENTS = 1,
+	IP_FLAG_DONT_FRAGMENT = 2
+};
+
 // big endian and most significant bit comes first
 typedef struct{
 	uint8_t headerLength: 4;
@@ -42,6 +64,9 @@ example
 2e 6e c0 a8 38 01 c0 a8 38 ff
 */
 #define MAX_IP_PACKET_SIZE ((1 << 16) - 1)
+#define MAX_IP_HEADER_SIZE (60)
+// TCP header with options
+#define MAX_TRANSPORT_HEADER_SIZE (60)
 
 // does not check dataLength
 void initIPV4Header(
@@ -52,53 +77,148 @@ uintptr_t getIPHeaderSize(const IPV4Header *h);
 uintptr_t getIPDataSize(const IPV4Header *h);
 void *getIPData(const IPV4Header *h);
 
+// one's complement sum of data; the result of addChecksum is folded by foldChecksum
+// the folded sum is big endian if data is big endian
+uint64_t addChecksum(uint64_t sum, const void *data, uintptr_t size);
+uint16_t foldChecksum(uint64_t sum);
 uint16_t calculateIPDataChecksum(const IPV4Header *h);
+// the initial value of TCP/UDP checksum for CHECKSUM_OFFLOAD_IPV4_DATA
+uint16_t calculatePseudoIPHeaderSum(const IPV4Header *h);
+// update the checksum after a 16-bit or 32-bit field is rewritten
+// all arguments and return values are big endian
+uint16_t updateChecksum16(uint16_t checksum, uint16_t oldValue, uint16_t newValue);
+uint16_t updateChecksum32(uint16_t checksum, uint32_t oldValue, uint32_t newValue);
+
+// fragment.c
+// in bytes
+uintptr_t getIPFragmentOffset(const IPV4Header *h);
+int isIPFragment(const IPV4Header *h);
+// clear IP_FLAG_DONT_FRAGMENT; does not update the checksum
+void setIPFragmentOffset(IPV4Header *h, uintptr_t offset, int moreFragments);
+// big endian
+uint16_t nextIPIdentification(void);
+void initIPReassembly(void);
+// return the reassembled packet if all fragments of the datagram are received
+// the caller releases it with releaseKernelMemory
+IPV4Header *reassembleIPPacket(const IPV4Header *fragment);
+
+// packetbuffer.c
+// PACKET_HEADROOM bytes before the data are reserved for the headers,
+// so that every layer prepends its header in place
+#define PACKET_HEADROOM (DESTINATION_PREFIX_SIZE + MAX_IP_HEADER_SIZE + MAX_TRANSPORT_HEADER_SIZE)
+
+typedef struct PacketPool PacketPool;
+typedef struct PacketBuffer{
+	PacketPool *pool;
+	uintptr_t capacity;
+	// the packet is buffer[begin, end)
+	uintptr_t begin, end;
+	struct PacketBuffer *next;
+	uint8_t buffer[];
+}PacketBuffer;
+
+// every buffer can hold PACKET_HEADROOM + dataSize bytes
+PacketPool *createPacketPool(uintptr_t dataSize, uintptr_t maxCount);
+// all buffers of the pool have been released
+void deletePacketPool(PacketPool *p);
+// return NULL if maxCount buffers are in use
+PacketBuffer *allocatePacketBuffer(PacketPool *p);
+// not in a pool; for the packets larger than the pool buffers
+PacketBuffer *createPacketBuffer(uintptr_t dataSize);
+void releasePacketBuffer(PacketBuffer *b);
+// return NULL if the buffer has no room
+void *prependPacketBuffer(PacketBuffer *b, uintptr_t size);
+void *appendPacketBuffer(PacketBuffer *b, uintptr_t size);
+void *getPacketData(const PacketBuffer *b);
+uintptr_t getPacketSize(const PacketBuffer *b);
+
+// prepend the header with the size of b as dataLength
+// return NULL if the buffer has no room or the packet is too large
+IPV4Header *prependIPV4Header(PacketBuffer *b, IPV4Address srcAddress, IPV4Address dstAddress,
+	enum IPDataProtocol dataProtocol, int checksumOffload);
 
 typedef struct IPSocket IPSocket;
 typedef struct RWIPQueue RWIPQueue;
 
-typedef IPV4Header *CreatePacket(
-	IPSocket *ipSocket, IPV4Address src, IPV4Address dst,
-	const uint8_t *buffer, uintptr_t bufferLength
+// see route.c
+struct DataLinkDevice;
+typedef struct{
+	struct DataLinkDevice *device;
+	// ANY_IPV4_ADDRESS if the destination is on-link
+	IPV4Address gateway;
+	// the version of routing table when the route was searched
+	uint32_t version;
+}Route;
+
+// checksumOffload and checksumVerified are enum ChecksumOffload
+// append buffer to the empty packet and prepend the IP header and the upper layer header
+// return 0 if the packet has no room
+typedef int CreatePacket(
+	IPSocket *ipSocket, PacketBuffer *packet, IPV4Address src, IPV4Address dst,
+	const uint8_t *buffer, uintptr_t bufferLength, int checksumOffload
 );
-typedef int FilterPacket(IPSocket *ipSocket, const IPV4Header *packet, uintptr_t packetSize);
-// return 0 the socket is closed and has no more read request
+typedef int FilterPacket(IPSocket *ipSocket, const IPV4Header *packet, uintptr_t packetSize, int checksumVerified);
+// called by the socket worker; must not block
+// return 0 if the packet waits for the next read request; see nextRWIPRequest
 typedef int ReceivePacket(IPSocket *ipSocket, RWIPQueue *receiveQueue, const IPV4Header *packet);
-typedef void DeletePacket(/*IPSocket *ipSocket, */IPV4Header *packet);
 typedef void DeleteSocket(IPSocket *ipSocket);
 
-// one receive queue & task for every socket
+#define MAX_IP_SOCKET_GROUP_COUNT (8)
+
+// sockets are processed by a few IP worker tasks; see startIPSocketTasks
 struct IPSocket{
 	void *instance;
 	IPV4Address localAddress;
 	uint16_t localPort;
 	IPV4Address remoteAddress;
 	uint16_t remotePort;
+	// IP_DATA_PROTOCOL_TCP or IP_DATA_PROTOCOL_UDP if the socket receives only the packets to localPort
+	// 0 if the socket filters all packets
+	int protocol;
 	int bindToDevice;
 	char deviceName[MAX_FILE_ENUM_NAME_LENGTH];
 	uintptr_t deviceNameLength;
+	// route to remoteAddress; see transmitIP
+	IPV4Address routeDestination;
+	Route route;
 
 	CreatePacket *createPacket;
 	FilterPacket *filterPacket;
 	ReceivePacket *receivePacket;
-	DeletePacket *deletePacket;
 	DeleteSocket *deleteSocket;
 
+	// see FILE_PARAM_JOIN_IP_GROUP; the groups are left in stopIPSocketTasks
+	uintptr_t groupCount;
+	IPV4Address group[MAX_IP_SOCKET_GROUP_COUNT];
+	struct IGMPClient *groupClient[MAX_IP_SOCKET_GROUP_COUNT];
+
 	ReferenceCount referenceCount;
+	struct IPSocketEngine *engine;
 	struct RWIPQueue *receive, *transmit;
 };
 
-void initIPSocket(IPSocket *s, void *inst, CreatePacket *c, FilterPacket *f, ReceivePacket *r, DeletePacket *d, DeleteSocket *ds);
+void initIPSocket(IPSocket *s, void *inst, CreatePacket *c, FilterPacket *f, ReceivePacket *r, DeleteSocket *ds);
 int scanIPSocketArguments(IPSocket *socket, const char *arg, uintptr_t argLength);
+// add the socket to the worker that receives, reads and writes for it
 int startIPSocketTasks(IPSocket *socket);
+// the worker releases its reference after removing the socket
 void stopIPSocketTasks(IPSocket *socket);
 
+// call after changing protocol, localAddress or localPort of a started socket; may sleep
+void rehashIPSocket(IPSocket *s);
 void setIPSocketLocalAddress(IPSocket *s, IPV4Address a);
 void setIPSocketRemoteAddress(IPSocket *s, IPV4Address a);
 void setIPSocketBindingDevice(IPSocket *s, const char *deviceName, uintptr_t nameLength);
 
 int createAddRWIPArgument(RWIPQueue *q, RWFileRequest *rwfr, IPSocket *ips, uint8_t *buffer, uintptr_t size);
+// return 0 if no request is pending
 int nextRWIPRequest(RWIPQueue *q, RWFileRequest **rwfr, uint8_t **buffer, uintptr_t *size);
+// send one packet created by createPacket in a buffer from the pool of the device
+// the caller must share memory with the internet service task; see initIP
+int transmitIP(IPSocket *s, const uint8_t *buffer, uintptr_t size);
+// send one TCP packet whose data may be larger than maxSegmentSize
+// the device or transmitIPSegments cuts the data into segments of at most maxSegmentSize bytes
+int transmitIPSegments(IPSocket *s, const uint8_t *buffer, uintptr_t size, uintptr_t maxSegmentSize);
 
 int setIPAddress(IPSocket *ips, uintptr_t param, uint64_t value);
 
@@ -118,10 +238,65 @@ typedef struct{
 
 typedef struct DHCPClient DHCPClient;
 
-DHCPClient *createDHCPClient(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock, uint64_t macAddress);
+// the routes of device are updated with ipConfig; see setDHCPRoutes
+DHCPClient *createDHCPClient(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock,
+	uint64_t macAddress, struct DataLinkDevice *device);
 
 //arp.c
 
 typedef struct ARPServer ARPServer;
 
-ARPServer *createARPServer(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock, uint64_t macAddress);
+// ipDeviceFile is opened with FILE_PARAM_DESTINATION_PREFIX
+ARPServer *createARPServer(const FileEnumeration *fe, IPConfig *ipConfig, Spinlock *ipConfigLock,
+	uint64_t macAddress, uintptr_t ipDeviceFile);
+// frame begins with DESTINATION_PREFIX_SIZE bytes reserved for the MAC address of nextHop
+// if the address is not resolved, queue the frame and send an ARP request
+// frame is released by the ARP server
+// return 0 if the frame is dropped
+int transmitToNeighbor(ARPServer *arp, IPV4Address nextHop, PacketBuffer *frame);
+
+// igmp.c
+typedef struct IGMPClient IGMPClient;
+
+int isMulticastIPV4Address(IPV4Address a);
+uint64_t toMulticastMACAddress(IPV4Address a);
+// deviceFile supports FILE_PARAM_ADD_RECEIVE_ADDRESS
+IGMPClient *createIGMPClient(const FileEnumeration *fe, uintptr_t deviceFile);
+void deleteIGMPClient(IGMPClient *igmp);
+// the groups are reference counted
+// the device receives the frames to the group after the first join, and the routers are informed
+// membership queries are not answered, so IGMP snooping switches may stop forwarding the group
+// after their membership interval
+int joinIPGroup(IGMPClient *igmp, IPV4Address group);
+// return 0 if the group is not joined
+int leaveIPGroup(IGMPClient *igmp, IPV4Address group);
+
+// capture.c
+// the beginning of every captured frame; the rest is dropped
+#define PACKET_CAPTURE_SNAPSHOT_LENGTH (128)
+
+typedef struct PacketCapture PacketCapture;
+
+// register the file system "capture" and measure the TSC frequency for the timestamps
+int initPacketCapture(void);
+// a ring of the recent frames of a device, readable in pcap format as "capture:" followed by name
+PacketCapture *createPacketCapture(const char *name, uintptr_t nameLength);
+void deletePacketCapture(PacketCapture *c);
+// timestamp is rdtsc(); data is the first dataSize bytes of the frame
+void capturePacket(PacketCapture *c, uint64_t timestamp, const uint8_t *data, uintptr_t dataSize, uintptr_t frameSize);
+
+// route.c
+// longest prefix match
+// return 0 if no route
+int searchRoute(IPV4Address destination, Route *r);
+// return 0 if the routing table has changed since r was searched
+int isRouteValid(const Route *r);
+// replace the connected and default routes of device
+int setDHCPRoutes(struct DataLinkDevice *device, const IPConfig *c);
+int addStaticRoute(IPV4Address subnet, uintptr_t prefixLength, IPV4Address gateway, struct DataLinkDevice *device);
+
+// internet.c
+// see SYSCALL_ADD_ROUTE
+// gateway is ANY_IPV4_ADDRESS if subnet is on-link
+int systemCall_addRoute(IPV4Address subnet, uintptr_t prefixLength, IPV4Address gateway,
+	const char *deviceName, uintptr_t nameLength);
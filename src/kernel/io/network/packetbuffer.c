@@ -0,0 +1,142 @@
+#include"std.h"
+#include"memory/memory.h"
+#include"task/exclusivelock.h"
+#include"network.h"
+
+// buffers are allocated when the pool is empty and never returned to the heap
+struct PacketPool{
+	Spinlock lock;
+	uintptr_t capacity;
+	uintptr_t count, maxCount;
+	PacketBuffer *freeList;
+};
+
+PacketPool *createPacketPool(uintptr_t dataSize, uintptr_t maxCount){
+	PacketPool *NEW(p);
+	if(p == NULL){
+		return NULL;
+	}
+	p->lock = initialSpinlock;
+	p->capacity = PACKET_HEADROOM + dataSize;
+	p->count = 0;
+	p->maxCount = maxCount;
+	p->freeList = NULL;
+	return p;
+}
+
+void deletePacketPool(PacketPool *p){
+	while(p->freeList != NULL){
+		PacketBuffer *b = p->freeList;
+		p->freeList = b->next;
+		releaseKernelMemory(b);
+		p->count--;
+	}
+	assert(p->count == 0);
+	DELETE(p);
+}
+
+static PacketBuffer *newPacketBuffer(PacketPool *p, uintptr_t capacity){
+	PacketBuffer *b = allocateKernelMemory(sizeof(*b) + capacity);
+	if(b == NULL){
+		return NULL;
+	}
+	b->pool = p;
+	b->capacity = capacity;
+	b->begin = PACKET_HEADROOM;
+	b->end = PACKET_HEADROOM;
+	b->next = NULL;
+	return b;
+}
+
+PacketBuffer *createPacketBuffer(uintptr_t dataSize){
+	return newPacketBuffer(NULL, PACKET_HEADROOM + dataSize);
+}
+
+PacketBuffer *allocatePacketBuffer(PacketPool *p){
+	acquireLock(&p->lock);
+	PacketBuffer *b = p->freeList;
+	int needCreate = 0;
+	if(b != NULL){
+		p->freeList = b->next;
+	}
+	else if(p->count < p->maxCount){
+		p->count++;
+		needCreate = 1;
+	}
+	releaseLock(&p->lock);
+	if(needCreate){
+		b = newPacketBuffer(p, p->capacity);
+		if(b == NULL){
+			acquireLock(&p->lock);
+			p->count--;
+			releaseLock(&p->lock);
+		}
+	}
+	if(b != NULL){
+		b->begin = PACKET_HEADROOM;
+		b->end = PACKET_HEADROOM;
+		b->next = NULL;
+	}
+	return b;
+}
+
+void releasePacketBuffer(PacketBuffer *b){
+	PacketPool *p = b->pool;
+	if(p == NULL){
+		releaseKernelMemory(b);
+		return;
+	}
+	acquireLock(&p->lock);
+	b->next = p->freeList;
+	p->freeList = b;
+	releaseLock(&p->lock);
+}
+
+void *prependPacketBuffer(PacketBuffer *b, uintptr_t size){
+	if(size > b->begin){
+		return NULL;
+	}
+	b->begin -= size;
+	return b->buffer + b->begin;
+}
+
+void *appendPacketBuffer(PacketBuffer *b, uintptr_t size){
+	if(size > b->capacity - b->end){
+		return NULL;
+	}
+	b->end += size;
+	return b->buffer + b->end - size;
+}
+
+void *getPacketData(const PacketBuffer *b){
+	return (void*)(b->buffer + b->begin);
+}
+
+uintptr_t getPacketSize(const PacketBuffer *b){
+	return b->end - b->begin;
+}
+
+#ifndef NDEBUG
+
+void testPacketBuffer(void);
+void testPacketBuffer(void){
+	PacketPool *p = createPacketPool(100, 2);
+	assert(p != NULL);
+	PacketBuffer *b1 = allocatePacketBuffer(p), *b2 = allocatePacketBuffer(p);
+	assert(b1 != NULL && b2 != NULL && allocatePacketBuffer(p) == NULL);
+	uint8_t *data = appendPacketBuffer(b1, 100);
+	assert(data != NULL && appendPacketBuffer(b1, 1) == NULL);
+	uint8_t *header = prependPacketBuffer(b1, PACKET_HEADROOM);
+	assert(header + PACKET_HEADROOM == data && prependPacketBuffer(b1, 1) == NULL);
+	assert(getPacketData(b1) == header && getPacketSize(b1) == PACKET_HEADROOM + 100);
+	// reuse
+	releasePacketBuffer(b1);
+	PacketBuffer *b3 = allocatePacketBuffer(p);
+	assert(b3 == b1 && getPacketSize(b3) == 0);
+	releasePacketBuffer(b2);
+	releasePacketBuffer(b3);
+	deletePacketPool(p);
+	printk("test packet buffer ok\n");
+}
+
+#endif
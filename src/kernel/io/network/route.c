@@ -0,0 +1,249 @@
+#include"std.h"
+#include"memory/memory.h"
+#include"task/exclusivelock.h"
+#include"network.h"
+
+// path-compressed binary trie of IPv4 prefixes
+// every node is either a route or a branch with 2 children
+typedef struct RouteNode{
+	// host byte order; bits after prefixLength are 0
+	uint32_t prefix;
+	uintptr_t prefixLength;
+	int hasRoute;
+	int isStatic;
+	struct DataLinkDevice *device;
+	IPV4Address gateway;
+
+	struct RouteNode *child[2];
+}RouteNode;
+
+typedef struct{
+	Spinlock lock;
+	RouteNode *root;
+	// see Route.version
+	volatile uint32_t version;
+}RoutingTable;
+
+static RoutingTable routingTable = {INITIAL_SPINLOCK, NULL, 1};
+
+static uint32_t toHostOrder(IPV4Address a){
+	return (((uint32_t)a.bytes[0]) << 24) | (((uint32_t)a.bytes[1]) << 16) |
+		(((uint32_t)a.bytes[2]) << 8) | ((uint32_t)a.bytes[3]);
+}
+
+static uint32_t prefixMask(uintptr_t prefixLength){
+	return (prefixLength == 0? 0: (0xffffffff << (32 - prefixLength)));
+}
+
+static int prefixBit(uint32_t address, uintptr_t index){
+	return (address >> (31 - index)) & 1;
+}
+
+static uintptr_t commonPrefixLength(uint32_t a, uint32_t b, uintptr_t maxLength){
+	uintptr_t i;
+	for(i = 0; i < maxLength; i++){
+		if(prefixBit(a, i) != prefixBit(b, i))
+			break;
+	}
+	return i;
+}
+
+static RouteNode *createRouteNode(uint32_t prefix, uintptr_t prefixLength){
+	RouteNode *NEW(n);
+	if(n == NULL){
+		return NULL;
+	}
+	n->prefix = (prefix & prefixMask(prefixLength));
+	n->prefixLength = prefixLength;
+	n->hasRoute = 0;
+	n->isStatic = 0;
+	n->device = NULL;
+	n->gateway = ANY_IPV4_ADDRESS;
+	n->child[0] = NULL;
+	n->child[1] = NULL;
+	return n;
+}
+
+// return the node of the prefix; create it and split the path if necessary
+static RouteNode *insertRouteNode(RouteNode **p, uint32_t prefix, uintptr_t prefixLength){
+	prefix &= prefixMask(prefixLength);
+	while(*p != NULL){
+		RouteNode *n = *p;
+		const uintptr_t common = commonPrefixLength(n->prefix, prefix, MIN(n->prefixLength, prefixLength));
+		if(common < n->prefixLength){
+			RouteNode *branch = createRouteNode(prefix, common);
+			if(branch == NULL){
+				return NULL;
+			}
+			branch->child[prefixBit(n->prefix, common)] = n;
+			*p = branch;
+			n = branch;
+		}
+		if(n->prefixLength == prefixLength){
+			return n;
+		}
+		p = &n->child[prefixBit(prefix, n->prefixLength)];
+	}
+	*p = createRouteNode(prefix, prefixLength);
+	return *p;
+}
+
+// remove the branch nodes which have less than 2 children
+static void compactRouteNode(RouteNode **p){
+	RouteNode *n = *p;
+	if(n->hasRoute || (n->child[0] != NULL && n->child[1] != NULL)){
+		return;
+	}
+	*p = (n->child[0] != NULL? n->child[0]: n->child[1]);
+	DELETE(n);
+}
+
+static RouteNode *searchRouteNode(RouteNode *n, uint32_t address){
+	RouteNode *best = NULL;
+	while(n != NULL){
+		if((address & prefixMask(n->prefixLength)) != n->prefix){
+			break;
+		}
+		if(n->hasRoute){
+			best = n;
+		}
+		if(n->prefixLength == 32){
+			break;
+		}
+		n = n->child[prefixBit(address, n->prefixLength)];
+	}
+	return best;
+}
+
+// remove the routes to device that match isStatic
+static void removeRouteNodes(RouteNode **p, struct DataLinkDevice *device, int isStatic){
+	RouteNode *n = *p;
+	if(n == NULL){
+		return;
+	}
+	removeRouteNodes(&n->child[0], device, isStatic);
+	removeRouteNodes(&n->child[1], device, isStatic);
+	if(n->hasRoute && n->device == device && n->isStatic == isStatic){
+		n->hasRoute = 0;
+	}
+	compactRouteNode(p);
+}
+
+static int addRouteToTable(RoutingTable *t, IPV4Address subnet, uintptr_t prefixLength,
+	IPV4Address gateway, struct DataLinkDevice *device, int isStatic){
+	if(prefixLength > 32){
+		return 0;
+	}
+	acquireLock(&t->lock);
+	RouteNode *n = insertRouteNode(&t->root, toHostOrder(subnet), prefixLength);
+	// DHCP does not overwrite static routes
+	int ok = (n != NULL && (isStatic || n->hasRoute == 0 || n->isStatic == 0));
+	if(ok){
+		n->hasRoute = 1;
+		n->isStatic = isStatic;
+		n->device = device;
+		n->gateway = gateway;
+		t->version++;
+	}
+	releaseLock(&t->lock);
+	return ok;
+}
+
+static int searchRouteInTable(RoutingTable *t, IPV4Address destination, Route *r){
+	acquireLock(&t->lock);
+	RouteNode *n = searchRouteNode(t->root, toHostOrder(destination));
+	if(n != NULL){
+		r->device = n->device;
+		r->gateway = n->gateway;
+		r->version = t->version;
+	}
+	releaseLock(&t->lock);
+	return (n != NULL);
+}
+
+static uintptr_t toPrefixLength(IPV4Address mask){
+	const uint32_t m = toHostOrder(mask);
+	uintptr_t i;
+	for(i = 0; i < 32 && prefixBit(m, i); i++);
+	return i;
+}
+
+int addStaticRoute(IPV4Address subnet, uintptr_t prefixLength, IPV4Address gateway, struct DataLinkDevice *device){
+	return addRouteToTable(&routingTable, subnet, prefixLength, gateway, device, 1);
+}
+
+int setDHCPRoutes(struct DataLinkDevice *device, const IPConfig *c){
+	RoutingTable *t = &routingTable;
+	acquireLock(&t->lock);
+	removeRouteNodes(&t->root, device, 0);
+	t->version++;
+	releaseLock(&t->lock);
+	if(c->localAddress.value == ANY_IPV4_ADDRESS.value){
+		return 1;
+	}
+	int ok = addRouteToTable(t, c->localAddress, toPrefixLength(c->subnetMask), ANY_IPV4_ADDRESS, device, 0);
+	if(ok && c->gateway.value != ANY_IPV4_ADDRESS.value){
+		ok = addRouteToTable(t, ANY_IPV4_ADDRESS, 0, c->gateway, device, 0);
+	}
+	return ok;
+}
+
+int searchRoute(IPV4Address destination, Route *r){
+	return searchRouteInTable(&routingTable, destination, r);
+}
+
+int isRouteValid(const Route *r){
+	return r->device != NULL && r->version == routingTable.version;
+}
+
+#ifndef NDEBUG
+
+static IPV4Address toIPV4Address(uint8_t b0, uint8_t b1, uint8_t b2, uint8_t b3){
+	IPV4Address a;
+	a.bytes[0] = b0;
+	a.bytes[1] = b1;
+	a.bytes[2] = b2;
+	a.bytes[3] = b3;
+	return a;
+}
+
+void testRoutingTable(void);
+void testRoutingTable(void){
+	RoutingTable t = {INITIAL_SPINLOCK, NULL, 1};
+	struct DataLinkDevice *d1 = (struct DataLinkDevice*)1, *d2 = (struct DataLinkDevice*)2, *d3 = (struct DataLinkDevice*)3;
+	Route r;
+	int ok = searchRouteInTable(&t, toIPV4Address(10, 0, 2, 2), &r);
+	assert(ok == 0);
+	ok = addRouteToTable(&t, ANY_IPV4_ADDRESS, 0, toIPV4Address(10, 0, 2, 2), d1, 0);
+	assert(ok);
+	ok = addRouteToTable(&t, toIPV4Address(10, 0, 2, 15), 24, ANY_IPV4_ADDRESS, d1, 0);
+	assert(ok);
+	ok = addRouteToTable(&t, toIPV4Address(10, 0, 0, 0), 8, toIPV4Address(10, 0, 2, 3), d2, 1);
+	assert(ok);
+	ok = addRouteToTable(&t, toIPV4Address(10, 0, 3, 0), 24, ANY_IPV4_ADDRESS, d3, 1);
+	assert(ok);
+	// longest prefix
+	ok = searchRouteInTable(&t, toIPV4Address(10, 0, 2, 2), &r);
+	assert(ok && r.device == d1 && r.gateway.value == ANY_IPV4_ADDRESS.value);
+	ok = searchRouteInTable(&t, toIPV4Address(10, 1, 2, 3), &r);
+	assert(ok && r.device == d2);
+	ok = searchRouteInTable(&t, toIPV4Address(10, 0, 3, 200), &r);
+	assert(ok && r.device == d3);
+	ok = searchRouteInTable(&t, toIPV4Address(192, 168, 0, 1), &r);
+	assert(ok && r.device == d1 && r.gateway.value == toIPV4Address(10, 0, 2, 2).value);
+	// DHCP cannot overwrite static routes
+	ok = addRouteToTable(&t, toIPV4Address(10, 0, 3, 0), 24, ANY_IPV4_ADDRESS, d1, 0);
+	assert(ok == 0);
+	// remove and compact
+	removeRouteNodes(&t.root, d1, 0);
+	ok = searchRouteInTable(&t, toIPV4Address(10, 0, 2, 2), &r);
+	assert(ok && r.device == d2);
+	ok = searchRouteInTable(&t, toIPV4Address(192, 168, 0, 1), &r);
+	assert(ok == 0);
+	removeRouteNodes(&t.root, d2, 1);
+	removeRouteNodes(&t.root, d3, 1);
+	assert(t.root == NULL);
+	printk("test routing table ok\n");
+}
+
+#endif
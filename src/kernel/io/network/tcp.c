@@ -1,27 +1,34 @@
 #include"common.h"
 #include"std.h"
 #include"file/file.h"
+#include"memory/memory.h"
+#include"resource/resource.h"
+#include"task/task.h"
+#include"task/exclusivelock.h"
+#include"multiprocessor/processorlocal.h"
+#include"assembly/assembly.h"
 #include"network.h"
 
 #pragma pack(1)
 
+// big endian and most significant bit comes first; see IPV4Header
 typedef struct TCPHeader{
 	uint16_t sourcePort;
 	uint16_t destinationPort;
 	uint32_t sequenceNumber;
 	uint32_t acknowledgeNumber;
-	uint16_t dataOffset: 4;
-	uint16_t reserved: 3;
-	uint16_t ns: 1; // nonce sum
-	uint16_t cwr: 1; // congestion window reduced
-	uint16_t ece: 1; // ECN echo
-	uint16_t urg: 1; // urgent pointer effective
-	uint16_t ack: 1;
-	uint16_t psh: 1; // push
-	uint16_t rst: 1; // reset
-	uint16_t syn: 1; // synchronize sequence number
-	uint16_t fin: 1; // finish
-	uint16_t windowsSize;
+	uint8_t ns: 1; // nonce sum
+	uint8_t reserved: 3;
+	uint8_t dataOffset: 4;
+	uint8_t fin: 1; // finish
+	uint8_t syn: 1; // synchronize sequence number
+	uint8_t rst: 1; // reset
+	uint8_t psh: 1; // push
+	uint8_t ack: 1;
+	uint8_t urg: 1; // urgent pointer effective
+	uint8_t ece: 1; // ECN echo
+	uint8_t cwr: 1; // congestion window reduced
+	uint16_t windowSize;
 	uint16_t checksum;
 	uint16_t urgentPointer;
 	uint8_t options[];
@@ -39,8 +46,8 @@ static uintptr_t getTCPHeaderSize(const TCPHeader *h){
 static void *getTCPData(const TCPHeader *h){
 	return ((uint8_t*)h) + getTCPHeaderSize(h);
 }
-__attribute__((__unused__))
-static uintptr_t getTCPDataSize(IPV4Header *ip, TCPHeader *tcp){
+
+static uintptr_t getTCPDataSize(const IPV4Header *ip, const TCPHeader *tcp){
 	return getIPDataSize(ip) - getTCPHeaderSize(tcp);
 }
 
@@ -49,97 +56,1884 @@ typedef struct{
 	TCPHeader tcp;
 }TCPIPHeader;
 
-static void initTCPIPPacket(
-	TCPIPHeader *h, const uint8_t *data, uint16_t dataSize,
-	uint32_t seqNumber, uint16_t windowSize,
-	IPV4Address localAddr, uint16_t localPort,
-	IPV4Address remoteAddr, uint16_t remotePort
+enum TCPOptionKind{
+	TCP_OPTION_END = 0,
+	TCP_OPTION_NOP = 1,
+	TCP_OPTION_MSS = 2,
+	TCP_OPTION_SACK_PERMITTED = 4,
+	TCP_OPTION_SACK = 5
+};
+
+#define TCP_MAX_HEADER_SIZE (60)
+// MTU of Ethernet - IP header - TCP header
+#define TCP_MAX_SEGMENT_SIZE (1460)
+// RFC 1122
+#define TCP_DEFAULT_SEGMENT_SIZE (536)
+// new data is sent in packets of up to this many segments; see transmitIPSegments
+#define TCP_LARGE_SEND_SEGMENT_COUNT (32)
+// no window scaling, so the window is 16-bit
+#define TCP_BUFFER_SIZE (1 << 16)
+#define TCP_MAX_WINDOW ((1 << 16) - 1)
+#define TCP_MAX_CONGESTION_WINDOW (4 * TCP_BUFFER_SIZE)
+#define TCP_MAX_SACK_BLOCK_COUNT (4)
+#define TCP_DUPLICATE_ACK_THRESHOLD (3)
+#define TCP_MAX_SYN_RETRANSMISSION (5)
+#define TCP_MAX_RETRANSMISSION (12)
+
+// timers are counted in ticks of TCPService
+#define TCP_TICK_MILLISECOND (10)
+#define TCP_INITIAL_RTO_TICK (100)
+#define TCP_MIN_RTO_TICK (20)
+#define TCP_MAX_RTO_TICK (6000)
+#define TCP_DELAYED_ACK_TICK (4)
+#define TCP_TIME_WAIT_TICK (6000)
+#define TCP_FIN_WAIT_2_TICK (6000)
+#define TCP_TIMER_WHEEL_SIZE (512)
+
+#define TCP_FIRST_DYNAMIC_PORT (49152)
+
+static uintptr_t createTCPSYNOptions(uint8_t *options){
+	options[0] = TCP_OPTION_MSS;
+	options[1] = 4;
+	options[2] = (TCP_MAX_SEGMENT_SIZE >> 8);
+	options[3] = (TCP_MAX_SEGMENT_SIZE & 0xff);
+	options[4] = TCP_OPTION_NOP;
+	options[5] = TCP_OPTION_NOP;
+	options[6] = TCP_OPTION_SACK_PERMITTED;
+	options[7] = 2;
+	return 8;
+}
+
+static int createTCPIPPacket(
+	__attribute__((__unused__)) IPSocket *ips, PacketBuffer *packet, IPV4Address src, IPV4Address dst,
+	const uint8_t *segment, uintptr_t segmentSize, int checksumOffload
 ){
-	initIPV4Header(&h->ip, dataSize, localAddr, remoteAddr, IP_DATA_PROTOCOL_TCP);
-	TCPHeader *tcp = &h->tcp;
-	MEMSET0(tcp);
-	tcp->sourcePort = changeEndian16(localPort);
-	tcp->destinationPort = changeEndian16(remotePort);
-	tcp->sequenceNumber = changeEndian32(seqNumber);
-	//acknowledgeNumber
-	tcp->dataOffset = sizeof(TCPHeader) / sizeof(uint32_t);
-	/*
-	reserved
-	ns
-	cwr
-	ece
-	urg
-	ack
-	psh
-	rst
-	syn
-	fin
-	*/
-	tcp->windowsSize = changeEndian16(windowSize);
-	tcp->checksum = 0;
-	//urgentPointer;
-	//options
-	memcpy(getTCPData(tcp), data, dataSize);
-	tcp->checksum = calculateIPDataChecksum(&h->ip);
+	uint8_t *data = appendPacketBuffer(packet, segmentSize);
+	if(data == NULL){
+		return 0;
+	}
+	memcpy(data, segment, segmentSize);
+	TCPIPHeader *h = (TCPIPHeader*)prependIPV4Header(packet, src, dst, IP_DATA_PROTOCOL_TCP, checksumOffload);
+	if(h == NULL){
+		return 0;
+	}
+	// the checksum includes the pseudo IP header, so it is calculated here
+	h->tcp.checksum = 0;
+	if(checksumOffload & CHECKSUM_OFFLOAD_IPV4_DATA){
+		h->tcp.checksum = calculatePseudoIPHeaderSum(&h->ip);
+		return 1;
+	}
+	h->tcp.checksum = calculateIPDataChecksum(&h->ip);
 	assert(calculateIPDataChecksum(&h->ip) == 0);
+	return 1;
+}
+
+// sequence number arithmetic, RFC 793
+static int isSeqLess(uint32_t a, uint32_t b){
+	return (int)(a - b) < 0;
+}
+
+static int isSeqLessOrEqual(uint32_t a, uint32_t b){
+	return (int)(a - b) <= 0;
+}
+
+static uint32_t minSeq(uint32_t a, uint32_t b){
+	return isSeqLess(a, b)? a: b;
+}
+
+static uint32_t maxSeq(uint32_t a, uint32_t b){
+	return isSeqLess(a, b)? b: a;
+}
+
+typedef struct{
+	uint32_t begin, end;
+}TCPRange;
+
+static void removeTCPRange(TCPRange *r, uintptr_t *count, uintptr_t index){
+	(*count)--;
+	for(; index < *count; index++){
+		r[index] = r[index + 1];
+	}
+}
+
+static void insertTCPRange(TCPRange *r, uintptr_t *count, uintptr_t index, uint32_t begin, uint32_t end){
+	uintptr_t i;
+	for(i = *count; i > index; i--){
+		r[i] = r[i - 1];
+	}
+	r[index].begin = begin;
+	r[index].end = end;
+	(*count)++;
+}
+
+typedef struct{
+	uint16_t maxSegmentSize;
+	int sackPermitted;
+	uintptr_t sackCount;
+	TCPRange sack[TCP_MAX_SACK_BLOCK_COUNT];
+}TCPOptions;
+
+static void parseTCPOptions(const TCPHeader *h, TCPOptions *o){
+	o->maxSegmentSize = 0;
+	o->sackPermitted = 0;
+	o->sackCount = 0;
+	const uint8_t *options = h->options;
+	const uintptr_t size = getTCPHeaderSize(h) - sizeof(*h);
+	uintptr_t i = 0;
+	while(i < size){
+		const uint8_t kind = options[i];
+		if(kind == TCP_OPTION_END){
+			break;
+		}
+		if(kind == TCP_OPTION_NOP){
+			i++;
+			continue;
+		}
+		if(i + 1 >= size || options[i + 1] < 2 || i + options[i + 1] > size){
+			break;
+		}
+		const uint8_t length = options[i + 1];
+		const uint8_t *value = options + i + 2;
+		switch(kind){
+		case TCP_OPTION_MSS:
+			if(length == 4){
+				o->maxSegmentSize = (((uint16_t)value[0]) << 8) + value[1];
+			}
+			break;
+		case TCP_OPTION_SACK_PERMITTED:
+			o->sackPermitted = 1;
+			break;
+		case TCP_OPTION_SACK:
+			for(o->sackCount = 0; o->sackCount < (length - 2u) / 8 && o->sackCount < TCP_MAX_SACK_BLOCK_COUNT; o->sackCount++){
+				uint32_t edge[2];
+				memcpy(edge, value + o->sackCount * 8, sizeof(edge));
+				o->sack[o->sackCount].begin = changeEndian32(edge[0]);
+				o->sack[o->sackCount].end = changeEndian32(edge[1]);
+			}
+			break;
+		}
+		i += length;
+	}
+}
+
+enum TCPState{
+	TCP_CLOSED,
+	TCP_LISTEN,
+	TCP_SYN_SENT,
+	TCP_SYN_RECEIVED,
+	TCP_ESTABLISHED,
+	TCP_FIN_WAIT_1,
+	TCP_FIN_WAIT_2,
+	TCP_CLOSE_WAIT,
+	TCP_CLOSING,
+	TCP_LAST_ACK,
+	TCP_TIME_WAIT
+};
+
+typedef struct TCPSocket TCPSocket;
+
+// an entry of tcpService.timerWheel
+typedef struct TCPTimer{
+	TCPSocket *socket;
+	// the earliest tick of the retransmission, delayed ACK and close timers
+	uint32_t tick;
+	struct TCPTimer **prev, *next;
+}TCPTimer;
+
+typedef struct TCPPendingIO{
+	RWFileRequest *rwfr;
+	uint8_t *buffer;
+	uintptr_t size;
+	uintptr_t doneSize;
+	TCPSocket *socket;
+	struct TCPPendingIO **prev, *next;
+}TCPPendingIO;
+
+struct TCPSocket{
+	IPSocket ipSocket;
+	// protect all fields below
+	Spinlock lock;
+	enum TCPState state;
+	// completed when the connection is established or reset
+	// a passive open waits in TCP_LISTEN for one connection
+	OpenFileRequest *openRequest;
+	// closed by user or failed to open
+	int isReleased;
+	// aborted by RST or retransmission timeout
+	int isReset;
+	// IP socket tasks are stopped
+	int isStopped;
+	// opened by openTCPServer
+	int isPassive;
+	TCPPendingIO *readList, *writeList;
+
+	// send sequence space, RFC 793
+	uint32_t initialSendSequence;
+	uint32_t sendUnacknowledged, sendNext, sendMax;
+	uint32_t sendWindow, sendWindowUpdateSequence, sendWindowUpdateAcknowledge;
+	// the sequence number after the last byte in sendBuffer
+	uint32_t sendDataEnd;
+	int isFINQueued;
+	uintptr_t maxSegmentSize;
+	int isSACKPermitted;
+	// received SACK blocks, sorted
+	TCPRange sacked[TCP_MAX_SACK_BLOCK_COUNT];
+	uintptr_t sackedCount;
+	// the byte of sequence number n is at sendBuffer[n % TCP_BUFFER_SIZE]
+	uint8_t *sendBuffer;
+
+	// receive sequence space
+	uint32_t receiveNext;
+	// the first byte not read by user
+	uint32_t readNext;
+	// the right edge of the last advertised window
+	uint32_t receiveAdvertised;
+	int isFINReceived;
+	int hasOutOfOrderFIN;
+	uint32_t outOfOrderFINSequence;
+	// the most recently updated block comes first, RFC 2018
+	TCPRange outOfOrder[TCP_MAX_SACK_BLOCK_COUNT];
+	uintptr_t outOfOrderCount;
+	uint8_t *receiveBuffer;
+
+	// NewReno, RFC 5681 and RFC 6582
+	uint32_t congestionWindow, slowStartThreshold;
+	uint32_t duplicateAckCount;
+	int isInFastRecovery;
+	uint32_t recover;
+	// the next hole to retransmit in fast recovery
+	uint32_t retransmitNext;
+	int needRetransmit;
+
+	// retransmission timer, RFC 6298
+	// smoothedRTT8 and rttVariance8 are 8 times of ticks
+	int hasRTTSample;
+	uint32_t smoothedRTT8, rttVariance8;
+	uint32_t retransmitTimeout;
+	int isMeasuringRTT;
+	uint32_t rttSequence, rttStartTick;
+	int isRetransmitTimerOn;
+	uint32_t retransmitTick;
+	uint32_t retransmitCount;
+	// persist timer uses the retransmission timer
+	int isWindowProbe;
+
+	// delayed ACK, RFC 1122
+	int isAckNow;
+	int isDelayedAckOn;
+	uint32_t delayedAckTick;
+	uint32_t unacknowledgedSegmentCount;
+
+	// TIME_WAIT and FIN_WAIT_2 timeout
+	int isCloseTimerOn;
+	uint32_t closeTick;
+
+	// the fields below are protected by tcpService.lock
+	struct TCPSocket **prev, *next;
+	// in socketList; only listed sockets can be scheduled
+	int isListed;
+	// in the ready list
+	int isReady;
+	struct TCPSocket *nextReady;
+	TCPTimer timer;
+};
+
+struct TCPService{
+	Spinlock lock;
+	TCPSocket *socketList;
+	uint16_t nextDynamicPort;
+	// tcpTask processes only the sockets in the ready list
+	TCPSocket *readyHead, **readyTail;
+	// a timer stays in the slot of (tick % TCP_TIMER_WHEEL_SIZE) until the tick is reached
+	TCPTimer *timerWheel[TCP_TIMER_WHEEL_SIZE];
+	// the timers up to this tick are expired
+	uint32_t wheelTick;
+	// released by the timer task and by scheduleTCPSocket
+	Semaphore *event;
+	volatile uint32_t currentTick;
+};
+
+static struct TCPService tcpService;
+
+static uint32_t getTCPTick(void){
+	return tcpService.currentTick;
+}
+
+static int isTCPTickReached(uint32_t now, uint32_t tick){
+	return (int)(now - tick) >= 0;
+}
+
+static void readyTCPSocket_noLock(TCPSocket *tcps){
+	if(tcps->isListed == 0 || tcps->isReady){
+		return;
+	}
+	tcps->isReady = 1;
+	tcps->nextReady = NULL;
+	*tcpService.readyTail = tcps;
+	tcpService.readyTail = &tcps->nextReady;
+}
+
+// wake tcpTask to process the socket
+static void scheduleTCPSocket(TCPSocket *tcps){
+	acquireLock(&tcpService.lock);
+	readyTCPSocket_noLock(tcps);
+	releaseLock(&tcpService.lock);
+	releaseSemaphore(tcpService.event);
+}
+
+// return NULL if no socket is ready
+static TCPSocket *takeReadyTCPSocket(int *isListed){
+	acquireLock(&tcpService.lock);
+	TCPSocket *tcps = tcpService.readyHead;
+	if(tcps != NULL){
+		tcpService.readyHead = tcps->nextReady;
+		if(tcpService.readyHead == NULL){
+			tcpService.readyTail = &tcpService.readyHead;
+		}
+		tcps->isReady = 0;
+		*isListed = tcps->isListed;
+	}
+	releaseLock(&tcpService.lock);
+	return tcps;
+}
+
+// move the sockets of the reached timers to the ready list
+static void expireTCPTimers(uint32_t now){
+	acquireLock(&tcpService.lock);
+	uint32_t i, slotCount = now - tcpService.wheelTick;
+	if(slotCount > TCP_TIMER_WHEEL_SIZE){
+		slotCount = TCP_TIMER_WHEEL_SIZE;
+	}
+	for(i = 1; i <= slotCount; i++){
+		TCPTimer *t = tcpService.timerWheel[(tcpService.wheelTick + i) % TCP_TIMER_WHEEL_SIZE];
+		while(t != NULL){
+			TCPTimer *next = t->next;
+			// a timer after one round of the wheel stays in the slot
+			if(isTCPTickReached(now, t->tick)){
+				REMOVE_FROM_DQUEUE(t);
+				readyTCPSocket_noLock(t->socket);
+			}
+			t = next;
+		}
+	}
+	tcpService.wheelTick = now;
+	releaseLock(&tcpService.lock);
+}
+
+static void setTCPSocketTimer(TCPSocket *tcps, int isOn, uint32_t tick){
+	TCPTimer *t = &tcps->timer;
+	acquireLock(&tcpService.lock);
+	if(IS_IN_DQUEUE(t)){
+		REMOVE_FROM_DQUEUE(t);
+	}
+	if(isOn && isTCPTickReached(tcpService.wheelTick, tick)){
+		readyTCPSocket_noLock(tcps);
+	}
+	else if(isOn){
+		t->tick = tick;
+		ADD_TO_DQUEUE(t, &tcpService.timerWheel[tick % TCP_TIMER_WHEEL_SIZE]);
+	}
+	releaseLock(&tcpService.lock);
+}
+
+static void updateEarliestTCPTick(int *isOn, uint32_t *earliest, int isTimerOn, uint32_t tick){
+	if(isTimerOn && (*isOn == 0 || isTCPTickReached(*earliest, tick))){
+		*isOn = 1;
+		*earliest = tick;
+	}
+}
+
+static void copyToTCPBuffer(uint8_t *ring, uint32_t seq, const uint8_t *data, uintptr_t size){
+	const uintptr_t offset = seq % TCP_BUFFER_SIZE;
+	const uintptr_t size1 = MIN(size, TCP_BUFFER_SIZE - offset);
+	memcpy(ring + offset, data, size1);
+	memcpy(ring, data + size1, size - size1);
+}
+
+static void copyFromTCPBuffer(uint8_t *data, const uint8_t *ring, uint32_t seq, uintptr_t size){
+	const uintptr_t offset = seq % TCP_BUFFER_SIZE;
+	const uintptr_t size1 = MIN(size, TCP_BUFFER_SIZE - offset);
+	memcpy(data, ring + offset, size1);
+	memcpy(data + size1, ring, size - size1);
+}
+
+// the SYN and the FIN do not occupy sendBuffer
+static uint32_t getTCPSendBufferUsed(const TCPSocket *tcps){
+	uint32_t begin = maxSeq(tcps->sendUnacknowledged, tcps->initialSendSequence + 1);
+	begin = minSeq(begin, tcps->sendDataEnd);
+	return tcps->sendDataEnd - begin;
+}
+
+static uint32_t getTCPReceiveDataEnd(const TCPSocket *tcps){
+	return tcps->receiveNext - (tcps->isFINReceived? 1: 0);
+}
+
+static uint32_t getTCPReceiveWindow(const TCPSocket *tcps){
+	uint32_t window = tcps->readNext + TCP_BUFFER_SIZE - getTCPReceiveDataEnd(tcps);
+	return MIN(window, TCP_MAX_WINDOW);
+}
+
+static uint32_t getTCPReceiveWindowEnd(const TCPSocket *tcps){
+	return getTCPReceiveDataEnd(tcps) + getTCPReceiveWindow(tcps);
+}
+
+// pending IO
+
+// IO completed with TCPSocket.lock acquired, see runTCPCompletion
+typedef struct{
+	TCPPendingIO *ioList;
+	OpenFileRequest *openRequest;
+	int isOpened;
+}TCPCompletion;
+
+#define INITIAL_TCP_COMPLETION {NULL, NULL, 0}
+
+static TCPPendingIO *createTCPPendingIO(RWFileRequest *rwfr, TCPSocket *tcps, uint8_t *buffer, uintptr_t size){
+	TCPPendingIO *NEW(p);
+	if(p == NULL){
+		return NULL;
+	}
+	p->rwfr = rwfr;
+	p->buffer = buffer;
+	p->size = size;
+	p->doneSize = 0;
+	p->socket = tcps;
+	p->prev = NULL;
+	p->next = NULL;
+	return p;
+}
+
+static void appendTCPPendingIO(TCPPendingIO **list, TCPPendingIO *p){
+	while(*list != NULL){
+		list = &(*list)->next;
+	}
+	ADD_TO_DQUEUE(p, list);
 }
-__attribute__((__unused__))
-static TCPIPHeader *createTCPIPPacket(
-	const uint8_t *data, uint16_t dataSize,
-	uint32_t seqNumber, uint16_t windowSize,
-	IPV4Address localAddr, uint16_t localPort,
-	IPV4Address remoteAddr, uint16_t remotePort
+
+static void cancelTCPPendingIO(void *voidArg){
+	TCPPendingIO *p = voidArg;
+	TCPSocket *tcps = p->socket;
+	acquireLock(&tcps->lock);
+	if(IS_IN_DQUEUE(p)){
+		REMOVE_FROM_DQUEUE(p);
+	}
+	releaseLock(&tcps->lock);
+	DELETE(p);
+}
+
+static void finishTCPPendingIO(TCPCompletion *c, TCPPendingIO *p){
+	REMOVE_FROM_DQUEUE(p);
+	if(setRWFileIONotCancellable(p->rwfr) == 0){
+		// being cancelled; see cancelTCPPendingIO
+		return;
+	}
+	appendTCPPendingIO(&c->ioList, p);
+}
+
+static void setTCPOpenCompletion(TCPSocket *tcps, TCPCompletion *c, int isOpened){
+	if(tcps->openRequest == NULL){
+		return;
+	}
+	c->openRequest = tcps->openRequest;
+	c->isOpened = isOpened;
+	tcps->openRequest = NULL;
+	if(isOpened == 0){
+		tcps->isReleased = 1;
+	}
+}
+
+static int readTCP(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uintptr_t size);
+static int writeTCP(RWFileRequest *rwfr, OpenedFile *of, const uint8_t *buffer, uintptr_t size);
+static void closeTCP(CloseFileRequest *cfr, OpenedFile *of);
+
+static void runTCPCompletion(TCPSocket *tcps, TCPCompletion *c){
+	while(c->ioList != NULL){
+		TCPPendingIO *p = c->ioList;
+		REMOVE_FROM_DQUEUE(p);
+		completeRWFileIO(p->rwfr, p->doneSize, 0);
+		DELETE(p);
+	}
+	if(c->openRequest == NULL){
+		return;
+	}
+	if(c->isOpened){
+		FileFunctions ff = INITIAL_FILE_FUNCTIONS;
+		ff.read = readTCP;
+		ff.write = writeTCP;
+		ff.close = closeTCP;
+		completeOpenFile(c->openRequest, tcps, &ff);
+	}
+	else{
+		failOpenFile(c->openRequest);
+	}
+}
+
+// copy received data to read requests
+static void deliverTCPReceiveData(TCPSocket *tcps, TCPCompletion *c){
+	const uint32_t dataEnd = getTCPReceiveDataEnd(tcps);
+	const uint32_t oldWindowEnd = getTCPReceiveWindowEnd(tcps);
+	if(tcps->isReleased){
+		tcps->readNext = dataEnd;
+	}
+	while(tcps->readList != NULL){
+		const uintptr_t available = dataEnd - tcps->readNext;
+		if(available == 0 && tcps->isFINReceived == 0 && tcps->isReset == 0){
+			break;
+		}
+		TCPPendingIO *p = tcps->readList;
+		p->doneSize = MIN(available, p->size);
+		copyFromTCPBuffer(p->buffer, tcps->receiveBuffer, tcps->readNext, p->doneSize);
+		tcps->readNext += p->doneSize;
+		finishTCPPendingIO(c, p);
+	}
+	// receiver side silly window avoidance, RFC 1122
+	const uint32_t newWindowEnd = getTCPReceiveWindowEnd(tcps);
+	if(newWindowEnd != oldWindowEnd &&
+	isSeqLessOrEqual(tcps->receiveAdvertised + MIN(TCP_BUFFER_SIZE / 2, 2 * TCP_MAX_SEGMENT_SIZE), newWindowEnd) &&
+	tcps->state != TCP_LISTEN && tcps->state != TCP_SYN_SENT && tcps->state != TCP_CLOSED){
+		tcps->isAckNow = 1;
+	}
+}
+
+// copy data of write requests to sendBuffer
+static void acceptTCPWriteData(TCPSocket *tcps, TCPCompletion *c){
+	while(tcps->writeList != NULL){
+		TCPPendingIO *p = tcps->writeList;
+		if((tcps->state != TCP_ESTABLISHED && tcps->state != TCP_CLOSE_WAIT) || tcps->isFINQueued){
+			finishTCPPendingIO(c, p);
+			continue;
+		}
+		const uint32_t space = TCP_BUFFER_SIZE - getTCPSendBufferUsed(tcps);
+		if(space == 0){
+			break;
+		}
+		const uintptr_t copySize = MIN(space, p->size - p->doneSize);
+		copyToTCPBuffer(tcps->sendBuffer, tcps->sendDataEnd, p->buffer + p->doneSize, copySize);
+		tcps->sendDataEnd += copySize;
+		p->doneSize += copySize;
+		if(p->doneSize == p->size){
+			finishTCPPendingIO(c, p);
+		}
+	}
+}
+
+static void resetTCPSocket(TCPSocket *tcps, TCPCompletion *c){
+	tcps->state = TCP_CLOSED;
+	tcps->isReset = 1;
+	tcps->isRetransmitTimerOn = 0;
+	tcps->isDelayedAckOn = 0;
+	tcps->isCloseTimerOn = 0;
+	tcps->isAckNow = 0;
+	setTCPOpenCompletion(tcps, c, 0);
+	while(tcps->writeList != NULL){
+		finishTCPPendingIO(c, tcps->writeList);
+	}
+	deliverTCPReceiveData(tcps, c);
+}
+
+// the state of one connection, cleared when a passive socket returns to TCP_LISTEN
+static void initTCPConnectionState(TCPSocket *tcps){
+	// RFC 6528 suggests a clock driven ISN
+	const uint32_t iss = (uint32_t)rdtsc();
+	tcps->initialSendSequence = iss;
+	tcps->sendUnacknowledged = iss;
+	tcps->sendNext = iss;
+	tcps->sendMax = iss;
+	tcps->sendWindow = 0;
+	tcps->sendWindowUpdateSequence = 0;
+	tcps->sendWindowUpdateAcknowledge = 0;
+	tcps->sendDataEnd = iss + 1;
+	tcps->isFINQueued = 0;
+	tcps->maxSegmentSize = TCP_DEFAULT_SEGMENT_SIZE;
+	tcps->isSACKPermitted = 0;
+	tcps->sackedCount = 0;
+	tcps->receiveNext = 0;
+	tcps->readNext = 0;
+	tcps->receiveAdvertised = 0;
+	tcps->isFINReceived = 0;
+	tcps->hasOutOfOrderFIN = 0;
+	tcps->outOfOrderFINSequence = 0;
+	tcps->outOfOrderCount = 0;
+	tcps->congestionWindow = TCP_DEFAULT_SEGMENT_SIZE;
+	tcps->slowStartThreshold = TCP_MAX_WINDOW;
+	tcps->duplicateAckCount = 0;
+	tcps->isInFastRecovery = 0;
+	tcps->recover = iss;
+	tcps->retransmitNext = iss;
+	tcps->needRetransmit = 0;
+	tcps->hasRTTSample = 0;
+	tcps->smoothedRTT8 = 0;
+	tcps->rttVariance8 = 0;
+	tcps->retransmitTimeout = TCP_INITIAL_RTO_TICK;
+	tcps->isMeasuringRTT = 0;
+	tcps->rttSequence = iss;
+	tcps->rttStartTick = 0;
+	tcps->isRetransmitTimerOn = 0;
+	tcps->retransmitTick = 0;
+	tcps->retransmitCount = 0;
+	tcps->isWindowProbe = 0;
+	tcps->isAckNow = 0;
+	tcps->isDelayedAckOn = 0;
+	tcps->delayedAckTick = 0;
+	tcps->unacknowledgedSegmentCount = 0;
+	tcps->isCloseTimerOn = 0;
+	tcps->closeTick = 0;
+}
+
+// RFC 793 page 70; a passive open is not failed by a bad SYN
+static void returnToTCPListen(TCPSocket *tcps){
+	IPSocket *ips = &tcps->ipSocket;
+	// see claimTCPConnection
+	acquireLock(&tcpService.lock);
+	ips->remoteAddress = ANY_IPV4_ADDRESS;
+	ips->remotePort = 0;
+	releaseLock(&tcpService.lock);
+	initTCPConnectionState(tcps);
+	tcps->state = TCP_LISTEN;
+}
+
+// aborted by RST or retransmission timeout
+static void abortTCPConnection(TCPSocket *tcps, TCPCompletion *c){
+	if(tcps->isPassive && tcps->state == TCP_SYN_RECEIVED){
+		returnToTCPListen(tcps);
+	}
+	else{
+		resetTCPSocket(tcps, c);
+	}
+}
+
+// timers
+
+static void startTCPRetransmitTimer(TCPSocket *tcps, uint32_t now){
+	tcps->isRetransmitTimerOn = 1;
+	tcps->retransmitTick = now + tcps->retransmitTimeout;
+}
+
+static void startTCPCloseTimer(TCPSocket *tcps, uint32_t now, uint32_t ticks){
+	tcps->isCloseTimerOn = 1;
+	tcps->closeTick = now + ticks;
+}
+
+static void updateTCPRetransmitTimeout(TCPSocket *tcps, uint32_t rttTick){
+	const uint32_t rtt8 = rttTick * 8;
+	if(tcps->hasRTTSample == 0){
+		tcps->hasRTTSample = 1;
+		tcps->smoothedRTT8 = rtt8;
+		tcps->rttVariance8 = rtt8 / 2;
+	}
+	else{
+		const uint32_t delta = (tcps->smoothedRTT8 > rtt8? tcps->smoothedRTT8 - rtt8: rtt8 - tcps->smoothedRTT8);
+		tcps->rttVariance8 = tcps->rttVariance8 - tcps->rttVariance8 / 4 + delta / 4;
+		tcps->smoothedRTT8 = tcps->smoothedRTT8 - tcps->smoothedRTT8 / 8 + rtt8 / 8;
+	}
+	// the clock granularity is 1 tick
+	uint32_t rto = (tcps->smoothedRTT8 + MAX(8, 4 * tcps->rttVariance8)) / 8;
+	rto = MAX(rto, TCP_MIN_RTO_TICK);
+	tcps->retransmitTimeout = MIN(rto, TCP_MAX_RTO_TICK);
+}
+
+static void handleTCPRetransmitTimeout(TCPSocket *tcps, TCPCompletion *c){
+	tcps->retransmitCount++;
+	tcps->isMeasuringRTT = 0;
+	if(tcps->state == TCP_SYN_SENT || tcps->state == TCP_SYN_RECEIVED){
+		if(tcps->retransmitCount > TCP_MAX_SYN_RETRANSMISSION){
+			abortTCPConnection(tcps, c);
+			return;
+		}
+		tcps->sendNext = tcps->initialSendSequence;
+	}
+	else if(tcps->sendWindow == 0){
+		// persist timer; a zero window is not congestion
+		tcps->retransmitCount = 0;
+		tcps->isWindowProbe = 1;
+		tcps->sendNext = tcps->sendUnacknowledged;
+	}
+	else{
+		if(tcps->retransmitCount > TCP_MAX_RETRANSMISSION){
+			resetTCPSocket(tcps, c);
+			return;
+		}
+		const uint32_t flightSize = tcps->sendMax - tcps->sendUnacknowledged;
+		tcps->slowStartThreshold = MAX(flightSize / 2, 2 * tcps->maxSegmentSize);
+		tcps->congestionWindow = tcps->maxSegmentSize;
+		tcps->recover = tcps->sendMax;
+		tcps->isInFastRecovery = 0;
+		tcps->duplicateAckCount = 0;
+		tcps->needRetransmit = 0;
+		// the receiver may have dropped out-of-order data, RFC 2018
+		tcps->sackedCount = 0;
+		// go back N
+		tcps->sendNext = tcps->sendUnacknowledged;
+	}
+	tcps->retransmitTimeout = MIN(tcps->retransmitTimeout * 2, TCP_MAX_RTO_TICK);
+}
+
+static void handleTCPTimers(TCPSocket *tcps, uint32_t now, TCPCompletion *c){
+	if(tcps->isRetransmitTimerOn && isTCPTickReached(now, tcps->retransmitTick)){
+		tcps->isRetransmitTimerOn = 0;
+		handleTCPRetransmitTimeout(tcps, c);
+	}
+	if(tcps->isDelayedAckOn && isTCPTickReached(now, tcps->delayedAckTick)){
+		tcps->isDelayedAckOn = 0;
+		tcps->isAckNow = 1;
+	}
+	if(tcps->isCloseTimerOn && isTCPTickReached(now, tcps->closeTick)){
+		tcps->isCloseTimerOn = 0;
+		if(tcps->state == TCP_TIME_WAIT || tcps->state == TCP_FIN_WAIT_2){
+			tcps->state = TCP_CLOSED;
+		}
+	}
+}
+
+// SACK scoreboard of the sender
+
+static void addTCPSackedRange(TCPSocket *tcps, uint32_t begin, uint32_t end){
+	TCPRange *const s = tcps->sacked;
+	uintptr_t i = 0;
+	// merge overlapping and adjacent ranges
+	while(i < tcps->sackedCount){
+		if(isSeqLess(end, s[i].begin) || isSeqLess(s[i].end, begin)){
+			i++;
+			continue;
+		}
+		begin = minSeq(begin, s[i].begin);
+		end = maxSeq(end, s[i].end);
+		removeTCPRange(s, &tcps->sackedCount, i);
+	}
+	for(i = 0; i < tcps->sackedCount && isSeqLess(s[i].begin, begin); i++);
+	if(tcps->sackedCount == TCP_MAX_SACK_BLOCK_COUNT){
+		// forget the highest range
+		if(i == TCP_MAX_SACK_BLOCK_COUNT){
+			return;
+		}
+		tcps->sackedCount--;
+	}
+	insertTCPRange(s, &tcps->sackedCount, i, begin, end);
+}
+
+static void removeTCPSackedRange(TCPSocket *tcps, uint32_t acknowledged){
+	TCPRange *const s = tcps->sacked;
+	while(tcps->sackedCount > 0 && isSeqLessOrEqual(s[0].end, acknowledged)){
+		removeTCPRange(s, &tcps->sackedCount, 0);
+	}
+	if(tcps->sackedCount > 0){
+		s[0].begin = maxSeq(s[0].begin, acknowledged);
+	}
+}
+
+static uint32_t getNextUnsackedSequence(const TCPSocket *tcps, uint32_t seq){
+	uintptr_t i;
+	for(i = 0; i < tcps->sackedCount; i++){
+		if(isSeqLessOrEqual(tcps->sacked[i].begin, seq) && isSeqLess(seq, tcps->sacked[i].end)){
+			seq = tcps->sacked[i].end;
+		}
+	}
+	return seq;
+}
+
+static uint32_t getNextSackedSequence(const TCPSocket *tcps, uint32_t seq){
+	uintptr_t i;
+	for(i = 0; i < tcps->sackedCount; i++){
+		if(isSeqLess(seq, tcps->sacked[i].begin)){
+			return tcps->sacked[i].begin;
+		}
+	}
+	return tcps->sendMax;
+}
+
+// there is unsacked data below the highest SACK block
+static int hasTCPSackHole(const TCPSocket *tcps){
+	if(tcps->sackedCount == 0){
+		return 0;
+	}
+	const uint32_t seq = getNextUnsackedSequence(tcps, maxSeq(tcps->retransmitNext, tcps->sendUnacknowledged));
+	return isSeqLess(seq, tcps->sacked[tcps->sackedCount - 1].begin);
+}
+
+// congestion control
+
+static void enterTCPFastRecovery(TCPSocket *tcps){
+	const uint32_t flightSize = tcps->sendMax - tcps->sendUnacknowledged;
+	tcps->slowStartThreshold = MAX(flightSize / 2, 2 * tcps->maxSegmentSize);
+	tcps->congestionWindow = tcps->slowStartThreshold + TCP_DUPLICATE_ACK_THRESHOLD * tcps->maxSegmentSize;
+	tcps->recover = tcps->sendMax;
+	tcps->isInFastRecovery = 1;
+	tcps->retransmitNext = tcps->sendUnacknowledged;
+	tcps->needRetransmit = 1;
+	tcps->isMeasuringRTT = 0;
+}
+
+static void handleTCPDuplicateAck(TCPSocket *tcps){
+	tcps->duplicateAckCount++;
+	if(tcps->isInFastRecovery){
+		// inflate the window for the segment that has left the network
+		tcps->congestionWindow += tcps->maxSegmentSize;
+		if(hasTCPSackHole(tcps)){
+			tcps->needRetransmit = 1;
+		}
+		return;
+	}
+	// avoid multiple fast retransmits in one window, RFC 6582
+	if(tcps->duplicateAckCount == TCP_DUPLICATE_ACK_THRESHOLD &&
+	isSeqLess(tcps->recover, tcps->sendUnacknowledged)){
+		enterTCPFastRecovery(tcps);
+	}
+}
+
+static void handleTCPNewAck(TCPSocket *tcps, uint32_t ack){
+	const uint32_t ackedSize = ack - tcps->sendUnacknowledged;
+	const uint32_t mss = tcps->maxSegmentSize;
+	if(tcps->isInFastRecovery){
+		if(isSeqLessOrEqual(tcps->recover, ack)){
+			// full acknowledgment
+			tcps->congestionWindow = MIN(tcps->slowStartThreshold, (tcps->sendMax - ack) + mss);
+			tcps->isInFastRecovery = 0;
+			tcps->duplicateAckCount = 0;
+		}
+		else{
+			// partial acknowledgment; retransmit the next hole and deflate the window
+			tcps->retransmitNext = ack;
+			tcps->needRetransmit = 1;
+			tcps->congestionWindow -= MIN(ackedSize, tcps->congestionWindow);
+			if(ackedSize >= mss){
+				tcps->congestionWindow += mss;
+			}
+			tcps->congestionWindow = MAX(tcps->congestionWindow, mss);
+		}
+		return;
+	}
+	tcps->duplicateAckCount = 0;
+	if(tcps->congestionWindow < tcps->slowStartThreshold){
+		tcps->congestionWindow += MIN(ackedSize, mss);
+	}
+	else{
+		tcps->congestionWindow += MAX(1, mss * mss / tcps->congestionWindow);
+	}
+	tcps->congestionWindow = MIN(tcps->congestionWindow, TCP_MAX_CONGESTION_WINDOW);
+}
+
+static int isTCPFINAcknowledged(const TCPSocket *tcps){
+	return tcps->isFINQueued && tcps->sendUnacknowledged == tcps->sendDataEnd + 1;
+}
+
+static void processTCPAcknowledge(
+	TCPSocket *tcps, const TCPHeader *h, const TCPOptions *o,
+	uint32_t seq, uint32_t ack, int isPureAck, uint32_t now
 ){
-	TCPIPHeader *NEW(h);
-	if(h == NULL){
+	if(isSeqLess(ack, tcps->sendUnacknowledged)){
+		return;
+	}
+	const uint32_t oldWindow = tcps->sendWindow;
+	if(isSeqLess(tcps->sendWindowUpdateSequence, seq) ||
+	(tcps->sendWindowUpdateSequence == seq && isSeqLessOrEqual(tcps->sendWindowUpdateAcknowledge, ack))){
+		tcps->sendWindow = changeEndian16(h->windowSize);
+		tcps->sendWindowUpdateSequence = seq;
+		tcps->sendWindowUpdateAcknowledge = ack;
+	}
+	uintptr_t i;
+	for(i = 0; i < o->sackCount; i++){
+		const TCPRange *r = o->sack + i;
+		if(isSeqLess(ack, r->end) && isSeqLess(r->begin, r->end) && isSeqLessOrEqual(r->end, tcps->sendMax)){
+			addTCPSackedRange(tcps, maxSeq(r->begin, ack), r->end);
+		}
+	}
+	if(ack == tcps->sendUnacknowledged){
+		// RFC 5681
+		if(isPureAck && tcps->sendWindow == oldWindow && tcps->sendMax != tcps->sendUnacknowledged){
+			handleTCPDuplicateAck(tcps);
+		}
+		return;
+	}
+	// Karn's algorithm; see createTCPSegment
+	if(tcps->isMeasuringRTT && isSeqLess(tcps->rttSequence, ack)){
+		tcps->isMeasuringRTT = 0;
+		updateTCPRetransmitTimeout(tcps, now - tcps->rttStartTick);
+	}
+	handleTCPNewAck(tcps, ack);
+	tcps->sendUnacknowledged = ack;
+	tcps->sendNext = maxSeq(tcps->sendNext, ack);
+	tcps->retransmitNext = maxSeq(tcps->retransmitNext, ack);
+	removeTCPSackedRange(tcps, ack);
+	tcps->retransmitCount = 0;
+	tcps->isWindowProbe = 0;
+	if(ack == tcps->sendMax){
+		tcps->isRetransmitTimerOn = 0;
+	}
+	else{
+		startTCPRetransmitTimer(tcps, now);
+	}
+	if(isTCPFINAcknowledged(tcps) == 0){
+		return;
+	}
+	switch(tcps->state){
+	case TCP_FIN_WAIT_1:
+		tcps->state = TCP_FIN_WAIT_2;
+		startTCPCloseTimer(tcps, now, TCP_FIN_WAIT_2_TICK);
+		break;
+	case TCP_CLOSING:
+		tcps->state = TCP_TIME_WAIT;
+		startTCPCloseTimer(tcps, now, TCP_TIME_WAIT_TICK);
+		break;
+	case TCP_LAST_ACK:
+		tcps->state = TCP_CLOSED;
+		break;
+	default:
+		break;
+	}
+}
+
+// receive
+
+static void addTCPOutOfOrderRange(TCPSocket *tcps, uint32_t begin, uint32_t end){
+	TCPRange *const r = tcps->outOfOrder;
+	uintptr_t i = 0;
+	while(i < tcps->outOfOrderCount){
+		if(isSeqLess(end, r[i].begin) || isSeqLess(r[i].end, begin)){
+			i++;
+			continue;
+		}
+		begin = minSeq(begin, r[i].begin);
+		end = maxSeq(end, r[i].end);
+		removeTCPRange(r, &tcps->outOfOrderCount, i);
+	}
+	// the data of forgotten ranges will be retransmitted
+	if(tcps->outOfOrderCount == TCP_MAX_SACK_BLOCK_COUNT){
+		tcps->outOfOrderCount--;
+	}
+	insertTCPRange(r, &tcps->outOfOrderCount, 0, begin, end);
+}
+
+static void receiveTCPFIN(TCPSocket *tcps, uint32_t now){
+	tcps->receiveNext++;
+	tcps->isFINReceived = 1;
+	tcps->hasOutOfOrderFIN = 0;
+	tcps->isAckNow = 1;
+	switch(tcps->state){
+	case TCP_ESTABLISHED:
+		tcps->state = TCP_CLOSE_WAIT;
+		break;
+	case TCP_FIN_WAIT_1:
+		tcps->state = TCP_CLOSING;
+		break;
+	case TCP_FIN_WAIT_2:
+		tcps->state = TCP_TIME_WAIT;
+		startTCPCloseTimer(tcps, now, TCP_TIME_WAIT_TICK);
+		break;
+	default:
+		break;
+	}
+}
+
+static void mergeTCPOutOfOrderRange(TCPSocket *tcps, uint32_t now){
+	TCPRange *const r = tcps->outOfOrder;
+	uintptr_t i = 0;
+	while(i < tcps->outOfOrderCount){
+		if(isSeqLess(tcps->receiveNext, r[i].begin)){
+			i++;
+			continue;
+		}
+		tcps->receiveNext = maxSeq(tcps->receiveNext, r[i].end);
+		removeTCPRange(r, &tcps->outOfOrderCount, i);
+		i = 0;
+	}
+	if(tcps->hasOutOfOrderFIN && tcps->outOfOrderFINSequence == tcps->receiveNext){
+		receiveTCPFIN(tcps, now);
+	}
+}
+
+static void processTCPData(TCPSocket *tcps, uint32_t seq, const uint8_t *data, uintptr_t size, uint32_t now){
+	uint32_t begin = seq, end = seq + size;
+	if(isSeqLess(begin, tcps->receiveNext)){
+		data += tcps->receiveNext - begin;
+		begin = tcps->receiveNext;
+	}
+	end = minSeq(end, tcps->readNext + TCP_BUFFER_SIZE);
+	if(isSeqLessOrEqual(end, begin)){
+		// duplicate or out of window
+		tcps->isAckNow = 1;
+		return;
+	}
+	copyToTCPBuffer(tcps->receiveBuffer, begin, data, end - begin);
+	if(begin != tcps->receiveNext){
+		addTCPOutOfOrderRange(tcps, begin, end);
+		// duplicate ACK with SACK blocks
+		tcps->isAckNow = 1;
+		return;
+	}
+	const int isFillingHole = (tcps->outOfOrderCount != 0);
+	tcps->receiveNext = end;
+	mergeTCPOutOfOrderRange(tcps, now);
+	tcps->unacknowledgedSegmentCount++;
+	// acknowledge every 2 segments
+	if(isFillingHole || tcps->unacknowledgedSegmentCount >= 2){
+		tcps->isAckNow = 1;
+	}
+	else if(tcps->isDelayedAckOn == 0){
+		tcps->isDelayedAckOn = 1;
+		tcps->delayedAckTick = now + TCP_DELAYED_ACK_TICK;
+	}
+}
+
+static void processTCPFIN(TCPSocket *tcps, uint32_t finSequence, uint32_t now){
+	if(isSeqLess(finSequence, tcps->receiveNext) || tcps->isFINReceived){
+		tcps->isAckNow = 1;
+		return;
+	}
+	if(finSequence != tcps->receiveNext){
+		tcps->hasOutOfOrderFIN = 1;
+		tcps->outOfOrderFINSequence = finSequence;
+		tcps->isAckNow = 1;
+		return;
+	}
+	receiveTCPFIN(tcps, now);
+}
+
+static void initTCPConnection(TCPSocket *tcps, const TCPOptions *o){
+	if(o->maxSegmentSize != 0){
+		tcps->maxSegmentSize = MIN(o->maxSegmentSize, TCP_MAX_SEGMENT_SIZE);
+	}
+	tcps->isSACKPermitted = o->sackPermitted;
+	// RFC 3390 and RFC 5681
+	const uint32_t mss = tcps->maxSegmentSize;
+	tcps->congestionWindow = (tcps->retransmitCount != 0? mss: MIN(4 * mss, MAX(2 * mss, 4380)));
+}
+
+static void processTCPSYNSent(
+	TCPSocket *tcps, const TCPHeader *h, const TCPOptions *o,
+	uint32_t seq, uint32_t ack, TCPCompletion *c, uint32_t now
+){
+	if(h->ack && ack != tcps->initialSendSequence + 1){
+		return;
+	}
+	if(h->rst){
+		if(h->ack){
+			// connection refused
+			resetTCPSocket(tcps, c);
+		}
+		return;
+	}
+	if(h->syn == 0){
+		return;
+	}
+	tcps->receiveNext = seq + 1;
+	tcps->readNext = tcps->receiveNext;
+	tcps->receiveAdvertised = tcps->receiveNext;
+	tcps->sendWindow = changeEndian16(h->windowSize);
+	tcps->sendWindowUpdateSequence = seq;
+	tcps->sendWindowUpdateAcknowledge = ack;
+	initTCPConnection(tcps, o);
+	tcps->isAckNow = 1;
+	if(h->ack == 0){
+		// simultaneous open; send SYN-ACK
+		tcps->state = TCP_SYN_RECEIVED;
+		tcps->sendNext = tcps->initialSendSequence;
+		return;
+	}
+	if(tcps->isMeasuringRTT){
+		tcps->isMeasuringRTT = 0;
+		updateTCPRetransmitTimeout(tcps, now - tcps->rttStartTick);
+	}
+	tcps->sendUnacknowledged = ack;
+	tcps->retransmitNext = ack;
+	tcps->recover = ack;
+	tcps->isRetransmitTimerOn = 0;
+	tcps->retransmitCount = 0;
+	tcps->state = TCP_ESTABLISHED;
+	setTCPOpenCompletion(tcps, c, 1);
+}
+
+// listening sockets have no remote port
+static int isTCPConnectionUsed_noLock(uint16_t localPort, IPV4Address remoteAddress, uint16_t remotePort){
+	TCPSocket *s;
+	for(s = tcpService.socketList; s != NULL; s = s->next){
+		const IPSocket *ips = &s->ipSocket;
+		if(ips->localPort == localPort && ips->remotePort == remotePort &&
+		ips->remoteAddress.value == remoteAddress.value){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// several sockets may listen on the same port; the first one takes the connection
+static int claimTCPConnection(TCPSocket *tcps, const IPV4Header *packet, const TCPHeader *h){
+	IPSocket *ips = &tcps->ipSocket;
+	const uint16_t remotePort = changeEndian16(h->sourcePort);
+	acquireLock(&tcpService.lock);
+	const int ok = (isTCPConnectionUsed_noLock(ips->localPort, packet->source, remotePort) == 0);
+	// the local address is not changed; see dispatchQueuedPacket
+	if(ok){
+		ips->remoteAddress = packet->source;
+		ips->remotePort = remotePort;
+	}
+	releaseLock(&tcpService.lock);
+	return ok;
+}
+
+static void processTCPListen(
+	TCPSocket *tcps, const IPV4Header *packet, const TCPHeader *h, const TCPOptions *o, uint32_t seq
+){
+	if(h->rst || h->ack || h->syn == 0){
+		return;
+	}
+	if(claimTCPConnection(tcps, packet, h) == 0){
+		return;
+	}
+	tcps->receiveNext = seq + 1;
+	tcps->readNext = tcps->receiveNext;
+	tcps->receiveAdvertised = tcps->receiveNext;
+	tcps->sendWindow = changeEndian16(h->windowSize);
+	tcps->sendWindowUpdateSequence = seq;
+	tcps->sendWindowUpdateAcknowledge = tcps->initialSendSequence;
+	initTCPConnection(tcps, o);
+	// send SYN-ACK; the open request is completed in TCP_SYN_RECEIVED
+	tcps->state = TCP_SYN_RECEIVED;
+	tcps->isAckNow = 1;
+}
+
+// RFC 793 page 69
+static int isTCPSegmentAcceptable(const TCPSocket *tcps, uint32_t seq, uint32_t segmentLength){
+	const uint32_t windowBegin = tcps->receiveNext;
+	const uint32_t windowEnd = tcps->readNext + TCP_BUFFER_SIZE;
+	if(windowBegin == windowEnd || segmentLength == 0){
+		if(windowBegin == windowEnd){
+			// accept ACK and RST; the data is dropped in processTCPData
+			return seq == windowBegin;
+		}
+		return isSeqLessOrEqual(windowBegin, seq) && isSeqLess(seq, windowEnd);
+	}
+	const uint32_t last = seq + segmentLength - 1;
+	return (isSeqLessOrEqual(windowBegin, seq) && isSeqLess(seq, windowEnd)) ||
+		(isSeqLessOrEqual(windowBegin, last) && isSeqLess(last, windowEnd));
+}
+
+static void processTCPSegment(TCPSocket *tcps, const IPV4Header *packet, TCPCompletion *c){
+	const TCPHeader *h = getIPData(packet);
+	const uint32_t seq = changeEndian32(h->sequenceNumber);
+	const uint32_t ack = changeEndian32(h->acknowledgeNumber);
+	const uint8_t *data = getTCPData(h);
+	const uintptr_t dataSize = getTCPDataSize(packet, h);
+	const uint32_t now = getTCPTick();
+	TCPOptions o;
+	parseTCPOptions(h, &o);
+	switch(tcps->state){
+	case TCP_CLOSED:
+		return;
+	case TCP_LISTEN:
+		processTCPListen(tcps, packet, h, &o, seq);
+		return;
+	case TCP_SYN_SENT:
+		processTCPSYNSent(tcps, h, &o, seq, ack, c, now);
+		return;
+	default:
+		break;
+	}
+	if(isTCPSegmentAcceptable(tcps, seq, dataSize + h->syn + h->fin) == 0){
+		if(h->rst == 0){
+			tcps->isAckNow = 1;
+		}
+		return;
+	}
+	if(h->rst){
+		abortTCPConnection(tcps, c);
+		return;
+	}
+	if(h->syn){
+		// challenge ACK, RFC 5961
+		tcps->isAckNow = 1;
+		return;
+	}
+	if(h->ack == 0){
+		return;
+	}
+	if(tcps->state == TCP_SYN_RECEIVED){
+		if(ack != tcps->initialSendSequence + 1){
+			return;
+		}
+		tcps->state = TCP_ESTABLISHED;
+		tcps->isRetransmitTimerOn = 0;
+		setTCPOpenCompletion(tcps, c, 1);
+	}
+	if(isSeqLess(tcps->sendMax, ack)){
+		tcps->isAckNow = 1;
+		return;
+	}
+	processTCPAcknowledge(tcps, h, &o, seq, ack, (dataSize == 0 && h->fin == 0), now);
+	switch(tcps->state){
+	case TCP_ESTABLISHED:
+	case TCP_FIN_WAIT_1:
+	case TCP_FIN_WAIT_2:
+		if(dataSize != 0){
+			processTCPData(tcps, seq, data, dataSize, now);
+		}
+		if(h->fin){
+			processTCPFIN(tcps, seq + dataSize, now);
+		}
+		break;
+	case TCP_CLOSE_WAIT:
+	case TCP_CLOSING:
+	case TCP_LAST_ACK:
+	case TCP_TIME_WAIT:
+		if(h->fin){
+			// retransmitted FIN
+			tcps->isAckNow = 1;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+// transmit
+
+static uintptr_t createTCPOptions(const TCPSocket *tcps, uint8_t *options){
+	if(tcps->isSACKPermitted == 0 || tcps->outOfOrderCount == 0){
+		return 0;
+	}
+	options[0] = TCP_OPTION_NOP;
+	options[1] = TCP_OPTION_NOP;
+	options[2] = TCP_OPTION_SACK;
+	options[3] = 2 + 8 * tcps->outOfOrderCount;
+	uintptr_t i;
+	for(i = 0; i < tcps->outOfOrderCount; i++){
+		uint32_t edge[2] = {
+			changeEndian32(tcps->outOfOrder[i].begin),
+			changeEndian32(tcps->outOfOrder[i].end)
+		};
+		memcpy(options + 4 + i * 8, edge, sizeof(edge));
+	}
+	return 4 + 8 * tcps->outOfOrderCount;
+}
+
+// RFC 6691; the MSS does not include TCP options
+static uintptr_t getTCPMaxDataSize(const TCPSocket *tcps){
+	if(tcps->isSACKPermitted == 0 || tcps->outOfOrderCount == 0){
+		return tcps->maxSegmentSize;
+	}
+	return tcps->maxSegmentSize - (4 + 8 * tcps->outOfOrderCount);
+}
+
+static uintptr_t initTCPSegment(TCPSocket *tcps, TCPHeader *h, uint32_t seq, uintptr_t dataSize, int syn, int fin){
+	MEMSET0(h);
+	h->sourcePort = changeEndian16(tcps->ipSocket.localPort);
+	h->destinationPort = changeEndian16(tcps->ipSocket.remotePort);
+	h->sequenceNumber = changeEndian32(seq);
+	if(tcps->state != TCP_SYN_SENT){
+		h->ack = 1;
+		h->acknowledgeNumber = changeEndian32(tcps->receiveNext);
+	}
+	h->syn = syn;
+	h->fin = fin;
+	h->psh = (dataSize != 0 && seq + dataSize == tcps->sendDataEnd);
+	const uintptr_t optionSize = (syn? createTCPSYNOptions(h->options): createTCPOptions(tcps, h->options));
+	h->dataOffset = (sizeof(*h) + optionSize) / sizeof(uint32_t);
+	const uint32_t window = getTCPReceiveWindow(tcps);
+	h->windowSize = changeEndian16(window);
+	tcps->receiveAdvertised = maxSeq(tcps->receiveAdvertised, getTCPReceiveWindowEnd(tcps));
+	copyFromTCPBuffer(h->options + optionSize, tcps->sendBuffer, seq, dataSize);
+	// every segment carries the latest ACK
+	tcps->isAckNow = 0;
+	tcps->isDelayedAckOn = 0;
+	tcps->unacknowledgedSegmentCount = 0;
+	return sizeof(*h) + optionSize + dataSize;
+}
+
+static int canSendTCPFIN(const TCPSocket *tcps){
+	switch(tcps->state){
+	case TCP_ESTABLISHED:
+	case TCP_CLOSE_WAIT:
+	case TCP_FIN_WAIT_1:
+	case TCP_CLOSING:
+	case TCP_LAST_ACK:
+		return tcps->isFINQueued && isTCPFINAcknowledged(tcps) == 0;
+	default:
+		return 0;
+	}
+}
+
+// fast retransmission of the next hole
+static int selectTCPRetransmission(TCPSocket *tcps, uint32_t *seq, uintptr_t *size, int *fin){
+	if(tcps->needRetransmit == 0){
+		return 0;
+	}
+	tcps->needRetransmit = 0;
+	const uint32_t begin = getNextUnsackedSequence(tcps, maxSeq(tcps->retransmitNext, tcps->sendUnacknowledged));
+	if(isSeqLessOrEqual(tcps->sendNext, begin)){
+		return 0;
+	}
+	uint32_t end = minSeq(begin + getTCPMaxDataSize(tcps), getNextSackedSequence(tcps, begin));
+	end = minSeq(end, minSeq(tcps->sendNext, tcps->sendDataEnd));
+	*seq = begin;
+	*size = end - begin;
+	*fin = (end == tcps->sendDataEnd && canSendTCPFIN(tcps) && isSeqLess(end, tcps->sendNext));
+	if(*size == 0 && *fin == 0){
+		return 0;
+	}
+	tcps->retransmitNext = end + *fin;
+	tcps->isMeasuringRTT = 0;
+	return 1;
+}
+
+// new data, or retransmission after timeout
+static int selectTCPData(TCPSocket *tcps, uint32_t *seq, uintptr_t *size, int *fin, uint32_t now){
+	const uint32_t sendNext = tcps->sendNext;
+	const uintptr_t pendingSize = tcps->sendDataEnd - sendNext;
+	const uintptr_t maxDataSize = getTCPMaxDataSize(tcps);
+	*seq = sendNext;
+	*size = 0;
+	*fin = 0;
+	if(isSeqLess(sendNext, tcps->sendDataEnd)){
+		const uint32_t flightSize = sendNext - tcps->sendUnacknowledged;
+		uint32_t window = MIN(tcps->congestionWindow, tcps->sendWindow);
+		if(tcps->sendWindow == 0 && tcps->isWindowProbe){
+			window = 1;
+		}
+		if(window > flightSize){
+			*size = MIN(MIN(window - flightSize, pendingSize), maxDataSize * TCP_LARGE_SEND_SEGMENT_COUNT);
+		}
+		// Nagle's algorithm and sender side silly window avoidance
+		if(*size < maxDataSize && *size < pendingSize && flightSize != 0 &&
+		isSeqLessOrEqual(tcps->sendMax, sendNext)){
+			*size = 0;
+		}
+		if(*size == 0 && tcps->sendWindow == 0 && tcps->isRetransmitTimerOn == 0){
+			startTCPRetransmitTimer(tcps, now);
+		}
+	}
+	if(*size == pendingSize && canSendTCPFIN(tcps) && sendNext + *size == tcps->sendDataEnd){
+		*fin = 1;
+	}
+	if(*size == 0 && *fin == 0){
+		return 0;
+	}
+	tcps->isWindowProbe = 0;
+	if(sendNext == tcps->sendMax && tcps->isMeasuringRTT == 0){
+		tcps->isMeasuringRTT = 1;
+		tcps->rttSequence = sendNext;
+		tcps->rttStartTick = now;
+	}
+	tcps->sendNext = sendNext + *size + *fin;
+	if(*fin){
+		if(tcps->state == TCP_ESTABLISHED){
+			tcps->state = TCP_FIN_WAIT_1;
+		}
+		if(tcps->state == TCP_CLOSE_WAIT){
+			tcps->state = TCP_LAST_ACK;
+		}
+	}
+	return 1;
+}
+
+// return the size of segment, or 0 if there is nothing to send
+static uintptr_t createTCPSegment(TCPSocket *tcps, TCPHeader *h, uint32_t now){
+	uint32_t seq;
+	uintptr_t size = 0;
+	int syn = 0, fin = 0;
+	switch(tcps->state){
+	case TCP_CLOSED:
+	case TCP_LISTEN:
+		return 0;
+	case TCP_SYN_SENT:
+	case TCP_SYN_RECEIVED:
+		if(tcps->sendNext != tcps->initialSendSequence){
+			return 0;
+		}
+		syn = 1;
+		seq = tcps->initialSendSequence;
+		if(tcps->sendMax == seq){
+			tcps->isMeasuringRTT = 1;
+			tcps->rttSequence = seq;
+			tcps->rttStartTick = now;
+		}
+		tcps->sendNext = seq + 1;
+		break;
+	default:
+		if(selectTCPRetransmission(tcps, &seq, &size, &fin)){
+			break;
+		}
+		if(selectTCPData(tcps, &seq, &size, &fin, now)){
+			break;
+		}
+		if(tcps->isAckNow == 0){
+			return 0;
+		}
+		seq = tcps->sendNext;
+		break;
+	}
+	if(size != 0 || syn || fin){
+		tcps->sendMax = maxSeq(tcps->sendMax, seq + size + syn + fin);
+		if(tcps->isRetransmitTimerOn == 0){
+			startTCPRetransmitTimer(tcps, now);
+		}
+	}
+	return initTCPSegment(tcps, h, seq, size, syn, fin);
+}
+
+// return 1 if the socket is closed and released
+static int processTCPSocket(TCPSocket *tcps, TCPHeader *segment){
+	TCPCompletion c = INITIAL_TCP_COMPLETION;
+	const uint32_t now = getTCPTick();
+	acquireLock(&tcps->lock);
+	handleTCPTimers(tcps, now, &c);
+	acceptTCPWriteData(tcps, &c);
+	deliverTCPReceiveData(tcps, &c);
+	releaseLock(&tcps->lock);
+	runTCPCompletion(tcps, &c);
+	while(1){
+		acquireLock(&tcps->lock);
+		uintptr_t size = createTCPSegment(tcps, segment, now);
+		const uintptr_t maxDataSize = getTCPMaxDataSize(tcps);
+		releaseLock(&tcps->lock);
+		if(size == 0){
+			break;
+		}
+		// lost segments are recovered by retransmission
+		transmitIPSegments(&tcps->ipSocket, (const uint8_t*)segment, size, maxDataSize);
+	}
+	acquireLock(&tcps->lock);
+	const int isClosed = (tcps->state == TCP_CLOSED && tcps->isReleased && tcps->openRequest == NULL);
+	int isTimerOn = 0;
+	uint32_t timerTick = 0;
+	updateEarliestTCPTick(&isTimerOn, &timerTick, tcps->isRetransmitTimerOn, tcps->retransmitTick);
+	updateEarliestTCPTick(&isTimerOn, &timerTick, tcps->isDelayedAckOn, tcps->delayedAckTick);
+	updateEarliestTCPTick(&isTimerOn, &timerTick, tcps->isCloseTimerOn, tcps->closeTick);
+	releaseLock(&tcps->lock);
+	// the timers started by the IP worker are followed by scheduleTCPSocket
+	if(isClosed == 0){
+		setTCPSocketTimer(tcps, isTimerOn, timerTick);
+	}
+	return isClosed;
+}
+
+static void stopTCPSocket(TCPSocket *tcps){
+	// the IP worker drops the packets after isStopped is set; see receiveTCPPacket
+	stopIPSocketTasks(&tcps->ipSocket);
+	acquireLock(&tcps->lock);
+	tcps->isStopped = 1;
+	uint8_t *sendBuffer = tcps->sendBuffer, *receiveBuffer = tcps->receiveBuffer;
+	tcps->sendBuffer = NULL;
+	tcps->receiveBuffer = NULL;
+	releaseLock(&tcps->lock);
+	releaseKernelMemory(sendBuffer);
+	releaseKernelMemory(receiveBuffer);
+}
+
+// return 1 if the socket is not in the ready list
+static int removeTCPSocket(TCPSocket *tcps){
+	acquireLock(&tcpService.lock);
+	REMOVE_FROM_DQUEUE(tcps);
+	if(IS_IN_DQUEUE(&tcps->timer)){
+		REMOVE_FROM_DQUEUE(&tcps->timer);
+	}
+	tcps->isListed = 0;
+	const int isReady = tcps->isReady;
+	releaseLock(&tcpService.lock);
+	return isReady == 0;
+}
+
+static void tcpTask(__attribute__((__unused__)) void *arg){
+	TCPHeader *segment = allocateKernelMemory(TCP_MAX_HEADER_SIZE + TCP_LARGE_SEND_SEGMENT_COUNT * TCP_MAX_SEGMENT_SIZE);
+	if(segment == NULL){
+		panic("cannot allocate TCP segment buffer");
+	}
+	while(1){
+		acquireAllSemaphore(tcpService.event);
+		expireTCPTimers(getTCPTick());
+		// only this task removes sockets from the list
+		TCPSocket *tcps;
+		int isListed;
+		while((tcps = takeReadyTCPSocket(&isListed)) != NULL){
+			if(isListed == 0){
+				// scheduled again before removed
+				stopTCPSocket(tcps);
+				continue;
+			}
+			if(processTCPSocket(tcps, segment) && removeTCPSocket(tcps)){
+				stopTCPSocket(tcps);
+			}
+		}
+	}
+}
+
+static void tcpTimerTask(__attribute__((__unused__)) void *arg){
+	uintptr_t alarm = systemCall_setAlarm(TCP_TICK_MILLISECOND, 1);
+	if(alarm == IO_REQUEST_FAILURE){
+		panic("cannot set TCP timer");
+	}
+	while(1){
+		if(systemCall_waitIO(alarm) != alarm){
+			panic("wrong TCP timer");
+		}
+		tcpService.currentTick++;
+		releaseSemaphore(tcpService.event);
+	}
+}
+
+// file interface
+
+static const TCPHeader *validateTCPHeader(const IPV4Header *packet, uintptr_t packetSize, int checksumVerified){
+	if(packet->protocol != IP_DATA_PROTOCOL_TCP){
+		return NULL;
+	}
+	const uintptr_t ipHeaderSize = getIPHeaderSize(packet);
+	if(ipHeaderSize + sizeof(TCPHeader) > packetSize){
+		printk("bad TCP/IP packet size %u; IP header size %u\n", packetSize, ipHeaderSize);
+		return NULL;
+	}
+	const TCPHeader *h = getIPData(packet);
+	const uintptr_t tcpHeaderSize = getTCPHeaderSize(h);
+	if(tcpHeaderSize < sizeof(TCPHeader) || ipHeaderSize + tcpHeaderSize > packetSize){
+		printk("bad TCP header size %u; packet size %u\n", tcpHeaderSize, packetSize);
+		return NULL;
+	}
+	if((checksumVerified & CHECKSUM_OFFLOAD_IPV4_DATA) == 0 && calculateIPDataChecksum(packet) != 0){
+		printk("bad TCP checksum %x %x\n", h->checksum, calculateIPDataChecksum(packet));
 		return NULL;
 	}
-	initTCPIPPacket(h, data, dataSize, seqNumber, windowSize, localAddr, localPort, remoteAddr, remotePort);
 	return h;
 }
 
-typedef struct{
-	IPSocket ipSocket;
-}TCPSocket;
-/*
-static void TCPClientTask(void *arg){
-	TCPSocket *tcps = *(TCPSocket**)arg;
+static int filterTCPPacket(IPSocket *ips, const IPV4Header *packet, uintptr_t packetSize, int checksumVerified){
+	TCPSocket *tcps = ips->instance;
+	if(tcps->isStopped){
+		return 0;
+	}
+	// every socket filters the packet, so compare the ports before verifying the checksum
+	if(packet->protocol != IP_DATA_PROTOCOL_TCP || getIPHeaderSize(packet) + sizeof(TCPHeader) > packetSize){
+		return 0;
+	}
+	const TCPHeader *h = getIPData(packet);
+	if(changeEndian16(h->destinationPort) != ips->localPort){
+		return 0;
+	}
+	if(ips->remotePort == 0){
+		// listening; see processTCPListen
+		if(h->syn == 0 || h->ack || h->rst){
+			return 0;
+		}
+	}
+	else if(changeEndian16(h->sourcePort) != ips->remotePort){
+		return 0;
+	}
+	return (validateTCPHeader(packet, packetSize, checksumVerified) != NULL);
+}
+
+static int receiveTCPPacket(IPSocket *ips, __attribute__((__unused__)) RWIPQueue *q, const IPV4Header *packet){
+	TCPSocket *tcps = ips->instance;
+	TCPCompletion c = INITIAL_TCP_COMPLETION;
+	acquireLock(&tcps->lock);
+	const int isStopped = tcps->isStopped;
+	if(isStopped == 0){
+		processTCPSegment(tcps, packet, &c);
+		acceptTCPWriteData(tcps, &c);
+		deliverTCPReceiveData(tcps, &c);
+	}
+	releaseLock(&tcps->lock);
+	// the packet is always consumed
+	if(isStopped){
+		return 1;
+	}
+	runTCPCompletion(tcps, &c);
+	scheduleTCPSocket(tcps);
+	return 1;
+}
 
+static int readTCP(RWFileRequest *rwfr, OpenedFile *of, uint8_t *buffer, uintptr_t size){
+	TCPSocket *tcps = getFileInstance(of);
+	TCPPendingIO *p = createTCPPendingIO(rwfr, tcps, buffer, size);
+	if(p == NULL){
+		return 0;
+	}
+	TCPCompletion c = INITIAL_TCP_COMPLETION;
+	acquireLock(&tcps->lock);
+	appendTCPPendingIO(&tcps->readList, p);
+	setRWFileIOCancellable(rwfr, p, cancelTCPPendingIO);
+	deliverTCPReceiveData(tcps, &c);
+	const int isWindowUpdate = tcps->isAckNow;
+	releaseLock(&tcps->lock);
+	runTCPCompletion(tcps, &c);
+	if(isWindowUpdate){
+		scheduleTCPSocket(tcps);
+	}
+	return 1;
 }
-*/
+
+static int writeTCP(RWFileRequest *rwfr, OpenedFile *of, const uint8_t *buffer, uintptr_t size){
+	TCPSocket *tcps = getFileInstance(of);
+	TCPPendingIO *p = createTCPPendingIO(rwfr, tcps, (uint8_t*)buffer, size);
+	if(p == NULL){
+		return 0;
+	}
+	TCPCompletion c = INITIAL_TCP_COMPLETION;
+	acquireLock(&tcps->lock);
+	appendTCPPendingIO(&tcps->writeList, p);
+	setRWFileIOCancellable(rwfr, p, cancelTCPPendingIO);
+	acceptTCPWriteData(tcps, &c);
+	releaseLock(&tcps->lock);
+	runTCPCompletion(tcps, &c);
+	scheduleTCPSocket(tcps);
+	return 1;
+}
+
 static void closeTCP(CloseFileRequest *cfr, OpenedFile *of){
 	TCPSocket *tcps = getFileInstance(of);
-	stopIPSocketTasks(&tcps->ipSocket);
+	acquireLock(&tcps->lock);
+	tcps->isReleased = 1;
+	if(tcps->state == TCP_ESTABLISHED || tcps->state == TCP_CLOSE_WAIT){
+		// FIN is sent after all data in sendBuffer
+		tcps->isFINQueued = 1;
+	}
+	releaseLock(&tcps->lock);
+	scheduleTCPSocket(tcps);
 	completeCloseFile(cfr);
 }
 
 static void deleteTCPSocket(IPSocket *ips){
 	TCPSocket *tcps = ips->instance;
+	assert(tcps->sendBuffer == NULL && tcps->receiveBuffer == NULL);
 	DELETE(tcps);
 }
 
-static int openTCPClient(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm){
+static int isTCPPortUsed_noLock(uint16_t port){
+	TCPSocket *s;
+	for(s = tcpService.socketList; s != NULL; s = s->next){
+		if(s->ipSocket.localPort == port){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// if the local port is 0, assign a dynamic port
+// a given local port may be shared by listening sockets and connections to different remote ports
+static int addTCPSocket(TCPSocket *tcps){
+	IPSocket *ips = &tcps->ipSocket;
+	acquireLock(&tcpService.lock);
+	int ok = 1;
+	if(ips->localPort == 0){
+		int i;
+		for(i = 0; i < 65536 - TCP_FIRST_DYNAMIC_PORT; i++){
+			uint16_t port = tcpService.nextDynamicPort;
+			tcpService.nextDynamicPort = (port == 65535? TCP_FIRST_DYNAMIC_PORT: port + 1);
+			if(isTCPPortUsed_noLock(port) == 0){
+				ips->localPort = port;
+				break;
+			}
+		}
+	}
+	ok = (ips->localPort != 0 &&
+		isTCPConnectionUsed_noLock(ips->localPort, ips->remoteAddress, ips->remotePort) == 0);
+	if(ok){
+		ADD_TO_DQUEUE(tcps, &tcpService.socketList);
+		tcps->isListed = 1;
+	}
+	releaseLock(&tcpService.lock);
+	return ok;
+}
+
+static void initTCPSocket(TCPSocket *tcps, OpenFileRequest *ofr){
+	tcps->lock = initialSpinlock;
+	tcps->state = TCP_SYN_SENT;
+	tcps->openRequest = ofr;
+	tcps->isReleased = 0;
+	tcps->isReset = 0;
+	tcps->isStopped = 0;
+	tcps->readList = NULL;
+	tcps->writeList = NULL;
+	tcps->isPassive = 0;
+	initTCPConnectionState(tcps);
+	tcps->prev = NULL;
+	tcps->next = NULL;
+	tcps->isListed = 0;
+	tcps->isReady = 0;
+	tcps->nextReady = NULL;
+	tcps->timer.socket = tcps;
+	tcps->timer.tick = 0;
+	tcps->timer.prev = NULL;
+	tcps->timer.next = NULL;
+}
+
+// the request is completed after the three-way handshake
+// an active open fails if the handshake is reset or times out; a passive open returns to TCP_LISTEN
+static int openTCPSocket(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm, int isPassive){
 	TCPSocket *NEW(tcps);
 	EXPECT(tcps != NULL);
-	initIPSocket(&tcps->ipSocket, tcps, NULL, NULL, NULL, NULL, deleteTCPSocket);
+	initIPSocket(&tcps->ipSocket, tcps, createTCPIPPacket, filterTCPPacket, receiveTCPPacket, deleteTCPSocket);
+	tcps->ipSocket.protocol = IP_DATA_PROTOCOL_TCP;
+	initTCPSocket(tcps, ofr);
 	int ok = scanIPSocketArguments(&tcps->ipSocket, fileName, nameLength);
 	EXPECT(ok && ofm.writable);
-
-	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
-	ff.close = closeTCP;
-	//Task *t = createSharedMemoryTask(TCPClientTask);
-	completeOpenFile(ofr, tcps, &ff);
+	IPSocket *ips = &tcps->ipSocket;
+	if(isPassive){
+		// the address in the name is local
+		ok = (ips->localAddress.value == ANY_IPV4_ADDRESS.value && ips->localPort == 0 && ips->remotePort != 0);
+		ips->localAddress = ips->remoteAddress;
+		ips->localPort = ips->remotePort;
+		ips->remoteAddress = ANY_IPV4_ADDRESS;
+		ips->remotePort = 0;
+		tcps->state = TCP_LISTEN;
+		tcps->isPassive = 1;
+	}
+	else{
+		ok = (ips->remoteAddress.value != ANY_IPV4_ADDRESS.value && ips->remotePort != 0);
+	}
+	EXPECT(ok);
+	tcps->sendBuffer = allocateKernelMemory(TCP_BUFFER_SIZE);
+	EXPECT(tcps->sendBuffer != NULL);
+	tcps->receiveBuffer = allocateKernelMemory(TCP_BUFFER_SIZE);
+	EXPECT(tcps->receiveBuffer != NULL);
+	ok = startIPSocketTasks(&tcps->ipSocket);
+	EXPECT(ok);
+	ok = addTCPSocket(tcps);
+	EXPECT(ok);
+	// the dynamic port is assigned after the socket is started
+	rehashIPSocket(ips);
+	// send SYN if active
+	scheduleTCPSocket(tcps);
 	return 1;
 	ON_ERROR;
+	// port is used; the socket is deleted by the IP worker
+	stopTCPSocket(tcps);
+	return 0;
+	ON_ERROR;
+	releaseKernelMemory(tcps->receiveBuffer);
+	ON_ERROR;
+	releaseKernelMemory(tcps->sendBuffer);
+	ON_ERROR;
+	ON_ERROR;
+	// invalid address
+	ON_ERROR;
+	// invalid argument
 	DELETE(tcps);
 	ON_ERROR;
 	return 0;
 }
 
+// tcp:REMOTE:PORT;src=LOCAL:PORT;dev=DEVICE
+static int openTCPClient(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm){
+	return openTCPSocket(ofr, fileName, nameLength, ofm, 0);
+}
+
+// tcpsrv:LOCAL:PORT;dev=DEVICE
+// each open accepts one connection; open again to accept more
+static int openTCPServer(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm){
+	return openTCPSocket(ofr, fileName, nameLength, ofm, 1);
+}
+
 void initTCP(void){
+	tcpService.lock = initialSpinlock;
+	tcpService.socketList = NULL;
+	tcpService.nextDynamicPort = TCP_FIRST_DYNAMIC_PORT;
+	tcpService.readyHead = NULL;
+	tcpService.readyTail = &tcpService.readyHead;
+	uintptr_t i;
+	for(i = 0; i < TCP_TIMER_WHEEL_SIZE; i++){
+		tcpService.timerWheel[i] = NULL;
+	}
+	tcpService.wheelTick = 0;
+	tcpService.currentTick = 0;
+	tcpService.event = createSemaphore(0);
+	if(tcpService.event == NULL){
+		panic("cannot initialize TCP service");
+	}
+	// share the device files with internetService
+	Task *t = createSharedMemoryTask(tcpTask, NULL, 0, processorLocalTask());
+	if(t == NULL){
+		panic("cannot create TCP task");
+	}
+	resume(t);
+	t = createSharedMemoryTask(tcpTimerTask, NULL, 0, processorLocalTask());
+	if(t == NULL){
+		panic("cannot create TCP timer task");
+	}
+	resume(t);
+
 	FileNameFunctions fnf = INITIAL_FILE_NAME_FUNCTIONS;
 	fnf.open = openTCPClient;
-	addFileSystem(&fnf, "tcpclient", strlen("tcpclient"));
-	//fnf.open = openTCPServer;
-	//addFileSystem(&fnf, "tcpserver", strlen("tcpserver"));
+	// the name must not be longer than MAX_FILE_SERVICE_NAME_LENGTH
+	if(addFileSystem(&fnf, "tcp", strlen("tcp")) == 0){
+		panic("cannot create TCP service");
+	}
+	fnf.open = openTCPServer;
+	if(addFileSystem(&fnf, "tcpsrv", strlen("tcpsrv")) == 0){
+		panic("cannot create TCP server service");
+	}
+}
+
+#ifndef NDEBUG
+
+// eth0 and eth1 are on the same hub, for example
+// qemu -net nic,model=e1000 -net nic,model=e1000 -net user
+// the user network assigns the first address to eth0
+#define TEST_TCP_SERVER_ADDRESS "10.0.2.15"
+#define TEST_TCP_PORT "5001"
+#define TEST_TCP_SIZE (16 << 20)
+
+static void testTCPSinkTask(void *arg){
+	Semaphore *done = *(Semaphore**)arg;
+	const char *fileName = "tcpsrv:0.0.0.0:" TEST_TCP_PORT ";dev=i8254x:eth0";
+	uintptr_t f = syncOpenFileN(fileName, strlen(fileName), OPEN_FILE_MODE_WRITABLE);
+	assert(f != IO_REQUEST_FAILURE);
+	const uintptr_t bufferSize = 16384;
+	uint8_t *buffer = allocateKernelMemory(bufferSize);
+	assert(buffer != NULL);
+	uintptr_t receivedSize = 0;
+	while(1){
+		uintptr_t readSize = bufferSize;
+		uintptr_t r = syncReadFile(f, buffer, &readSize);
+		assert(r != IO_REQUEST_FAILURE);
+		if(readSize == 0){
+			break;
+		}
+		receivedSize += readSize;
+	}
+	uintptr_t r = syncCloseFile(f);
+	assert(r != IO_REQUEST_FAILURE);
+	releaseKernelMemory(buffer);
+	assert(receivedSize == TEST_TCP_SIZE);
+	releaseSemaphore(done);
+	systemCall_terminate();
 }
+
+void testTCPThroughput(void);
+void testTCPThroughput(void){
+	int ok = waitForFirstResource("tcpsrv", RESOURCE_FILE_SYSTEM, matchName);
+	assert(ok);
+	// wait for DHCP
+	sleep(3000);
+	Semaphore *done = createSemaphore(0);
+	assert(done != NULL);
+	Task *t = createSharedMemoryTask(testTCPSinkTask, &done, sizeof(done), processorLocalTask());
+	assert(t != NULL);
+	resume(t);
+	// wait for the server to listen
+	sleep(100);
+	const char *fileName = "tcp:" TEST_TCP_SERVER_ADDRESS ":" TEST_TCP_PORT ";dev=i8254x:eth1";
+	uintptr_t f = syncOpenFileN(fileName, strlen(fileName), OPEN_FILE_MODE_WRITABLE);
+	assert(f != IO_REQUEST_FAILURE);
+	const uintptr_t bufferSize = 16384, totalSize = TEST_TCP_SIZE;
+	uint8_t *buffer = allocateKernelMemory(bufferSize);
+	assert(buffer != NULL);
+	uintptr_t i;
+	for(i = 0; i < bufferSize; i++){
+		buffer[i] = 'a' + i % 26;
+	}
+	uint64_t t0 = rdtsc();
+	for(i = 0; i < totalSize; i += bufferSize){
+		uintptr_t writeSize = bufferSize;
+		uintptr_t r = syncWriteFile(f, buffer, &writeSize);
+		assert(r != IO_REQUEST_FAILURE && writeSize == bufferSize);
+	}
+	uintptr_t r = syncCloseFile(f);
+	assert(r != IO_REQUEST_FAILURE);
+	// the sink reads until FIN
+	acquireSemaphore(done);
+	uint64_t t1 = rdtsc();
+	deleteSemaphore(done);
+	releaseKernelMemory(buffer);
+	printk("TCP received %u KB in %u M cycles\n", totalSize >> 10, (uint32_t)((t1 - t0) / 1000000));
+	printk("test TCP throughput ok\n");
+	systemCall_terminate();
+}
+
+#endif
@@ -39,62 +39,69 @@ static_assert(MEMBER_OFFSET(typeof(UDPIPHeader), ip) == 0);
 static_assert(MEMBER_OFFSET(typeof(UDPIPHeader), udp) == 20);
 
 static void initUDPIPPacket(
-	UDPIPHeader *h, const uint8_t *data, uint16_t dataSize,
+	UDPIPHeader *h, uint16_t dataSize,
 	IPV4Address localAddr, uint16_t localPort,
-	IPV4Address remoteAddr, uint16_t remotePort
+	IPV4Address remoteAddr, uint16_t remotePort,
+	int checksumOffload
 ){
 	initIPV4Header(&h->ip, dataSize + sizeof(h->udp), localAddr, remoteAddr, IP_DATA_PROTOCOL_UDP);
+	if(checksumOffload & CHECKSUM_OFFLOAD_IPV4_HEADER){
+		h->ip.headerChecksum = 0;
+	}
 	h->udp.sourcePort = changeEndian16(localPort);
 	h->udp.destinationPort = changeEndian16(remotePort);
 	h->udp.length = changeEndian16(dataSize + sizeof(h->udp));
 	h->udp.checksum = 0;
-	memcpy(h->udp.payload, data, dataSize);
-
+	assert(getUDPPacketSize(&h->udp) == getIPDataSize(&h->ip));
+	if(checksumOffload & CHECKSUM_OFFLOAD_IPV4_DATA){
+		h->udp.checksum = calculatePseudoIPHeaderSum(&h->ip);
+		return;
+	}
 	h->udp.checksum = calculateIPDataChecksum(&h->ip);
 	if(h->udp.checksum == 0){
 		h->udp.checksum = 0xffff;
 	}
 	assert(calculateIPDataChecksum(&h->ip) == 0);
-	assert(getUDPPacketSize(&h->udp) == getIPDataSize(&h->ip));
 }
 
+// copy data behind the headroom of packet and prepend the headers in place
 static UDPIPHeader *createUDPIPPacket(
-	const uint8_t *data, uintptr_t dataSize,
+	PacketBuffer *packet, const uint8_t *data, uintptr_t dataSize,
 	IPV4Address localAddr, uint16_t localPort,
-	IPV4Address remoteAddr, uint16_t remotePort
+	IPV4Address remoteAddr, uint16_t remotePort,
+	int checksumOffload
 ){
 	if(dataSize > MAX_UDP_PAYLOAD_SIZE){
 		return NULL;
 	}
-	UDPIPHeader *h = allocateKernelMemory(sizeof(*h) + dataSize);
+	uint8_t *payload = appendPacketBuffer(packet, dataSize);
+	if(payload == NULL){
+		return NULL;
+	}
+	memcpy(payload, data, dataSize);
+	UDPIPHeader *h = prependPacketBuffer(packet, sizeof(*h));
 	if(h == NULL){
 		return NULL;
 	}
-	initUDPIPPacket(h, data, dataSize, localAddr, localPort, remoteAddr, remotePort);
+	initUDPIPPacket(h, dataSize, localAddr, localPort, remoteAddr, remotePort, checksumOffload);
 	return h;
 }
 
-static IPV4Header *createUDPIPPacketFromSocket(
-	IPSocket *ips, IPV4Address src, IPV4Address dst,
-	const uint8_t *buffer, uintptr_t size
+static int createUDPIPPacketFromSocket(
+	IPSocket *ips, PacketBuffer *packet, IPV4Address src, IPV4Address dst,
+	const uint8_t *buffer, uintptr_t size, int checksumOffload
 ){
 	//UDPSocket *udps = ips->instance;
 	UDPIPHeader *h = createUDPIPPacket(
-		buffer, size,
+		packet, buffer, size,
 		src, ips->localPort,
-		dst, ips->remotePort
+		dst, ips->remotePort,
+		checksumOffload
 	);
-	EXPECT(h != NULL);
-	return &h->ip;
-	ON_ERROR;
-	return NULL;
-}
-
-static void deleteUDPIPPacket(IPV4Header *h){
-	releaseKernelMemory(h);
+	return (h != NULL);
 }
 
-static const UDPHeader *validateUDPHeader(const IPV4Header *packet, uintptr_t packetSize){
+static const UDPHeader *validateUDPHeader(const IPV4Header *packet, uintptr_t packetSize, int checksumVerified){
 	if(packet->protocol != IP_DATA_PROTOCOL_UDP){
 		return NULL;
 	}
@@ -109,23 +116,23 @@ static const UDPHeader *validateUDPHeader(const IPV4Header *packet, uintptr_t pa
 		printk("bad UDP/IP packet size %u; UDP packet size %u; IP header size %u\n", packetSize, udpPacketSize, ipHeaderSize);
 		return NULL;
 	}
-	if(h->checksum != 0 && calculateIPDataChecksum(packet) != 0){
+	if(h->checksum != 0 && (checksumVerified & CHECKSUM_OFFLOAD_IPV4_DATA) == 0 && calculateIPDataChecksum(packet) != 0){
 		printk("bad UDP checksum %x %x\n", h->checksum, calculateIPDataChecksum(packet));
 		return NULL;
 	}
 	return h;
 }
 
-static int filterUDPPacket(IPSocket *ips, const IPV4Header *packet, uintptr_t packetSize){
-	const UDPHeader *h = validateUDPHeader(packet, packetSize);
-	if(h == NULL){
+static int filterUDPPacket(IPSocket *ips, const IPV4Header *packet, uintptr_t packetSize, int checksumVerified){
+	// every socket filters the packet, so compare the port before verifying the checksum
+	if(packet->protocol != IP_DATA_PROTOCOL_UDP || getIPHeaderSize(packet) + sizeof(UDPHeader) > packetSize){
 		return 0;
 	}
 	UDPSocket *udps = ips->instance;
-	if(changeEndian16(h->destinationPort) != udps->ipSocket.localPort){
+	if(changeEndian16(((const UDPHeader*)getIPData(packet))->destinationPort) != udps->ipSocket.localPort){
 		return 0;
 	}
-	return 1;
+	return (validateUDPHeader(packet, packetSize, checksumVerified) != NULL);
 }
 
 static int receiveUDPPacket(__attribute__((__unused__)) IPSocket *ips, RWIPQueue *q, const IPV4Header *packet){
@@ -189,7 +196,8 @@ static void deleteUDPSocket(IPSocket *ips){
 static int openUDPSocket(OpenFileRequest *ofr, const char *fileName, uintptr_t nameLength, OpenFileMode ofm){
 	UDPSocket *NEW(udps);
 	EXPECT(udps != NULL);
-	initIPSocket(&udps->ipSocket, udps, createUDPIPPacketFromSocket, filterUDPPacket, receiveUDPPacket, deleteUDPIPPacket, deleteUDPSocket);
+	initIPSocket(&udps->ipSocket, udps, createUDPIPPacketFromSocket, filterUDPPacket, receiveUDPPacket, deleteUDPSocket);
+	udps->ipSocket.protocol = IP_DATA_PROTOCOL_UDP;
 	int ok = scanIPSocketArguments(&udps->ipSocket, fileName, nameLength);
 	EXPECT(ok && ofm.writable);
 	// TODO: is port using
@@ -70,7 +70,10 @@ struct XHCICapabilityRegisters{
 // PCI
 #define PCI_DRIVER_NAME ("pci")
 
-static uint32_t readPCIConfig(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset){
+// 0xcf8 and 0xcfc are shared by all processors
+static Spinlock pciConfigLock = INITIAL_SPINLOCK;
+
+static void selectPCIConfig(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset){
 	assert(offset % 4 == 0);
 	out32(0xcf8,
 		0x80000000 | // enable config cycle
@@ -79,7 +82,21 @@ static uint32_t readPCIConfig(uint8_t bus, uint8_t dev, uint8_t func, uint8_t of
 		(func << 8) | // 3 bits
 		offset // 8 bits
 	);
-	return in32(0xcfc);
+}
+
+static uint32_t readPCIConfig(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset){
+	acquireLock(&pciConfigLock);
+	selectPCIConfig(bus, dev, func, offset);
+	uint32_t v = in32(0xcfc);
+	releaseLock(&pciConfigLock);
+	return v;
+}
+
+static void writePCIConfig(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset, uint32_t value){
+	acquireLock(&pciConfigLock);
+	selectPCIConfig(bus, dev, func, offset);
+	out32(0xcfc, value);
+	releaseLock(&pciConfigLock);
 }
 
 typedef struct{
@@ -251,20 +268,24 @@ uintptr_t enumeratePCI(uint32_t classCode, uint32_t classMask){
 	return syncEnumerateFile(buf);
 }
 
-uintptr_t nextPCIConfigRegisters(uintptr_t pciEnumHandle, PCIConfigRegisters *regs, uintptr_t readSize){
+uintptr_t openNextPCIConfigSpace(uintptr_t pciEnumHandle, int writable){
 	FileEnumeration fe;
 	uintptr_t feSize = sizeof(fe);
 	uintptr_t r = syncReadFile(pciEnumHandle, &fe, &feSize);
 	if(r == IO_REQUEST_FAILURE || feSize != sizeof(fe))
-		return 0;
+		return IO_REQUEST_FAILURE;
 	char buf[20];
 	assert(fe.nameLength < 12);
 	fe.name[fe.nameLength] = '\0';
-	snprintf(buf, sizeof(buf), "%s:%s", PCI_DRIVER_NAME, fe.name);
-	uintptr_t pciHandle = syncOpenFile(buf);
+	uintptr_t nameLength = snprintf(buf, sizeof(buf), "%s:%s", PCI_DRIVER_NAME, fe.name);
+	return syncOpenFileN(buf, nameLength, (writable? OPEN_FILE_MODE_WRITABLE: OPEN_FILE_MODE_0));
+}
+
+uintptr_t nextPCIConfigRegisters(uintptr_t pciEnumHandle, PCIConfigRegisters *regs, uintptr_t readSize){
+	uintptr_t pciHandle = openNextPCIConfigSpace(pciEnumHandle, 0);
 	if(pciHandle == IO_REQUEST_FAILURE)
 		return 0;
-	r = syncSeekReadFile(pciHandle, regs, 0, &readSize);
+	uintptr_t r = syncSeekReadFile(pciHandle, regs, 0, &readSize);
 	if(r == IO_REQUEST_FAILURE)
 		readSize = 0;
 	r = syncCloseFile(pciHandle);
@@ -272,6 +293,33 @@ uintptr_t nextPCIConfigRegisters(uintptr_t pciEnumHandle, PCIConfigRegisters *re
 	return readSize;
 }
 
+uintptr_t findPCICapability(uintptr_t pciHandle, uint8_t capabilityID){
+	PCICommonConfigRegisters common;
+	uintptr_t readSize = sizeof(common);
+	uintptr_t r = syncSeekReadFile(pciHandle, &common, 0, &readSize);
+	// status bit 4 = capability list
+	if(r == IO_REQUEST_FAILURE || readSize != sizeof(common) || (common.status & (1 << 4)) == 0)
+		return 0;
+	uint8_t offset;
+	readSize = sizeof(offset);
+	r = syncSeekReadFile(pciHandle, &offset, MEMBER_OFFSET(PCIConfigRegisters0, capability), &readSize);
+	if(r == IO_REQUEST_FAILURE || readSize != sizeof(offset))
+		return 0;
+	// at most 48 capabilities after the header; avoid looping on a broken list
+	int i;
+	for(i = 0; i < 48 && offset >= sizeof(PCIConfigRegisters0); i++){
+		uint8_t idNext[2];
+		readSize = sizeof(idNext);
+		r = syncSeekReadFile(pciHandle, idNext, offset & ~3, &readSize);
+		if(r == IO_REQUEST_FAILURE || readSize != sizeof(idNext))
+			return 0;
+		if(idNext[0] == capabilityID)
+			return offset & ~3;
+		offset = idNext[1];
+	}
+	return 0;
+}
+
 static PCIManager pciManager = {NULL, INITIAL_SPINLOCK};
 
 static_assert(sizeof(union PCIConfigSpaceLocation) < sizeof(unsigned));
@@ -281,22 +329,49 @@ static int seekReadPCIConfigSpace(
 	uint8_t *buffer, uint64_t position, uintptr_t bufferSize
 ){
 	const PCIConfigSpace *cs = getFileInstance(of);
-	if(position > sizeof(cs->regs))
+	if(position > PCI_CONFIG_SPACE_SIZE)
 		return 0;
 	uintptr_t beginPos = (uintptr_t)position;
-	uintptr_t endPos = MIN(beginPos + bufferSize, cs->regsSize);
-	memcpy(buffer, ((const uint8_t*)&cs->regs) + beginPos, endPos - beginPos);
+	uintptr_t endPos = MIN(beginPos + bufferSize, PCI_CONFIG_SPACE_SIZE);
+	// the header is cached at enumeration; capabilities are read from the device
+	uintptr_t i;
+	for(i = beginPos; i < endPos; i++){
+		if(i < cs->regsSize){
+			buffer[i - beginPos] = ((const uint8_t*)&cs->regs)[i];
+			continue;
+		}
+		uint32_t v = readPCIConfig(cs->location.bus, cs->location.device, cs->location.function, i & ~3);
+		buffer[i - beginPos] = ((v >> ((i % 4) * 8)) & 0xff);
+	}
 	completeRWFileIO(rwfr, endPos - beginPos, 0);
 	return 1;
 }
 
+// only aligned 32-bit registers; the cached header is not updated
+static int seekWritePCIConfigSpace(
+	RWFileRequest *rwfr, OpenedFile *of,
+	const uint8_t *buffer, uint64_t position, uintptr_t bufferSize
+){
+	const PCIConfigSpace *cs = getFileInstance(of);
+	if(position % sizeof(uint32_t) != 0 || bufferSize % sizeof(uint32_t) != 0 ||
+		position > PCI_CONFIG_SPACE_SIZE || bufferSize > PCI_CONFIG_SPACE_SIZE - position)
+		return 0;
+	uintptr_t i;
+	for(i = 0; i < bufferSize; i += sizeof(uint32_t)){
+		uint32_t v;
+		memcpy(&v, buffer + i, sizeof(v));
+		writePCIConfig(cs->location.bus, cs->location.device, cs->location.function, position + i, v);
+	}
+	completeRWFileIO(rwfr, bufferSize, 0);
+	return 1;
+}
+
 static void closePCIConfigSpace(CloseFileRequest *cfr, __attribute__((__unused__)) OpenedFile *of){
 	completeCloseFile(cfr);
 	// do not delete of->instance
 }
 
-static int openPCIConfigSpace(OpenFileRequest *ofr, const char *fileName, uintptr_t length,
-	__attribute__((__unused__)) OpenFileMode mode){
+static int openPCIConfigSpace(OpenFileRequest *ofr, const char *fileName, uintptr_t length, OpenFileMode mode){
 	unsigned loc;
 	int ok = (snscanf(fileName, length, "%x", &loc) == 1);
 	EXPECT(ok);
@@ -311,6 +386,9 @@ static int openPCIConfigSpace(OpenFileRequest *ofr, const char *fileName, uintpt
 	EXPECT(cs != NULL);
 	FileFunctions ff = INITIAL_FILE_FUNCTIONS;
 	ff.seekRead = seekReadPCIConfigSpace;
+	if(mode.writable){
+		ff.seekWrite = seekWritePCIConfigSpace;
+	}
 	ff.close = closePCIConfigSpace;
 	completeOpenFile(ofr, (void*)cs, &ff);
 	return 1;
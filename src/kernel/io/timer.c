@@ -155,7 +155,7 @@ static void handleTimerEvents(TimerEventList *tel){
 
 static int chainedTimerHandler(const InterruptParam *p){
 	handleTimerEvents((TimerEventList*)p->argument);
-	schedule();
+	scheduleTimeSlice();
 	return 1;
 }
 
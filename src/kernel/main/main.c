@@ -7,6 +7,7 @@
 #include"memory/memory.h"
 #include"memory/segment.h"
 #include"task/task.h"
+#include"task/fpu.h"
 #include"assembly/assembly.h"
 #include"io/io.h"
 #include"file/file.h"
@@ -73,14 +74,17 @@ void c_entry(void){
 	// 3. GDT
 	SegmentTable *gdt = createSegmentTable();
 	loadgdt(gdt);
+	initProcessorLocal(gdt);
 	// 4. IDT
 	if(isBSP){
 		global.idt = initInterruptTable(gdt);
 	}
 	lidt(global.idt);
 	// 5. system call & exception
+	initProcessorFPU();
 	if(isBSP){
 		global.syscallTable = initSystemCall(global.idt);
+		initFPU(global.idt);
 	}
 	// 6. task
 	if(isBSP){
@@ -110,7 +114,5 @@ void c_entry(void){
 	if(isBSP){
 		initService();
 	}
-	while(1){
-		hlt();
-	}
+	runIdleTask();
 }
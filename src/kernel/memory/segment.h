@@ -18,6 +18,8 @@ enum SegmentIndex{
 	GDT_USER_CODE_INDEX,
 	GDT_USER_DATA_INDEX,
 	GDT_TSS_INDEX,
+	// gs; see processorlocal.c and interruptentry.asm
+	GDT_PROCESSOR_LOCAL_INDEX,
 	GDT_LENGTH
 };
 SegmentSelector getSegmentSelector(SegmentTable *t, enum SegmentIndex i);
@@ -25,5 +27,7 @@ SegmentSelector getSegmentSelector(SegmentTable *t, enum SegmentIndex i);
 SegmentTable *createSegmentTable(void);
 SegmentSelector *getKernelCodeSelector(SegmentTable *t);
 void setTSSKernelStack(SegmentTable *t, uint32_t esp0);
+// set the base of GDT_PROCESSOR_LOCAL_INDEX and load the segment to gs
+void setProcessorLocalSegment(SegmentTable *t, uintptr_t base, uintptr_t size);
 void loadgdt(SegmentTable *gdt);
 void sgdt(uint32_t *base, uint16_t *limit);
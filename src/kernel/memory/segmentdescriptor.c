@@ -76,6 +76,8 @@ static void setSegment(
 }
 
 static_assert(sizeof(SegmentDescriptor) == 8);
+// the selector is the same on all processors; see interruptentry.asm
+static_assert(GDT_PROCESSOR_LOCAL_INDEX == 6);
 
 SegmentSelector getSegmentSelector(SegmentTable *t, enum SegmentIndex i){
 	return t->selector[i];
@@ -107,9 +109,21 @@ SegmentTable *createSegmentTable(void){
 		t->tss = tss;
 	}
 	setSegment(t, GDT_TSS_INDEX, (uintptr_t)t->tss, sizeof(TSS) - 1, KERNEL_TSS);
+	// see setProcessorLocalSegment
+	setSegment(t, GDT_PROCESSOR_LOCAL_INDEX, 0, 0xffffffff, KERNEL_DATA);
 	return t;
 }
 
+void setProcessorLocalSegment(SegmentTable *t, uintptr_t base, uintptr_t size){
+	setSegment(t, GDT_PROCESSOR_LOCAL_INDEX, base, size - 1, KERNEL_DATA);
+	__asm__ __volatile__(
+	"mov %0, %%gs\n"
+	:
+	:"r"(getSegmentSelector(t, GDT_PROCESSOR_LOCAL_INDEX).value)
+	:"memory"
+	);
+}
+
 void setTSSKernelStack(SegmentTable *t, uint32_t esp0){
 	t->tss->ss0 = getSegmentSelector(t, GDT_KERNEL_DATA_INDEX).value;
 	t->tss->esp0 = esp0;
@@ -81,6 +81,7 @@ static_assert(NUMBER_OF_SLAB_UNIT == 8);
 
 typedef struct SlabManager{
 	Spinlock lock;
+	SpinlockStatistics lockStatistics;
 	Slab *usableSlab[NUMBER_OF_SLAB_UNIT];
 	Slab *usedSlab[NUMBER_OF_SLAB_UNIT];
 
@@ -190,7 +191,11 @@ static SlabManager *createSlabManager(
 }
 
 SlabManager *createKernelSlabManager(void){
-	return createSlabManager(allocateKernelPages, checkAndReleaseKernelPages, KERNEL_PAGE);
+	SlabManager *m = createSlabManager(allocateKernelPages, checkAndReleaseKernelPages, KERNEL_PAGE);
+	if(m != NULL){
+		addSpinlockStatistics(&m->lock, &m->lockStatistics, "kernel slab");
+	}
+	return m;
 }
 SlabManager *createUserSlabManager(void){
 	return createSlabManager(systemCall_allocateHeap, systemCall_releaseHeap, USER_WRITABLE_PAGE);
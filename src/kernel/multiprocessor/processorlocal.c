@@ -1,67 +1,81 @@
+#include"common.h"
 #include"assembly/assembly.h"
 #include"memory/memory.h"
+#include"memory/segment.h"
+#include"interrupt/controller/pic.h"
 #include"multiprocessor/processorlocal.h"
 #include"task/task.h"
 
 typedef struct ProcessorLocal{
+	// the linear address of this structure
+	struct ProcessorLocal *self;
 	struct SegmentTable *gdt;
 	struct InterruptController *pic;
 	struct TaskManager *taskManager;
+	// currentTask(taskManager); see setProcessorLocalTask
+	struct Task *task;
 	TimerEventList *timer;
+	// PIC.processorIndex
+	uint32_t index;
 }ProcessorLocal;
 
-// see pic.c
-ProcessorLocal *(*getProcessorLocal)(void) = NULL;
-
-#define GET_PROCESSOR_LOCAL(TYPE, NAME, VARIABLE) \
+// the ProcessorLocal of each processor is the base of gs; see initProcessorLocal
+// one instruction does not need cli, even if the task is moved to another processor after reading
+#define GET_PROCESSOR_LOCAL(TYPE, NAME, MEMBER) \
 TYPE processorLocal##NAME(void){\
-	EFlags eflags = getEFlags();\
-	if(eflags.bit.interrupt){\
-		cli();\
-	}\
-	TYPE v = (VARIABLE);\
-	if(eflags.bit.interrupt){\
-		sti();\
-	}\
+	static_assert(sizeof(TYPE) == 4);\
+	TYPE v;\
+	__asm__ __volatile__(\
+	"movl %%gs:%c1, %0\n"\
+	:"=r"(v)\
+	:"i"(MEMBER_OFFSET(ProcessorLocal, MEMBER))\
+	);\
 	return v;\
 }
 
-GET_PROCESSOR_LOCAL(PIC*, PIC, getProcessorLocal()->pic)
-GET_PROCESSOR_LOCAL(SegmentTable*, GDT, getProcessorLocal()->gdt)
-GET_PROCESSOR_LOCAL(TaskManager*, TaskManager, getProcessorLocal()->taskManager)
-GET_PROCESSOR_LOCAL(Task*, Task, currentTask(getProcessorLocal()->taskManager))
-GET_PROCESSOR_LOCAL(TimerEventList*, Timer, getProcessorLocal()->timer)
+GET_PROCESSOR_LOCAL(PIC*, PIC, pic)
+GET_PROCESSOR_LOCAL(SegmentTable*, GDT, gdt)
+GET_PROCESSOR_LOCAL(TaskManager*, TaskManager, taskManager)
+GET_PROCESSOR_LOCAL(Task*, Task, task)
+GET_PROCESSOR_LOCAL(TimerEventList*, Timer, timer)
+GET_PROCESSOR_LOCAL(uint32_t, Index, index)
 
-static ProcessorLocal *lapicToProcLocal = NULL;
+// gs is loaded in interruptentry.asm
+static ProcessorLocal *getProcessorLocal(void){
+	ProcessorLocal *local;
+	__asm__ __volatile__(
+	"movl %%gs:%c1, %0\n"
+	:"=r"(local)
+	:"i"(MEMBER_OFFSET(ProcessorLocal, self))
+	);
+	return local;
+}
 
 void setProcessorLocal(PIC *pic, SegmentTable *gdt, TaskManager *taskManager, TimerEventList *timer){
 	ProcessorLocal *local = getProcessorLocal();
+	assert(local->gdt == gdt);
 	local->pic = pic;
-	local->gdt = gdt;
 	local->taskManager = taskManager;
+	local->task = currentTask(taskManager);
 	local->timer = timer;
+	local->index = pic->processorIndex;
+	// the idle task is always available to the processor; see popPriorityQueue
+	setTaskAffinity(local->task, PROCESSOR_BIT(local->index));
 }
 
-static ProcessorLocal *getProcessorLocalByLAPIC(void){
+void setProcessorLocalTask(Task *t){
 	assert(getEFlags().bit.interrupt == 0);
-	uint32_t id = getMemoryMappedLAPICID();
-	return &lapicToProcLocal[id];
-}
-
-static ProcessorLocal *getProcessorLocal0(void){
-	return &lapicToProcLocal[0];
+	getProcessorLocal()->task = t;
 }
 
-void initProcessorLocal(uint32_t maxProcessorCount){
-	if(lapicToProcLocal == NULL){
-		NEW_ARRAY(lapicToProcLocal, maxProcessorCount);
-		memset(lapicToProcLocal, 0, maxProcessorCount * sizeof(lapicToProcLocal[0]));
-	}
-	if(maxProcessorCount == 1){
-		getProcessorLocal = getProcessorLocal0;
-	}
-	else{
-		getProcessorLocal = getProcessorLocalByLAPIC;
+void initProcessorLocal(SegmentTable *gdt){
+	ProcessorLocal *NEW(local);
+	if(local == NULL){
+		panic("cannot allocate processor local data");
 	}
+	MEMSET0(local);
+	local->self = local;
+	local->gdt = gdt;
+	setProcessorLocalSegment(gdt, (uintptr_t)local, sizeof(*local));
 }
 
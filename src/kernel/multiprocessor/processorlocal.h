@@ -11,9 +11,14 @@ SegmentTable *processorLocalGDT(void);
 TaskManager *processorLocalTaskManager(void);
 Task *processorLocalTask(void);
 TimerEventList *processorLocalTimer(void);
+// less than the number of processors; the processorIndex of PIC functions
+uint32_t processorLocalIndex(void);
 
-void initProcessorLocal(uint32_t maxProcessorCount);
+// allocate the data of the processor and load it to gs
+void initProcessorLocal(SegmentTable *gdt);
 void setProcessorLocal(PIC *pic, SegmentTable *gdt, TaskManager *taskManager, TimerEventList *timer);
+// see taskSwitch
+void setProcessorLocalTask(Task *t);
 
 // see pic.c
 uint32_t getMemoryMappedLAPICID(void);
@@ -3,65 +3,125 @@
 #include"assembly/assembly.h"
 #include"spinlock.h"
 
-#define NOT_ACQUIRABLE (0)
-#define ACQUIRABLE (1)
-#define IGNORED (2)
-
 const Spinlock initialSpinlock = INITIAL_SPINLOCK;
 const Spinlock nullSpinlock = NULL_SPINLOCK;
 
 int isAcquirable(Spinlock *spinlock){
-	if(spinlock->acquirable == IGNORED)
+	if(spinlock->isNull)
 		return 1;
-	return spinlock->acquirable != NOT_ACQUIRABLE;
+	return spinlock->nowServing == spinlock->nextTicket;
 }
 
 int acquireLock(Spinlock *spinlock){
-	if(spinlock->acquirable == IGNORED){
+	if(spinlock->isNull){
 		return 0;
 	}
 	unsigned interruptEnabled = getEFlags().bit.interrupt;
-
+	// an interrupt handler waiting behind this ticket would never be served
+	cli();
+	const uint32_t ticket = lock_xadd32(&spinlock->nextTicket, 1);
+	SpinlockStatistics *const statistics = spinlock->statistics;
 	int tryCount = 0;
-	while(1){
-		cli();
-		int acquired = xchg8(&spinlock->acquirable, NOT_ACQUIRABLE);
-		if(acquired == ACQUIRABLE){
-			spinlock->interruptFlag = interruptEnabled;
-			return tryCount;
+	if(spinlock->nowServing != ticket){
+		const uint64_t spinBegin = (statistics != NULL? rdtsc(): 0);
+		while(1){
+			// back off in proportion to the number of waiters ahead
+			uint32_t distance = ticket - spinlock->nowServing;
+			if(distance == 0)
+				break;
+			tryCount += distance;
+			for(; distance > 0; distance--){
+				pause();
+			}
 		}
-		if(interruptEnabled){
-			sti();
+		if(statistics != NULL){
+			statistics->contendedCount++;
+			statistics->spinCycles += rdtsc() - spinBegin;
 		}
-		do{
-			tryCount++;
-			pause();
-		}while(spinlock->acquirable == NOT_ACQUIRABLE);
 	}
+	if(statistics != NULL){
+		statistics->acquireCount++;
+	}
+	spinlock->interruptFlag = interruptEnabled;
+	return tryCount;
 }
 
 void releaseLock(Spinlock *spinlock){
-	if(spinlock->acquirable == IGNORED){
+	if(spinlock->isNull){
 		return;
 	}
-	assert(spinlock->acquirable == NOT_ACQUIRABLE);
+	assert(spinlock->nowServing != spinlock->nextTicket);
 	int interruptEnabled = spinlock->interruptFlag;
-	xchg8(&spinlock->acquirable, ACQUIRABLE);
+	// only the holder writes nowServing
+	lock_add32(&spinlock->nowServing, 1);
 	if(interruptEnabled){
 		sti();
 	}
 }
-/*
+
+typedef struct{
+	Spinlock lock;
+	SpinlockStatistics *head;
+}SpinlockStatisticsList;
+
+static SpinlockStatisticsList statisticsList = {INITIAL_SPINLOCK, NULL};
+
+void addSpinlockStatistics(Spinlock *spinlock, SpinlockStatistics *statistics, const char *name){
+	statistics->name = name;
+	statistics->acquireCount = 0;
+	statistics->contendedCount = 0;
+	statistics->spinCycles = 0;
+	acquireLock(&statisticsList.lock);
+	statistics->next = statisticsList.head;
+	statisticsList.head = statistics;
+	releaseLock(&statisticsList.lock);
+	acquireLock(spinlock);
+	spinlock->statistics = statistics;
+	releaseLock(spinlock);
+}
+
+// the counters are read without acquiring the counted locks
+uintptr_t printSpinlockStatistics(char *buffer, uintptr_t bufferSize){
+	uintptr_t printSize = 0;
+	acquireLock(&statisticsList.lock);
+	const SpinlockStatistics *s;
+	for(s = statisticsList.head; s != NULL && printSize < bufferSize; s = s->next){
+		int r = snprintf(buffer + printSize, bufferSize - printSize, "%s: acquire %llu contend %llu spin cycles %llu\n",
+			s->name, s->acquireCount, s->contendedCount, s->spinCycles);
+		if(r < 0)
+			break;
+		printSize += r;
+	}
+	releaseLock(&statisticsList.lock);
+	return printSize;
+}
+
 #ifndef NDEBUG
+
+void testSpinlock(void);
 void testSpinlock(void){
 	Spinlock s = initialSpinlock;
+	SpinlockStatistics st;
+	addSpinlockStatistics(&s, &st, "test");
+	assert(st.acquireCount == 1 && st.contendedCount == 0);
 	acquireLock(&s);
 	assert(isAcquirable(&s) == 0);
 	releaseLock(&s);
+	assert(isAcquirable(&s) == 1 && st.acquireCount == 2);
+	// tickets wrap around
+	s.nextTicket = 0xffffffff;
+	s.nowServing = 0xffffffff;
+	assert(acquireLock(&s) == 0 && s.nextTicket == 0);
+	releaseLock(&s);
 	assert(isAcquirable(&s) == 1);
+	Spinlock n = nullSpinlock;
+	acquireLock(&n);
+	assert(isAcquirable(&n) == 1);
+	releaseLock(&n);
+	printk("test spinlock ok\n");
 }
+
 #endif
-*/
 
 // barrier
 
@@ -81,4 +141,3 @@ void addAndWaitAtBarrier(Barrier *b, uint32_t threadCount){
 		pause();
 	}
 }
-
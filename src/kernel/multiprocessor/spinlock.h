@@ -5,20 +5,42 @@
 
 // spinlock
 
+// see addSpinlockStatistics
+typedef struct SpinlockStatistics{
+	const char *name;
+	// updated by the holder of the lock
+	uint64_t acquireCount, contendedCount, spinCycles;
+	struct SpinlockStatistics *next;
+}SpinlockStatistics;
+
+// ticket lock; the waiters acquire the lock in first-come-first-served order
 typedef struct Spinlock{
-	volatile uint8_t acquirable;
+	// the lock is acquirable if nowServing == nextTicket
+	volatile uint32_t nextTicket;
+	volatile uint32_t nowServing;
 	volatile uint8_t interruptFlag;
+	// acquireLock and releaseLock do nothing; see NULL_SPINLOCK
+	uint8_t isNull;
+	// NULL if the lock is not counted
+	SpinlockStatistics *statistics;
 }Spinlock;
 
-#define INITIAL_SPINLOCK {acquirable: 1, interruptFlag: 0}
+#define INITIAL_SPINLOCK {nextTicket: 0, nowServing: 0, interruptFlag: 0, isNull: 0, statistics: NULL}
 extern const Spinlock initialSpinlock;
-#define NULL_SPINLOCK {acquirable: 2, interruptFlag: 0}
+#define NULL_SPINLOCK {nextTicket: 0, nowServing: 0, interruptFlag: 0, isNull: 1, statistics: NULL}
 extern const Spinlock nullSpinlock;
 
 int isAcquirable(Spinlock *spinlock);
+// interrupts are disabled while waiting
+// return the number of spins
 int acquireLock(Spinlock *spinlock);
 void releaseLock(Spinlock *spinlock);
 
+// statistics is never removed
+void addSpinlockStatistics(Spinlock *spinlock, SpinlockStatistics *statistics, const char *name);
+// one line for each counted lock; see stat:spinlock
+uintptr_t printSpinlockStatistics(char *buffer, uintptr_t bufferSize);
+
 // barrier
 
 typedef struct Barrier{
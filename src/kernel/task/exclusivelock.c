@@ -146,41 +146,168 @@ void deleteSemaphore(Semaphore *s){
 	DELETE(s);
 }
 
+// Mutex
+
+// about the cost of a task switch
+#define MAX_MUTEX_SPIN_COUNT (1000)
+
+struct Mutex{
+	struct Task *volatile owner;
+	TaskQueue taskQueue;
+	ExclusiveLock exLock;
+};
+
+static int _acquireMutex(void *inst){
+	Mutex *m = inst;
+	if(m->owner == NULL){
+		m->owner = processorLocalTask();
+		return 1;
+	}
+	return 0;
+}
+
+static void _pushMutexQueue(void *inst, Task *t){
+	pushQueue(&((Mutex*)inst)->taskQueue, t);
+}
+
+static Task *_releaseMutex(void *inst){
+	Mutex *m = inst;
+	Task *t = popQueue(&m->taskQueue);
+	m->owner = t;
+	return t;
+}
+
+int tryAcquireMutex(Mutex *m){
+	return acquireExLock(&m->exLock, _acquireMutex, _pushMutexQueue, 0);
+}
+
+void acquireMutex(Mutex *m){
+	uintptr_t spinCount = 0;
+	while(tryAcquireMutex(m) == 0){
+		Task *owner;
+		while((owner = m->owner) != NULL && isTaskRunning(owner) && spinCount < MAX_MUTEX_SPIN_COUNT){
+			pause();
+			spinCount++;
+		}
+		// the owner is suspended or holds the mutex for long
+		if(owner != NULL){
+			assert(owner != processorLocalTask());
+			acquireExLock(&m->exLock, _acquireMutex, _pushMutexQueue, 1);
+			return;
+		}
+	}
+}
+
+void releaseMutex(Mutex *m){
+	assert(isMutexOwner(m));
+	releaseExLock(&m->exLock, _releaseMutex);
+}
+
+int isMutexOwner(Mutex *m){
+	return m->owner == processorLocalTask();
+}
+
+Mutex *createMutex(void){
+	Mutex *NEW(m);
+	if(m == NULL)
+		return NULL;
+	m->owner = NULL;
+	m->taskQueue = initialTaskQueue;
+	initExclusiveLock(&m->exLock, m);
+	return m;
+}
+
+void deleteMutex(Mutex *m){
+	assert(m->owner == NULL && IS_TASK_QUEUE_EMPTY(&m->taskQueue));
+	DELETE(m);
+}
+
 // ReaderWriterLock
+// readers add to the counter of their processor, so that uncontended readers touch only local cache lines
+// a task may release on another processor, so only the sum of the counters is meaningful
+// a writer sets writerActive to stop new readers and waits until the sum is 0
+
+// the processors share counters if there are more
+#define READER_COUNTER_COUNT (8)
+#define CACHE_LINE_SIZE (64)
+
+typedef struct{
+	volatile uint32_t count;
+	uint8_t padding[CACHE_LINE_SIZE - sizeof(uint32_t)];
+}ReaderCounter;
 
 struct ReaderWriterLock{
 	int writerFirst;
-	int writerCount, readerCount;
-	TaskQueue writerQueue, readerQueue;
+	ReaderCounter readerCounter[READER_COUNTER_COUNT];
+	// new readers wait in readerQueue if writerActive is not 0
+	volatile uint32_t writerActive;
+	// readers release readerDrained if writerWaiting is not 0
+	volatile uint32_t writerWaiting;
+	Semaphore *readerDrained;
+	// writers wait for each other
+	Mutex *writerMutex;
+	struct Task *volatile writer;
+	TaskQueue readerQueue;
 	ExclusiveLock exLock;
 };
 
 ReaderWriterLock *createReaderWriterLock(int writerFirst){
 	ReaderWriterLock *NEW(rwl);
-	if(rwl == NULL)
-		return NULL;
+	EXPECT(rwl != NULL);
+	rwl->readerDrained = createSemaphore(0);
+	EXPECT(rwl->readerDrained != NULL);
+	rwl->writerMutex = createMutex();
+	EXPECT(rwl->writerMutex != NULL);
 	rwl->writerFirst = writerFirst;
-	rwl->writerCount =
-	rwl->readerCount = 0;
+	uintptr_t i;
+	for(i = 0; i < READER_COUNTER_COUNT; i++){
+		rwl->readerCounter[i].count = 0;
+	}
+	rwl->writerActive = 0;
+	rwl->writerWaiting = 0;
+	rwl->writer = NULL;
 	rwl->readerQueue = initialTaskQueue;
-	rwl->writerQueue = initialTaskQueue;
 	initExclusiveLock(&rwl->exLock, rwl);
 	return rwl;
+	//deleteMutex(rwl->writerMutex);
+	ON_ERROR;
+	deleteSemaphore(rwl->readerDrained);
+	ON_ERROR;
+	DELETE(rwl);
+	ON_ERROR;
+	return NULL;
+}
+
+static uint32_t sumReaderCounter(ReaderWriterLock *rwl){
+	uint32_t sum = 0;
+	uintptr_t i;
+	for(i = 0; i < READER_COUNTER_COUNT; i++){
+		sum += rwl->readerCounter[i].count;
+	}
+	return sum;
 }
 
 void deleteReaderWriterLock(ReaderWriterLock *rwl){
-	assert(rwl->readerCount == 0 && rwl->writerCount == 0 &&
-		IS_TASK_QUEUE_EMPTY(&rwl->readerQueue) && IS_TASK_QUEUE_EMPTY(&rwl->writerQueue));
+	assert(sumReaderCounter(rwl) == 0 && rwl->writer == NULL && IS_TASK_QUEUE_EMPTY(&rwl->readerQueue));
+	deleteMutex(rwl->writerMutex);
+	deleteSemaphore(rwl->readerDrained);
 	DELETE(rwl);
 }
 
-static int _acquireReaderLock(void *inst){
-	ReaderWriterLock *rwl = inst;
-	if(rwl->writerCount == 0 && (rwl->writerFirst == 0 || IS_TASK_QUEUE_EMPTY(&rwl->writerQueue))){
-		rwl->readerCount++;
-		return 1;
+static volatile uint32_t *localReaderCounter(ReaderWriterLock *rwl){
+	return &rwl->readerCounter[processorLocalIndex() % READER_COUNTER_COUNT].count;
+}
+
+static void removeReader(ReaderWriterLock *rwl){
+	// the locked instruction orders the decrement before reading writerWaiting
+	lock_add32(localReaderCounter(rwl), (uint32_t)-1);
+	if(rwl->writerWaiting){
+		releaseSemaphore(rwl->readerDrained);
 	}
-	return 0;
+}
+
+static int _isWriterInactive(void *inst){
+	return ((ReaderWriterLock*)inst)->writerActive == 0;
 }
 
 static void _pushReaderQueue(void *inst, Task *t){
@@ -188,53 +315,58 @@ static void _pushReaderQueue(void *inst, Task *t){
 }
 
 void acquireReaderLock(ReaderWriterLock *rwl){
-	acquireExLock(&rwl->exLock, _acquireReaderLock, _pushReaderQueue, 1);
-}
-
-static int _acquireWriterLock(void *inst){
-	ReaderWriterLock *rwl = inst;
-	if(rwl->writerCount == 0 && rwl->readerCount == 0){
-		rwl->writerCount++;
-		return 1;
+	while(1){
+		// the locked instruction orders the increment before reading writerActive
+		lock_add32(localReaderCounter(rwl), 1);
+		if(rwl->writerActive == 0)
+			break;
+		removeReader(rwl);
+		acquireExLock(&rwl->exLock, _isWriterInactive, _pushReaderQueue, 1);
 	}
-	return 0;
 }
 
-static void _pushWriterQueue(void *inst, Task *t){
-	pushQueue(&((ReaderWriterLock *)inst)->writerQueue, t);
+// wake up all readers after writerActive is cleared
+static void setWriterInactive(ReaderWriterLock *rwl){
+	acquireLock(&rwl->exLock.lock);
+	rwl->writerActive = 0;
+	TaskQueue readers = rwl->readerQueue;
+	rwl->readerQueue = initialTaskQueue;
+	releaseLock(&rwl->exLock.lock);
+	Task *t;
+	while((t = popQueue(&readers)) != NULL){
+		resume(t);
+	}
 }
 
 void acquireWriterLock(ReaderWriterLock *rwl){
-	acquireExLock(&rwl->exLock, _acquireWriterLock, _pushWriterQueue, 1);
-}
-
-static Task *_releaseReaderWriterLock(void *instance){
-	ReaderWriterLock *rwl = instance;
-	Task *t = NULL;
-	if(rwl->writerCount != 0){ // current task is writer
-		rwl->writerCount--;
-	}
-	else/*if(rwl->readerCount != 0)*/{
-		rwl->readerCount--;
-	}
-	if((rwl->writerFirst && IS_TASK_QUEUE_EMPTY(&rwl->writerQueue) == 0) ||
-		IS_TASK_QUEUE_EMPTY(&rwl->readerQueue)){ // next writer
-		t = popQueue(&rwl->writerQueue);
-		if(t != NULL){
-			rwl->writerCount++;
-		}
-	}
-	else{ // next reader
-		t = popQueue(&rwl->readerQueue);
-		if(t != NULL){
-			rwl->readerCount++;
+	acquireMutex(rwl->writerMutex);
+	xchg32(&rwl->writerWaiting, 1);
+	while(1){
+		xchg32(&rwl->writerActive, 1);
+		// the readers seeing writerActive == 0 are counted
+		if(sumReaderCounter(rwl) == 0)
+			break;
+		// reader first: let new readers in until all readers leave
+		if(rwl->writerFirst == 0){
+			setWriterInactive(rwl);
 		}
+		acquireAllSemaphore(rwl->readerDrained);
 	}
-	return t;
+	rwl->writerWaiting = 0;
+	tryAcquireAllSemaphore(rwl->readerDrained);
+	rwl->writer = processorLocalTask();
 }
 
 void releaseReaderWriterLock(ReaderWriterLock *rwl){
-	releaseExLock(&rwl->exLock, _releaseReaderWriterLock);
+	// readers never run with the writer
+	if(rwl->writer == NULL){
+		removeReader(rwl);
+		return;
+	}
+	assert(rwl->writer == processorLocalTask());
+	rwl->writer = NULL;
+	setWriterInactive(rwl);
+	releaseMutex(rwl->writerMutex);
 }
 
 #ifndef NDEBUG
@@ -260,6 +392,38 @@ static void testRWLock_w(void *rwlPtr){
 	systemCall_terminate();
 }
 
+static void testMutex_t(void *mutexPtr){
+	Mutex *m = (*(Mutex**)mutexPtr);
+
+	acquireMutex(m);
+	printk("testMutex_t acquired\n");
+	releaseMutex(m);
+
+	systemCall_terminate();
+}
+
+void testMutex(void);
+
+void testMutex(void){
+	Mutex *m = createMutex();
+	assert(m != NULL);
+	acquireMutex(m);
+	assert(isMutexOwner(m) && tryAcquireMutex(m) == 0);
+	Task *t = createSharedMemoryTask(testMutex_t, &m, sizeof(m), processorLocalTask());
+	assert(t != NULL);
+	resume(t);
+	sleep(500);
+	// hand off to testMutex_t
+	printk("testMutex released\n");
+	releaseMutex(m);
+	sleep(500);
+	assert(tryAcquireMutex(m) == 1);
+	releaseMutex(m);
+	deleteMutex(m);
+	printk("test mutex ok\n");
+	systemCall_terminate();
+}
+
 void testRWLock(void);
 
 void testRWLock(void){
@@ -19,6 +19,17 @@ int acquireAllSemaphore(Semaphore *s);
 void releaseSemaphore(Semaphore *s);
 int getSemaphoreValue(Semaphore *s);
 
+// a Semaphore of value 1 for short critical sections
+// the waiter spins while the owner is running on another processor, and blocks otherwise
+// releaseMutex hands the mutex to the first blocked task
+typedef struct Mutex Mutex;
+Mutex *createMutex(void);
+void deleteMutex(Mutex *m);
+int tryAcquireMutex(Mutex *m);
+void acquireMutex(Mutex *m);
+void releaseMutex(Mutex *m);
+int isMutexOwner(Mutex *m);
+
 typedef struct ReaderWriterLock ReaderWriterLock;
 ReaderWriterLock *createReaderWriterLock(int writerFirst);
 void deleteReaderWriterLock(ReaderWriterLock *rwl);
@@ -0,0 +1,181 @@
+#include"common.h"
+#include"fpu.h"
+#include"task.h"
+#include"assembly/assembly.h"
+#include"memory/memory.h"
+#include"interrupt/handler.h"
+#include"multiprocessor/processorlocal.h"
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+
+// FXSAVE writes 512 bytes and FNSAVE writes 108 bytes
+#define FPU_CONTEXT_SIZE (512)
+#define FPU_CONTEXT_ALIGN (16)
+
+struct FPUContext{
+	uint8_t buffer[FPU_CONTEXT_SIZE + FPU_CONTEXT_ALIGN];
+};
+
+static struct{
+	// all processors are assumed to be the same
+	int useFXSR;
+	// the context after FNINIT; see initFPU
+	FPUContext initialContext;
+}fpu;
+
+static uint8_t *getContextArea(FPUContext *c){
+	return (uint8_t*)CEIL((uintptr_t)c->buffer, FPU_CONTEXT_ALIGN);
+}
+
+static void saveFPU(FPUContext *c){
+	uint8_t *a = getContextArea(c);
+	if(fpu.useFXSR){
+		__asm__ __volatile__("fxsave (%0)\n"::"r"(a):"memory");
+	}
+	else{
+		// FNSAVE also reinitializes the FPU
+		__asm__ __volatile__("fnsave (%0)\n"::"r"(a):"memory");
+	}
+}
+
+static void restoreFPU(FPUContext *c){
+	uint8_t *a = getContextArea(c);
+	if(fpu.useFXSR){
+		__asm__ __volatile__("fxrstor (%0)\n"::"r"(a):"memory");
+	}
+	else{
+		__asm__ __volatile__("frstor (%0)\n"::"r"(a):"memory");
+	}
+}
+
+static void clts(void){
+	__asm__ __volatile__("clts\n");
+}
+
+static void setTS(void){
+	setCR0(getCR0() | CR0_TS);
+}
+
+// if CR0.TS is clear, the registers have the context of the current task
+static int isTSSet(void){
+	return (getCR0() & CR0_TS) != 0;
+}
+
+void deleteFPUContext(FPUContext *c){
+	DELETE(c);
+}
+
+// the task may run on another processor next time, so the context is saved now
+void saveFPUContextOnTaskSwitch(Task *oldTask){
+	if(isTSSet()){
+		return;
+	}
+	FPUContext *c = getTaskFPUContext(oldTask);
+	assert(c != NULL);
+	saveFPU(c);
+	setTS();
+}
+
+// the first FPU instruction after a task switch
+static void fpuNotAvailableHandler(InterruptParam *p){
+	Task *t = processorLocalTask();
+	FPUContext *c = getTaskFPUContext(t);
+	if(c == NULL){
+		NEW(c);
+		if(c == NULL){
+			printk("cannot allocate FPU context\n");
+			defaultInterruptHandler(p);
+			return;
+		}
+		memcpy(getContextArea(c), getContextArea(&fpu.initialContext), FPU_CONTEXT_SIZE);
+		setTaskFPUContext(t, c);
+	}
+	clts();
+	restoreFPU(c);
+}
+
+int beginKernelFPU(void){
+	int interruptEnabled = getEFlags().bit.interrupt;
+	cli();
+	if(isTSSet() == 0){
+		saveFPU(getTaskFPUContext(processorLocalTask()));
+	}
+	clts();
+	__asm__ __volatile__("fninit\n");
+	return interruptEnabled;
+}
+
+void endKernelFPU(int interruptEnabled){
+	// the next FPU instruction of the task restores its context
+	setTS();
+	if(interruptEnabled){
+		sti();
+	}
+}
+
+void initProcessorFPU(void){
+	fpu.useFXSR = cpuid_hasFXSR();
+	uint32_t cr0 = getCR0();
+	// WAIT also checks CR0.TS; report errors by exceptions
+	cr0 = ((cr0 & ~(CR0_EM | CR0_TS)) | CR0_MP | CR0_NE);
+	setCR0(cr0);
+	if(fpu.useFXSR){
+		uint32_t cr4 = getCR4() | CR4_OSFXSR;
+		if(cpuid_hasSSE()){
+			cr4 |= CR4_OSXMMEXCPT;
+		}
+		setCR4(cr4);
+	}
+	__asm__ __volatile__("fninit\n");
+	setTS();
+}
+
+void initFPU(InterruptTable *idt){
+	clts();
+	__asm__ __volatile__("fninit\n");
+	saveFPU(&fpu.initialContext);
+	setTS();
+	registerInterrupt(idt, NO_FLOATING_FAULT, fpuNotAvailableHandler, 0);
+}
+
+#ifndef NDEBUG
+
+#define TEST_FPU_LOOP_COUNT (100)
+
+static void testFPUTask(void *arg){
+	const double v = *(int*)arg;
+	int a;
+	for(a = 0; a < TEST_FPU_LOOP_COUNT; a++){
+		double r = 0;
+		__asm__ __volatile__("fldl %0\n"::"m"(v));
+		cli();
+		schedule();
+		sti();
+		__asm__ __volatile__("fstpl %0\n":"=m"(r));
+		assert(r == v);
+	}
+	systemCall_terminate();
+}
+
+void testFPU(void);
+void testFPU(void){
+	int a;
+	for(a = 1; a <= 4; a++){
+		Task *t = createSharedMemoryTask(testFPUTask, &a, sizeof(a), processorLocalTask());
+		assert(t != NULL);
+		resume(t);
+	}
+	int e = beginKernelFPU();
+	double r = 0;
+	__asm__ __volatile__("fld1\nfstpl %0\n":"=m"(r));
+	endKernelFPU(e);
+	assert(r == 1.0);
+	printk("test FPU ok\n");
+}
+
+#endif
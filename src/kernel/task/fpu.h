@@ -0,0 +1,24 @@
+#include<std.h>
+
+typedef struct InterruptTable InterruptTable;
+typedef struct FPUContext FPUContext;
+typedef struct Task Task;
+
+// lazy FPU context switch
+// CR0.TS is set when switching tasks. The first FPU or SSE instruction of a task raises NO_FLOATING_FAULT,
+// and the handler restores the context of the task. See saveFPUContextOnTaskSwitch
+
+// register the NO_FLOATING_FAULT handler
+void initFPU(InterruptTable *idt);
+// set CR0 and CR4 of the processor
+void initProcessorFPU(void);
+
+void deleteFPUContext(FPUContext *c);
+// assume interrupt disabled
+void saveFPUContextOnTaskSwitch(Task *oldTask);
+
+// the kernel uses FPU or SSE only between beginKernelFPU and endKernelFPU
+// disable interrupt and save the context of the current task
+// return the interrupt flag for endKernelFPU
+int beginKernelFPU(void);
+void endKernelFPU(int interruptEnabled);
@@ -9,16 +9,65 @@ typedef struct Task Task;
 typedef struct PageManager PageManager;
 typedef struct LinearMemoryManager LinearMemoryManager;
 typedef struct OpenFileManager OpenFileManager;
+typedef struct FPUContext FPUContext;
 
 // assume interrupt disabled
 void schedule(void);
+// called on every timer tick
+// switch tasks if the time slice is used up or a woken task should preempt the current one
+void scheduleTimeSlice(void);
+// called when leaving an interrupt handler; see resume
+void scheduleIfPreempted(void);
+// the default is 20 milliseconds
+void setTaskTimeSlice(Task *t, uint32_t millisecond);
+// how the idle task of each processor waits for a ready task
+enum IdleMode{
+	// wake up on interrupts, usually the next timer tick
+	IDLE_HALT,
+	// MONITOR/MWAIT; resume wakes the processor by writing the monitored line instead of sending IPI
+	IDLE_MWAIT,
+	// spin without sleeping, for the lowest wakeup latency
+	IDLE_POLL
+};
+// the default is IDLE_MWAIT if supported, otherwise IDLE_HALT
+// return 0 if the processor does not support the mode
+int setIdleMode(enum IdleMode mode);
+// the bootstrap task of each processor becomes the idle task; see c_entry
+// assume interrupt enabled; never return
+void runIdleTask(void);
+// bit i is the processor of processorLocalIndex() == i (mod 32)
+#define PROCESSOR_BIT(I) (((uint32_t)1) << ((I) % 32))
+#define ANY_PROCESSOR ((uint32_t)0xffffffff)
+// the created tasks inherit the affinity of the creator, except createTaskAndMemorySpace
+// the bits of the processors not in the system are ignored
+// if t is the current task and the processor is not allowed, assume interrupt enabled
+void setTaskAffinity(Task *t, uint32_t affinity);
+// set the affinity of the current task; return 0 if no processor in the system is allowed
+int systemCall_setAffinity(uint32_t affinity);
+// for the stat file system
+uintptr_t printTaskStatistics(char *buffer, uintptr_t bufferSize);
 
 Task *currentTask(TaskManager *tm);
+// the task is on a processor; the result may be outdated when returned
+int isTaskRunning(const Task *t);
 LinearMemoryManager *getTaskLinearMemory(Task *t);
 OpenFileManager *getOpenFileManager(Task *t);
+// NULL if the task has not used FPU
+FPUContext *getTaskFPUContext(Task *t);
+void setTaskFPUContext(Task *t, FPUContext *c);
 
 void resume(/*TaskManager *tm, */Task *t);
 
+// read-copy-update
+// a read-side critical section does not switch tasks, so it ends before the next context switch
+// return the interrupt flag for rcuReadUnlock
+int rcuReadLock(void);
+void rcuReadUnlock(int interruptEnabled);
+// wait until every other processor has switched tasks
+// the nodes removed before the call are not read after it returns
+// assume interrupt enabled
+void synchronizeRCU(void);
+
 TaskManager *createTaskManager(SegmentTable *gdt);
 void initTaskManagement(SystemCallTable *systemCallTable);
 
@@ -49,6 +98,8 @@ int initUserLinearBlockManager(uintptr_t beginAddr, uintptr_t initEndAddr);
 // task id is an address in kernel space. we haven't defined the usage yet
 uintptr_t systemCall_createUserThread(void (*entry)(void), uintptr_t stackSize);
 Task *createSharedMemoryTask(void (*entry)(void*), void *arg, uintptr_t argSize, Task *sharedMemoryTask);
+// delete a task returned by createSharedMemoryTask before resume
+void deleteUnstartedTask(Task *t);
 // always succeed and do not return
 void terminateCurrentTask(void);
 void systemCall_terminate(void);
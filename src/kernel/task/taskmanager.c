@@ -1,5 +1,6 @@
 #include"task.h"
 #include"task_private.h"
+#include"fpu.h"
 #include"exclusivelock.h"
 #include"assembly/assembly.h"
 #include"memory/segment.h"
@@ -11,6 +12,7 @@
 #include"io/io.h"
 #include"file/file.h"
 #include"interrupt/systemcall.h"
+#include"interrupt/controller/pic.h"
 #include"common.h"
 
 typedef struct TaskMemoryManager{
@@ -71,10 +73,27 @@ typedef struct Task{
 	TaskMemoryManager *taskMemory;
 	// opened files
 	OpenFileManager *openFileManager;
+	// NULL if the task has not used FPU; see fpu.c
+	FPUContext *fpuContext;
 
 	// scheduling
 	enum TaskState state;
 	int priority;
+	// selected by a processor; updated with globalQueue->lock
+	volatile int isRunning;
+	// the processors allowed to run the task; see PROCESSOR_BIT
+	uint32_t affinity;
+	// cpuTime weighted by priority; see accountTaskTime
+	uint64_t virtualRuntime;
+	// in TSC cycles
+	uint64_t cpuTime;
+	// rdtsc() when cpuTime was updated
+	uint64_t accountTime;
+	// see setTaskTimeSlice and scheduleTimeSlice
+	uint32_t timeSliceTicks, usedTicks;
+	uint32_t switchCount;
+	// all tasks; see printTaskStatistics
+	struct Task *nextInList, **prevInList;
 
 	// system call
 	SystemCallFunction taskDefinedSystemCall;
@@ -95,14 +114,32 @@ static void setCurrentUserStackBottom(uintptr_t stack){
 }
 
 #define NUMBER_OF_PRIORITIES (4)
+// the tasks run only if no other task is ready
+#define IDLE_PRIORITY (NUMBER_OF_PRIORITIES - 1)
+#define DEFAULT_TIME_SLICE_TICKS (2)
+// in ticks; see placeWokenTask
+#define SLEEPER_CREDIT_TICKS (1)
 
 typedef struct TaskPriorityQueue{
 	Spinlock lock;
-	TaskQueue taskQueue[NUMBER_OF_PRIORITIES];
+	SpinlockStatistics lockStatistics;
+	// sorted by virtualRuntime
+	TaskQueue fairQueue;
+	// FIFO of IDLE_PRIORITY tasks
+	TaskQueue idleQueue;
+	// not decreasing; the virtualRuntime of the last selected task
+	uint64_t minVirtualRuntime;
+	// the first tick length measured by any processor; 0 before that
+	uint64_t tscPerTick;
 }TaskPriorityQueue;
 
 static TaskPriorityQueue *globalQueue = NULL;
 
+static struct{
+	Spinlock lock;
+	Task *head;
+}taskList = {INITIAL_SPINLOCK, NULL};
+
 struct TaskManager{
 	Task *current;
 	SegmentTable *gdt;
@@ -110,8 +147,25 @@ struct TaskManager{
 	Task *oldTask; // see switchCurrent()
 	void (*afterTaskSwitchFunc)(Task*, uintptr_t);
 	uintptr_t afterTaskSwitchArg;
+	// incremented in every taskSwitch; see synchronizeRCU
+	volatile uint32_t switchCount;
+	// set by resume if the woken task should preempt current; see scheduleIfPreempted
+	volatile int needReschedule;
+	// measured in scheduleTimeSlice
+	uint64_t lastTickTime, tscPerTick;
+	// PROCESSOR_BIT of the processor; set in runIdleTask
+	uint32_t processorBit;
+	// the idle task is waiting on needReschedule; see wakeIdleProcessor
+	volatile int isIdleWaiting;
+	struct TaskManager *nextManager;
 };
 
+// the managers are never deleted
+static struct{
+	Spinlock lock;
+	TaskManager *head;
+}taskManagerList = {INITIAL_SPINLOCK, NULL};
+
 
 const TaskQueue initialTaskQueue = INITIAL_TASK_QUEUE;
 
@@ -148,17 +202,85 @@ Task *popQueue(TaskQueue *q){
 	return t;
 }
 
+// put the task before the first task with larger virtualRuntime
+static void insertByVirtualRuntime(TaskQueue *q, Task *t){
+	Task *h = q->head;
+	if(h == NULL || t->virtualRuntime < h->virtualRuntime){
+		pushQueue(q, t);
+		q->head = t;
+		return;
+	}
+	Task *p = h->prev;
+	while(t->virtualRuntime < p->virtualRuntime){
+		p = p->prev;
+	}
+	t->next = p->next;
+	t->prev = p;
+	t->next->prev = t;
+	p->next = t;
+}
+
 static void pushPriorityQueue(TaskPriorityQueue *q, Task *t){
-	pushQueue(q->taskQueue + t->priority, t);
+	if(t->priority == IDLE_PRIORITY){
+		pushQueue(&q->idleQueue, t);
+	}
+	else{
+		insertByVirtualRuntime(&q->fairQueue, t);
+	}
+}
+
+// the first task allowed to run on the processor
+static Task *popAffinityQueue(TaskQueue *q, uint32_t processorBit){
+	Task *h = q->head;
+	if(h == NULL){
+		return NULL;
+	}
+	Task *t = h;
+	while((t->affinity & processorBit) == 0){
+		t = t->next;
+		if(t == h)
+			return NULL;
+	}
+	if(t == h){
+		return popQueue(q);
+	}
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	return t;
+}
+
+// the task with the least virtualRuntime
+// every processor has an idle task; see setProcessorLocal
+static Task *popPriorityQueue(TaskPriorityQueue *q, uint32_t processorBit){
+	Task *t = popAffinityQueue(&q->fairQueue, processorBit);
+	if(t != NULL){
+		q->minVirtualRuntime = MAX(q->minVirtualRuntime, t->virtualRuntime);
+		return t;
+	}
+	t = popAffinityQueue(&q->idleQueue, processorBit);
+	assert(t != NULL);
+	return t;
+}
+
+// a higher priority task gets more processor time for the same virtualRuntime
+// assume the task is running on this processor
+static void accountTaskTime(Task *t){
+	const uint64_t now = rdtsc();
+	const uint64_t delta = now - t->accountTime;
+	t->accountTime = now;
+	t->cpuTime += delta;
+	if(t->priority != IDLE_PRIORITY){
+		t->virtualRuntime += (delta << t->priority);
+	}
 }
 
-static Task *popPriorityQueue(TaskPriorityQueue *q){
-	int p;
-	for(p = 0; 1; p++){
-		assert(p < NUMBER_OF_PRIORITIES);
-		Task *t = popQueue(q->taskQueue + p);
-		if(t != NULL)
-			return t;
+// a task waking up from I/O runs before the tasks that have used their time slices
+// but it cannot save more than SLEEPER_CREDIT_TICKS for the next time
+static void placeWokenTask(TaskPriorityQueue *q, Task *t){
+	const uint64_t credit = q->tscPerTick * SLEEPER_CREDIT_TICKS;
+	if(q->minVirtualRuntime > credit && t->virtualRuntime < q->minVirtualRuntime - credit){
+		t->virtualRuntime = q->minVirtualRuntime - credit;
 	}
 }
 
@@ -183,17 +305,31 @@ void taskSwitch(void (*func)(Task*, uintptr_t), uintptr_t arg){
 	tm->afterTaskSwitchArg = arg;
 	tm->oldTask = tm->current;
 	acquireLock(&globalQueue->lock);
+	accountTaskTime(tm->oldTask);
 	if(func == NULL){
 		pushPriorityQueue(globalQueue, tm->oldTask);
 	}
 	else{
 		tm->oldTask->state = SUSPENDED;
 	}
-	tm->current = popPriorityQueue(globalQueue);
+	// other processors cannot select oldTask until the lock is released in callAfterTaskSwitchFunc
+	tm->oldTask->isRunning = 0;
+	// the processor has left all read-side critical sections
+	tm->switchCount++;
+	tm->current = popPriorityQueue(globalQueue, PROCESSOR_BIT(processorLocalIndex()));
+	tm->current->isRunning = 1;
+	tm->current->accountTime = rdtsc();
+	tm->current->usedTicks = 0;
+	tm->current->switchCount++;
+	tm->needReschedule = 0;
+	tm->isIdleWaiting = 0;
+	setProcessorLocalTask(tm->current);
 	// if releaseLock() before contextSwitch(), the stack sometimes becomes corrupted
 	//releaseLock(&readyQueue->lock);
 	setTSSKernelStack(tm->gdt, tm->current->espInterrupt);
 	if(tm->current != tm->oldTask){// otherwise, esp0 will be wrong value
+		// before another processor can select oldTask
+		saveFPUContextOnTaskSwitch(tm->oldTask);
 		contextSwitch(&tm->oldTask->esp0, tm->current->esp0, toCR3(tm->current->taskMemory->manager.page));
 		// may go to startTask or return here
 	}
@@ -210,6 +346,162 @@ void schedule(){
 	taskSwitch(NULL, 0);
 }
 
+void scheduleTimeSlice(void){
+	TaskManager *tm = processorLocalTaskManager();
+	const uint64_t now = rdtsc();
+	if(tm->lastTickTime != 0){
+		tm->tscPerTick = now - tm->lastTickTime;
+		if(globalQueue->tscPerTick == 0){
+			acquireLock(&globalQueue->lock);
+			if(globalQueue->tscPerTick == 0){
+				globalQueue->tscPerTick = tm->tscPerTick;
+			}
+			releaseLock(&globalQueue->lock);
+		}
+	}
+	tm->lastTickTime = now;
+	Task *t = tm->current;
+	t->usedTicks++;
+	if(t->usedTicks < t->timeSliceTicks && tm->needReschedule == 0 &&
+		(t->priority != IDLE_PRIORITY || IS_TASK_QUEUE_EMPTY(&globalQueue->fairQueue))){
+		return;
+	}
+	schedule();
+}
+
+void scheduleIfPreempted(void){
+	TaskManager *tm = processorLocalTaskManager();
+	// before setProcessorLocal
+	if(tm == NULL){
+		return;
+	}
+	if(tm->needReschedule){
+		schedule();
+	}
+}
+
+static struct{
+	volatile enum IdleMode mode;
+}idle = {IDLE_HALT};
+
+int setIdleMode(enum IdleMode mode){
+	if(mode == IDLE_MWAIT && cpuid_hasMonitor() == 0){
+		return 0;
+	}
+	idle.mode = mode;
+	return 1;
+}
+
+void runIdleTask(void){
+	TaskManager *tm = processorLocalTaskManager();
+	assert(tm->current->priority == IDLE_PRIORITY);
+	tm->processorBit = PROCESSOR_BIT(processorLocalIndex());
+	while(1){
+		cli();
+		if(tm->needReschedule){
+			schedule();
+		}
+		// set again after every interrupt, because taskSwitch clears it
+		switch(idle.mode){
+		case IDLE_MWAIT:
+			tm->isIdleWaiting = 1;
+			monitor(&tm->needReschedule);
+			// resume may have written needReschedule before monitor
+			if(tm->needReschedule == 0){
+				stiAndMWait();
+			}
+			break;
+		case IDLE_POLL:
+			tm->isIdleWaiting = 1;
+			sti();
+			while(tm->needReschedule == 0 && tm->isIdleWaiting && idle.mode == IDLE_POLL){
+				pause();
+			}
+			break;
+		default:
+			stiAndHlt();
+			break;
+		}
+		sti();
+	}
+}
+
+// let an idle processor allowed to run t select it without waiting for the timer tick
+// if the processor has not started waiting, the next timer tick selects t; see scheduleTimeSlice
+static void wakeIdleProcessor(Task *t){
+	TaskManager *m;
+	for(m = taskManagerList.head; m != NULL; m = m->nextManager){
+		if(m->isIdleWaiting && (t->affinity & m->processorBit) != 0){
+			m->isIdleWaiting = 0;
+			m->needReschedule = 1;
+			break;
+		}
+	}
+}
+
+// the bits of the processors in the system
+static uint32_t getProcessorMask(void){
+	const int processorCount = processorLocalPIC()->numberOfProcessors;
+	if(processorCount >= 32){
+		return ANY_PROCESSOR;
+	}
+	return PROCESSOR_BIT(processorCount) - 1;
+}
+
+void setTaskAffinity(Task *t, uint32_t affinity){
+	affinity &= getProcessorMask();
+	assert(affinity != 0);
+	acquireLock(&globalQueue->lock);
+	t->affinity = affinity;
+	releaseLock(&globalQueue->lock);
+	// move to an allowed processor
+	if(t == processorLocalTask() && (affinity & PROCESSOR_BIT(processorLocalIndex())) == 0){
+		cli();
+		schedule();
+		sti();
+	}
+}
+
+void setTaskTimeSlice(Task *t, uint32_t millisecond){
+	uint32_t ticks = DIV_CEIL(millisecond * TIMER_FREQUENCY, 1000);
+	t->timeSliceTicks = MAX(ticks, 1);
+}
+
+int rcuReadLock(void){
+	int interruptEnabled = getEFlags().bit.interrupt;
+	if(interruptEnabled){
+		cli();
+	}
+	return interruptEnabled;
+}
+
+void rcuReadUnlock(int interruptEnabled){
+	if(interruptEnabled){
+		sti();
+	}
+}
+
+void synchronizeRCU(void){
+	TaskManager *self = processorLocalTaskManager();
+	// before setProcessorLocal, only the bootstrap processor is running; see c_entry
+	if(self == NULL){
+		return;
+	}
+	assert(getEFlags().bit.interrupt);
+	// the readers on this processor have returned
+	TaskManager *tm;
+	for(tm = taskManagerList.head; tm != NULL; tm = tm->nextManager){
+		if(tm == self)
+			continue;
+		const uint32_t c = tm->switchCount;
+		while(tm->switchCount == c){
+			cli();
+			schedule();
+			sti();
+		}
+	}
+}
+
 #define KERNEL_STACK_SIZE ((size_t)8192)
 #define STACK_ALIGN_SIZE ((size_t)4)
 static_assert(KERNEL_STACK_SIZE % PAGE_SIZE == 0);
@@ -306,7 +598,7 @@ uint32_t initTaskStack(uint32_t eFlags, uint32_t eip, uint32_t esp0);
 
 static Task *createTask(
 	uint32_t esp0, uint32_t espInterrupt, void *stackBottom,
-	TaskMemoryManager *taskMemory, OpenFileManager *openFileManager, int priority
+	TaskMemoryManager *taskMemory, OpenFileManager *openFileManager, int priority, uint32_t affinity
 ){
 	Task *NEW(t);
 	EXPECT(t != NULL);
@@ -324,12 +616,29 @@ static Task *createTask(
 	addTaskMemoryReference(taskMemory, 1);
 	t->openFileManager = openFileManager;
 	addOpenFileManagerReference(openFileManager, 1);
+	t->fpuContext = NULL;
 	t->state = SUSPENDED;
 	t->priority = priority;
+	t->isRunning = 0;
+	t->affinity = affinity;
+	t->virtualRuntime = 0;
+	t->cpuTime = 0;
+	t->accountTime = 0;
+	t->timeSliceTicks = DEFAULT_TIME_SLICE_TICKS;
+	t->usedTicks = 0;
+	t->switchCount = 0;
 	t->taskDefinedSystemCall = undefinedSystemCall;
 	t->taskDefinedArgument = 0;
 	t->next =
 	t->prev = NULL;
+	acquireLock(&taskList.lock);
+	t->prevInList = &taskList.head;
+	t->nextInList = taskList.head;
+	if(t->nextInList != NULL){
+		t->nextInList->prevInList = &t->nextInList;
+	}
+	taskList.head = t;
+	releaseLock(&taskList.lock);
 
 	return t;
 	//deleteSemaphore(t->ioSemaphore);
@@ -339,9 +648,18 @@ static Task *createTask(
 	return NULL;
 }
 
+static void removeFromTaskList(Task *t){
+	acquireLock(&taskList.lock);
+	*(t->prevInList) = t->nextInList;
+	if(t->nextInList != NULL){
+		t->nextInList->prevInList = t->prevInList;
+	}
+	releaseLock(&taskList.lock);
+}
+
 // create task and kernel stack
 static Task *createKernelTask(void *eip0, const void *arg, size_t argSize,
-	int priority, TaskMemoryManager *tm, OpenFileManager *ofm){
+	int priority, uint32_t affinity, TaskMemoryManager *tm, OpenFileManager *ofm){
 	// kernel task stack
 	EXPECT(argSize <= KERNEL_STACK_SIZE / 2);
 	void *stackBottom = allocateKernelPages(KERNEL_STACK_SIZE, KERNEL_PAGE);
@@ -360,7 +678,7 @@ static Task *createKernelTask(void *eip0, const void *arg, size_t argSize,
 	EFlags eflags = getEFlags();
 	eflags.bit.interrupt = 0;
 	esp0 = initTaskStack(eflags.value, (uint32_t)eip0, esp0);
-	Task *t = createTask(esp0, stackTop - 4, stackBottom, tm, ofm, priority);
+	Task *t = createTask(esp0, stackTop - 4, stackBottom, tm, ofm, priority, affinity);
 	EXPECT(t != NULL);
 	return t;
 	//DELETE(t);
@@ -437,7 +755,7 @@ Task *createTaskAndMemorySpace(void (*loader)(void*), void *arg, size_t argSize,
 	// 3. openFileManager
 	OpenFileManager *ofm = createOpenFileManager();
 	EXPECT(ofm != NULL);
-	Task *t = createKernelTask(loader, arg, argSize, priority, tm, ofm);
+	Task *t = createKernelTask(loader, arg, argSize, priority, ANY_PROCESSOR, tm, ofm);
 	EXPECT(t != NULL);
 
 	unmapUserPageTableSet(pageManager);
@@ -475,6 +793,22 @@ static void userThreadEntry(struct UserThreadParam *p){
 	terminateCurrentTask();
 }
 
+static void setAffinityHandler(InterruptParam *p){
+	sti();
+	// otherwise no processor selects the task
+	uint32_t affinity = (SYSTEM_CALL_ARGUMENT_0(p) & getProcessorMask());
+	if(affinity == 0){
+		SYSTEM_CALL_RETURN_VALUE_0(p) = 0;
+		return;
+	}
+	setTaskAffinity(processorLocalTask(), affinity);
+	SYSTEM_CALL_RETURN_VALUE_0(p) = 1;
+}
+
+int systemCall_setAffinity(uint32_t affinity){
+	return (int)systemCall2(SYSCALL_SET_AFFINITY, affinity);
+}
+
 static void createUserThreadHandler(InterruptParam *p){
 	sti();
 	uintptr_t entry = SYSTEM_CALL_ARGUMENT_0(p);
@@ -483,7 +817,7 @@ static void createUserThreadHandler(InterruptParam *p){
 	// TODO: check if the entry is legal
 	struct UserThreadParam param = {entry, stackSize};
 	Task *newTask = createKernelTask(userThreadEntry, &param, sizeof(param),
-		current->priority, current->taskMemory, current->openFileManager);
+		current->priority, current->affinity, current->taskMemory, current->openFileManager);
 	if(newTask != NULL){
 		resume(newTask);
 	}
@@ -496,8 +830,24 @@ uintptr_t systemCall_createUserThread(void(*entry)(void), uintptr_t stackSize){
 
 // TODO: how to check if sharedMemoryTask is valid?
 Task *createSharedMemoryTask(void (*entry)(void*), void *arg, uintptr_t argSize, Task *sharedMemoryTask){
-	return createKernelTask(entry, arg, argSize,
-		sharedMemoryTask->priority, sharedMemoryTask->taskMemory, sharedMemoryTask->openFileManager);
+	return createKernelTask(entry, arg, argSize, sharedMemoryTask->priority, sharedMemoryTask->affinity,
+		sharedMemoryTask->taskMemory, sharedMemoryTask->openFileManager);
+}
+
+void deleteUnstartedTask(Task *t){
+	assert(t->state == SUSPENDED && t->switchCount == 0 && t->fpuContext == NULL);
+	assert(t->pendingIOList == NULL && t->completedIOList == NULL);
+	// the memory and files are shared with the creator
+	if(addOpenFileManagerReference(t->openFileManager, -1) == 0 ||
+		addTaskMemoryReference(t->taskMemory, -1) == 0){
+		panic("the task does not share memory");
+	}
+	deleteSemaphore(t->ioSemaphore);
+	removeFromTaskList(t);
+	if(checkAndReleaseKernelPages(t->kernelStackBottom) == 0){
+		panic("");
+	}
+	DELETE(t);
 }
 
 static void cancelAllIORequests(void){
@@ -535,6 +885,10 @@ static void clearTerminateQueue(TaskQueueAndLock *ql){
 		if(checkAndReleaseKernelPages(t->kernelStackBottom) == 0){
 			panic("");
 		}
+		removeFromTaskList(t);
+		if(t->fpuContext != NULL){
+			deleteFPUContext(t->fpuContext);
+		}
 		DELETE(t);
 	}
 }
@@ -618,15 +972,58 @@ void setTaskSystemCall(Task *t, SystemCallFunction f, uintptr_t a){
 void resume(/*TaskManager *tm, */Task *t){
 	assert(t->state == SUSPENDED);
 	t->state = READY;
+	TaskManager *tm = processorLocalTaskManager();
 	acquireLock(&globalQueue->lock);
+	// also for new tasks and the tasks not allowed on this processor
+	if(t->priority != IDLE_PRIORITY){
+		placeWokenTask(globalQueue, t);
+	}
+	// wakeup preemption on this processor
+	if(t->priority != IDLE_PRIORITY && tm != NULL && (t->affinity & PROCESSOR_BIT(processorLocalIndex())) != 0){
+		Task *c = tm->current;
+		if(c->priority == IDLE_PRIORITY){
+			tm->needReschedule = 1;
+		}
+		else{
+			accountTaskTime(c);
+			if(t->virtualRuntime + globalQueue->tscPerTick < c->virtualRuntime){
+				tm->needReschedule = 1;
+			}
+		}
+	}
 	pushPriorityQueue(globalQueue, t);
+	if(t->priority != IDLE_PRIORITY && (tm == NULL || tm->needReschedule == 0)){
+		wakeIdleProcessor(t);
+	}
 	releaseLock(&globalQueue->lock);
 }
 
+uintptr_t printTaskStatistics(char *buffer, uintptr_t bufferSize){
+	const uint64_t tscPerTick = processorLocalTaskManager()->tscPerTick;
+	uintptr_t printSize = 0;
+	acquireLock(&taskList.lock);
+	const Task *t;
+	for(t = taskList.head; t != NULL && printSize < bufferSize; t = t->nextInList){
+		const uint64_t ms = (tscPerTick == 0? 0: t->cpuTime * 1000 / (tscPerTick * TIMER_FREQUENCY));
+		int r = snprintf(buffer + printSize, bufferSize - printSize,
+			"task %x: priority %d affinity %x cpu time %llu ms virtual runtime %llu switch %u\n",
+			t, t->priority, t->affinity, ms, t->virtualRuntime, t->switchCount);
+		if(r < 0)
+			break;
+		printSize += r;
+	}
+	releaseLock(&taskList.lock);
+	return printSize;
+}
+
 Task *currentTask(TaskManager *tm){
 	return tm->current;
 }
 
+int isTaskRunning(const Task *t){
+	return t->isRunning;
+}
+
 LinearMemoryManager *getTaskLinearMemory(Task *t){
 	return &t->taskMemory->manager;
 }
@@ -635,6 +1032,14 @@ OpenFileManager *getOpenFileManager(Task *t){
 	return t->openFileManager;
 }
 
+FPUContext *getTaskFPUContext(Task *t){
+	return t->fpuContext;
+}
+
+void setTaskFPUContext(Task *t, FPUContext *c){
+	t->fpuContext = c;
+}
+
 static void taskDefinedHandler(InterruptParam *p){
 	uintptr_t oldArgument = p->argument;
 	Task *t = processorLocalTask();
@@ -654,16 +1059,29 @@ TaskManager *createTaskManager(SegmentTable *gdt){
 		panic("cannot initialize task manager");
 	}
 	tm->current = createTask(/*esp0*/0, /*espInterrupt*/0, /*stackBottom*/0,
-		kernelTaskMemory, kernelOpenFileManager, NUMBER_OF_PRIORITIES - 1);
+		kernelTaskMemory, kernelOpenFileManager, IDLE_PRIORITY, ANY_PROCESSOR);
 	if(tm->current == NULL){
 		panic("cannot initialize bootstrap task");
 	}
 	// do not put into the queue because the task is running
 	tm->current->state = READY;
+	tm->current->isRunning = 1;
+	tm->current->accountTime = rdtsc();
 	tm->gdt = gdt;
 	tm->oldTask = NULL;
 	tm->afterTaskSwitchFunc = NULL;
 	tm->afterTaskSwitchArg = 0;
+	tm->switchCount = 0;
+	tm->needReschedule = 0;
+	tm->lastTickTime = 0;
+	tm->tscPerTick = 0;
+	tm->processorBit = 0;
+	tm->isIdleWaiting = 0;
+	acquireLock(&taskManagerList.lock);
+	tm->nextManager = taskManagerList.head;
+	COMPILER_BARRIER();
+	taskManagerList.head = tm;
+	releaseLock(&taskManagerList.lock);
 	return tm;
 }
 
@@ -919,10 +1337,14 @@ void initTaskManagement(SystemCallTable *systemCallTable){
 	if(globalQueue == NULL){
 		panic("cannot initialize task management");
 	}
-	int p;
 	globalQueue->lock = initialSpinlock;
-	for(p = 0; p < NUMBER_OF_PRIORITIES; p++){
-		globalQueue->taskQueue[p] = initialTaskQueue;
+	addSpinlockStatistics(&globalQueue->lock, &globalQueue->lockStatistics, "task queue");
+	globalQueue->fairQueue = initialTaskQueue;
+	globalQueue->idleQueue = initialTaskQueue;
+	globalQueue->minVirtualRuntime = 0;
+	globalQueue->tscPerTick = 0;
+	if(setIdleMode(IDLE_MWAIT) == 0){
+		setIdleMode(IDLE_HALT);
 	}
 	kernelTaskMemory = createTaskMemory(kernelLinear->physical, kernelLinear->page, kernelLinear->linear);
 	if(kernelTaskMemory == NULL){
@@ -940,6 +1362,7 @@ void initTaskManagement(SystemCallTable *systemCallTable){
 	registerSystemCall(systemCallTable, SYSCALL_TRANSLATE_PAGE, translatePageHandler, 0);
 	registerSystemCall(systemCallTable, SYSCALL_CREATE_USER_THREAD, createUserThreadHandler, 0);
 	registerSystemCall(systemCallTable, SYSCALL_TERMINATE, terminateHandler, 0);
+	registerSystemCall(systemCallTable, SYSCALL_SET_AFFINITY, setAffinityHandler, 0);
 	//initSemaphore(systemCallTable);
 }
 
@@ -998,4 +1421,164 @@ void testCreateThread(void *arg){
 	threadEntry();
 }
 
+void testFairQueue(void);
+void testFairQueue(void){
+	TaskPriorityQueue q;
+	q.fairQueue = initialTaskQueue;
+	q.idleQueue = initialTaskQueue;
+	q.minVirtualRuntime = 0;
+	q.tscPerTick = 1;
+	Task t[4];
+	const uint64_t vr[4] = {3, 1, 2, 1};
+	int a;
+	for(a = 0; a < 4; a++){
+		MEMSET0(t + a);
+		t[a].affinity = ANY_PROCESSOR;
+		t[a].virtualRuntime = vr[a];
+		pushPriorityQueue(&q, t + a);
+	}
+	t[1].affinity = PROCESSOR_BIT(1);
+	// skip the tasks not allowed on the processor
+	assert(popPriorityQueue(&q, PROCESSOR_BIT(0)) == t + 3);
+	pushPriorityQueue(&q, t + 3);
+	// equal virtualRuntime in FIFO order
+	assert(popPriorityQueue(&q, ANY_PROCESSOR) == t + 1 && popPriorityQueue(&q, ANY_PROCESSOR) == t + 3);
+	assert(popPriorityQueue(&q, ANY_PROCESSOR) == t + 2 && popPriorityQueue(&q, ANY_PROCESSOR) == t + 0);
+	assert(q.minVirtualRuntime == 3 && IS_TASK_QUEUE_EMPTY(&q.fairQueue));
+	t[0].priority = IDLE_PRIORITY;
+	pushPriorityQueue(&q, t + 0);
+	assert(IS_TASK_QUEUE_EMPTY(&q.fairQueue) && popPriorityQueue(&q, ANY_PROCESSOR) == t + 0);
+	// the credit of a woken task is limited
+	t[1].virtualRuntime = 0;
+	placeWokenTask(&q, t + 1);
+	assert(t[1].virtualRuntime == 3 - SLEEPER_CREDIT_TICKS);
+	printk("test fair queue ok\n");
+}
+
+typedef struct RCUTestNode{
+	volatile uint32_t value;
+	struct RCUTestNode **prev, *next;
+}RCUTestNode;
+
+#define RCU_TEST_VALUE (0x12345678)
+#define RCU_TEST_LOOP_COUNT (1000)
+static struct{
+	Spinlock lock;
+	RCUTestNode *head;
+	volatile int isDone;
+}rcuTestList = {INITIAL_SPINLOCK, NULL, 0};
+
+static void testRCUReader(__attribute__((__unused__)) void *arg){
+	while(rcuTestList.isDone == 0){
+		int interruptEnabled = rcuReadLock();
+		RCUTestNode *n;
+		for(n = rcuTestList.head; n != NULL; n = n->next){
+			assert(n->value == RCU_TEST_VALUE);
+		}
+		rcuReadUnlock(interruptEnabled);
+	}
+	systemCall_terminate();
+}
+
+void testRCU(void);
+void testRCU(void){
+	int a;
+	uintptr_t dummyArg = 0;
+	rcuTestList.isDone = 0;
+	for(a = 0; a < 2; a++){
+		Task *t = createSharedMemoryTask(testRCUReader, &dummyArg, sizeof(dummyArg), processorLocalTask());
+		assert(t != NULL);
+		resume(t);
+	}
+	for(a = 0; a < RCU_TEST_LOOP_COUNT; a++){
+		RCUTestNode *NEW(n);
+		assert(n != NULL);
+		n->value = RCU_TEST_VALUE;
+		acquireLock(&rcuTestList.lock);
+		RCU_ADD_TO_DQUEUE(n, &rcuTestList.head);
+		// remove the oldest node
+		RCUTestNode *old = n;
+		while(old->next != NULL){
+			old = old->next;
+		}
+		if(a % 2 == 1){
+			RCU_REMOVE_FROM_DQUEUE(old);
+		}
+		else{
+			old = NULL;
+		}
+		releaseLock(&rcuTestList.lock);
+		if(old != NULL){
+			synchronizeRCU();
+			// the readers would see the change
+			old->value = 0;
+			DELETE(old);
+		}
+	}
+	rcuTestList.isDone = 1;
+	printk("test RCU ok\n");
+}
+
+#define WAKEUP_TEST_COUNT (20)
+// long enough for the other processor to become idle
+#define WAKEUP_TEST_INTERVAL (30)
+static struct{
+	Semaphore *semaphore;
+	volatile uint64_t wakeTime;
+	uint64_t latencySum;
+	volatile int wakeCount;
+}wakeupTest;
+
+static void testWakeupLatencyTask(__attribute__((__unused__)) void *arg){
+	int a;
+	for(a = 0; a < WAKEUP_TEST_COUNT; a++){
+		acquireSemaphore(wakeupTest.semaphore);
+		wakeupTest.latencySum += rdtsc() - wakeupTest.wakeTime;
+		wakeupTest.wakeCount++;
+	}
+	systemCall_terminate();
+}
+
+// the time from releaseSemaphore to the woken task running on an idle processor
+void testIdleWakeupLatency(void);
+void testIdleWakeupLatency(void){
+	const int processorCount = processorLocalPIC()->numberOfProcessors;
+	if(processorCount < 2){
+		printk("test idle wakeup latency needs 2 processors\n");
+		return;
+	}
+	const uint32_t otherProcessor = PROCESSOR_BIT((processorLocalIndex() + 1) % processorCount);
+	const enum IdleMode oldMode = idle.mode;
+	const enum IdleMode mode[3] = {IDLE_HALT, IDLE_MWAIT, IDLE_POLL};
+	uintptr_t dummyArg = 0;
+	int m;
+	for(m = 0; m < (int)LENGTH_OF(mode); m++){
+		if(setIdleMode(mode[m]) == 0){
+			printk("idle mode %d is not supported\n", mode[m]);
+			continue;
+		}
+		wakeupTest.semaphore = createSemaphore(0);
+		assert(wakeupTest.semaphore != NULL);
+		wakeupTest.latencySum = 0;
+		wakeupTest.wakeCount = 0;
+		Task *t = createSharedMemoryTask(testWakeupLatencyTask, &dummyArg, sizeof(dummyArg), processorLocalTask());
+		assert(t != NULL);
+		setTaskAffinity(t, otherProcessor);
+		resume(t);
+		int a;
+		for(a = 0; a < WAKEUP_TEST_COUNT; a++){
+			sleep(WAKEUP_TEST_INTERVAL);
+			wakeupTest.wakeTime = rdtsc();
+			releaseSemaphore(wakeupTest.semaphore);
+			while(wakeupTest.wakeCount == a){
+				sleep(1);
+			}
+		}
+		printk("idle mode %d: wakeup latency %llu cycles\n", mode[m], wakeupTest.latencySum / WAKEUP_TEST_COUNT);
+		deleteSemaphore(wakeupTest.semaphore);
+	}
+	setIdleMode(oldMode);
+	printk("test idle wakeup latency ok\n");
+}
+
 #endif